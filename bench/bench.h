@@ -0,0 +1,39 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Shared bits for the guest benchmarks
+	
+	Benchmarks stick to unsigned arithmetic and never divide, so they don't depend on signed compares or on the
+	compiler's divide-by-zero traps.
+ */
+
+//no includes, we don't have a C standard library
+
+//prototype for syscall wrapper in assembly code (c_testprog/startup.S)
+extern unsigned int do_syscall(unsigned int a0, unsigned int a1, unsigned int syscall_num);
+
+enum syscalls
+{
+	SYS_PRINT_INT = 1,
+	SYS_PRINT_STR = 4
+};
+
+/**
+	@brief Prints "name: value", the checksum a run is checked against
+ */
+static void PrintResult(const char* name, unsigned int value)
+{
+	do_syscall((unsigned int)name, 0, SYS_PRINT_STR);
+	do_syscall((unsigned int)": ", 0, SYS_PRINT_STR);
+	do_syscall(value, 0, SYS_PRINT_INT);
+	do_syscall((unsigned int)"\n", 0, SYS_PRINT_STR);
+}
+
+/**
+	@brief Next value of a simple LCG, for filling inputs without a C library
+ */
+static unsigned int Random(unsigned int* seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
@@ -0,0 +1,48 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Benchmark: table-driven CRC-32 and FNV-1a over a byte buffer
+ */
+#include "bench.h"
+
+#define LEN		16384
+#define REPEAT	16
+
+static unsigned int table[256];
+static unsigned char buf[LEN];
+
+int main()
+{
+	for(unsigned int i=0; i<256; i++)
+	{
+		unsigned int c = i;
+		for(unsigned int k=0; k<8; k++)
+			c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+		table[i] = c;
+	}
+	
+	unsigned int seed = 3;
+	for(unsigned int i=0; i<LEN; i++)
+		buf[i] = Random(&seed);
+	
+	unsigned int crc = 0;
+	unsigned int hash = 0;
+	for(unsigned int r=0; r<REPEAT; r++)
+	{
+		unsigned int c = 0xffffffff;
+		for(unsigned int i=0; i<LEN; i++)
+			c = table[(c ^ buf[i]) & 0xff] ^ (c >> 8);
+		crc ^= ~c;
+		
+		unsigned int h = 2166136261u;
+		for(unsigned int i=0; i<LEN; i++)
+			h = (h ^ buf[i]) * 16777619u;
+		hash += h;
+		
+		buf[r] ^= crc;
+	}
+	
+	PrintResult("crc", crc);
+	PrintResult("fnv", hash);
+	return 0;
+}
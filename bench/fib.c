@@ -0,0 +1,21 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Benchmark: naive recursive Fibonacci, mostly calls and returns
+ */
+#include "bench.h"
+
+#define N	27
+
+static unsigned int Fib(unsigned int n)
+{
+	if(n < 2)
+		return n;
+	return Fib(n - 1) + Fib(n - 2);
+}
+
+int main()
+{
+	PrintResult("fib", Fib(N));
+	return 0;
+}
@@ -0,0 +1,48 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Benchmark: dense integer matrix multiply
+ */
+#include "bench.h"
+
+#define N		48
+#define REPEAT	8
+
+static unsigned int a[N][N];
+static unsigned int b[N][N];
+static unsigned int c[N][N];
+
+int main()
+{
+	unsigned int seed = 1;
+	for(unsigned int i=0; i<N; i++)
+	{
+		for(unsigned int j=0; j<N; j++)
+		{
+			a[i][j] = Random(&seed) & 0xff;
+			b[i][j] = Random(&seed) & 0xff;
+		}
+	}
+	
+	unsigned int sum = 0;
+	for(unsigned int r=0; r<REPEAT; r++)
+	{
+		for(unsigned int i=0; i<N; i++)
+		{
+			for(unsigned int j=0; j<N; j++)
+			{
+				unsigned int acc = r;
+				for(unsigned int k=0; k<N; k++)
+					acc += a[i][k] * b[k][j];
+				c[i][j] = acc;
+			}
+		}
+		
+		for(unsigned int i=0; i<N; i++)
+			for(unsigned int j=0; j<N; j++)
+				sum = (sum << 1 | sum >> 31) ^ c[i][j];
+	}
+	
+	PrintResult("matmul", sum);
+	return 0;
+}
@@ -0,0 +1,76 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Benchmark: quicksort of pseudo-random words
+ */
+#include "bench.h"
+
+#define N		8192
+#define REPEAT	4
+
+static unsigned int v[N];
+
+/**
+	@brief Sorts v[lo..hi] (inclusive), Hoare partitioning around the middle element
+	
+	Recurses on the smaller side only, so the depth stays logarithmic on our small stack.
+ */
+static void Sort(unsigned int lo, unsigned int hi)
+{
+	while(lo < hi)
+	{
+		unsigned int pivot = v[lo + ((hi - lo) >> 1)];
+		unsigned int i = lo - 1;
+		unsigned int j = hi + 1;
+		while(1)
+		{
+			do
+				i++;
+			while(v[i] < pivot);
+			do
+				j--;
+			while(v[j] > pivot);
+			if(i >= j)
+				break;
+			
+			unsigned int t = v[i];
+			v[i] = v[j];
+			v[j] = t;
+		}
+		
+		if(j - lo < hi - j)
+		{
+			Sort(lo, j);
+			lo = j + 1;
+		}
+		else
+		{
+			Sort(j + 1, hi);
+			hi = j;
+		}
+	}
+}
+
+int main()
+{
+	unsigned int seed = 7;
+	unsigned int sum = 0;
+	for(unsigned int r=0; r<REPEAT; r++)
+	{
+		for(unsigned int i=0; i<N; i++)
+			v[i] = Random(&seed);
+		
+		Sort(0, N - 1);
+		
+		//Fold in the order, and poison the checksum if it isn't sorted
+		for(unsigned int i=0; i<N; i++)
+		{
+			sum = sum * 31 + v[i];
+			if( (i != 0) && (v[i-1] > v[i]) )
+				sum = 0xdeadbeef;
+		}
+	}
+	
+	PrintResult("qsort", sum);
+	return 0;
+}
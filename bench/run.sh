@@ -0,0 +1,90 @@
+#!/bin/bash
+#
+# Runs each benchmark through the simulator several times and reports guest MIPS (best of the runs), compared
+# against a saved baseline.
+#
+# Usage: run.sh [-n runs] [-e engine] [-b baseline.txt] [-t percent] [-s] foo.elf...
+#   -n  runs per benchmark (default 5)
+#   -e  simulator engine (default interp)
+#   -b  baseline file (default baseline-<engine>.txt)
+#   -t  how many percent slower than the baseline counts as a regression (default 5)
+#   -s  save the results as the new baseline instead of comparing
+#
+# Each foo.elf must print exactly what foo.expected holds. Exits 1 if any benchmark printed the wrong thing or
+# regressed, 0 otherwise.
+
+SIM=${SIM:-$(dirname "$0")/../sim/sim}
+RUNS=5
+ENGINE=interp
+BASELINE=
+THRESHOLD=5
+SAVE=0
+while getopts "n:e:b:t:s" opt; do
+	case $opt in
+		n) RUNS=$OPTARG ;;
+		e) ENGINE=$OPTARG ;;
+		b) BASELINE=$OPTARG ;;
+		t) THRESHOLD=$OPTARG ;;
+		s) SAVE=1 ;;
+		*) exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ -z "$BASELINE" ] && BASELINE=baseline-$ENGINE.txt
+SIM=$(realpath "$SIM")
+
+# The simulator drops its output.txt in the current directory, so run from a scratch one
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+failed=0
+: > "$TMP/results"
+printf "%-12s %14s %10s %10s %8s\n" benchmark instructions MIPS baseline change
+for elf in "$@"; do
+	name=$(basename "$elf" .elf)
+	expected=${elf%.elf}.expected
+	elf=$(realpath "$elf")
+
+	best=0
+	count=0
+	status=
+	for ((i = 0; i < RUNS; i++)); do
+		(cd "$TMP" && "$SIM" --engine="$ENGINE" --report="$TMP/report.json" "$elf") > "$TMP/stdout"
+
+		# Guest output is everything after the loader's messages
+		if ! sed '1,/^Starting simulation/d' "$TMP/stdout" | cmp -s - "$expected"; then
+			status=WRONG
+			break
+		fi
+
+		mips=$(sed -n 's/.*"mips": \([0-9.]*\).*/\1/p' "$TMP/report.json")
+		count=$(sed -n 's/.*"instructions": \([0-9]*\).*/\1/p' "$TMP/report.json")
+		best=$(awk -v a="$mips" -v b="$best" 'BEGIN { print (a > b) ? a : b }')
+	done
+
+	if [ -n "$status" ]; then
+		printf "%-12s %14s %10s %10s %8s\n" "$name" - - - "$status"
+		failed=1
+		continue
+	fi
+	echo "$name $best" >> "$TMP/results"
+
+	base=$(awk -v n="$name" '$1 == n { print $2 }' "$BASELINE" 2>/dev/null)
+	if [ "$SAVE" = 1 ] || [ -z "$base" ]; then
+		printf "%-12s %14s %10s %10s %8s\n" "$name" "$count" "$best" - -
+		continue
+	fi
+
+	change=$(awk -v a="$best" -v b="$base" 'BEGIN { printf "%+.1f%%", (a - b) * 100 / b }')
+	if awk -v a="$best" -v b="$base" -v t="$THRESHOLD" 'BEGIN { exit !(a < b * (1 - t / 100)) }'; then
+		change="$change SLOWER"
+		failed=1
+	fi
+	printf "%-12s %14s %10s %10s %8s\n" "$name" "$count" "$best" "$base" "$change"
+done
+
+if [ "$SAVE" = 1 ]; then
+	cp "$TMP/results" "$BASELINE"
+	echo "Saved baseline to $BASELINE"
+fi
+exit $failed
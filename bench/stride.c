@@ -0,0 +1,35 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Benchmark: read-modify-write sweeps over a 256 KB array at strides of 1 to 256 words
+ */
+#include "bench.h"
+
+#define WORDS		65536
+#define MAX_STRIDE	256
+
+static unsigned int mem[WORDS];
+
+int main()
+{
+	for(unsigned int i=0; i<WORDS; i++)
+		mem[i] = i;
+	
+	//Every sweep touches each word once, only the order changes
+	unsigned int sum = 0;
+	for(unsigned int stride=1; stride<=MAX_STRIDE; stride<<=1)
+	{
+		for(unsigned int start=0; start<stride; start++)
+		{
+			for(unsigned int i=start; i<WORDS; i+=stride)
+			{
+				unsigned int x = mem[i];
+				sum += x;
+				mem[i] = x + stride;
+			}
+		}
+	}
+	
+	PrintResult("stride", sum);
+	return 0;
+}
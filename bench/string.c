@@ -0,0 +1,73 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Benchmark: byte-at-a-time string copy, compare and length
+ */
+#include "bench.h"
+
+#define COUNT	256
+#define MAXLEN	64
+#define REPEAT	16
+
+static char pool[COUNT][MAXLEN];
+static char copy[COUNT][MAXLEN];
+
+//Not called strcpy etc. so the compiler doesn't treat them as the builtins
+static void CopyString(char* dst, const char* src)
+{
+	while( (*dst++ = *src++) != 0 )
+		;
+}
+
+static unsigned int CompareStrings(const char* a, const char* b)
+{
+	while( (*a != 0) && (*a == *b) )
+	{
+		a++;
+		b++;
+	}
+	return (unsigned char)*a - (unsigned char)*b;
+}
+
+static unsigned int StringLength(const char* s)
+{
+	const char* p = s;
+	while(*p != 0)
+		p++;
+	return p - s;
+}
+
+int main()
+{
+	//Strings of 0 to MAXLEN-1 letters; many share a prefix so compares go some way in
+	unsigned int seed = 5;
+	for(unsigned int i=0; i<COUNT; i++)
+	{
+		unsigned int len = Random(&seed) & (MAXLEN - 1);
+		for(unsigned int k=0; k<len; k++)
+			pool[i][k] = 'a' + ((Random(&seed) & 0x30) ? (k & 3) : (Random(&seed) & 15));
+		pool[i][len] = 0;
+	}
+	
+	unsigned int sum = 0;
+	for(unsigned int r=0; r<REPEAT; r++)
+	{
+		for(unsigned int i=0; i<COUNT; i++)
+		{
+			CopyString(copy[i], pool[(i + r) & (COUNT - 1)]);
+			sum += StringLength(copy[i]);
+		}
+		
+		for(unsigned int i=0; i<COUNT; i++)
+		{
+			for(unsigned int j=i; j<COUNT; j+=7)
+			{
+				unsigned int d = CompareStrings(copy[i], copy[j]);
+				sum = sum * 3 + (d != 0) + (d >> 31);
+			}
+		}
+	}
+	
+	PrintResult("string", sum);
+	return 0;
+}
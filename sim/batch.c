@@ -0,0 +1,276 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Batch mode: runs a list of ELFs on a pool of worker threads
+ */
+#include "sim.h"
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+//Longest line accepted in a batch list
+#define BATCH_LINE_MAX		4096
+
+/**
+	@brief One line of the batch list, and how it went
+ */
+struct batch_job
+{
+	char* elf;
+	char* input;				//file fed to the guest's console input, NULL for none
+
+	int halt_reason;
+	uint64_t inst_count;
+	uint64_t elapsed;
+};
+
+/**
+	@brief Jobs a worker hasn't started yet: the range [head, tail) of the job array.
+
+	The owner works forwards from head, idle workers steal from tail.
+ */
+struct batch_queue
+{
+	pthread_mutex_t lock;
+	size_t head;
+	size_t tail;
+};
+
+struct batch_pool
+{
+	struct batch_job* jobs;
+	struct batch_queue* queues;
+	int threads;
+	const struct sim_options* options;
+};
+
+struct batch_worker
+{
+	struct batch_pool* pool;
+	int id;
+	pthread_t thread;
+};
+
+/**
+	@brief Reads the batch list: one ELF per line, optionally followed by a file to use as its console input.
+
+	Blank lines and lines starting with # are ignored. Returns the number of jobs, or -1 if the list can't be read.
+ */
+static long ReadBatchList(const char* list, struct batch_job** jobs)
+{
+	FILE* fp = fopen(list, "r");
+	if(fp == NULL)
+		return -1;
+
+	long count = 0;
+	long size = 0;
+	*jobs = NULL;
+
+	char line[BATCH_LINE_MAX];
+	while(fgets(line, sizeof(line), fp) != NULL)
+	{
+		char* elf = strtok(line, " \t\r\n");
+		if( (elf == NULL) || (elf[0] == '#') )
+			continue;
+		char* input = strtok(NULL, " \t\r\n");
+
+		if(count == size)
+		{
+			size = size ? size * 2 : 64;
+			*jobs = realloc(*jobs, size * sizeof(struct batch_job));
+		}
+
+		struct batch_job* job = &(*jobs)[count++];
+		memset(job, 0, sizeof(*job));
+		job->elf = strdup(elf);
+		job->input = input ? strdup(input) : NULL;
+	}
+
+	fclose(fp);
+	return count;
+}
+
+/**
+	@brief Runs one job in a fresh simulator instance.
+
+	Guest output and simulator messages go to foo.elf.stdout and the stats to foo.elf.output.txt. The profile, JSON
+	report, checkpoint and trace, if asked for, go to foo.elf.profile.txt, foo.elf.report.json, foo.elf.ckpt and
+	foo.elf.trace.
+ */
+static void RunJob(struct batch_pool* pool, struct batch_job* job)
+{
+	size_t len = strlen(job->elf) + sizeof(".profile.txt");
+	char* out_path = malloc(len);
+	char* stats_path = malloc(len);
+	char* profile_path = malloc(len);
+	char* report_path = malloc(len);
+	char* checkpoint_path = malloc(len);
+	char* trace_path = malloc(len);
+	snprintf(out_path, len, "%s.stdout", job->elf);
+	snprintf(stats_path, len, "%s.output.txt", job->elf);
+	snprintf(profile_path, len, "%s.profile.txt", job->elf);
+	snprintf(report_path, len, "%s.report.json", job->elf);
+	snprintf(checkpoint_path, len, "%s.ckpt", job->elf);
+	snprintf(trace_path, len, "%s.trace", job->elf);
+	
+	struct sim_options options = *pool->options;
+	if(options.profile_path != NULL)
+		options.profile_path = profile_path;
+	if(options.report_path != NULL)
+		options.report_path = report_path;
+	if(options.checkpoint_path != NULL)
+		options.checkpoint_path = checkpoint_path;
+	if(options.trace_path != NULL)
+		options.trace_path = trace_path;
+	if(job->input != NULL)
+		options.input_path = job->input;
+
+	FILE* out = fopen(out_path, "w");
+	FILE* in = fopen("/dev/null", "r");
+	if( (out == NULL) || (in == NULL) )
+		job->halt_reason = HALT_FAULT;
+
+	else
+	{
+		struct simulator* sim = malloc(sizeof(struct simulator));
+		InitSimulator(sim, &options, out, in, stats_path);
+		job->halt_reason = RunProgram(sim, job->elf);
+		job->inst_count = sim->ctx.inst_count;
+		job->elapsed = sim->elapsed;
+		FreeSimulator(sim);
+		free(sim);
+	}
+
+	if(out != NULL)
+		fclose(out);
+	if(in != NULL)
+		fclose(in);
+	free(out_path);
+	free(stats_path);
+	free(profile_path);
+	free(report_path);
+	free(checkpoint_path);
+	free(trace_path);
+}
+
+/**
+	@brief Takes the next job from our own queue, or steals one from the back of somebody else's.
+
+	Returns NULL when every queue is empty. No job is ever added once the pool starts, so that means we're done.
+ */
+static struct batch_job* NextJob(struct batch_pool* pool, int id)
+{
+	struct batch_queue* own = &pool->queues[id];
+	struct batch_job* job = NULL;
+
+	pthread_mutex_lock(&own->lock);
+	if(own->head < own->tail)
+		job = &pool->jobs[own->head++];
+	pthread_mutex_unlock(&own->lock);
+
+	for(int i=1; (job == NULL) && (i < pool->threads); i++)
+	{
+		struct batch_queue* victim = &pool->queues[(id + i) % pool->threads];
+		pthread_mutex_lock(&victim->lock);
+		if(victim->head < victim->tail)
+			job = &pool->jobs[--victim->tail];
+		pthread_mutex_unlock(&victim->lock);
+	}
+
+	return job;
+}
+
+static void* BatchWorker(void* arg)
+{
+	struct batch_worker* worker = (struct batch_worker*)arg;
+
+	struct batch_job* job;
+	while( (job = NextJob(worker->pool, worker->id)) != NULL )
+		RunJob(worker->pool, job);
+
+	return NULL;
+}
+
+/**
+	@brief Runs every ELF in a batch list, several at once
+
+	@param list		Batch list, see ReadBatchList
+	@param threads	Worker count, 0 for one per online CPU
+	@param options	Settings for every job
+
+	Returns the process exit status: 0 if every job reached syscall 10, 1 otherwise.
+ */
+int RunBatch(const char* list, int threads, const struct sim_options* options)
+{
+	struct batch_job* jobs;
+	long count = ReadBatchList(list, &jobs);
+	if(count < 0)
+	{
+		printf("failed to read batch list %s\n", list);
+		return 1;
+	}
+
+	if(threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(threads > count)
+		threads = count;
+	if(threads < 1)
+		threads = 1;
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	//Deal the jobs out in contiguous runs, stealing evens things up from there
+	struct batch_pool pool;
+	pool.jobs = jobs;
+	pool.threads = threads;
+	pool.options = options;
+	pool.queues = calloc(threads, sizeof(struct batch_queue));
+	for(int i=0; i<threads; i++)
+	{
+		pthread_mutex_init(&pool.queues[i].lock, NULL);
+		pool.queues[i].head = (size_t)count * i / threads;
+		pool.queues[i].tail = (size_t)count * (i+1) / threads;
+	}
+
+	struct batch_worker* workers = calloc(threads, sizeof(struct batch_worker));
+	for(int i=0; i<threads; i++)
+	{
+		workers[i].pool = &pool;
+		workers[i].id = i;
+		if(0 != pthread_create(&workers[i].thread, NULL, BatchWorker, &workers[i]))
+		{
+			printf("failed to start worker thread\n");
+			exit(1);
+		}
+	}
+	for(int i=0; i<threads; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	//Summary, in list order
+	long failed = 0;
+	for(long i=0; i<count; i++)
+	{
+		printf("%s: %s, %llu instructions, %llu nanoseconds\n", jobs[i].elf, HaltReasonName(jobs[i].halt_reason),
+			(long long unsigned int)jobs[i].inst_count, (long long unsigned int)jobs[i].elapsed);
+		if(jobs[i].halt_reason != HALT_EXIT)
+			failed++;
+	}
+	printf("Ran %ld jobs on %d threads in %ld ms, %ld did not exit cleanly\n", count, threads,
+		(long)((t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000), failed);
+
+	for(long i=0; i<count; i++)
+	{
+		free(jobs[i].elf);
+		free(jobs[i].input);
+	}
+	for(int i=0; i<threads; i++)
+		pthread_mutex_destroy(&pool.queues[i].lock);
+	free(pool.queues);
+	free(workers);
+	free(jobs);
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,224 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Set-associative cache model with selectable replacement and write policies
+ */
+#include "sim.h"
+#include <string.h>
+
+static int IsPowerOfTwo(uint32_t x)
+{
+	return (x != 0) && ((x & (x - 1)) == 0);
+}
+
+//Reads a size with an optional k or m suffix
+static int ParseSize(const char** text, uint32_t* value)
+{
+	char* end;
+	unsigned long v = strtoul(*text, &end, 10);
+	if(end == *text)
+		return 0;
+	if( (*end == 'k') || (*end == 'K') )
+	{
+		v <<= 10;
+		end++;
+	}
+	else if( (*end == 'm') || (*end == 'M') )
+	{
+		v <<= 20;
+		end++;
+	}
+	if(v > 0x80000000UL)
+		return 0;
+	*value = v;
+	*text = end;
+	return 1;
+}
+
+/**
+	@brief Parses a cache description: size:assoc:line, then optionally lru|fifo|random and wb|wt, e.g. 32k:4:64:lru:wb
+
+	Size, associativity and line size must be powers of two, with lines of at least a word. Returns 0 if the
+	description is bad.
+ */
+int ParseCacheConfig(const char* text, struct cache_config* config)
+{
+	memset(config, 0, sizeof(*config));
+	config->replacement = CACHE_LRU;
+	config->write_policy = CACHE_WRITE_BACK;
+
+	if(!ParseSize(&text, &config->size) || (*text++ != ':') ||
+		!ParseSize(&text, &config->assoc) || (*text++ != ':') ||
+		!ParseSize(&text, &config->line) )
+		return 0;
+
+	while(*text == ':')
+	{
+		text++;
+		size_t len = strcspn(text, ":");
+		if( (len == 3) && !strncmp(text, "lru", 3) )
+			config->replacement = CACHE_LRU;
+		else if( (len == 4) && !strncmp(text, "fifo", 4) )
+			config->replacement = CACHE_FIFO;
+		else if( (len == 6) && !strncmp(text, "random", 6) )
+			config->replacement = CACHE_RANDOM;
+		else if( (len == 2) && !strncmp(text, "wb", 2) )
+			config->write_policy = CACHE_WRITE_BACK;
+		else if( (len == 2) && !strncmp(text, "wt", 2) )
+			config->write_policy = CACHE_WRITE_THROUGH;
+		else
+			return 0;
+		text += len;
+	}
+	if(*text != '\0')
+		return 0;
+
+	return IsPowerOfTwo(config->size) && IsPowerOfTwo(config->assoc) && IsPowerOfTwo(config->line) &&
+		(config->line >= 4) && (config->size >= config->assoc * config->line);
+}
+
+/**
+	@brief Makes an empty (all invalid) cache from a config that ParseCacheConfig accepted
+ */
+struct cache* CreateCache(const char* name, const struct cache_config* config)
+{
+	struct cache* cache = calloc(1, sizeof(struct cache));
+	cache->name = name;
+	cache->config = *config;
+
+	uint32_t lines = config->size / config->line;
+	cache->set_mask = lines / config->assoc - 1;
+	while( (1u << cache->line_shift) < config->line)
+		cache->line_shift++;
+
+	cache->tags = calloc(lines, sizeof(uint32_t));
+	cache->valid = calloc(lines, 1);
+	cache->dirty = calloc(lines, 1);
+	cache->stamps = calloc(lines, sizeof(uint64_t));
+	cache->random = 0x2545f491;
+	InitPcStats(&cache->pcs);
+	return cache;
+}
+
+//Picks the way to replace in a full set
+static uint32_t ChooseVictim(struct cache* cache, uint32_t first)
+{
+	uint32_t assoc = cache->config.assoc;
+	if(cache->config.replacement == CACHE_RANDOM)
+	{
+		cache->random ^= cache->random << 13;
+		cache->random ^= cache->random >> 17;
+		cache->random ^= cache->random << 5;
+		return cache->random & (assoc - 1);
+	}
+
+	//LRU and FIFO differ only in when the stamp is updated: every use, or just on fill
+	uint32_t victim = 0;
+	for(uint32_t way=1; way<assoc; way++)
+	{
+		if(cache->stamps[first + way] < cache->stamps[first + victim])
+			victim = way;
+	}
+	return victim;
+}
+
+/**
+	@brief Looks up one access (which never spans lines, all accesses are aligned) and updates the cache
+
+	Returns 1 for a hit, 0 for a miss.
+ */
+int CacheAccess(struct cache* cache, uint32_t pc, uint32_t address, int write)
+{
+	uint32_t tag = address >> cache->line_shift;
+	uint32_t first = (tag & cache->set_mask) * cache->config.assoc;
+	int write_back = (cache->config.write_policy == CACHE_WRITE_BACK);
+
+	if(write)
+		cache->writes++;
+	else
+		cache->reads++;
+	cache->clock++;
+
+	uint32_t invalid = cache->config.assoc;
+	for(uint32_t way=0; way<cache->config.assoc; way++)
+	{
+		uint32_t i = first + way;
+		if(!cache->valid[i])
+		{
+			invalid = way;
+			continue;
+		}
+		if(cache->tags[i] != tag)
+			continue;
+
+		if(cache->config.replacement == CACHE_LRU)
+			cache->stamps[i] = cache->clock;
+		if(write)
+		{
+			if(write_back)
+				cache->dirty[i] = 1;
+			else
+				cache->write_throughs++;
+		}
+		return 1;
+	}
+
+	GetPcStat(&cache->pcs, pc)->misses++;
+	if(write)
+		cache->write_misses++;
+	else
+		cache->read_misses++;
+
+	//Write-through caches don't allocate on a store miss
+	if(write && !write_back)
+	{
+		cache->write_throughs++;
+		return 0;
+	}
+
+	uint32_t way = (invalid < cache->config.assoc) ? invalid : ChooseVictim(cache, first);
+	uint32_t i = first + way;
+	if(cache->valid[i] && cache->dirty[i])
+		cache->writebacks++;
+	cache->tags[i] = tag;
+	cache->valid[i] = 1;
+	cache->dirty[i] = write;
+	cache->stamps[i] = cache->clock;
+	return 0;
+}
+
+void WriteCacheStats(FILE* fp, const struct cache* cache)
+{
+	static const char* replacement_names[] = {"LRU", "FIFO", "random"};
+	const struct cache_config* c = &cache->config;
+	uint64_t accesses = cache->reads + cache->writes;
+	uint64_t misses = cache->read_misses + cache->write_misses;
+
+	fprintf(fp, "%s: %u bytes, %u-way, %u byte lines, %s, %s\n", cache->name, c->size, c->assoc, c->line,
+		replacement_names[c->replacement], (c->write_policy == CACHE_WRITE_BACK) ? "write-back" : "write-through");
+	fprintf(fp, "%s Accesses: %llu (%llu reads, %llu writes)\n", cache->name, (long long unsigned int)accesses,
+		(long long unsigned int)cache->reads, (long long unsigned int)cache->writes);
+	fprintf(fp, "%s Misses: %llu (%llu reads, %llu writes), miss rate %.2f%%\n", cache->name,
+		(long long unsigned int)misses, (long long unsigned int)cache->read_misses,
+		(long long unsigned int)cache->write_misses, accesses ? (100.0 * misses / accesses) : 0.0);
+	if(c->write_policy == CACHE_WRITE_BACK)
+		fprintf(fp, "%s Writebacks: %llu\n", cache->name, (long long unsigned int)cache->writebacks);
+	else
+		fprintf(fp, "%s Write-throughs: %llu\n", cache->name, (long long unsigned int)cache->write_throughs);
+
+	char title[64];
+	snprintf(title, sizeof(title), "%s misses by PC", cache->name);
+	WritePcStats(fp, &cache->pcs, title, MODEL_TOP_PCS);
+}
+
+void FreeCache(struct cache* cache)
+{
+	if(cache == NULL)
+		return;
+	free(cache->tags);
+	free(cache->valid);
+	free(cache->dirty);
+	free(cache->stamps);
+	FreePcStats(&cache->pcs);
+	free(cache);
+}
@@ -0,0 +1,374 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Checkpoints: snapshots of the registers and every memory region that later runs can start from
+
+	A checkpoint file is a checkpoint_header, then for each region a checkpoint_region followed by its
+	checkpoint_runs, then the page data. Only runs of pages holding something other than zeros are stored, each at a
+	CHECKPOINT_PAGE aligned file offset so restoring can map them straight from the file.
+ */
+#include "sim.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CHECKPOINT_MAGIC	"MIPSCKP2"
+
+//Granularity of sparse storage and of restore mappings
+#define CHECKPOINT_PAGE		4096
+
+struct checkpoint_header
+{
+	char magic[8];
+	uint32_t region_count;
+	uint32_t pc;
+	uint32_t regs[32];
+	uint32_t HI;
+	uint32_t LO;
+	uint64_t inst_count;
+
+	//Stack and heap bounds, as in virtual_memory
+	uint32_t stack_top;
+	uint32_t stack_bottom;
+	uint32_t stack_limit;
+	uint32_t heap_start;
+	uint32_t brk;
+	uint32_t heap_end;
+};
+
+struct checkpoint_region
+{
+	uint32_t vaddr;
+	uint32_t len;
+	uint32_t run_count;
+	uint32_t reserved;
+};
+
+//Pages [first_page, first_page + page_count) of a region, stored at offset
+struct checkpoint_run
+{
+	uint32_t first_page;
+	uint32_t page_count;
+	uint64_t offset;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Saving
+
+//Bytes of page i that belong to the region
+static uint32_t PageBytes(const struct virtual_mem_region* region, uint32_t page)
+{
+	uint32_t left = region->len - page * CHECKPOINT_PAGE;
+	return (left < CHECKPOINT_PAGE) ? left : CHECKPOINT_PAGE;
+}
+
+static int IsZeroPage(const struct virtual_mem_region* region, uint32_t page)
+{
+	const uint8_t* p = (const uint8_t*)region->data + page * CHECKPOINT_PAGE;
+	uint32_t len = PageBytes(region, page);
+	for(uint32_t i=0; i<len; i++)
+	{
+		if(p[i] != 0)
+			return 0;
+	}
+	return 1;
+}
+
+/**
+	@brief Splits a region into runs of nonzero pages. Returns how many, the array in *runs is malloc'd.
+ */
+static uint32_t FindRuns(const struct virtual_mem_region* region, struct checkpoint_run** runs)
+{
+	uint32_t pages = (region->len + CHECKPOINT_PAGE - 1) / CHECKPOINT_PAGE;
+	uint32_t count = 0;
+
+	//Runs are separated by at least one zero page, so there can't be more than half the pages (rounded up)
+	*runs = malloc((pages / 2 + 1) * sizeof(struct checkpoint_run));
+	for(uint32_t page=0; page<pages; page++)
+	{
+		if(IsZeroPage(region, page))
+			continue;
+		if( (count != 0) && ((*runs)[count-1].first_page + (*runs)[count-1].page_count == page) )
+			(*runs)[count-1].page_count++;
+		else
+		{
+			(*runs)[count].first_page = page;
+			(*runs)[count].page_count = 1;
+			(*runs)[count].offset = 0;
+			count++;
+		}
+	}
+	return count;
+}
+
+/**
+	@brief Writes a checkpoint of the current machine state to the checkpoint path from the options
+
+	pc and inst_count are passed separately since a checkpoint taken from inside a syscall should resume after it.
+	Failing to write it is reported but doesn't stop the guest.
+ */
+void WriteCheckpoint(struct simulator* sim, uint32_t pc, uint64_t inst_count)
+{
+	const char* path = sim->options.checkpoint_path;
+	struct virtual_memory* memory = &sim->memory;
+
+	//Regions in list order, so lookups see them in the same order after restoring
+	uint32_t region_count = 0;
+	for(struct virtual_mem_region* region = memory->regions; region != NULL; region = region->next)
+		region_count++;
+	struct checkpoint_run** runs = calloc(region_count + 1, sizeof(struct checkpoint_run*));
+	uint32_t* run_counts = calloc(region_count + 1, sizeof(uint32_t));
+
+	//Lay out the file: metadata first, then every run's data on a page boundary
+	uint64_t offset = sizeof(struct checkpoint_header);
+	uint32_t i = 0;
+	for(struct virtual_mem_region* region = memory->regions; region != NULL; region = region->next, i++)
+	{
+		run_counts[i] = FindRuns(region, &runs[i]);
+		offset += sizeof(struct checkpoint_region) + run_counts[i] * sizeof(struct checkpoint_run);
+	}
+	i = 0;
+	for(struct virtual_mem_region* region = memory->regions; region != NULL; region = region->next, i++)
+	{
+		for(uint32_t j=0; j<run_counts[i]; j++)
+		{
+			offset = (offset + CHECKPOINT_PAGE - 1) & ~(uint64_t)(CHECKPOINT_PAGE - 1);
+			runs[i][j].offset = offset;
+			offset += (uint64_t)runs[i][j].page_count * CHECKPOINT_PAGE;
+		}
+	}
+
+	int ok = 0;
+	FILE* fp = fopen(path, "wb");
+	if(fp != NULL)
+	{
+		struct checkpoint_header hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic));
+		hdr.region_count = region_count;
+		hdr.pc = pc;
+		memcpy(hdr.regs, sim->ctx.regs, sizeof(hdr.regs));
+		hdr.regs[zero] = 0;
+		hdr.HI = sim->ctx.HI;
+		hdr.LO = sim->ctx.LO;
+		hdr.inst_count = inst_count;
+		hdr.stack_top = sim->memory.stack_top;
+		hdr.stack_bottom = sim->memory.stack_bottom;
+		hdr.stack_limit = sim->memory.stack_limit;
+		hdr.heap_start = sim->memory.heap_start;
+		hdr.brk = sim->memory.brk;
+		hdr.heap_end = sim->memory.heap_end;
+		ok = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1);
+
+		i = 0;
+		for(struct virtual_mem_region* region = memory->regions; ok && (region != NULL); region = region->next, i++)
+		{
+			struct checkpoint_region cr = {region->vaddr, region->len, run_counts[i], 0};
+			ok = (fwrite(&cr, sizeof(cr), 1, fp) == 1);
+			if(ok && (run_counts[i] != 0) )
+				ok = (fwrite(runs[i], sizeof(struct checkpoint_run), run_counts[i], fp) == run_counts[i]);
+		}
+
+		//Seeking past the end leaves holes, so the padding doesn't take up disk space either
+		i = 0;
+		for(struct virtual_mem_region* region = memory->regions; ok && (region != NULL); region = region->next, i++)
+		{
+			for(uint32_t j=0; ok && (j<run_counts[i]); j++)
+			{
+				struct checkpoint_run* run = &runs[i][j];
+				uint32_t start = run->first_page * CHECKPOINT_PAGE;
+				uint32_t len = (run->page_count - 1) * CHECKPOINT_PAGE + PageBytes(region, run->first_page + run->page_count - 1);
+				ok = (fseeko(fp, run->offset, SEEK_SET) == 0) &&
+					(fwrite((uint8_t*)region->data + start, 1, len, fp) == len);
+			}
+		}
+
+		if(fclose(fp) != 0)
+			ok = 0;
+	}
+
+	if(ok)
+	{
+		ConsolePrintf(&sim->console, "Checkpoint at %llu instructions written to %s\n",
+			(long long unsigned int)inst_count, path);
+	}
+	else
+		ConsolePrintf(&sim->console, "failed to write checkpoint to %s\n", path);
+
+	for(i=0; i<region_count; i++)
+		free(runs[i]);
+	free(runs);
+	free(run_counts);
+}
+
+/**
+	@brief Runs the interpreter until inst_count reaches target, then takes a checkpoint
+
+	Returns 0 if the guest stopped on an invalid instruction first, 1 otherwise.
+ */
+int RunToCheckpoint(struct virtual_memory* memory, struct context* ctx, uint64_t target)
+{
+	struct virtual_mem_region* text = NULL;
+	while(ctx->inst_count < target)
+	{
+		struct predecoded_inst* pi = FetchPredecodedInstruction(ctx->pc, memory, &text);
+		ctx->regs[zero] = 0;
+		if(!predecoded_handlers[pi->op](pi, memory, ctx))
+			return 0;
+		ctx->inst_count++;
+	}
+
+	WriteCheckpoint(ctx->sim, ctx->pc, ctx->inst_count);
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Restoring
+
+/**
+	@brief Maps one region from a checkpoint and adds it to the end of the region list
+
+	Stored runs are mapped copy-on-write from the file over a demand-zero mapping, so nothing is read until the
+	guest touches it. Returns 0 (after saying why) if the region is damaged.
+ */
+static int RestoreRegion(struct simulator* sim, int fd, uint64_t file_len, const struct checkpoint_region* cr,
+	const struct checkpoint_run* runs, struct virtual_mem_region*** tail)
+{
+	uint32_t pages = (uint32_t)(((uint64_t)cr->len + CHECKPOINT_PAGE - 1) / CHECKPOINT_PAGE);
+	size_t map_len = (size_t)pages * CHECKPOINT_PAGE;
+	int direct = (sysconf(_SC_PAGESIZE) == CHECKPOINT_PAGE);
+
+	uint8_t* base = (map_len == 0) ? NULL : mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if( (map_len == 0) || (base == MAP_FAILED) )
+	{
+		ConsolePrintf(&sim->console, "failed to allocate memory region\n");
+		return 0;
+	}
+
+	//Add it straight away so it's freed with the rest if anything below fails
+	struct virtual_mem_region* region =
+		(struct virtual_mem_region*)calloc(sizeof(struct virtual_mem_region), 1);
+	region->vaddr = cr->vaddr;
+	region->len = cr->len;
+	region->data = (uint32_t*)base;
+	region->map_base = base;
+	region->map_len = map_len;
+	**tail = region;
+	*tail = &region->next;
+
+	for(uint32_t i=0; i<cr->run_count; i++)
+	{
+		const struct checkpoint_run* run = &runs[i];
+		uint64_t len = (uint64_t)run->page_count * CHECKPOINT_PAGE;
+		if( (run->page_count == 0) || (run->first_page >= pages) || (run->page_count > pages - run->first_page) ||
+			(run->offset % CHECKPOINT_PAGE) || (run->offset >= file_len) )
+		{
+			ConsolePrintf(&sim->console, "damaged checkpoint region at %x\n", cr->vaddr);
+			return 0;
+		}
+
+		uint8_t* p = base + (size_t)run->first_page * CHECKPOINT_PAGE;
+		if(direct)
+		{
+			if(mmap(p, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, run->offset) == MAP_FAILED)
+			{
+				ConsolePrintf(&sim->console, "failed to map memory region\n");
+				return 0;
+			}
+		}
+		else
+		{
+			//Host pages don't line up with ours, read it in instead
+			if(len > file_len - run->offset)
+				len = file_len - run->offset;
+			if(pread(fd, p, len, run->offset) != (ssize_t)len)
+			{
+				ConsolePrintf(&sim->console, "failed to read memory region\n");
+				return 0;
+			}
+		}
+	}
+
+	ConsolePrintf(&sim->console, "    Mapping 0x%x bytes of virtual memory from checkpoint at address %x\n", region->len, region->vaddr);
+	return 1;
+}
+
+/**
+	@brief Restores the registers and memory from a checkpoint, in place of ReadELF
+
+	Halts the simulator with HALT_FAULT if the file can't be used.
+ */
+void ReadCheckpoint(const char* fname, struct simulator* sim)
+{
+	struct context* ctx = &sim->ctx;
+
+	ConsolePrintf(&sim->console, "Restoring checkpoint %s...\n", fname);
+	int fd = open(fname, O_RDONLY);
+	if(fd < 0)
+	{
+		ConsolePrintf(&sim->console, "failed to load\n");
+		HaltSimulator(sim, HALT_FAULT);
+	}
+
+	//The header and region table are small, read them; the data itself is mapped
+	struct stat st;
+	struct checkpoint_header hdr;
+	if( (fstat(fd, &st) != 0) || (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) ||
+		memcmp(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic)) )
+	{
+		close(fd);
+		ConsolePrintf(&sim->console, "not a checkpoint file\n");
+		HaltSimulator(sim, HALT_FAULT);
+	}
+
+	uint64_t file_len = st.st_size;
+	uint64_t offset = sizeof(hdr);
+	struct virtual_mem_region** tail = &sim->memory.regions;
+	for(uint32_t i=0; i<hdr.region_count; i++)
+	{
+		struct checkpoint_region cr;
+		if(pread(fd, &cr, sizeof(cr), offset) != sizeof(cr))
+		{
+			close(fd);
+			ConsolePrintf(&sim->console, "truncated checkpoint file\n");
+			HaltSimulator(sim, HALT_FAULT);
+		}
+		offset += sizeof(cr);
+
+		size_t runs_len = (size_t)cr.run_count * sizeof(struct checkpoint_run);
+		struct checkpoint_run* runs = malloc(runs_len + 1);
+		int ok = (runs_len <= file_len - offset) && (pread(fd, runs, runs_len, offset) == (ssize_t)runs_len);
+		if(!ok)
+			ConsolePrintf(&sim->console, "truncated checkpoint file\n");
+		else
+			ok = RestoreRegion(sim, fd, file_len, &cr, runs, &tail);
+		free(runs);
+		if(!ok)
+		{
+			close(fd);
+			HaltSimulator(sim, HALT_FAULT);
+		}
+		offset += runs_len;
+	}
+
+	//Private mappings stay valid without the file
+	close(fd);
+
+	ctx->pc = hdr.pc;
+	memcpy(ctx->regs, hdr.regs, sizeof(ctx->regs));
+	ctx->HI = hdr.HI;
+	ctx->LO = hdr.LO;
+	ctx->inst_count = hdr.inst_count;
+	sim->memory.stack_top = hdr.stack_top;
+	sim->memory.stack_bottom = hdr.stack_bottom;
+	sim->memory.stack_limit = hdr.stack_limit;
+	sim->memory.heap_start = hdr.heap_start;
+	sim->memory.brk = hdr.brk;
+	sim->memory.heap_end = hdr.heap_end;
+	ConsolePrintf(&sim->console, "    Resuming at %08x after %llu instructions\n", ctx->pc,
+		(long long unsigned int)ctx->inst_count);
+
+	BuildPageTable(&sim->memory);
+}
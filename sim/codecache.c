@@ -0,0 +1,289 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Code cache: decoded instructions saved to disk when a program stops, and reused by later runs of it
+
+	A cache file is named after a hash of the ELF's PT_LOAD segments and holds a code_cache_header, then one
+	code_cache_page for every page that had decoded words, with the words it was decoded from. Loading maps the file
+	and decodes nothing: each saved record goes straight into the predecode cache, but only if the word it came from
+	is still the one in memory, so a hash collision or code that changed since costs nothing but those words.
+ */
+#include "sim.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//Records hold predecoded_ops ids, so this changes whenever the ops do
+#define CODE_CACHE_MAGIC	"MIPSCOD3"
+
+//Words in one guest page
+#define CODE_CACHE_WORDS	(VM_PAGE_SIZE / 4)
+
+struct code_cache_header
+{
+	char magic[8];
+	uint64_t hash;					//of the PT_LOAD segments, see HashCode
+	uint32_t page_count;
+	uint32_t record_size;			//sizeof(struct code_cache_record), in case the layout ever changes
+};
+
+//A predecoded_inst without its handler, which is a host address and is picked again on loading
+struct code_cache_record
+{
+	uint32_t imm;
+	uint32_t target;
+	uint8_t op;
+	uint8_t rs;
+	uint8_t rt;
+	uint8_t rd;
+	uint8_t shamt;
+	uint8_t decoded;				//zero if the word wasn't, the rest is then meaningless
+	uint8_t fused;					//it ran as a pair with the next word
+	uint8_t reserved;
+};
+
+//Page page of the region at vaddr, len bytes long
+struct code_cache_page
+{
+	uint32_t vaddr;
+	uint32_t len;
+	uint32_t page;
+	uint32_t words;					//how many of those below belong to the region
+	uint32_t source[CODE_CACHE_WORDS];
+	struct code_cache_record records[CODE_CACHE_WORDS];
+};
+
+/**
+	@brief Carries an FNV-1a style hash over len more bytes, eight at a time
+
+	Weaker than hashing bytewise, but the hash only names the file: entries are checked against memory anyway.
+ */
+uint64_t HashCode(uint64_t hash, const void* data, size_t len)
+{
+	const uint8_t* p = (const uint8_t*)data;
+	for(; len >= 8; p += 8, len -= 8)
+	{
+		uint64_t word;
+		memcpy(&word, p, sizeof(word));
+		hash = (hash ^ word) * 0x100000001b3ull;
+	}
+	for(; len != 0; p++, len--)
+		hash = (hash ^ *p) * 0x100000001b3ull;
+	return hash;
+}
+
+//dir/hash.code, in path
+static void CodeCachePath(const struct simulator* sim, char* path, size_t size)
+{
+	snprintf(path, size, "%s/%016llx.code", sim->options.code_cache_dir, (long long unsigned int)sim->code_hash);
+}
+
+//Same region, by where it is and how big: the file doesn't know about region structs
+static struct virtual_mem_region* FindCachedRegion(struct virtual_memory* memory, const struct code_cache_page* cp)
+{
+	for(struct virtual_mem_region* region = memory->regions; region != NULL; region = region->next)
+	{
+		if( (region->vaddr == cp->vaddr) && (region->len == cp->len) )
+			return region;
+	}
+	return NULL;
+}
+
+//Puts the records of one page whose words still match into the predecode cache, unfused. Returns how many.
+static uint32_t InstallPage(struct virtual_mem_region* region, const struct code_cache_page* cp)
+{
+	uint32_t words = (region->len + 3) / 4;
+	uint32_t first = cp->page * CODE_CACHE_WORDS;
+	if( (first >= words) || (cp->words > words - first) || (cp->words > CODE_CACHE_WORDS) )
+		return 0;
+
+	if(region->decoded == NULL)
+	{
+		region->decoded_pages = calloc((region->len + VM_PAGE_SIZE - 1) >> VM_PAGE_SHIFT, 1);
+		region->decoded = calloc(words, sizeof(struct predecoded_inst));
+	}
+
+	uint32_t installed = 0;
+	for(uint32_t i=0; i<cp->words; i++)
+	{
+		const struct code_cache_record* rec = &cp->records[i];
+		if( !rec->decoded || (rec->op >= PD_COUNT) || (region->data[first + i] != cp->source[i]) )
+			continue;
+		struct predecoded_inst* pi = &region->decoded[first + i];
+		pi->imm = rec->imm;
+		pi->target = rec->target;
+		pi->op = rec->op;
+		pi->rs = rec->rs;
+		pi->rt = rec->rt;
+		pi->rd = rec->rd;
+		pi->shamt = rec->shamt;
+		pi->handler = predecoded_handlers[rec->op];
+		installed++;
+	}
+	if(installed != 0)
+		region->decoded_pages[cp->page] = 1;
+	return installed;
+}
+
+//Fuses the pairs on a page that were fused when saved, now that the words after them are in too (if they are)
+static void FusePage(struct virtual_mem_region* region, const struct code_cache_page* cp)
+{
+	uint32_t words = (region->len + 3) / 4;
+	struct predecoded_inst* pi = &region->decoded[cp->page * CODE_CACHE_WORDS];
+	for(uint32_t i=0; i<cp->words; i++)
+	{
+		if( !cp->records[i].fused || (pi[i].handler == NULL) || (cp->page * CODE_CACHE_WORDS + i + 1 >= words) ||
+			(pi[i+1].handler == NULL) )
+			continue;
+		predecoded_handler fused = FusedHandler(&pi[i], &pi[i+1]);
+		if(fused != NULL)
+			pi[i].handler = fused;
+	}
+}
+
+/**
+	@brief Fills the predecode cache from the options' code cache directory, if it has a file for this program
+
+	Called once the ELF is mapped. A missing or unusable file just means decoding as usual.
+ */
+void LoadCodeCache(struct simulator* sim)
+{
+	char path[1024];
+	CodeCachePath(sim, path, sizeof(path));
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return;
+	struct stat st;
+	const uint8_t* file = MAP_FAILED;
+	if( (fstat(fd, &st) == 0) && ((size_t)st.st_size >= sizeof(struct code_cache_header)) )
+		file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if(file == MAP_FAILED)
+		return;
+
+	const struct code_cache_header* hdr = (const struct code_cache_header*)file;
+	const struct code_cache_page* pages = (const struct code_cache_page*)(file + sizeof(*hdr));
+	if( memcmp(hdr->magic, CODE_CACHE_MAGIC, sizeof(hdr->magic)) || (hdr->hash != sim->code_hash) ||
+		(hdr->record_size != sizeof(struct code_cache_record)) ||
+		(hdr->page_count > (st.st_size - sizeof(*hdr)) / sizeof(struct code_cache_page)) )
+	{
+		munmap((void*)file, st.st_size);
+		return;
+	}
+
+	uint32_t installed = 0;
+	for(uint32_t i=0; i<hdr->page_count; i++)
+	{
+		struct virtual_mem_region* region = FindCachedRegion(&sim->memory, &pages[i]);
+		if(region != NULL)
+			installed += InstallPage(region, &pages[i]);
+	}
+	for(uint32_t i=0; i<hdr->page_count; i++)
+	{
+		struct virtual_mem_region* region = FindCachedRegion(&sim->memory, &pages[i]);
+		if( (region != NULL) && (region->decoded_pages != NULL) && region->decoded_pages[pages[i].page] )
+			FusePage(region, &pages[i]);
+	}
+	munmap((void*)file, st.st_size);
+
+	sim->memory.decoded_new = 0;
+	ConsolePrintf(&sim->console, "    Reusing %u decoded instructions from %s\n", installed, path);
+}
+
+//Fills in a page's entry from the predecode cache. Returns 0 if nothing on it is decoded any more.
+static int SavePage(const struct virtual_mem_region* region, uint32_t page, struct code_cache_page* cp)
+{
+	uint32_t words = (region->len + 3) / 4;
+	uint32_t first = page * CODE_CACHE_WORDS;
+	memset(cp, 0, sizeof(*cp));
+	cp->vaddr = region->vaddr;
+	cp->len = region->len;
+	cp->page = page;
+	cp->words = (words - first < CODE_CACHE_WORDS) ? (words - first) : CODE_CACHE_WORDS;
+
+	int any = 0;
+	for(uint32_t i=0; i<cp->words; i++)
+	{
+		//A decoded word hasn't been stored to since, so memory still holds what it was decoded from
+		const struct predecoded_inst* pi = &region->decoded[first + i];
+		if(pi->handler == NULL)
+			continue;
+		struct code_cache_record* rec = &cp->records[i];
+		cp->source[i] = region->data[first + i];
+		rec->imm = pi->imm;
+		rec->target = pi->target;
+		rec->op = pi->op;
+		rec->rs = pi->rs;
+		rec->rt = pi->rt;
+		rec->rd = pi->rd;
+		rec->shamt = pi->shamt;
+		rec->decoded = 1;
+		rec->fused = IsFusedInstruction(pi);
+		any = 1;
+	}
+	return any;
+}
+
+/**
+	@brief Writes everything decoded so far to the code cache directory, when the program stops
+
+	Nothing is written if every decoded word came from the file loaded. The file is written under another name and
+	renamed over the old one, so runs of the same program at the same time (batch jobs, say) never see half of
+	one. Failing to write it is reported but changes nothing else.
+ */
+void SaveCodeCache(struct simulator* sim)
+{
+	struct virtual_memory* memory = &sim->memory;
+	if( (sim->options.code_cache_dir == NULL) || (sim->code_hash == 0) || !memory->decoded_new)
+		return;
+	memory->decoded_new = 0;
+
+	char path[1024];
+	char temp[1100];
+	CodeCachePath(sim, path, sizeof(path));
+	snprintf(temp, sizeof(temp), "%s.%d.%p", path, (int)getpid(), (void*)sim);
+	mkdir(sim->options.code_cache_dir, 0777);
+
+	int ok = 0;
+	FILE* fp = fopen(temp, "wb");
+	if(fp != NULL)
+	{
+		//The page count goes in once it's known
+		struct code_cache_header hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, CODE_CACHE_MAGIC, sizeof(hdr.magic));
+		hdr.hash = sim->code_hash;
+		hdr.record_size = sizeof(struct code_cache_record);
+		ok = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1);
+
+		struct code_cache_page* cp = malloc(sizeof(struct code_cache_page));
+		for(struct virtual_mem_region* region = memory->regions; ok && (region != NULL); region = region->next)
+		{
+			if(region->decoded == NULL)
+				continue;
+			uint32_t pages = (region->len + VM_PAGE_SIZE - 1) >> VM_PAGE_SHIFT;
+			for(uint32_t page = 0; ok && (page < pages); page++)
+			{
+				if(!region->decoded_pages[page] || !SavePage(region, page, cp))
+					continue;
+				ok = (fwrite(cp, sizeof(*cp), 1, fp) == 1);
+				hdr.page_count++;
+			}
+		}
+		free(cp);
+
+		if(ok)
+			ok = (fseek(fp, 0, SEEK_SET) == 0) && (fwrite(&hdr, sizeof(hdr), 1, fp) == 1);
+		if(fclose(fp) != 0)
+			ok = 0;
+		if(ok)
+			ok = (rename(temp, path) == 0);
+		if(!ok)
+			unlink(temp);
+	}
+
+	if(!ok)
+		ConsolePrintf(&sim->console, "failed to write code cache to %s\n", path);
+}
@@ -0,0 +1,251 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Buffered guest console output, optionally drained by a writer thread
+ */
+#include "sim.h"
+#include <string.h>
+#include <stdarg.h>
+#include <sched.h>
+
+//How long the writer thread naps when it has caught up
+#define CONSOLE_IDLE_NS			50000
+
+/**
+	@brief Sets up a console writing to out, without a writer thread
+ */
+void InitConsole(struct console* con, FILE* out)
+{
+	memset(con, 0, sizeof(*con));
+	con->out = out;
+	con->buffer = malloc(CONSOLE_BUFFER_SIZE);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Writer thread
+
+static void* ConsoleWriter(void* arg)
+{
+	struct console* con = (struct console*)arg;
+	uint64_t tail = con->tail;
+
+	while(1)
+	{
+		//Read stop and any flush request before head, so everything produced before them is visible below
+		int stop = __atomic_load_n(&con->stop, __ATOMIC_ACQUIRE);
+		uint64_t request = __atomic_load_n(&con->flush_request, __ATOMIC_ACQUIRE);
+		uint64_t head = __atomic_load_n(&con->head, __ATOMIC_ACQUIRE);
+
+		int wrote = (head != tail);
+		while(tail != head)
+		{
+			size_t offset = tail & (CONSOLE_BUFFER_SIZE - 1);
+			size_t len = head - tail;
+			if(len > CONSOLE_BUFFER_SIZE - offset)
+				len = CONSOLE_BUFFER_SIZE - offset;
+
+			fwrite(con->buffer + offset, 1, len, con->out);
+			tail += len;
+			__atomic_store_n(&con->tail, tail, __ATOMIC_RELEASE);
+		}
+
+		//Caught up: push it out of stdio too, and let anyone waiting on a flush go
+		if(wrote || (request != con->flush_done) )
+			fflush(con->out);
+		if(request != con->flush_done)
+			__atomic_store_n(&con->flush_done, request, __ATOMIC_RELEASE);
+
+		if(stop)
+			break;
+		if(!wrote)
+		{
+			struct timespec nap = {0, CONSOLE_IDLE_NS};
+			nanosleep(&nap, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+	@brief Hands output off to a writer thread from now on, so the simulation never waits on a slow terminal or pipe
+
+	Falls back to plain buffering if the thread can't be started.
+ */
+void StartConsoleWriter(struct console* con)
+{
+	if(con->async)
+		return;
+
+	//Anything already buffered goes first
+	ConsoleFlush(con);
+
+	con->head = 0;
+	con->tail = 0;
+	con->flush_request = 0;
+	con->flush_done = 0;
+	con->stop = 0;
+	if(0 == pthread_create(&con->writer, NULL, ConsoleWriter, con))
+		con->async = 1;
+}
+
+/**
+	@brief Lets several harts write from now on. Each call then holds a lock, so messages and outputs never mix
+ */
+void ShareConsole(struct console* con)
+{
+	pthread_mutex_init(&con->lock, NULL);
+	con->shared = 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Output
+
+static void WriteUnlocked(struct console* con, const char* data, size_t len)
+{
+	//Plain buffering: write out whole buffers as they fill
+	if(!con->async)
+	{
+		while(len > 0)
+		{
+			size_t n = CONSOLE_BUFFER_SIZE - con->used;
+			if(n > len)
+				n = len;
+			memcpy(con->buffer + con->used, data, n);
+			con->used += n;
+			data += n;
+			len -= n;
+
+			if(con->used == CONSOLE_BUFFER_SIZE)
+			{
+				fwrite(con->buffer, 1, con->used, con->out);
+				con->used = 0;
+			}
+		}
+		return;
+	}
+
+	//Ring: copy into whatever space the writer has freed up, only waiting if it's completely full
+	uint64_t head = con->head;
+	while(len > 0)
+	{
+		uint64_t tail = __atomic_load_n(&con->tail, __ATOMIC_ACQUIRE);
+		size_t space = CONSOLE_BUFFER_SIZE - (head - tail);
+		if(space == 0)
+		{
+			sched_yield();
+			continue;
+		}
+
+		size_t offset = head & (CONSOLE_BUFFER_SIZE - 1);
+		size_t n = CONSOLE_BUFFER_SIZE - offset;
+		if(n > space)
+			n = space;
+		if(n > len)
+			n = len;
+		memcpy(con->buffer + offset, data, n);
+		data += n;
+		len -= n;
+		head += n;
+		__atomic_store_n(&con->head, head, __ATOMIC_RELEASE);
+	}
+}
+
+void ConsoleWrite(struct console* con, const char* data, size_t len)
+{
+	if(!con->shared)
+	{
+		WriteUnlocked(con, data, len);
+		return;
+	}
+	pthread_mutex_lock(&con->lock);
+	WriteUnlocked(con, data, len);
+	pthread_mutex_unlock(&con->lock);
+}
+
+void ConsolePrintf(struct console* con, const char* format, ...)
+{
+	char text[256];
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+	if(len < 0)
+		return;
+
+	if((size_t)len < sizeof(text))
+	{
+		ConsoleWrite(con, text, len);
+		return;
+	}
+
+	//Didn't fit, format it again into something big enough
+	char* big = malloc(len + 1);
+	va_start(args, format);
+	vsnprintf(big, len + 1, format, args);
+	va_end(args);
+	ConsoleWrite(con, big, len);
+	free(big);
+}
+
+static void FlushUnlocked(struct console* con)
+{
+	if(!con->async)
+	{
+		if(con->used != 0)
+			fwrite(con->buffer, 1, con->used, con->out);
+		con->used = 0;
+		fflush(con->out);
+		return;
+	}
+
+	uint64_t request = con->flush_request + 1;
+	__atomic_store_n(&con->flush_request, request, __ATOMIC_RELEASE);
+	while(__atomic_load_n(&con->flush_done, __ATOMIC_ACQUIRE) != request)
+		sched_yield();
+}
+
+/**
+	@brief Makes sure everything written so far has reached the output file (e.g. a prompt before reading input)
+ */
+void ConsoleFlush(struct console* con)
+{
+	if(!con->shared)
+	{
+		FlushUnlocked(con);
+		return;
+	}
+	pthread_mutex_lock(&con->lock);
+	FlushUnlocked(con);
+	pthread_mutex_unlock(&con->lock);
+}
+
+/**
+	@brief Flushes everything written so far to the old stream, then sends later output to out. Only without a
+	writer thread.
+ */
+void ConsoleRedirect(struct console* con, FILE* out)
+{
+	ConsoleFlush(con);
+	con->out = out;
+}
+
+/**
+	@brief Flushes everything, stops the writer thread if there is one and frees the buffer
+ */
+void CloseConsole(struct console* con)
+{
+	ConsoleFlush(con);
+	if(con->async)
+	{
+		__atomic_store_n(&con->stop, 1, __ATOMIC_RELEASE);
+		pthread_join(con->writer, NULL);
+		con->async = 0;
+	}
+
+	free(con->buffer);
+	con->buffer = NULL;
+	if(con->shared)
+		pthread_mutex_destroy(&con->lock);
+	con->shared = 0;
+}
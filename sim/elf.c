@@ -0,0 +1,311 @@
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief ELF loading
+ */
+#include "sim.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+	@brief Maps one PT_LOAD segment into a new guest region
+	
+	The segment gets a demand-zero anonymous mapping covering all of p_memsz. When the file offset and virtual
+	address agree modulo the host page size (which any normal linker output does), the file contents are then
+	mapped copy-on-write over the front of it, so untouched code and data are shared with the page cache. Only the
+	part of the last file page that belongs to the BSS has to be cleared by hand. Anything else, and everything when
+	there's no file (fd < 0), is copied.
+	
+	Returns 0 (after saying why) if the segment can't be mapped.
+ */
+static int MapSegment(struct simulator* sim, int fd, const uint8_t* image, size_t image_len, const Elf32_Phdr* phdr)
+{
+	if(phdr->p_filesz > phdr->p_memsz)
+	{
+		ConsolePrintf(&sim->console, "segment at %x is larger in the file than in memory\n", phdr->p_vaddr);
+		return 0;
+	}
+	if( (phdr->p_offset > image_len) || (phdr->p_filesz > image_len - phdr->p_offset) )
+	{
+		ConsolePrintf(&sim->console, "segment at %x extends past the end of the file\n", phdr->p_vaddr);
+		return 0;
+	}
+	
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t slack = phdr->p_vaddr % page;
+	size_t map_len = (slack + phdr->p_memsz + page - 1) & ~(page - 1);
+	
+	uint8_t* base = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(base == MAP_FAILED)
+	{
+		ConsolePrintf(&sim->console, "failed to allocate memory region\n");
+		return 0;
+	}
+	
+	if(phdr->p_filesz != 0)
+	{
+		if( (fd >= 0) && (phdr->p_offset % page == slack) )
+		{
+			size_t file_len = (slack + phdr->p_filesz + page - 1) & ~(page - 1);
+			void* p = mmap(base, file_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, phdr->p_offset - slack);
+			if(p == MAP_FAILED)
+			{
+				ConsolePrintf(&sim->console, "failed to map memory region\n");
+				munmap(base, map_len);
+				return 0;
+			}
+			
+			//The last file page also holds whatever follows the segment in the file
+			size_t bss = slack + phdr->p_filesz;
+			size_t bss_end = slack + phdr->p_memsz;
+			if(bss_end > file_len)
+				bss_end = file_len;
+			if(bss_end > bss)
+				memset(base + bss, 0, bss_end - bss);
+		}
+		else
+			memcpy(base + slack, image + phdr->p_offset, phdr->p_filesz);
+	}
+	
+	struct virtual_mem_region* region =
+		(struct virtual_mem_region*)calloc(sizeof(struct virtual_mem_region), 1);
+	region->vaddr = phdr->p_vaddr;
+	region->len = phdr->p_memsz;
+	region->data = (uint32_t*)(base + slack);
+	region->map_base = base;
+	region->map_len = map_len;
+	region->next = sim->memory.regions;
+	sim->memory.regions = region;
+	ConsolePrintf(&sim->console, "    Mapping 0x%x bytes of virtual memory from executable at address %x\n", region->len, region->vaddr);
+	return 1;
+}
+
+/**
+	@brief Validates the headers of a mapped ELF image and maps its loadable segments
+	
+	Returns 0 (after saying why) if the image is unusable.
+ */
+static int ParseELF(struct simulator* sim, int fd, const uint8_t* image, size_t image_len)
+{
+	//Validate the ELF header
+	if(image_len < sizeof(Elf32_Ehdr))
+	{
+		ConsolePrintf(&sim->console, "failed to read elf header\n");
+		return 0;
+	}
+	Elf32_Ehdr hdr;
+	memcpy(&hdr, image, sizeof(hdr));
+	if( (hdr.e_ident[EI_MAG0] != 0x7f) ||
+		(hdr.e_ident[EI_MAG1] != 'E') ||
+		(hdr.e_ident[EI_MAG2] != 'L') ||
+		(hdr.e_ident[EI_MAG3] != 'F')
+		)
+	{
+		ConsolePrintf(&sim->console, "bad ELF magic\n");
+		return 0;
+	}
+	if(hdr.e_ident[EI_DATA] != ELFDATA2LSB)
+	{
+		ConsolePrintf(&sim->console, "not little endian\n");
+		return 0;
+	}
+	if(hdr.e_ident[EI_CLASS] != ELFCLASS32)
+	{
+		ConsolePrintf(&sim->console, "not an ELFCLASS32\n");
+		return 0;
+	}
+	if(hdr.e_machine != EM_MIPS)
+	{
+		ConsolePrintf(&sim->console, "not a MIPS binary\n");
+		return 0;
+	}
+	if(hdr.e_type != ET_EXEC)
+	{
+		ConsolePrintf(&sim->console, "not an executable file\n");
+		return 0;
+	}
+	if(hdr.e_version != EV_CURRENT)
+	{
+		ConsolePrintf(&sim->console, "not the right ELF version\n");
+		return 0;
+	}
+	
+	//Save the entry point address
+	ConsolePrintf(&sim->console, "    Virtual address of entry point is %08x\n", hdr.e_entry);
+	sim->ctx.pc = hdr.e_entry;
+	
+	//Walk the program headers
+	sim->code_hash = CODE_HASH_SEED;
+	if(hdr.e_phentsize != sizeof(Elf32_Phdr))
+	{
+		ConsolePrintf(&sim->console, "invalid phentsize\n");
+		return 0;
+	}
+	if( (hdr.e_phoff > image_len) || (hdr.e_phnum * sizeof(Elf32_Phdr) > image_len - hdr.e_phoff) )
+	{
+		ConsolePrintf(&sim->console, "fail to read phdr\n");
+		return 0;
+	}
+	for(size_t i=0; i<hdr.e_phnum; i++)
+	{
+		Elf32_Phdr phdr;
+		memcpy(&phdr, image + hdr.e_phoff + i*sizeof(phdr), sizeof(phdr));
+		
+		//Skip non-loadable stuff, it never becomes guest memory
+		if( (phdr.p_type != PT_LOAD) || (phdr.p_memsz == 0) )
+			continue;
+		
+		if(!MapSegment(sim, fd, image, image_len, &phdr))
+			return 0;
+		
+		//Where each segment goes and what's in it decide what decodes to what, so they name the code cache
+		if(sim->options.code_cache_dir != NULL)
+		{
+			uint32_t layout[3] = {phdr.p_vaddr, phdr.p_memsz, phdr.p_filesz};
+			sim->code_hash = HashCode(sim->code_hash, layout, sizeof(layout));
+			sim->code_hash = HashCode(sim->code_hash, image + phdr.p_offset, phdr.p_filesz);
+		}
+	}
+	
+	return 1;
+}
+
+/**
+	@brief Hands every function in the ELF symbol table to the profiler
+	
+	Code labels without a type (e.g. from assembly startup code) count as functions too. A missing or damaged
+	symbol table just means an unsymbolized profile.
+ */
+static void LoadSymbols(struct simulator* sim, const uint8_t* image, size_t image_len)
+{
+	Elf32_Ehdr hdr;
+	memcpy(&hdr, image, sizeof(hdr));
+	if( (hdr.e_shentsize != sizeof(Elf32_Shdr)) || (hdr.e_shoff > image_len) ||
+		(hdr.e_shnum * sizeof(Elf32_Shdr) > image_len - hdr.e_shoff) )
+		return;
+	const Elf32_Shdr* sections = (const Elf32_Shdr*)(image + hdr.e_shoff);
+	
+	for(size_t i=0; i<hdr.e_shnum; i++)
+	{
+		const Elf32_Shdr* symtab = &sections[i];
+		if( (symtab->sh_type != SHT_SYMTAB) || (symtab->sh_link >= hdr.e_shnum) ||
+			(symtab->sh_offset > image_len) || (symtab->sh_size > image_len - symtab->sh_offset) )
+			continue;
+		const Elf32_Shdr* strtab = &sections[symtab->sh_link];
+		if( (strtab->sh_offset > image_len) || (strtab->sh_size > image_len - strtab->sh_offset) )
+			continue;
+		const char* strings = (const char*)(image + strtab->sh_offset);
+		
+		const Elf32_Sym* syms = (const Elf32_Sym*)(image + symtab->sh_offset);
+		for(size_t j=0; j<symtab->sh_size / sizeof(Elf32_Sym); j++)
+		{
+			const Elf32_Sym* sym = &syms[j];
+			int type = ELF_ST_TYPE(sym->st_info);
+			if( (sym->st_shndx == SHN_UNDEF) || (sym->st_shndx >= hdr.e_shnum) || (sym->st_name >= strtab->sh_size) )
+				continue;
+			if( (type != STT_FUNC) && !( (type == STT_NOTYPE) && (sections[sym->st_shndx].sh_flags & SHF_EXECINSTR) ) )
+				continue;
+			
+			//Names have to end inside the string table
+			const char* name = strings + sym->st_name;
+			if( (name[0] == '\0') || (memchr(name, '\0', strtab->sh_size - sym->st_name) == NULL) )
+				continue;
+			
+			AddProfileSymbol(sim->profile, sym->st_value, sym->st_size, name);
+		}
+	}
+}
+
+/**
+	@brief Maps the segments of an ELF image (which fd, if not -1, is open on), then sets up the stack and heap
+	
+	Returns 0 (after saying why) if that can't be done.
+ */
+static int LoadELF(struct simulator* sim, int fd, const uint8_t* image, size_t image_len)
+{
+	struct context* ctx = &sim->ctx;
+	struct virtual_memory* memory = &sim->memory;
+	
+	//Zeroize all context stuff
+	for(int i=0; i<32; i++)
+		ctx->regs[i] = 0;
+	
+	if(!ParseELF(sim, fd, image, image_len))
+		return 0;
+	if(sim->profile != NULL)
+		LoadSymbols(sim, image, image_len);
+	
+	//The heap starts after the highest segment below the stack
+	uint32_t program_end = 0;
+	for(struct virtual_mem_region* region = memory->regions; region != NULL; region = region->next)
+	{
+		uint64_t end = (uint64_t)region->vaddr + region->len;
+		if( (end <= VM_STACK_TOP - VM_STACK_MAX) && (end > program_end) )
+			program_end = end;
+	}
+	
+	//Create one last memory region for the stack, then point the stack pointer to it
+	if(!SetupStackAndHeap(memory, VM_STACK_TOP, program_end))
+	{
+		ConsolePrintf(&sim->console, "failed to allocate memory region\n");
+		return 0;
+	}
+	ctx->regs[REGID_SP] = VM_STACK_TOP - 4;
+	ConsolePrintf(&sim->console, "    Mapping 0x%x bytes of virtual memory for stack at address %x\n", VM_STACK_INITIAL,
+		memory->stack_bottom);
+	
+	//Set up fast translations now that the memory map is final
+	BuildPageTable(memory);
+	if(sim->options.code_cache_dir != NULL)
+		LoadCodeCache(sim);
+	return 1;
+}
+
+/**
+	@brief Reads an ELF executable
+	
+	The file is mapped once and only PT_LOAD segments become guest memory; see MapSegment. Halts the simulator with
+	HALT_FAULT if the file can't be used.
+ */
+void ReadELF(const char* fname, struct simulator* sim)
+{
+	//Open and map the file
+	ConsolePrintf(&sim->console, "Reading ELF file %s...\n", fname);
+	int fd = open(fname, O_RDONLY);
+	if(fd < 0)
+	{
+		ConsolePrintf(&sim->console, "failed to load\n");
+		HaltSimulator(sim, HALT_FAULT);
+	}
+	struct stat st;
+	const uint8_t* image = MAP_FAILED;
+	if(fstat(fd, &st) == 0)
+		image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(image == MAP_FAILED)
+	{
+		close(fd);
+		ConsolePrintf(&sim->console, "failed to load\n");
+		HaltSimulator(sim, HALT_FAULT);
+	}
+	size_t image_len = st.st_size;
+	
+	//Private mappings of the segments stay valid without the file
+	int ok = LoadELF(sim, fd, image, image_len);
+	munmap((void*)image, image_len);
+	close(fd);
+	if(!ok)
+		HaltSimulator(sim, HALT_FAULT);
+}
+
+/**
+	@brief Reads an ELF executable that's already in memory. Segments are copied, so image can go afterwards.
+ */
+void ReadELFImage(const char* name, const uint8_t* image, size_t image_len, struct simulator* sim)
+{
+	ConsolePrintf(&sim->console, "Reading ELF image %s...\n", name);
+	if(!LoadELF(sim, -1, image, image_len))
+		HaltSimulator(sim, HALT_FAULT);
+}
@@ -0,0 +1,752 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief GDB remote serial protocol stub: registers, memory, step and continue, breakpoints patched into the
+	predecoded entries and watchpoints through the page table
+ */
+#include "sim.h"
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+//Registers in a 'g' packet: the GPRs, then sr, lo, hi, badvaddr, cause and pc (no FPU)
+#define DEBUG_REGISTERS		38
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Breakpoints and watchpoints
+
+static int IsBreakpoint(const struct debugger* d, uint32_t address)
+{
+	for(int i=0; i<d->breakpoint_count; i++)
+	{
+		if(d->breakpoints[i] == address)
+			return 1;
+	}
+	return 0;
+}
+
+//Stands in for the instruction under a breakpoint: stops the run before it, pc still pointing at it
+static int BreakpointHandler(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->sim->debugger->stopped = SIGTRAP;
+	return 0;
+}
+
+/**
+	@brief Called whenever the word at a region offset has just been decoded (the one after it may have been too, to
+	fuse them): points whichever has a breakpoint at BreakpointHandler, and splits a pair whose second half has one
+	so it can't run past it
+ */
+void PatchBreakpoints(struct debugger* d, struct virtual_mem_region* region, uint32_t offset)
+{
+	struct predecoded_inst* pi = &region->decoded[offset / 4];
+	if( (offset + 4 < region->len) && IsBreakpoint(d, region->vaddr + offset + 4) )
+	{
+		if(IsFusedInstruction(pi))
+			pi->handler = predecoded_handlers[pi->op];
+		if(pi[1].handler != NULL)
+			pi[1].handler = BreakpointHandler;
+	}
+	if(IsBreakpoint(d, region->vaddr + offset))
+		pi->handler = BreakpointHandler;
+}
+
+//First region holding address, like every access finds it, NULL if none does. Never grows the stack.
+static struct virtual_mem_region* FindRegion(struct virtual_memory* memory, uint32_t address)
+{
+	for(struct virtual_mem_region* region = memory->regions; region != NULL; region = region->next)
+	{
+		if(address - region->vaddr < region->len)
+			return region;
+	}
+	return NULL;
+}
+
+//Sets a breakpoint on an aligned word of mapped memory. Returns 0 if there can't be one there.
+static int InsertBreakpoint(struct simulator* sim, uint32_t address)
+{
+	struct debugger* d = sim->debugger;
+	struct virtual_mem_region* region = FindRegion(&sim->memory, address);
+	if( (region == NULL) || ( (address - region->vaddr) & 3) )
+		return 0;
+	if(IsBreakpoint(d, address))
+		return 1;
+	if(d->breakpoint_count == DEBUG_MAX_BREAKPOINTS)
+		return 0;
+	d->breakpoints[d->breakpoint_count++] = address;
+
+	//Decoding it (if it wasn't already) patches the entry, but one decoded earlier needs doing here, along with a
+	//pair ending at it
+	struct virtual_mem_region* text = region;
+	FetchPredecodedInstruction(address, &sim->memory, &text);
+	uint32_t offset = address - region->vaddr;
+	PatchBreakpoints(d, region, offset);
+	if( (offset != 0) && (region->decoded[offset / 4 - 1].handler != NULL) )
+		PatchBreakpoints(d, region, offset - 4);
+	return 1;
+}
+
+static int RemoveBreakpoint(struct simulator* sim, uint32_t address)
+{
+	struct debugger* d = sim->debugger;
+	int i = 0;
+	while( (i < d->breakpoint_count) && (d->breakpoints[i] != address) )
+		i++;
+	if(i == d->breakpoint_count)
+		return 0;
+	d->breakpoints[i] = d->breakpoints[--d->breakpoint_count];
+
+	//Both words decode again (and fuse again, if they did) when next reached
+	struct virtual_mem_region* region = FindRegion(&sim->memory, address);
+	if( (region == NULL) || (region->decoded == NULL) )
+		return 1;
+	uint32_t offset = address - region->vaddr;
+	struct predecoded_inst* pi = &region->decoded[offset / 4];
+	pi->handler = NULL;
+	if( (offset != 0) && (pi[-1].handler != BreakpointHandler) )
+		pi[-1].handler = NULL;
+	return 1;
+}
+
+/**
+	@brief Puts every page a watchpoint covers back on the slow path, after something rebuilt their translations
+ */
+void ProtectWatchedPages(struct simulator* sim)
+{
+	struct debugger* d = sim->debugger;
+	for(int i=0; i<d->watchpoint_count; i++)
+	{
+		const struct watchpoint* w = &d->watchpoints[i];
+		uint64_t end = (uint64_t)w->address + w->len;
+		for(uint64_t page = w->address & ~VM_PAGE_MASK; page < end; page += VM_PAGE_SIZE)
+			ForceSlowPage(&sim->memory, (uint32_t)page);
+	}
+}
+
+static int InsertWatchpoint(struct simulator* sim, uint32_t address, uint32_t len, int kind)
+{
+	struct debugger* d = sim->debugger;
+	if( (len == 0) || (d->watchpoint_count == DEBUG_MAX_WATCHPOINTS) )
+		return 0;
+	struct watchpoint* w = &d->watchpoints[d->watchpoint_count++];
+	w->address = address;
+	w->len = len;
+	w->kind = kind;
+	ProtectWatchedPages(sim);
+	return 1;
+}
+
+static int RemoveWatchpoint(struct simulator* sim, uint32_t address, uint32_t len, int kind)
+{
+	struct debugger* d = sim->debugger;
+	for(int i=0; i<d->watchpoint_count; i++)
+	{
+		struct watchpoint* w = &d->watchpoints[i];
+		if( (w->address != address) || (w->len != len) || (w->kind != kind) )
+			continue;
+
+		//Only a rebuild gives pages back their fast translations, then the ones still watched lose them again
+		*w = d->watchpoints[--d->watchpoint_count];
+		BuildPageTable(&sim->memory);
+		ProtectWatchedPages(sim);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+	@brief Called for every guest access that came off the fast path while a debugger is attached. One that touches
+	a watchpoint stops the run once the instruction making it has finished.
+ */
+void WatchAccess(struct simulator* sim, uint32_t address, uint32_t size, int write)
+{
+	struct debugger* d = sim->debugger;
+	for(int i=0; i<d->watchpoint_count; i++)
+	{
+		const struct watchpoint* w = &d->watchpoints[i];
+		if( (address >= (uint64_t)w->address + w->len) || (w->address >= (uint64_t)address + size) )
+			continue;
+		if( (w->kind == WATCH_WRITE) ? !write : (w->kind == WATCH_READ) ? write : 0 )
+			continue;
+
+		d->stopped = SIGTRAP;
+		d->hit = w;
+		d->hit_address = (address > w->address) ? address : w->address;
+		sim->stop_at = sim->ctx.inst_count + 1;
+		return;
+	}
+}
+
+/**
+	@brief Runs the predecoded interpreter until inst_count reaches sim->stop_at, a breakpoint, or an invalid
+	instruction
+
+	Like RunInterpreterUntil, except that the target is read again after every instruction, so a watchpoint can
+	bring it forward. A run that starts on a breakpoint (carrying on from it) runs the instruction under it first.
+ */
+void RunDebugged(struct virtual_memory* memory, struct context* ctx)
+{
+	struct simulator* sim = ctx->sim;
+	struct virtual_mem_region* text = NULL;
+
+	if(ctx->inst_count < sim->stop_at)
+	{
+		struct predecoded_inst* pi = FetchPredecodedInstruction(ctx->pc, memory, &text);
+		if(pi->handler == BreakpointHandler)
+		{
+			ctx->regs[zero] = 0;
+			if(!predecoded_handlers[pi->op](pi, memory, ctx))
+				return;
+			ctx->inst_count++;
+		}
+	}
+
+	while(ctx->inst_count < sim->stop_at)
+	{
+		struct predecoded_inst* pi = FetchPredecodedInstruction(ctx->pc, memory, &text);
+		predecoded_handler handler = pi->handler;
+		if( (sim->stop_at - ctx->inst_count < 2) && (handler != BreakpointHandler) )
+			handler = predecoded_handlers[pi->op];
+		ctx->regs[zero] = 0;
+		if(!handler(pi, memory, ctx))
+			break;
+		ctx->inst_count++;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Packets
+
+//Next byte from GDB, -1 once the connection is gone
+static int ReadByte(struct debugger* d)
+{
+	if(d->in_pos == d->in_len)
+	{
+		ssize_t got = recv(d->fd, d->in, sizeof(d->in), 0);
+		if(got <= 0)
+			return -1;
+		d->in_pos = 0;
+		d->in_len = got;
+	}
+	return (unsigned char)d->in[d->in_pos++];
+}
+
+static int SendAll(struct debugger* d, const char* data, size_t len)
+{
+	while(len != 0)
+	{
+		ssize_t sent = send(d->fd, data, len, MSG_NOSIGNAL);
+		if(sent <= 0)
+			return 0;
+		data += sent;
+		len -= sent;
+	}
+	return 1;
+}
+
+/**
+	@brief Reads the next packet's payload into buf (NUL terminated), acknowledging it. Returns its length, or -1 once
+	the connection is gone.
+
+	Acks and interrupts arriving between packets are skipped, and a packet that fails its checksum is asked for
+	again.
+ */
+static int ReadPacket(struct debugger* d, char* buf)
+{
+	while(1)
+	{
+		int c;
+		while( (c = ReadByte(d)) != '$')
+		{
+			if(c < 0)
+				return -1;
+		}
+
+		int len = 0;
+		uint8_t sum = 0;
+		while( (c = ReadByte(d)) != '#')
+		{
+			if(c < 0)
+				return -1;
+			if(len < DEBUG_PACKET_MAX)
+				buf[len++] = c;
+			sum += c;
+		}
+		buf[len] = '\0';
+
+		char check[3] = {0};
+		for(int i=0; i<2; i++)
+		{
+			if( (c = ReadByte(d)) < 0)
+				return -1;
+			check[i] = c;
+		}
+		if(d->no_ack)
+			return len;
+		if(strtoul(check, NULL, 16) == sum)
+		{
+			SendAll(d, "+", 1);
+			return len;
+		}
+		SendAll(d, "-", 1);
+	}
+}
+
+//Sends a packet, then (unless acks are off) waits for GDB to take it, sending it again if asked
+static void Reply(struct debugger* d, const char* payload)
+{
+	size_t len = strlen(payload);
+	uint8_t sum = 0;
+	for(size_t i=0; i<len; i++)
+		sum += (uint8_t)payload[i];
+	char trailer[4];
+	snprintf(trailer, sizeof(trailer), "#%02x", sum);
+
+	while(1)
+	{
+		if(!SendAll(d, "$", 1) || !SendAll(d, payload, len) || !SendAll(d, trailer, 3) || d->no_ack)
+			return;
+		int c;
+		while( ( (c = ReadByte(d)) != '+') && (c != '-') )
+		{
+			if(c < 0)
+				return;
+		}
+		if(c == '+')
+			return;
+	}
+}
+
+//Whether GDB sent ^C since the run started (they come outside packets)
+static int Interrupted(struct debugger* d)
+{
+	while(1)
+	{
+		if(d->in_pos == d->in_len)
+		{
+			struct pollfd pfd = { d->fd, POLLIN, 0 };
+			if(poll(&pfd, 1, 0) <= 0)
+				return 0;
+		}
+		int c = ReadByte(d);
+		if(c < 0)
+			return 1;
+		if(c == 0x03)
+			return 1;
+	}
+}
+
+//Appends a register to a 'g' or 'p' reply as GDB wants it: target (little endian) byte order
+static char* PutRegister(char* p, uint32_t value)
+{
+	for(int i=0; i<4; i++, value >>= 8)
+		p += sprintf(p, "%02x", value & 0xff);
+	return p;
+}
+
+static uint32_t ParseRegister(const char* p)
+{
+	uint32_t value = 0;
+	for(int i=0; i<4; i++)
+	{
+		char byte[3] = { p[2*i], p[2*i + 1], '\0' };
+		value |= (uint32_t)strtoul(byte, NULL, 16) << (8 * i);
+	}
+	return value;
+}
+
+//Register n in GDB's numbering, 0 for the CP0 ones there's nothing behind
+static uint32_t GetRegister(const struct context* ctx, int n)
+{
+	if(n == 0)
+		return 0;
+	if(n < 32)
+		return ctx->regs[n];
+	switch(n)
+	{
+		case 33:
+			return ctx->LO;
+		case 34:
+			return ctx->HI;
+		case 37:
+			return ctx->pc;
+		default:
+			return 0;
+	}
+}
+
+static void SetRegister(struct context* ctx, int n, uint32_t value)
+{
+	if( (n > 0) && (n < 32) )
+		ctx->regs[n] = value;
+	else if(n == 33)
+		ctx->LO = value;
+	else if(n == 34)
+		ctx->HI = value;
+	else if(n == 37)
+		ctx->pc = value;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Commands
+
+//Host address of a guest byte the debugger asked for, NULL if it isn't mapped
+static uint8_t* DebugByte(struct simulator* sim, uint32_t address, struct virtual_mem_region** region)
+{
+	*region = FindRegion(&sim->memory, address);
+	if(*region == NULL)
+		return NULL;
+	return (uint8_t*)(*region)->data + (address - (*region)->vaddr);
+}
+
+//m addr,len: as many of the bytes as are mapped, up to the first that isn't
+static void ReadMemory(struct simulator* sim, struct debugger* d, const char* args)
+{
+	char* end;
+	uint32_t address = strtoul(args, &end, 16);
+	uint32_t len = (*end == ',') ? strtoul(end + 1, NULL, 16) : 0;
+	if(len > DEBUG_PACKET_MAX / 2)
+		len = DEBUG_PACKET_MAX / 2;
+
+	char reply[DEBUG_PACKET_MAX + 1];
+	uint32_t i = 0;
+	for(; i<len; i++)
+	{
+		struct virtual_mem_region* region;
+		const uint8_t* p = DebugByte(sim, address + i, &region);
+		if(p == NULL)
+			break;
+		sprintf(reply + 2*i, "%02x", *p);
+	}
+	reply[2*i] = '\0';
+	Reply(d, (i == 0) && (len != 0) ? "E01" : reply);
+}
+
+//M addr,len:bytes, all or nothing. Stores to code get it decoded again, like any other store.
+static void WriteMemory(struct simulator* sim, struct debugger* d, const char* args)
+{
+	char* end;
+	uint32_t address = strtoul(args, &end, 16);
+	uint32_t len = (*end == ',') ? strtoul(end + 1, &end, 16) : 0;
+	const char* hex = (*end == ':') ? end + 1 : NULL;
+	if( (hex == NULL) || (strlen(hex) < 2 * (size_t)len) )
+	{
+		Reply(d, "E01");
+		return;
+	}
+
+	struct virtual_mem_region* region;
+	for(uint32_t i=0; i<len; i++)
+	{
+		if(DebugByte(sim, address + i, &region) == NULL)
+		{
+			Reply(d, "E01");
+			return;
+		}
+	}
+	for(uint32_t i=0; i<len; i++)
+	{
+		char byte[3] = { hex[2*i], hex[2*i + 1], '\0' };
+		*DebugByte(sim, address + i, &region) = strtoul(byte, NULL, 16);
+		InvalidateSpan(&sim->memory, region, address + i, 1);
+	}
+	Reply(d, "OK");
+}
+
+//Z/z type,addr,kind
+static void SetPoint(struct simulator* sim, struct debugger* d, const char* args, int insert)
+{
+	char* end;
+	int type = strtol(args, &end, 16);
+	uint32_t address = (*end == ',') ? strtoul(end + 1, &end, 16) : 0;
+	uint32_t len = (*end == ',') ? strtoul(end + 1, NULL, 16) : 0;
+
+	int ok;
+	if( (type == 0) || (type == 1) )
+		ok = insert ? InsertBreakpoint(sim, address) : RemoveBreakpoint(sim, address);
+	else if( (type >= WATCH_WRITE) && (type <= WATCH_ACCESS) )
+		ok = insert ? InsertWatchpoint(sim, address, len, type) : RemoveWatchpoint(sim, address, len, type);
+	else
+	{
+		Reply(d, "");
+		return;
+	}
+	Reply(d, ok ? "OK" : "E01");
+}
+
+//Tells GDB why the program isn't running: stopped on a signal, or finished
+static void ReplyStop(struct simulator* sim, struct debugger* d)
+{
+	char reply[64];
+	if(!sim->finished)
+	{
+		if(d->hit != NULL)
+		{
+			const char* kind = (d->hit->kind == WATCH_WRITE) ? "watch" : (d->hit->kind == WATCH_READ) ? "rwatch" : "awatch";
+			snprintf(reply, sizeof(reply), "T%02x%s:%08x;", d->stopped, kind, d->hit_address);
+		}
+		else
+			snprintf(reply, sizeof(reply), "S%02x", d->stopped);
+	}
+	else if(sim->halt_reason == HALT_EXIT)
+		snprintf(reply, sizeof(reply), "W00");
+	else
+		snprintf(reply, sizeof(reply), "X%02x", (sim->halt_reason == HALT_FAULT) ? SIGSEGV : SIGILL);
+	Reply(d, reply);
+}
+
+/**
+	@brief c or s: runs one instruction, or until something stops the program, then says why
+
+	Continuing goes DEBUG_POLL_INTERVAL instructions at a time, looking for ^C in between. A fault or invalid
+	instruction is first reported as a signal with the program still there to look at, and only as the end of it
+	the next time it's resumed.
+ */
+static void Resume(struct simulator* sim, struct debugger* d, int step, const char* args)
+{
+	if(sim->finished)
+	{
+		d->stopped = 0;
+		ReplyStop(sim, d);
+		return;
+	}
+	if(args[0] != '\0')
+		sim->ctx.pc = strtoul(args, NULL, 16);
+	d->stopped = 0;
+	d->hit = NULL;
+
+	int reason;
+	do
+	{
+		reason = ContinueProgram(sim, step ? 1 : DEBUG_POLL_INTERVAL);
+	} while(!step && (reason == HALT_BUDGET) && !Interrupted(d));
+	ConsoleFlush(&sim->console);
+
+	if(reason == HALT_BUDGET)
+		d->stopped = step ? SIGTRAP : SIGINT;
+	else if( (reason == HALT_FAULT) || (reason == HALT_NONE) )
+	{
+		//Still there to look at, so for now it's a signal
+		d->stopped = (reason == HALT_FAULT) ? SIGSEGV : SIGILL;
+		char reply[8];
+		snprintf(reply, sizeof(reply), "S%02x", d->stopped);
+		Reply(d, reply);
+		return;
+	}
+	ReplyStop(sim, d);
+}
+
+//Answers one packet. Returns 0 once GDB is done with the program (detached or killed it).
+static int HandlePacket(struct simulator* sim, struct debugger* d, char* packet)
+{
+	char reply[DEBUG_PACKET_MAX + 1];
+	struct context* ctx = &sim->ctx;
+	switch(packet[0])
+	{
+		case '?':
+			if(sim->finished && (d->stopped == 0))
+				ReplyStop(sim, d);
+			else
+			{
+				snprintf(reply, sizeof(reply), "S%02x", d->stopped ? d->stopped : SIGTRAP);
+				Reply(d, reply);
+			}
+			return 1;
+
+		case 'g':
+		{
+			char* p = reply;
+			for(int i=0; i<DEBUG_REGISTERS; i++)
+				p = PutRegister(p, GetRegister(ctx, i));
+			Reply(d, reply);
+			return 1;
+		}
+
+		case 'G':
+			for(int i=0; (i < DEBUG_REGISTERS) && (strlen(packet + 1) >= 8 * (size_t)(i + 1)); i++)
+				SetRegister(ctx, i, ParseRegister(packet + 1 + 8*i));
+			Reply(d, "OK");
+			return 1;
+
+		case 'p':
+		{
+			int n = strtol(packet + 1, NULL, 16);
+			if(n < DEBUG_REGISTERS)
+				*PutRegister(reply, GetRegister(ctx, n)) = '\0';
+			else
+				strcpy(reply, "xxxxxxxx");
+			Reply(d, reply);
+			return 1;
+		}
+
+		case 'P':
+		{
+			char* end;
+			int n = strtol(packet + 1, &end, 16);
+			if( (*end == '=') && (strlen(end + 1) >= 8) )
+				SetRegister(ctx, n, ParseRegister(end + 1));
+			Reply(d, "OK");
+			return 1;
+		}
+
+		case 'm':
+			ReadMemory(sim, d, packet + 1);
+			return 1;
+
+		case 'M':
+			WriteMemory(sim, d, packet + 1);
+			return 1;
+
+		case 'c':
+		case 's':
+			Resume(sim, d, packet[0] == 's', packet + 1);
+			return 1;
+
+		case 'Z':
+		case 'z':
+			SetPoint(sim, d, packet + 1, packet[0] == 'Z');
+			return 1;
+
+		case 'H':
+		case 'T':
+			Reply(d, "OK");
+			return 1;
+
+		case 'D':
+			Reply(d, "OK");
+			return 0;
+
+		case 'k':
+			return 0;
+
+		case 'q':
+			if(!strncmp(packet, "qSupported", 10))
+			{
+				snprintf(reply, sizeof(reply), "PacketSize=%x;QStartNoAckMode+", DEBUG_PACKET_MAX);
+				Reply(d, reply);
+			}
+			else if(!strcmp(packet, "qAttached"))
+				Reply(d, "1");
+			else if(!strcmp(packet, "qC"))
+				Reply(d, "QC1");
+			else if(!strcmp(packet, "qfThreadInfo"))
+				Reply(d, "m1");
+			else if(!strcmp(packet, "qsThreadInfo"))
+				Reply(d, "l");
+			else
+				Reply(d, "");
+			return 1;
+
+		case 'Q':
+			if(!strcmp(packet, "QStartNoAckMode"))
+			{
+				Reply(d, "OK");
+				d->no_ack = 1;
+			}
+			else
+				Reply(d, "");
+			return 1;
+
+		default:
+			Reply(d, "");
+			return 1;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sessions
+
+//Waits for GDB to connect on a loopback TCP port. Returns the connection, or -1.
+static int AcceptDebugger(struct simulator* sim, int port)
+{
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	if(listener < 0)
+		return -1;
+	int one = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if( (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0) || (listen(listener, 1) != 0) )
+	{
+		close(listener);
+		return -1;
+	}
+
+	ConsolePrintf(&sim->console, "Waiting for gdb on port %d (target remote :%d)...\n", port, port);
+	ConsoleFlush(&sim->console);
+	int fd = accept(listener, NULL, NULL);
+	close(listener);
+	if(fd >= 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+//Takes out every breakpoint and watchpoint, leaving the program to run as if no debugger had been there
+static void Disarm(struct simulator* sim)
+{
+	struct debugger* d = sim->debugger;
+	while(d->breakpoint_count != 0)
+		RemoveBreakpoint(sim, d->breakpoints[0]);
+	if(d->watchpoint_count != 0)
+	{
+		d->watchpoint_count = 0;
+		BuildPageTable(&sim->memory);
+	}
+}
+
+/**
+	@brief Loads a program (or checkpoint) and runs it under GDB, which has to connect to port first
+
+	The program starts stopped at its entry point. If GDB detaches, it runs on to the end on the selected engine; if
+	GDB kills it or goes away, it's left where it is (and HALT_BREAK returned). Otherwise returns how it stopped, like
+	RunProgram.
+ */
+int DebugProgram(struct simulator* sim, const char* fname, int port)
+{
+	if(!LoadProgram(sim, fname))
+		return sim->halt_reason;
+
+	int fd = AcceptDebugger(sim, port);
+	if(fd < 0)
+	{
+		ConsolePrintf(&sim->console, "failed to listen for gdb on port %d\n", port);
+		ConsoleFlush(&sim->console);
+		return HALT_FAULT;
+	}
+	sim->debugger = calloc(1, sizeof(struct debugger));
+	sim->debugger->fd = fd;
+
+	char packet[DEBUG_PACKET_MAX + 1];
+	int detached = 0;
+	while(ReadPacket(sim->debugger, packet) >= 0)
+	{
+		if(!HandlePacket(sim, sim->debugger, packet))
+		{
+			detached = (packet[0] == 'D');
+			break;
+		}
+	}
+
+	Disarm(sim);
+	FreeDebugger(sim);
+	if(detached)
+		return ContinueProgram(sim, 0);
+	return sim->finished ? sim->halt_reason : HALT_BREAK;
+}
+
+void FreeDebugger(struct simulator* sim)
+{
+	if(sim->debugger == NULL)
+		return;
+	close(sim->debugger->fd);
+	free(sim->debugger);
+	sim->debugger = NULL;
+}
@@ -0,0 +1,285 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Multiple harts sharing one address space, each running the predecoded interpreter on its own host thread
+ */
+#include "sim.h"
+#include <string.h>
+
+//Hart whose thread this is, NULL on the thread running hart 0 (and on any thread not running a guest at all)
+static __thread struct hart* current_hart;
+
+/**
+	@brief Sets up for up to options.harts harts. From here on memory, console and input are shared
+ */
+void InitHarts(struct simulator* sim)
+{
+	struct hart_set* set = calloc(1, sizeof(struct hart_set));
+	set->count = sim->options.harts;
+	set->harts = calloc(set->count, sizeof(struct hart));
+	pthread_mutex_init(&set->lock, NULL);
+	pthread_cond_init(&set->changed, NULL);
+	sim->harts = set;
+
+	pthread_mutex_init(&sim->memory.lock, NULL);
+	sim->memory.shared = 1;
+	ShareConsole(&sim->console);
+	ShareInput(&sim->in);
+}
+
+struct hart* CurrentHart(void)
+{
+	return current_hart;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Running
+
+/**
+	@brief Never returns: on hart 0 the whole program halts (after the others have stopped), any other hart just
+	stops
+ */
+static void HandleStop(struct context* ctx) __attribute__((noreturn));
+static void HandleStop(struct context* ctx)
+{
+	struct simulator* sim = ctx->sim;
+	if(ctx->hart != 0)
+		HaltSimulator(sim, HALT_EXIT);
+
+	int reason = __atomic_load_n(&sim->harts->stop_reason, __ATOMIC_ACQUIRE);
+	if(reason == HALT_EXIT)
+		ExitProgram(ctx);
+	StopHarts(sim);
+	HaltSimulator(sim, reason);
+}
+
+/**
+	@brief The interpreter loop for one hart, returning on an invalid instruction
+
+	The same as RunInterpreter, except that every HART_POLL_INTERVAL instructions it checks whether another hart has
+	ended the program, and that the handler is loaded exactly once: another hart's store may clear it at any time,
+	in which case the word is simply fetched (and decoded) again.
+ */
+void RunHart(struct virtual_memory* memory, struct context* ctx)
+{
+	struct virtual_mem_region* text = NULL;
+	int* stop = &ctx->sim->harts->stop;
+
+	while(1)
+	{
+		for(int i=0; i<HART_POLL_INTERVAL; i++)
+		{
+			struct predecoded_inst* pi = FetchPredecodedInstruction(ctx->pc, memory, &text);
+			predecoded_handler handler = __atomic_load_n(&pi->handler, __ATOMIC_ACQUIRE);
+			if(handler == NULL)
+				continue;
+			ctx->regs[zero] = 0;
+			if(!handler(pi, memory, ctx))
+				return;
+			ctx->inst_count++;
+		}
+
+		if(__atomic_load_n(stop, __ATOMIC_RELAXED))
+			HandleStop(ctx);
+	}
+}
+
+static void* HartThread(void* arg)
+{
+	struct hart* hart = (struct hart*)arg;
+	struct simulator* sim = hart->ctx.sim;
+	struct hart_set* set = sim->harts;
+
+	current_hart = hart;
+	hart->halt_reason = HALT_NONE;
+	if(setjmp(hart->halt) == 0)
+		RunHart(&sim->memory, &hart->ctx);
+
+	//Exiting the hart is the only way out that doesn't end the program
+	if(hart->halt_reason != HALT_EXIT)
+		StopProgram(sim, hart->halt_reason);
+
+	pthread_mutex_lock(&set->lock);
+	hart->state = HART_EXITED;
+	pthread_cond_broadcast(&set->changed);
+	pthread_mutex_unlock(&set->lock);
+	return NULL;
+}
+
+/**
+	@brief Starts a new hart at entry, with $sp = stack and $a0 = arg. $gp is inherited, everything else is zero.
+
+	Returns its ID, or -1 if every hart is in use (or there's only the one). Everything the calling hart wrote before
+	this is visible to the new one.
+ */
+uint32_t SpawnHart(struct context* ctx, uint32_t entry, uint32_t stack, uint32_t arg)
+{
+	struct hart_set* set = ctx->sim->harts;
+	if(set == NULL)
+		return 0xffffffff;
+
+	pthread_mutex_lock(&set->lock);
+	uint32_t id;
+	for(id = 1; id < set->count; id++)
+	{
+		if(set->harts[id].state == HART_FREE)
+			break;
+	}
+	if( (id == set->count) || set->stop)
+	{
+		pthread_mutex_unlock(&set->lock);
+		return 0xffffffff;
+	}
+
+	struct hart* hart = &set->harts[id];
+	memset(&hart->ctx, 0, sizeof(hart->ctx));
+	hart->ctx.sim = ctx->sim;
+	hart->ctx.hart = id;
+	hart->ctx.pc = entry;
+	hart->ctx.regs[REGID_SP] = stack;
+	hart->ctx.regs[REGID_A0] = arg;
+	hart->ctx.regs[REGID_GP] = ctx->regs[REGID_GP];
+	hart->joining = 0;
+	hart->exit_value = 0;
+
+	//Thread creation is a full barrier, which is what makes the parent's writes visible
+	if(0 != pthread_create(&hart->thread, NULL, HartThread, hart))
+	{
+		pthread_mutex_unlock(&set->lock);
+		return 0xffffffff;
+	}
+	hart->state = HART_RUNNING;
+	hart->thread_started = 1;
+	pthread_mutex_unlock(&set->lock);
+	return id;
+}
+
+/**
+	@brief Waits for hart id to exit. Returns its exit value, or -1 if it isn't running (or is already being joined).
+
+	Everything the hart wrote is visible once this returns.
+ */
+uint32_t JoinHart(struct context* ctx, uint32_t id)
+{
+	struct hart_set* set = ctx->sim->harts;
+	if( (set == NULL) || (id == 0) || (id >= set->count) || (id == ctx->hart) )
+		return 0xffffffff;
+
+	pthread_mutex_lock(&set->lock);
+	struct hart* hart = &set->harts[id];
+	if( (hart->state == HART_FREE) || hart->joining)
+	{
+		pthread_mutex_unlock(&set->lock);
+		return 0xffffffff;
+	}
+
+	hart->joining = 1;
+	while( (hart->state == HART_RUNNING) && !set->stop)
+		pthread_cond_wait(&set->changed, &set->lock);
+	if(hart->state != HART_EXITED)
+	{
+		//The program is stopping. Whoever stops the harts joins this one
+		hart->joining = 0;
+		pthread_mutex_unlock(&set->lock);
+		HandleStop(ctx);
+	}
+	
+	//Whoever clears thread_started joins the thread
+	hart->thread_started = 0;
+	pthread_mutex_unlock(&set->lock);
+
+	pthread_join(hart->thread, NULL);
+
+	pthread_mutex_lock(&set->lock);
+	uint32_t value = hart->exit_value;
+	set->retired += hart->ctx.inst_count;
+	hart->joining = 0;
+	hart->state = HART_FREE;
+	pthread_mutex_unlock(&set->lock);
+	return value;
+}
+
+/**
+	@brief Ends the calling hart with an exit value for whoever joins it. On hart 0 this ends the program, like
+	syscall 10.
+ */
+void ExitHart(struct context* ctx, uint32_t value)
+{
+	if(ctx->hart == 0)
+		ExitProgram(ctx);
+
+	ctx->sim->harts->harts[ctx->hart].exit_value = value;
+	HaltSimulator(ctx->sim, HALT_EXIT);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Stopping
+
+/**
+	@brief Tells every hart the program is ending, and why. The first reason given sticks.
+
+	Running harts notice within HART_POLL_INTERVAL instructions, joins wake up straight away. A hart waiting for
+	console input only notices once the read returns.
+ */
+void StopProgram(struct simulator* sim, int reason)
+{
+	struct hart_set* set = sim->harts;
+	if(set == NULL)
+		return;
+
+	pthread_mutex_lock(&set->lock);
+	if(!set->stop)
+	{
+		__atomic_store_n(&set->stop_reason, reason, __ATOMIC_RELEASE);
+		__atomic_store_n(&set->stop, 1, __ATOMIC_RELEASE);
+	}
+	pthread_cond_broadcast(&set->changed);
+	pthread_mutex_unlock(&set->lock);
+}
+
+/**
+	@brief Stops every spawned hart and waits for their threads. Called on hart 0, however the program ends.
+	Harmless if they're already stopped.
+
+	Their instruction counts are then added to hart 0's, so the stats count everything that ran.
+ */
+void StopHarts(struct simulator* sim)
+{
+	struct hart_set* set = sim->harts;
+	if(set == NULL)
+		return;
+
+	StopProgram(sim, HALT_EXIT);
+	pthread_mutex_lock(&set->lock);
+	for(uint32_t id = 1; id < set->count; id++)
+	{
+		//A hart being joined by another is left to it: that one won't stop before it's done
+		struct hart* hart = &set->harts[id];
+		if(!hart->thread_started)
+			continue;
+		hart->thread_started = 0;
+		pthread_mutex_unlock(&set->lock);
+		pthread_join(hart->thread, NULL);
+		pthread_mutex_lock(&set->lock);
+		hart->state = HART_FREE;
+		set->retired += hart->ctx.inst_count;
+	}
+
+	sim->ctx.inst_count += set->retired;
+	set->retired = 0;
+	pthread_mutex_unlock(&set->lock);
+}
+
+void FreeHarts(struct simulator* sim)
+{
+	struct hart_set* set = sim->harts;
+	if(set == NULL)
+		return;
+
+	pthread_mutex_destroy(&set->lock);
+	pthread_cond_destroy(&set->changed);
+	free(set->harts);
+	free(set);
+	sim->harts = NULL;
+	pthread_mutex_destroy(&sim->memory.lock);
+}
@@ -0,0 +1,250 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Guest console input: read from a stdio stream (optionally recorded), or served from a mapped input file
+
+	Both sources go through the same parsers, which follow what the scanf calls syscalls 5 and 8 used to make, so a
+	recording played back as --input gives the guest exactly what it read the first time.
+ */
+#include "sim.h"
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+void InitInput(struct console_input* input, FILE* fp)
+{
+	memset(input, 0, sizeof(*input));
+	input->fp = fp;
+}
+
+/**
+	@brief Serves input from a file mapped into memory from now on, instead of the stream. Returns 0 if it can't
+	be opened.
+ */
+int MapInputFile(struct console_input* input, const char* path)
+{
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return 0;
+	struct stat st;
+	if(fstat(fd, &st) != 0)
+	{
+		close(fd);
+		return 0;
+	}
+
+	//An empty file can't be mapped, but it's still a valid (empty) input
+	const uint8_t* data = (const uint8_t*)"";
+	if(st.st_size != 0)
+	{
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(data == MAP_FAILED)
+		{
+			close(fd);
+			return 0;
+		}
+	}
+	close(fd);
+
+	input->data = data;
+	input->len = st.st_size;
+	input->pos = 0;
+	input->mapped = (st.st_size != 0);
+	return 1;
+}
+
+/**
+	@brief Serves input from len bytes at data from now on, the same way as a mapped input file. The caller keeps them
+	valid until the next SetInputBuffer or CloseInput, and frees them.
+ */
+void SetInputBuffer(struct console_input* input, const uint8_t* data, size_t len)
+{
+	if(input->mapped)
+		munmap((void*)input->data, input->len);
+	input->data = data;
+	input->len = len;
+	input->pos = 0;
+	input->mapped = 0;
+}
+
+/**
+	@brief Points a buffer set by SetInputBuffer at its grown (and maybe moved) copy, carrying on from the same
+	position
+ */
+void ExtendInputBuffer(struct console_input* input, const uint8_t* data, size_t len)
+{
+	input->data = data;
+	input->len = len;
+}
+
+/**
+	@brief Lets several harts read from now on. Each read then holds a lock, so numbers and lines come out whole
+ */
+void ShareInput(struct console_input* input)
+{
+	pthread_mutex_init(&input->lock, NULL);
+	input->shared = 1;
+}
+
+/**
+	@brief Copies everything the guest consumes from the stream to a file. Returns 0 if it can't be created.
+ */
+int RecordInput(struct console_input* input, const char* path)
+{
+	input->record = fopen(path, "wb");
+	return input->record != NULL;
+}
+
+void CloseInput(struct console_input* input)
+{
+	if(input->mapped)
+		munmap((void*)input->data, input->len);
+	input->data = NULL;
+	input->mapped = 0;
+	if(input->record != NULL)
+		fclose(input->record);
+	input->record = NULL;
+	if(input->shared)
+		pthread_mutex_destroy(&input->lock);
+	input->shared = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Reading
+
+//Next byte without consuming it, EOF at the end
+static int PeekInput(struct console_input* input)
+{
+	if(input->data != NULL)
+		return (input->pos < input->len) ? input->data[input->pos] : EOF;
+
+	int c = getc(input->fp);
+	if(c != EOF)
+		ungetc(c, input->fp);
+	return c;
+}
+
+//Consumes the byte PeekInput just returned
+static void SkipInput(struct console_input* input)
+{
+	if(input->data != NULL)
+	{
+		input->pos++;
+		return;
+	}
+
+	int c = getc(input->fp);
+	if( (input->record != NULL) && (c != EOF) )
+		putc(c, input->record);
+}
+
+/**
+	@brief Reads a decimal integer the way scanf("%d") does: leading whitespace, an optional sign, then digits
+
+	Returns 0 (leaving *value alone) if there's no number next.
+ */
+static int ReadIntUnlocked(struct console_input* input, uint32_t* value)
+{
+	int c;
+	while( ((c = PeekInput(input)) != EOF) && isspace(c) )
+		SkipInput(input);
+
+	int negative = 0;
+	if( (c == '-') || (c == '+') )
+	{
+		negative = (c == '-');
+		SkipInput(input);
+		c = PeekInput(input);
+	}
+	if( (c == EOF) || !isdigit(c) )
+		return 0;
+
+	uint32_t v = 0;
+	while( (c != EOF) && isdigit(c) )
+	{
+		v = v * 10 + (c - '0');
+		SkipInput(input);
+		c = PeekInput(input);
+	}
+	*value = negative ? -v : v;
+	return 1;
+}
+
+/**
+	@brief Reads the rest of the line the way scanf("%[^\n]%*c") does, keeping at most size-1 bytes of it in buf
+	(always NUL terminated)
+
+	The whole line and its newline are consumed. Fails, consuming nothing and leaving buf empty, if the line is
+	empty or the input has run out. Returns the number of bytes kept, or -1 on failure.
+ */
+static int ReadLineUnlocked(struct console_input* input, char* buf, size_t size)
+{
+	size_t kept = 0;
+	if(size != 0)
+		buf[0] = '\0';
+
+	int c = PeekInput(input);
+	if( (c == EOF) || (c == '\n') )
+		return -1;
+
+	//A mapped line can be copied in one go
+	if(input->data != NULL)
+	{
+		const uint8_t* start = input->data + input->pos;
+		const uint8_t* nl = memchr(start, '\n', input->len - input->pos);
+		size_t len = nl ? (size_t)(nl - start) : (input->len - input->pos);
+		kept = (size != 0) && (len > size - 1) ? (size - 1) : len;
+		if(size != 0)
+		{
+			memcpy(buf, start, kept);
+			buf[kept] = '\0';
+		}
+		input->pos += len + (nl ? 1 : 0);
+		return kept;
+	}
+
+	while( (c != EOF) && (c != '\n') )
+	{
+		if(kept + 1 < size)
+			buf[kept++] = c;
+		SkipInput(input);
+		c = PeekInput(input);
+	}
+	if(c == '\n')
+		SkipInput(input);
+	if(size != 0)
+		buf[kept] = '\0';
+	return kept;
+}
+
+int InputReadInt(struct console_input* input, uint32_t* value)
+{
+	if(!input->shared)
+		return ReadIntUnlocked(input, value);
+	pthread_mutex_lock(&input->lock);
+	int ok = ReadIntUnlocked(input, value);
+	pthread_mutex_unlock(&input->lock);
+	return ok;
+}
+
+int InputReadLine(struct console_input* input, char* buf, size_t size)
+{
+	if(!input->shared)
+		return ReadLineUnlocked(input, buf, size);
+	pthread_mutex_lock(&input->lock);
+	int kept = ReadLineUnlocked(input, buf, size);
+	pthread_mutex_unlock(&input->lock);
+	return kept;
+}
+
+/**
+	@brief Whether reading may have to wait for someone typing (so output should be flushed first, and the wait kept
+	out of the run time)
+ */
+int InputMayBlock(const struct console_input* input)
+{
+	return input->data == NULL;
+}
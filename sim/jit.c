@@ -0,0 +1,755 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief x86-64 translation of hot basic blocks
+
+	Translated code keeps all guest state in struct context: rbx holds the context and r12 the address space for the
+	whole block, eax/ecx/edx/esi/edi are scratch. Loads and stores inline the page table lookup from
+	FetchWordFromVirtualMemory() and only call back into C when that misses, so segfaults are still reported (and
+	still exit) from the C code. Blocks always return to the threaded engine, which handles chaining and syscalls.
+ */
+#include "sim.h"
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+//Size of the executable buffer for each address space
+#define JIT_BUFFER_SIZE		(16 * 1024 * 1024)
+
+//Enough room for the longest sequence emitted for any one guest instruction
+#define JIT_MAX_INST_BYTES	256
+
+//x86 register numbers
+enum x86_regs
+{
+	EAX = 0,
+	ECX = 1,
+	EDX = 2,
+	EBX = 3,
+	ESI = 6,
+	EDI = 7
+};
+
+//Guest register locations relative to rbx
+#define CTX_PC			((int32_t)offsetof(struct context, pc))
+#define CTX_REG(r)		((int32_t)(offsetof(struct context, regs) + 4 * (r)))
+#define CTX_HI			((int32_t)offsetof(struct context, HI))
+#define CTX_LO			((int32_t)offsetof(struct context, LO))
+#define CTX_COUNT		((int32_t)offsetof(struct context, inst_count))
+
+/**
+	@brief Output cursor for one block
+ */
+struct jit_emitter
+{
+	uint8_t* p;
+	uint8_t* end;
+	struct basic_block* block;		//block being translated, handed back to the engine at every exit
+	const uint64_t* publish_at;		//the block cache's, see EmitChainableExit
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Slow paths called from translated code
+
+//Loads return the value zero-extended, the translation sign-extends if needed
+static uint32_t JitLoadWord(struct virtual_memory* memory, uint32_t address)
+{
+	return FetchWordFromVirtualMemory(address, memory);
+}
+
+static uint32_t JitLoadHalfword(struct virtual_memory* memory, uint32_t address)
+{
+	return FetchHalfwordFromVirtualMemory(address, memory);
+}
+
+static uint32_t JitLoadByte(struct virtual_memory* memory, uint32_t address)
+{
+	return FetchByteFromVirtualMemory(address, memory);
+}
+
+//Stores return nonzero if they overwrote decoded code
+static uint32_t JitStoreWord(struct virtual_memory* memory, uint32_t address, uint32_t value)
+{
+	StoreWordToVirtualMemory(address, value, memory);
+	return memory->code_dirty;
+}
+
+static uint32_t JitStoreHalfword(struct virtual_memory* memory, uint32_t address, uint32_t value)
+{
+	StoreHalfwordToVirtualMemory(address, value, memory);
+	return memory->code_dirty;
+}
+
+static uint32_t JitStoreByte(struct virtual_memory* memory, uint32_t address, uint32_t value)
+{
+	StoreByteToVirtualMemory(address, value, memory);
+	return memory->code_dirty;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Instruction encoding
+
+static void Emit8(struct jit_emitter* e, uint8_t v)
+{
+	*e->p++ = v;
+}
+
+static void Emit32(struct jit_emitter* e, uint32_t v)
+{
+	memcpy(e->p, &v, 4);
+	e->p += 4;
+}
+
+static void Emit64(struct jit_emitter* e, uint64_t v)
+{
+	memcpy(e->p, &v, 8);
+	e->p += 8;
+}
+
+static void EmitBytes(struct jit_emitter* e, const uint8_t* bytes, size_t len)
+{
+	memcpy(e->p, bytes, len);
+	e->p += len;
+}
+
+#define EMIT(e, ...) do { const uint8_t b[] = { __VA_ARGS__ }; EmitBytes(e, b, sizeof(b)); } while(0)
+
+//<op> reg, [rbx + disp32] (or the reverse direction, depending on the opcode)
+static void EmitCtx(struct jit_emitter* e, uint8_t opcode, int reg, int32_t disp)
+{
+	Emit8(e, opcode);
+	Emit8(e, 0x80 | (reg << 3) | EBX);
+	Emit32(e, disp);
+}
+
+static void EmitLoadCtx(struct jit_emitter* e, int reg, int32_t disp)
+{
+	EmitCtx(e, 0x8b, reg, disp);
+}
+
+static void EmitStoreCtx(struct jit_emitter* e, int reg, int32_t disp)
+{
+	EmitCtx(e, 0x89, reg, disp);
+}
+
+//mov dword [rbx + disp32], imm32
+static void EmitStoreCtxImm(struct jit_emitter* e, int32_t disp, uint32_t imm)
+{
+	EmitCtx(e, 0xc7, 0, disp);
+	Emit32(e, imm);
+}
+
+//Conditional or unconditional rel32 jump with the offset left blank; returns where to patch it
+static uint8_t* EmitJcc(struct jit_emitter* e, uint8_t cc)
+{
+	Emit8(e, 0x0f);
+	Emit8(e, cc);
+	Emit32(e, 0);
+	return e->p - 4;
+}
+
+static uint8_t* EmitJmp(struct jit_emitter* e)
+{
+	Emit8(e, 0xe9);
+	Emit32(e, 0);
+	return e->p - 4;
+}
+
+//Points a blank jump at the current position
+static void PatchHere(struct jit_emitter* e, uint8_t* rel)
+{
+	int32_t off = (int32_t)(e->p - (rel + 4));
+	memcpy(rel, &off, 4);
+}
+
+#define CC_NE	0x85
+#define CC_E	0x84
+#define CC_AE	0x83
+#define CC_B	0x82
+#define CC_L	0x8c
+#define CC_GE	0x8d
+#define CC_LE	0x8e
+#define CC_G	0x8f
+
+//mov rax, imm64; call rax
+static void EmitCall(struct jit_emitter* e, void* fn)
+{
+	EMIT(e, 0x48, 0xb8);
+	Emit64(e, (uint64_t)(uintptr_t)fn);
+	EMIT(e, 0xff, 0xd0);
+}
+
+//Returns {code, block} in rax:rdx and runs the epilogue
+static void EmitReturn(struct jit_emitter* e, uint32_t code)
+{
+	Emit8(e, 0xb8);						//mov eax, code
+	Emit32(e, code);
+	EMIT(e, 0x48, 0xba);				//mov rdx, block
+	Emit64(e, (uint64_t)(uintptr_t)e->block);
+	EMIT(e,
+		0x48, 0x83, 0xc4, 0x08,		//add rsp, 8
+		0x41, 0x5c,					//pop r12
+		0x5b,						//pop rbx
+		0xc3						//ret
+		);
+}
+
+static void EmitPrologue(struct jit_emitter* e)
+{
+	EMIT(e,
+		0x53,						//push rbx
+		0x41, 0x54,					//push r12
+		0x48, 0x83, 0xec, 0x08,		//sub rsp, 8 (keep the stack 16-byte aligned for calls)
+		0x48, 0x89, 0xfb,			//mov rbx, rdi
+		0x49, 0x89, 0xf4			//mov r12, rsi
+		);
+}
+
+//Sets ctx->pc, returns the exit code
+static void EmitExit(struct jit_emitter* e, int pc_in_eax, uint32_t pc, uint32_t code)
+{
+	if(pc_in_eax)
+		EmitStoreCtx(e, EAX, CTX_PC);
+	else
+		EmitStoreCtxImm(e, CTX_PC, pc);
+	EmitReturn(e, code);
+}
+
+/**
+	@brief Exit that can later be chained to a successor block. Returns the rel32 to patch
+
+	Under a monitor, backward jumps skip the chained jump once the count reaches the next update, so the engine gets
+	to make it. Every loop of chained blocks has one, and anything else comes back through the engine anyway.
+ */
+static uint8_t* EmitChainableExit(struct jit_emitter* e, uint32_t pc, uint32_t code)
+{
+	EmitStoreCtxImm(e, CTX_PC, pc);
+	if( (e->publish_at != NULL) && (pc <= e->block->start) )
+	{
+		EMIT(e, 0x48, 0xb8);				//mov rax, publish_at
+		Emit64(e, (uint64_t)(uintptr_t)e->publish_at);
+		EMIT(e, 0x48, 0x8b, 0x00);			//mov rax, [rax]
+		Emit8(e, 0x48);
+		EmitCtx(e, 0x39, EAX, CTX_COUNT);	//cmp [rbx + CTX_COUNT], rax
+		EMIT(e, 0x73, 0x05);				//jae past the jmp below
+	}
+	uint8_t* patch = EmitJmp(e);		//rel32 of 0 falls through to the return below
+	EmitReturn(e, code);
+	return patch;
+}
+
+//ctx->inst_count += credit (negative to take some back)
+static void EmitCredit(struct jit_emitter* e, int32_t credit)
+{
+	Emit8(e, 0x48);
+	EmitCtx(e, 0x81, 0, CTX_COUNT);		//add qword [rbx + CTX_COUNT], credit
+	Emit32(e, credit);
+}
+
+//What the block's credit covers from the instruction at pc on
+static int32_t CreditFrom(struct jit_emitter* e, uint32_t pc)
+{
+	return (int32_t)(e->block->credit - (pc - e->block->start) / 4);
+}
+
+/**
+	@brief Goes before a slow-path call that can fault: points the pc at the access and takes back the credit for it
+	and the rest of the block, so a fault stops with the interpreter's pc and count. EmitFaultableDone gives it back.
+ */
+static void EmitFaultable(struct jit_emitter* e, uint32_t pc)
+{
+	EmitStoreCtxImm(e, CTX_PC, pc);
+	EmitCredit(e, -CreditFrom(e, pc));
+}
+
+static void EmitFaultableDone(struct jit_emitter* e, uint32_t pc)
+{
+	EmitCredit(e, CreditFrom(e, pc));
+}
+
+/**
+	@brief Emits the page table lookup for an access of size bytes at the guest address in eax
+
+	Leaves the address in esi and the page table entry in rdx. Returns the jumps to patch to the slow path (address
+	outside the page's fast range, or not aligned to the access size); slow2 is NULL for bytes, which can't be
+	misaligned.
+ */
+static void EmitTranslate(struct jit_emitter* e, int size, uint8_t** slow1, uint8_t** slow2)
+{
+	EMIT(e,
+		0x89, 0xc6,							//mov esi, eax
+		0x89, 0xc1,							//mov ecx, eax
+		0xc1, 0xe9, VM_L1_SHIFT,			//shr ecx, VM_L1_SHIFT
+		0x49, 0x8b, 0x94, 0xcc);			//mov rdx, [r12 + rcx*8 + pages]
+	Emit32(e, (uint32_t)offsetof(struct virtual_memory, pages));
+	EMIT(e,
+		0x89, 0xc1,							//mov ecx, eax
+		0xc1, 0xe9, VM_PAGE_SHIFT,			//shr ecx, VM_PAGE_SHIFT
+		0x81, 0xe1);						//and ecx, VM_L2_ENTRIES-1
+	Emit32(e, VM_L2_ENTRIES - 1);
+	EMIT(e,
+		0x48, 0x8d, 0x0c, 0x49,				//lea rcx, [rcx + rcx*2]
+		0x48, 0x8d, 0x14, 0xca,				//lea rdx, [rdx + rcx*8]
+		0x89, 0xc1,							//mov ecx, eax
+		0x81, 0xe1);						//and ecx, VM_PAGE_MASK
+	Emit32(e, VM_PAGE_MASK);
+	EMIT(e, 0x0f, 0xb7, 0x7a, (uint8_t)offsetof(struct page_table_entry, lo));		//movzx edi, word [rdx + lo]
+	EMIT(e, 0x29, 0xf9);																//sub ecx, edi
+	EMIT(e, 0x0f, 0xb7, 0x7a, (uint8_t)offsetof(struct page_table_entry, span));		//movzx edi, word [rdx + span]
+	EMIT(e, 0x39, 0xf9);																//cmp ecx, edi
+	*slow1 = EmitJcc(e, CC_AE);
+	*slow2 = NULL;
+	if(size > 1)
+	{
+		EMIT(e, 0xa8, size - 1);														//test al, size-1
+		*slow2 = EmitJcc(e, CC_NE);
+	}
+}
+
+//eax = guest register rs + imm
+static void EmitEffectiveAddress(struct jit_emitter* e, struct predecoded_inst* pi)
+{
+	EmitLoadCtx(e, EAX, CTX_REG(pi->rs));
+	Emit8(e, 0x05);							//add eax, imm32
+	Emit32(e, pi->imm);
+}
+
+//Leaves the block if a slow-path store (result in eax) reported overwriting decoded code
+static void EmitCodeDirtyCheck(struct jit_emitter* e, uint32_t next_pc)
+{
+	EMIT(e, 0x85, 0xc0);					//test eax, eax
+	uint8_t* ok = EmitJcc(e, CC_E);
+	EmitExit(e, 0, next_pc, JIT_EXIT_SIDE);
+	PatchHere(e, ok);
+}
+
+/**
+	@brief Fast path for stores: the page must also have no decoded code, and be marked dirty already if the region is
+	tracked for a snapshot. Otherwise go through C, which invalidates or marks it.
+
+	Expects the address in esi and the page table entry in rdx. Returns the jumps to patch to the slow path.
+ */
+static void EmitNoCodeCheck(struct jit_emitter* e, uint8_t** slow1, uint8_t** slow2)
+{
+	EMIT(e, 0x48, 0x8b, 0x4a, (uint8_t)offsetof(struct page_table_entry, region));	//mov rcx, [rdx + region]
+	EMIT(e, 0x48, 0x83, 0xb9);															//cmp qword [rcx + decoded], 0
+	Emit32(e, (uint32_t)offsetof(struct virtual_mem_region, decoded));
+	Emit8(e, 0x00);
+	*slow1 = EmitJcc(e, CC_NE);
+
+	EMIT(e, 0x48, 0x8b, 0xb9);															//mov rdi, [rcx + dirty_pages]
+	Emit32(e, (uint32_t)offsetof(struct virtual_mem_region, dirty_pages));
+	EMIT(e, 0x48, 0x85, 0xff);															//test rdi, rdi
+	uint8_t* untracked = EmitJcc(e, CC_E);
+	EMIT(e, 0x41, 0x89, 0xf0);															//mov r8d, esi
+	EMIT(e, 0x44, 0x2b, 0x81);															//sub r8d, [rcx + vaddr]
+	Emit32(e, (uint32_t)offsetof(struct virtual_mem_region, vaddr));
+	EMIT(e, 0x41, 0xc1, 0xe8, VM_PAGE_SHIFT);											//shr r8d, VM_PAGE_SHIFT
+	EMIT(e, 0x42, 0x80, 0x3c, 0x07, 0x00);												//cmp byte [rdi + r8], 0
+	*slow2 = EmitJcc(e, CC_E);
+	PatchHere(e, untracked);
+}
+
+static void EmitLoad(struct jit_emitter* e, struct predecoded_inst* pi, int size, int is_signed, uint32_t pc)
+{
+	uint8_t* slow1;
+	uint8_t* slow2;
+	EmitEffectiveAddress(e, pi);
+	EmitTranslate(e, size, &slow1, &slow2);
+	EMIT(e, 0x48, 0x8b, 0x12);				//mov rdx, [rdx] (bias)
+	if(size == 4)
+		EMIT(e, 0x8b, 0x04, 0x02);			//mov eax, [rdx + rax]
+	else if(size == 2)
+		EMIT(e, 0x0f, 0xb7, 0x04, 0x02);	//movzx eax, word [rdx + rax]
+	else
+		EMIT(e, 0x0f, 0xb6, 0x04, 0x02);	//movzx eax, byte [rdx + rax]
+	uint8_t* done = EmitJmp(e);
+
+	PatchHere(e, slow1);
+	if(slow2)
+		PatchHere(e, slow2);
+	EmitFaultable(e, pc);
+	EMIT(e, 0x4c, 0x89, 0xe7);				//mov rdi, r12
+	EmitCall(e, (size == 4) ? (void*)JitLoadWord : (size == 2) ? (void*)JitLoadHalfword : (void*)JitLoadByte);
+	EmitFaultableDone(e, pc);
+	PatchHere(e, done);
+
+	if(is_signed)
+	{
+		if(size == 2)
+			EMIT(e, 0x0f, 0xbf, 0xc0);		//movsx eax, ax
+		else
+			EMIT(e, 0x0f, 0xbe, 0xc0);		//movsx eax, al
+	}
+
+	//Loads into $zero still happen (they can fault) but the result is dropped
+	if(pi->rt != zero)
+		EmitStoreCtx(e, EAX, CTX_REG(pi->rt));
+}
+
+static void EmitStore(struct jit_emitter* e, struct predecoded_inst* pi, int size, uint32_t pc)
+{
+	uint8_t* slow1;
+	uint8_t* slow2;
+	EmitEffectiveAddress(e, pi);
+	EmitTranslate(e, size, &slow1, &slow2);
+	uint8_t* slow3;
+	uint8_t* slow4;
+	EmitNoCodeCheck(e, &slow3, &slow4);
+	EMIT(e, 0x48, 0x8b, 0x12);				//mov rdx, [rdx] (bias)
+	EmitLoadCtx(e, ECX, CTX_REG(pi->rt));
+	if(size == 4)
+		EMIT(e, 0x89, 0x0c, 0x02);			//mov [rdx + rax], ecx
+	else if(size == 2)
+		EMIT(e, 0x66, 0x89, 0x0c, 0x02);	//mov [rdx + rax], cx
+	else
+		EMIT(e, 0x88, 0x0c, 0x02);			//mov [rdx + rax], cl
+	uint8_t* done = EmitJmp(e);
+
+	PatchHere(e, slow1);
+	if(slow2)
+		PatchHere(e, slow2);
+	PatchHere(e, slow3);
+	PatchHere(e, slow4);
+	EmitFaultable(e, pc);
+	EMIT(e, 0x4c, 0x89, 0xe7);				//mov rdi, r12
+	EmitLoadCtx(e, EDX, CTX_REG(pi->rt));
+	EmitCall(e, (size == 4) ? (void*)JitStoreWord : (size == 2) ? (void*)JitStoreHalfword : (void*)JitStoreByte);
+	EmitFaultableDone(e, pc);
+	EmitCodeDirtyCheck(e, pc + 4);
+	PatchHere(e, done);
+}
+
+//reg[rd] = reg[rs] <op> reg[rt]
+static void EmitAluReg(struct jit_emitter* e, struct predecoded_inst* pi, uint8_t opcode)
+{
+	EmitLoadCtx(e, EAX, CTX_REG(pi->rs));
+	EmitCtx(e, opcode, EAX, CTX_REG(pi->rt));
+	EmitStoreCtx(e, EAX, CTX_REG(pi->rd));
+}
+
+//reg[rt] = reg[rs] <op> imm, opcode is the "<op> eax, imm32" short form
+static void EmitAluImm(struct jit_emitter* e, struct predecoded_inst* pi, uint8_t opcode)
+{
+	EmitLoadCtx(e, EAX, CTX_REG(pi->rs));
+	Emit8(e, opcode);
+	Emit32(e, pi->imm);
+	EmitStoreCtx(e, EAX, CTX_REG(pi->rt));
+}
+
+//setcc al; movzx eax, al; then store to the destination. cc is the condition's jcc code (CC_B, CC_L).
+static void EmitSetCondition(struct jit_emitter* e, uint8_t cc, int dest)
+{
+	EMIT(e, 0x0f, cc + 0x10, 0xc0, 0x0f, 0xb6, 0xc0);
+	EmitStoreCtx(e, EAX, CTX_REG(dest));
+}
+
+//Taken/not-taken exits for a conditional branch whose "not taken" jump is pending
+static void EmitBranchExits(struct jit_emitter* e, struct basic_block* block, struct predecoded_inst* pi, uint8_t* not_taken)
+{
+	block->taken_patch = EmitChainableExit(e, pi->target, JIT_EXIT_TAKEN);
+	PatchHere(e, not_taken);
+	block->fallthrough_patch = EmitChainableExit(e, block->end, JIT_EXIT_FALLTHROUGH);
+}
+
+//Condition, after test eax, eax, under which a branch comparing rs with zero is not taken
+static uint8_t NotTakenCondition(int op)
+{
+	switch(op)
+	{
+		case PD_BGEZ:
+		case PD_BGEZAL:
+			return CC_L;
+		case PD_BLTZ:
+		case PD_BLTZAL:
+			return CC_GE;
+		case PD_BLEZ:
+			return CC_G;
+		default:
+			return CC_LE;
+	}
+}
+
+/**
+	@brief Emits one guest instruction. Returns 0 if it can't be translated
+ */
+static int EmitInstruction(struct jit_emitter* e, struct basic_block* block, struct predecoded_inst* pi, uint32_t pc)
+{
+	uint8_t* not_taken;
+
+	switch(pi->op)
+	{
+		//Branches and jumps. Comparisons against zero are signed; the linking ones only link when taken.
+		case PD_BGEZ:
+		case PD_BGEZAL:
+		case PD_BLTZ:
+		case PD_BLTZAL:
+		case PD_BLEZ:
+		case PD_BGTZ:
+			EmitLoadCtx(e, EAX, CTX_REG(pi->rs));
+			EMIT(e, 0x85, 0xc0);								//test eax, eax
+			not_taken = EmitJcc(e, NotTakenCondition(pi->op));
+			if( (pi->op == PD_BGEZAL) || (pi->op == PD_BLTZAL) )
+				EmitStoreCtxImm(e, CTX_REG(ra), pc + 8);
+			EmitBranchExits(e, block, pi, not_taken);
+			break;
+		case PD_J:
+			block->taken_patch = EmitChainableExit(e, pi->target, JIT_EXIT_TAKEN);
+			break;
+		case PD_JAL:
+			EmitStoreCtxImm(e, CTX_REG(ra), pc + 8);
+			block->taken_patch = EmitChainableExit(e, pi->target, JIT_EXIT_TAKEN);
+			break;
+		case PD_BEQ:
+		case PD_BNE:
+			EmitLoadCtx(e, EAX, CTX_REG(pi->rs));
+			EmitCtx(e, 0x3b, EAX, CTX_REG(pi->rt));			//cmp eax, [rt]
+			not_taken = EmitJcc(e, (pi->op == PD_BEQ) ? CC_NE : CC_E);
+			EmitBranchExits(e, block, pi, not_taken);
+			break;
+		case PD_JR:
+			EmitLoadCtx(e, EAX, CTX_REG(pi->rs));
+			EmitExit(e, 1, 0, JIT_EXIT_INDIRECT);
+			break;
+		case PD_SYSCALL:
+			EmitExit(e, 0, pc, JIT_EXIT_SYSCALL);
+			break;
+
+		//Immediate ALU ops
+		case PD_ADDI:
+			EmitAluImm(e, pi, 0x05);
+			break;
+		case PD_SLTI:
+		case PD_SLTIU:
+			EmitLoadCtx(e, EAX, CTX_REG(pi->rs));
+			Emit8(e, 0x3d);										//cmp eax, imm32
+			Emit32(e, pi->imm);
+			EmitSetCondition(e, (pi->op == PD_SLTI) ? CC_L : CC_B, pi->rt);
+			break;
+		case PD_ANDI:
+			EmitAluImm(e, pi, 0x25);
+			break;
+		case PD_ORI:
+			EmitAluImm(e, pi, 0x0d);
+			break;
+		case PD_XORI:
+			EmitAluImm(e, pi, 0x35);
+			break;
+		case PD_LUI:
+			EmitStoreCtxImm(e, CTX_REG(pi->rt), pi->imm);
+			break;
+
+		//Memory
+		case PD_LB:
+			EmitLoad(e, pi, 1, 1, pc);
+			break;
+		case PD_LBU:
+			EmitLoad(e, pi, 1, 0, pc);
+			break;
+		case PD_LH:
+			EmitLoad(e, pi, 2, 1, pc);
+			break;
+		case PD_LHU:
+			EmitLoad(e, pi, 2, 0, pc);
+			break;
+		case PD_LW:
+			EmitLoad(e, pi, 4, 0, pc);
+			break;
+		case PD_SB:
+			EmitStore(e, pi, 1, pc);
+			break;
+		case PD_SH:
+			EmitStore(e, pi, 2, pc);
+			break;
+		case PD_SW:
+			EmitStore(e, pi, 4, pc);
+			break;
+
+		//Register ALU ops
+		case PD_SLL:
+		case PD_SRL:
+		case PD_SRA:
+			EmitLoadCtx(e, EAX, CTX_REG(pi->rt));
+			EMIT(e, 0xc1, (pi->op == PD_SLL) ? 0xe0 : (pi->op == PD_SRL) ? 0xe8 : 0xf8, pi->shamt);	//shl/shr/sar eax, shamt
+			EmitStoreCtx(e, EAX, CTX_REG(pi->rd));
+			break;
+		case PD_SLLV:
+		case PD_SRLV:
+			EmitLoadCtx(e, ECX, CTX_REG(pi->rs));
+			EmitLoadCtx(e, EAX, CTX_REG(pi->rt));
+			EMIT(e, 0xd3, (pi->op == PD_SLLV) ? 0xe0 : 0xe8);				//shl/shr eax, cl
+			EmitStoreCtx(e, EAX, CTX_REG(pi->rd));
+			break;
+		case PD_MFHI:
+			EmitLoadCtx(e, EAX, CTX_HI);
+			EmitStoreCtx(e, EAX, CTX_REG(pi->rd));
+			break;
+		case PD_MFLO:
+			EmitLoadCtx(e, EAX, CTX_LO);
+			EmitStoreCtx(e, EAX, CTX_REG(pi->rd));
+			break;
+		case PD_MULT:
+		case PD_MULTU:
+			EmitLoadCtx(e, EAX, CTX_REG(pi->rs));
+			EmitCtx(e, 0xf7, (pi->op == PD_MULT) ? 5 : 4, CTX_REG(pi->rt));	//imul/mul dword [rt], into edx:eax
+			EmitStoreCtx(e, EAX, CTX_LO);
+			EmitStoreCtx(e, EDX, CTX_HI);
+			break;
+		case PD_DIV:
+		{
+			//Dividing by zero leaves HI and LO alone instead of trapping on the host. Dividing by -1 negates and
+			//divides by 1, since INT_MIN / -1 traps too.
+			EmitLoadCtx(e, ECX, CTX_REG(pi->rt));
+			EMIT(e, 0x85, 0xc9);								//test ecx, ecx
+			uint8_t* by_zero = EmitJcc(e, CC_E);
+			EmitLoadCtx(e, EAX, CTX_REG(pi->rs));
+			EMIT(e, 0x83, 0xf9, 0xff);							//cmp ecx, -1
+			uint8_t* divide = EmitJcc(e, CC_NE);
+			EMIT(e, 0xf7, 0xd8);								//neg eax
+			EMIT(e, 0xf7, 0xd9);								//neg ecx
+			PatchHere(e, divide);
+			EMIT(e, 0x99);										//cdq
+			EMIT(e, 0xf7, 0xf9);								//idiv ecx
+			EmitStoreCtx(e, EAX, CTX_LO);
+			EmitStoreCtx(e, EDX, CTX_HI);
+			PatchHere(e, by_zero);
+			break;
+		}
+		case PD_DIVU:
+		{
+			//Dividing by zero leaves HI and LO alone instead of trapping on the host
+			EmitLoadCtx(e, ECX, CTX_REG(pi->rt));
+			EMIT(e, 0x85, 0xc9);								//test ecx, ecx
+			uint8_t* by_zero = EmitJcc(e, CC_E);
+			EmitLoadCtx(e, EAX, CTX_REG(pi->rs));
+			EMIT(e, 0x31, 0xd2);								//xor edx, edx
+			EMIT(e, 0xf7, 0xf1);								//div ecx
+			EmitStoreCtx(e, EAX, CTX_LO);
+			EmitStoreCtx(e, EDX, CTX_HI);
+			PatchHere(e, by_zero);
+			break;
+		}
+		case PD_ADD:
+			EmitAluReg(e, pi, 0x03);
+			break;
+		case PD_SUB:
+			EmitAluReg(e, pi, 0x2b);
+			break;
+		case PD_AND:
+			EmitAluReg(e, pi, 0x23);
+			break;
+		case PD_OR:
+			EmitAluReg(e, pi, 0x0b);
+			break;
+		case PD_XOR:
+			EmitAluReg(e, pi, 0x33);
+			break;
+		case PD_SLT:
+		case PD_SLTU:
+			EmitLoadCtx(e, EAX, CTX_REG(pi->rs));
+			EmitCtx(e, 0x3b, EAX, CTX_REG(pi->rt));			//cmp eax, [rt]
+			EmitSetCondition(e, (pi->op == PD_SLT) ? CC_L : CC_B, pi->rd);
+			break;
+
+		//Leave invalid instructions to the engine, which reports them
+		default:
+			return 0;
+	}
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Public API
+
+/**
+	@brief Translates a block to native code
+
+	Returns NULL if the block can't be translated (invalid instruction) or the code buffer is full, in which case it
+	simply keeps running in the threaded engine.
+ */
+native_block JitCompileBlock(struct block_cache* cache, struct virtual_memory* memory, struct basic_block* block)
+{
+	if(cache->code == NULL)
+	{
+		void* buf = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(buf == MAP_FAILED)
+			return NULL;
+		cache->code = buf;
+		cache->code_size = JIT_BUFFER_SIZE;
+		cache->code_used = 0;
+	}
+
+	struct jit_emitter e;
+	e.p = cache->code + cache->code_used;
+	e.end = cache->code + cache->code_size;
+	uint8_t* entry = e.p;
+	e.block = block;
+	e.publish_at = cache->publish_at;
+
+	block->taken_patch = NULL;
+	block->fallthrough_patch = NULL;
+
+	EmitPrologue(&e);
+	block->native_body = e.p;
+	EmitCredit(&e, block->credit);
+
+	struct virtual_mem_region* text = NULL;
+	for(uint32_t i=0; i<block->count; i++)
+	{
+		if(e.end - e.p < JIT_MAX_INST_BYTES)
+			return NULL;
+
+		uint32_t pc = block->insts[i].pc;
+		struct predecoded_inst* pi = FetchPredecodedInstruction(pc, memory, &text);
+		if(WritesOnlyZero(pi))
+			continue;
+		if(!EmitInstruction(&e, block, pi, pc))
+			return NULL;
+	}
+
+	//Block stopped at the size limit or the end of its region
+	if(block->insts[block->count].label != NULL)
+	{
+		if(e.end - e.p < JIT_MAX_INST_BYTES)
+			return NULL;
+		block->fallthrough_patch = EmitChainableExit(&e, block->end, JIT_EXIT_FALLTHROUGH);
+	}
+
+	cache->code_used = (e.p - cache->code + 15) & ~(size_t)15;
+	return (native_block)entry;
+}
+
+/**
+	@brief Points a block's chainable exit straight at a translated successor
+
+	@param patch	The block's taken_patch or fallthrough_patch; cleared once linked so this is only done once
+ */
+void JitChain(uint8_t** patch, struct basic_block* successor)
+{
+	if( (*patch == NULL) || (successor->native == NULL) )
+		return;
+
+	int32_t off = (int32_t)(successor->native_body - (*patch + 4));
+	memcpy(*patch, &off, 4);
+	*patch = NULL;
+}
+
+/**
+	@brief Discards all translations (the blocks they belong to are being freed)
+ */
+void JitReset(struct block_cache* cache)
+{
+	cache->code_used = 0;
+}
+
+/**
+	@brief Releases the code buffer
+ */
+void JitFree(struct block_cache* cache)
+{
+	if(cache->code != NULL)
+		munmap(cache->code, cache->code_size);
+	cache->code = NULL;
+	cache->code_size = 0;
+	cache->code_used = 0;
+}
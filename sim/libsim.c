@@ -0,0 +1,176 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Embedding API (see libsim.h) on top of the simulator instances batch mode and main() use
+ */
+#include "sim.h"
+#include "libsim.h"
+#include <string.h>
+
+/**
+	@brief A simulator plus what it needs to be loaded again: the options' strings point into args
+ */
+struct sim_instance
+{
+	struct simulator sim;
+	struct sim_options options;
+	char** args;
+	int arg_count;
+	FILE* out;
+	FILE* in;
+	char* path;						//program last loaded, NULL before SimLoad
+};
+
+static int StatusFromHalt(int reason)
+{
+	switch(reason)
+	{
+		case HALT_EXIT:
+			return SIM_EXITED;
+		case HALT_FAULT:
+			return SIM_FAULT;
+		case HALT_BUDGET:
+			return SIM_BUDGET;
+		default:
+			return SIM_INVALID;
+	}
+}
+
+/**
+	@brief Creates an instance with options given the way the command line takes them, e.g. "--engine=threaded"
+
+	out gets guest console output and simulator messages, in is read by syscalls 5 and 8 (NULL for stdout and
+	stdin). Neither is closed by SimDestroy. No output.txt is written; the instruction count comes from
+	SimInstructionCount. Returns NULL if an option is unknown or the combination can't run. --harts and
+	--checkpoint-at aren't allowed: both would keep running past a budget. Neither are --batch, --replay, --verify
+	and --gdb.
+ */
+struct sim_instance* SimCreate(int argc, const char* const* argv, FILE* out, FILE* in)
+{
+	struct sim_instance* inst = calloc(1, sizeof(struct sim_instance));
+	inst->args = calloc(argc + 1, sizeof(char*));
+	inst->arg_count = argc;
+	inst->out = out ? out : stdout;
+	inst->in = in ? in : stdin;
+
+	InitOptions(&inst->options);
+	int ok = 1;
+	for(int i=0; ok && (i<argc); i++)
+	{
+		inst->args[i] = strdup(argv[i]);
+		ok = ParseOption(inst->args[i], &inst->options);
+	}
+	if( !ok || !CheckOptions(&inst->options) || (inst->options.harts > 1) || (inst->options.checkpoint_at != 0) ||
+		(inst->options.replay_path != NULL) || inst->options.verify || (inst->options.gdb_port != 0) )
+	{
+		SimDestroy(inst);
+		return NULL;
+	}
+
+	InitSimulator(&inst->sim, &inst->options, inst->out, inst->in, NULL);
+	return inst;
+}
+
+/**
+	@brief Loads an ELF (or with --restore, that checkpoint; path is then only remembered for SimReset), ready to
+	run from its entry point. Returns 1 if it could, 0 (after saying why on the console) if not.
+
+	Only call this once per instance; SimReset starts the same program over. The loaded image is kept as a
+	snapshot for that.
+ */
+int SimLoad(struct sim_instance* inst, const char* path)
+{
+	if(inst->path != NULL)
+		return 0;
+	inst->path = strdup(path);
+	if(!LoadProgram(&inst->sim, inst->path))
+		return 0;
+	TakeSnapshot(&inst->sim);
+	return 1;
+}
+
+/**
+	@brief Runs the loaded program until it stops, or until max_insts more instructions have run (0 for no limit)
+
+	Returns one of sim_status. After SIM_BUDGET calling this again carries on exactly where it left off; any other
+	status is final, and is returned again by every later call until SimReset. Runs with a budget always go through
+	an interpreter: the reference with --engine=reference, otherwise the predecoded one.
+ */
+int SimRun(struct sim_instance* inst, uint64_t max_insts)
+{
+	if(inst->path == NULL)
+		return SIM_NOT_LOADED;
+	return StatusFromHalt(ContinueProgram(&inst->sim, max_insts));
+}
+
+/**
+	@brief Runs exactly one instruction. Returns SIM_BUDGET if the program can go on, otherwise how it stopped.
+ */
+int SimStep(struct sim_instance* inst)
+{
+	return SimRun(inst, 1);
+}
+
+/**
+	@brief Throws away all guest state (memory, registers, counts, models, profile) and starts the program over
+
+	Only the pages the last run stored to are copied back from the snapshot SimLoad took, so this costs about as
+	much as the run touched rather than a reload; code that wasn't overwritten stays decoded. Without a snapshot
+	(there wasn't the memory for one) the program is loaded again. Returns what SimLoad would, or 0 if nothing was
+	loaded. Console streams carry on where they were.
+ */
+int SimReset(struct sim_instance* inst)
+{
+	if(inst->path == NULL)
+		return 0;
+	if(RestartProgram(&inst->sim))
+		return 1;
+	FreeSimulator(&inst->sim);
+	InitSimulator(&inst->sim, &inst->options, inst->out, inst->in, NULL);
+	if(!LoadProgram(&inst->sim, inst->path))
+		return 0;
+	TakeSnapshot(&inst->sim);
+	return 1;
+}
+
+void SimDestroy(struct sim_instance* inst)
+{
+	if(inst == NULL)
+		return;
+
+	//Only an instance that got through SimCreate has a simulator to free
+	if(inst->sim.ctx.sim != NULL)
+		FreeSimulator(&inst->sim);
+	for(int i=0; i<inst->arg_count; i++)
+		free(inst->args[i]);
+	free(inst->args);
+	free(inst->path);
+	free(inst);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Guest state
+
+uint32_t SimGetPC(const struct sim_instance* inst)
+{
+	return inst->sim.ctx.pc;
+}
+
+/**
+	@brief Returns general purpose register reg (0-31), 32 for HI and 33 for LO, and 0 for anything else
+ */
+uint32_t SimGetRegister(const struct sim_instance* inst, unsigned int reg)
+{
+	if(reg < 32)
+		return (reg == 0) ? 0 : inst->sim.ctx.regs[reg];
+	if(reg == 32)
+		return inst->sim.ctx.HI;
+	if(reg == 33)
+		return inst->sim.ctx.LO;
+	return 0;
+}
+
+uint64_t SimInstructionCount(const struct sim_instance* inst)
+{
+	return inst->sim.ctx.inst_count;
+}
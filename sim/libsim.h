@@ -0,0 +1,39 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Embedding API: simulator instances a host program creates, loads, runs in slices, resets and destroys
+
+	Build with "make lib" and link against libsim.a (or load libsim.so) with -pthread. Nothing here ever exits the
+	process, whatever the guest does. Instances share nothing, so several can be used at once from different threads,
+	but each one only from one thread at a time.
+ */
+#ifndef libsim_h
+#define libsim_h
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct sim_instance;
+
+//What a run ended with
+enum sim_status
+{
+	SIM_EXITED,				//the guest made syscall 10
+	SIM_FAULT,				//segfault, or the program or an input file couldn't be loaded
+	SIM_INVALID,			//ran into an invalid instruction
+	SIM_BUDGET,				//ran the instructions it was given, SimRun carries on from there
+	SIM_NOT_LOADED			//SimLoad hasn't been called
+};
+
+struct sim_instance* SimCreate(int argc, const char* const* argv, FILE* out, FILE* in);
+int SimLoad(struct sim_instance* inst, const char* path);
+int SimRun(struct sim_instance* inst, uint64_t max_insts);
+int SimStep(struct sim_instance* inst);
+int SimReset(struct sim_instance* inst);
+void SimDestroy(struct sim_instance* inst);
+
+uint32_t SimGetPC(const struct sim_instance* inst);
+uint32_t SimGetRegister(const struct sim_instance* inst, unsigned int reg);
+uint64_t SimInstructionCount(const struct sim_instance* inst);
+
+#endif
@@ -4,166 +4,94 @@
 	@brief Startup code for simulator
  */
 #include "sim.h"
+#include <string.h>
 
 /**
 	@brief Program entry point
  */
 int main(int argc, char* argv[])
 {
-	//Sanity check args
-	if(argc != 2)
+	//Parse command line options
+	struct sim_options options;
+	InitOptions(&options);
+	const char* fname = NULL;
+	const char* batch = NULL;
+	const char* serve = NULL;
+	int threads = 0;
+	int ok = 1;
+	for(int i=1; i<argc; i++)
 	{
-		printf("Usage: sim foo.elf\n");
-		return 0;
+		if(!strcmp(argv[i], "--batch") && (i+1 < argc))
+			batch = argv[++i];
+		else if(!strcmp(argv[i], "--serve") && (i+1 < argc))
+			serve = argv[++i];
+		else if(!strcmp(argv[i], "-j") && (i+1 < argc))
+			threads = atoi(argv[++i]);
+		else if(!strncmp(argv[i], "-j", 2) && (argv[i][2] != '\0'))
+			threads = atoi(argv[i] + 2);
+		else if( (argv[i][0] != '-') && (fname == NULL) )
+			fname = argv[i];
+		else
+			ok = ParseOption(argv[i], &options);
+		if(!ok)
+			break;
 	}
+	ok = ok && CheckOptions(&options);
 	
-	//Read and map the file
-	struct virtual_mem_region* memory = NULL;
-	struct context ctx;
-	ReadELF(argv[1], &memory, &ctx);
-	
-	//Run the CPU
-	RunSimulator(memory, &ctx);
-	
-	//TODO: clean up
-	
-	return 0;
-}
-
-/**
-	@brief Reads an ELF executable
- */
-void ReadELF(const char* fname, struct virtual_mem_region** memory, struct context* ctx)
-{
-	//Zeroize all context stuff
-	for(int i=0; i<32; i++)
-		ctx->regs[i] = 0;
+	//Only input typed on the terminal (or piped in) gets recorded, one debugger or monitor file can't take a whole
+	//batch, and a replay or a watch runs no program at all
+	if( ( (options.record_input_path != NULL) || (options.gdb_port != 0) || (options.monitor_path != NULL) ) &&
+		(batch != NULL) )
+		ok = 0;
+	if( (options.replay_path != NULL) && ( (fname != NULL) || (batch != NULL) ) )
+		ok = 0;
+	if(ok && (options.replay_path != NULL) )
+		return ReplayTrace(&options, options.replay_path, "output.txt");
+	if( (options.watch_path != NULL) && ( (fname != NULL) || (batch != NULL) || (options.restore_path != NULL) ||
+		(options.monitor_path != NULL) ) )
+		ok = 0;
+	if(ok && (options.watch_path != NULL) )
+		return WatchMonitor(options.watch_path);
 	
-	//Open the file
-	printf("Reading ELF file %s...\n", fname);
-	FILE* fp = fopen(fname, "rb");
-	if(fp == NULL)
-	{
-		printf("failed to load\n");
-		exit(1);
-	}
+	//A server's jobs bring their own program and input, get their output back over the socket and write no files
+	if( (serve != NULL) && ( (fname != NULL) || (batch != NULL) || (options.restore_path != NULL) ||
+		(options.input_path != NULL) || (options.record_input_path != NULL) || (options.profile_path != NULL) ||
+		(options.report_path != NULL) || (options.checkpoint_path != NULL) || (options.checkpoint_at != 0) ||
+		(options.trace_path != NULL) || (options.harts > 1) || options.async_output || options.verify ||
+		(options.gdb_port != 0) || (options.monitor_path != NULL) ) )
+		ok = 0;
+	if(ok && (serve != NULL) )
+		return RunServer(serve, &options);
 	
-	//Read and validate the ELF header
-	Elf32_Ehdr hdr;
-	if(1 != fread(&hdr, sizeof(hdr), 1, fp))
-	{
-		printf("failed to read elf header\n");
-		exit(1);
-	}
-	if( (hdr.e_ident[EI_MAG0] != 0x7f) ||
-		(hdr.e_ident[EI_MAG1] != 'E') ||
-		(hdr.e_ident[EI_MAG2] != 'L') ||
-		(hdr.e_ident[EI_MAG3] != 'F')
-		)
-	{
-		printf("bad ELF magic\n");
-		exit(1);
-	}
-	if(hdr.e_ident[EI_DATA] != ELFDATA2LSB)
+	//Sanity check args. A checkpoint stands in for the ELF, but batch jobs always start from their own
+	int have_program = (fname != NULL) || (options.restore_path != NULL);
+	if( !ok || (threads < 0) || ( have_program == (batch != NULL) ) || ( (fname != NULL) && (options.restore_path != NULL) ) )
 	{
-		printf("not little endian\n");
-		exit(1);
-	}
-	if(hdr.e_ident[EI_CLASS] != ELFCLASS32)
-	{
-		printf("not an ELFCLASS32\n");
-		exit(1);
-	}
-	if(hdr.e_machine != EM_MIPS)
-	{
-		printf("not a MIPS binary\n");
-		exit(1);
-	}
-	if(hdr.e_type != ET_EXEC)
-	{
-		printf("not an executable file\n");
-		exit(1);
-	}
-	if(hdr.e_version != EV_CURRENT)
-	{
-		printf("not the right ELF version\n");
-		exit(1);
+		printf("Usage: sim [options] foo.elf\n");
+		printf("       sim [options] --restore=foo.ckpt\n");
+		printf("       sim [options] --batch list.txt [-j threads]\n");
+		printf("       sim [options] --serve socket\n");
+		printf("       sim [model options] --replay=foo.trace\n");
+		printf("       sim --watch=file\n");
+		printf("Options: --engine=interp|threaded|jit|reference --async-output --huge-pages --profile[=profile.txt]\n");
+		printf("         --report=report.json --checkpoint=foo.ckpt [--checkpoint-at=count] --trace=foo.trace\n");
+		printf("         --input=file --record-input=file --harts=n --verify --bulk-cost=n --gdb=port\n");
+		printf("         --code-cache=dir --monitor=file --fast-forward\n");
+		printf("         --icache=size:assoc:line[:lru|fifo|random][:wb|wt] --dcache=...\n");
+		printf("         --pipeline[=noforward] --mult-latency=n --div-latency=n --branch-penalty=n --miss-penalty=n\n");
+		printf("         --predictor=static|btfn|bimodal|gshare[:bits] --ras=n\n");
+		return 0;
 	}
 	
-	//Save the entry point address
-	printf("    Virtual address of entry point is %08x\n", hdr.e_entry);
-	ctx->pc = hdr.e_entry;
-	
-	//Read the program headers
-	if(0 != fseek(fp, hdr.e_phoff, SEEK_SET))
-	{
-		printf("fail to seek to phdrs\n");
-		exit(1);
-	}
-	if(hdr.e_phentsize != sizeof(Elf32_Phdr))
-	{
-		printf("invalid phentsize\n");
-		exit(1);
-	}
-	for(size_t i=0; i<hdr.e_phnum; i++)
-	{
-		Elf32_Phdr phdr;
-		if(1 != fread(&phdr, sizeof(phdr), 1, fp))
-		{
-			printf("fail to read phdr\n");
-			exit(1);
-		}
-		
-		//Make the memory segment
-		struct virtual_mem_region* region =
-			(struct virtual_mem_region*)calloc(sizeof(struct virtual_mem_region), 1);
-		region->vaddr = phdr.p_vaddr;
-		region->len = phdr.p_memsz;
-		region->data = calloc(phdr.p_memsz, 1);
-		region->next = *memory;
-		*memory = region;
-		printf("    Mapping 0x%x bytes of virtual memory from executable at address %x\n", region->len, region->vaddr);
-		
-		//Skip non-loadable stuff
-		if(phdr.p_type != PT_LOAD)
-			continue;
-			
-		//Get ready to read the segment
-		long current_pos = ftell(fp);
-		if(0 != fseek(fp, phdr.p_offset, SEEK_SET))
-		{
-			printf("fail to re-seek\n");
-			exit(1);
-		}
-		
-		//Read the memory segment
-		if(phdr.p_filesz != 0)
-		{
-			if(phdr.p_filesz != fread(region->data, 1, phdr.p_filesz, fp))
-			{
-				printf("fail to read memory region\n");
-				exit(1);
-			}
-		}
-		
-		//Done, go back to where we were
-		if(0 != fseek(fp, current_pos, SEEK_SET))
-		{
-			printf("fail to re-seek\n");
-			exit(1);
-		}
-	}
+	if(batch != NULL)
+		return RunBatch(batch, threads, &options);
 	
-	fclose(fp);
+	//Read and map the file, then run the CPU
+	struct simulator sim;
+	InitSimulator(&sim, &options, stdout, stdin, "output.txt");
+	int reason = (options.gdb_port != 0) ? DebugProgram(&sim, fname, options.gdb_port) : RunProgram(&sim, fname);
+	FreeSimulator(&sim);
 	
-	//Create one last memory region for the stack, then point the stack pointer to it
-	struct virtual_mem_region* region =
-		(struct virtual_mem_region*)calloc(sizeof(struct virtual_mem_region), 1);
-	region->vaddr = 0xc0000000;
-	region->len = 0x8000;
-	region->data = calloc(region->len, 1);
-	region->next = *memory;
-	*memory = region;
-	ctx->regs[REGID_SP] = region->vaddr + region->len - 4;
-	printf("    Mapping 0x%x bytes of virtual memory for stack at address %x\n", region->len, region->vaddr);
+	//Same exit status as always: 1 once the guest exits (or faults), 0 if it ran into an invalid instruction
+	return (reason == HALT_NONE) ? 0 : 1;
 }
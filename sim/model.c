@@ -0,0 +1,271 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Modeling interpreter: runs the predecoded interpreter with cache, branch predictor and timing models (and the
+	trace writer) watching every instruction
+
+	Like the profiler this is its own copy of the interpreter loop, so the normal engines pay nothing for the models.
+ */
+#include "sim.h"
+
+/**
+	@brief Sets up whichever models the options ask for. Returns NULL if there are none.
+ */
+struct model* CreateModel(const struct sim_options* options)
+{
+	if( (options->icache.size == 0) && (options->dcache.size == 0) && !options->pipeline.enabled &&
+		(options->predictor.kind == PREDICTOR_NONE) && (options->trace_path == NULL) )
+		return NULL;
+
+	struct model* model = calloc(1, sizeof(struct model));
+	if(options->icache.size != 0)
+		model->icache = CreateCache("L1I", &options->icache);
+	if(options->dcache.size != 0)
+		model->dcache = CreateCache("L1D", &options->dcache);
+	if(options->pipeline.enabled)
+		model->pipeline = CreatePipeline(&options->pipeline);
+	if(options->predictor.kind != PREDICTOR_NONE)
+		model->predictor = CreatePredictor(&options->predictor);
+	return model;
+}
+
+/**
+	@brief Finds (or makes) the execution counters for a region
+ */
+static struct model_region* ModelRegion(struct model* model, struct virtual_mem_region* region)
+{
+	struct model_region* mr;
+	for(mr = model->regions; mr != NULL; mr = mr->next)
+	{
+		if(mr->region == region)
+			return mr;
+	}
+
+	mr = calloc(1, sizeof(struct model_region));
+	mr->region = region;
+	mr->executed = calloc((region->len + 3) / 4, sizeof(uint64_t));
+	mr->next = model->regions;
+	model->regions = mr;
+	return mr;
+}
+
+/**
+	@brief Works out where a load or store goes. Returns 0 for anything that isn't a load or store.
+ */
+static int DataAccess(union mips_instruction inst, const struct context* ctx, uint32_t* address, int* write)
+{
+	switch(inst.itype.opcode)
+	{
+		case OP_LB:
+		case OP_LBU:
+		case OP_LH:
+		case OP_LHU:
+		case OP_LW:
+		case OP_LL:
+			*write = 0;
+			break;
+		case OP_SB:
+		case OP_SH:
+		case OP_SW:
+		case OP_SC:
+			*write = 1;
+			break;
+		default:
+			return 0;
+	}
+	*address = ctx->regs[inst.itype.rs] + SIGN_EXTEND_16(inst.itype.imm);
+	return 1;
+}
+
+/**
+	@brief Shows a control transfer that just ran to the branch predictor
+
+	Returns whether fetch had to be redirected after it: a mispredicted branch or jr, or any j/jal (their target is
+	known in ID, but they always cost a fetched instruction).
+ */
+static int PredictControl(struct predictor* pred, union mips_instruction inst, uint32_t pc, uint32_t next_pc)
+{
+	int taken = (next_pc != pc + 4);
+	switch(inst.itype.opcode)
+	{
+		case OP_RTYPE:
+			if(inst.rtype.func != FUNC_JR)
+				return taken;
+			if(inst.rtype.rs == ra)
+				return PredictReturn(pred, pc, next_pc);
+			return PredictIndirect(pred, pc);
+
+		case OP_J:
+			return 1;
+		case OP_JAL:
+			PushReturn(pred, pc + 8);
+			return 1;
+
+		case OP_BGEZ:
+			//A taken BGEZAL/BLTZAL is a call
+			if( (inst.itype.rt & 0x10) && taken )
+				PushReturn(pred, pc + 8);
+			//fall through
+		case OP_BEQ:
+		case OP_BNE:
+		case OP_BLEZ:
+		case OP_BGTZ:
+			return PredictBranch(pred, pc, pc + 4 + (SIGN_EXTEND_16(inst.itype.imm) << 2), taken);
+
+		default:
+			return taken;
+	}
+}
+
+/**
+	@brief Feeds one retired instruction to every model
+
+	@param next_pc	Where execution went after it
+	@param access	Whether it was a load or store, at address (write for a store)
+ */
+void ModelInstruction(struct model* model, union mips_instruction inst, uint32_t pc, uint32_t next_pc, int access,
+	uint32_t address, int write)
+{
+	int icache_miss = 0;
+	if(model->icache != NULL)
+		icache_miss = !CacheAccess(model->icache, pc, pc, 0);
+
+	int dcache_miss = 0;
+	if( (model->dcache != NULL) && access )
+		dcache_miss = !CacheAccess(model->dcache, pc, address, write);
+
+	//Without a predictor, anything that didn't carry on to the next word redirected fetch
+	int redirected = (next_pc != pc + 4);
+	if(model->predictor != NULL)
+		redirected = PredictControl(model->predictor, inst, pc, next_pc);
+	if(model->pipeline != NULL)
+		PipelineStep(model->pipeline, inst, redirected, icache_miss, dcache_miss);
+}
+
+/**
+	@brief Runs the predecoded interpreter, feeding each retired instruction and its data access to the models (and
+	the trace, if there is one)
+
+	Same semantics and instruction count as RunInterpreter, but also stops once a budgeted run (see ContinueProgram)
+	is used up.
+ */
+void RunModel(struct virtual_memory* memory, struct context* ctx)
+{
+	struct model* model = ctx->sim->model;
+	if( (ctx->sim->options.trace_path != NULL) && (model->trace == NULL) )
+	{
+		model->trace = CreateTrace(ctx->sim->options.trace_path);
+		if(model->trace == NULL)
+		{
+			ConsolePrintf(&ctx->sim->console, "failed to write trace to %s\n", ctx->sim->options.trace_path);
+			HaltSimulator(ctx->sim, HALT_FAULT);
+		}
+	}
+
+	// Region the last instruction was fetched from, and its counters
+	struct virtual_mem_region* text = NULL;
+	struct model_region* counts = NULL;
+
+	while(ctx->inst_count < ctx->sim->stop_at)
+	{
+		uint32_t pc = ctx->pc;
+		struct predecoded_inst* pi = FetchPredecodedInstruction(pc, memory, &text);
+		if( (counts == NULL) || (counts->region != text) )
+			counts = ModelRegion(model, text);
+		uint32_t offset = (pc - text->vaddr) / 4;
+		union mips_instruction inst;
+		inst.word = text->data[offset];
+		ctx->regs[zero] = 0;
+		counts->executed[offset]++;
+
+		//Where a load or store goes has to be worked out before it runs (it may overwrite its own base register)
+		uint32_t address = 0;
+		int write = 0;
+		int access = DataAccess(inst, ctx, &address, &write);
+		uint32_t value = ctx->regs[inst.itype.rt];
+
+		if(!predecoded_handlers[pi->op](pi, memory, ctx))
+			break;
+		ctx->inst_count++;
+
+		ModelInstruction(model, inst, pc, ctx->pc, access, address, write);
+		if(model->trace != NULL)
+		{
+			//Stores trace the value written, loads the one read
+			if(access && !write)
+				value = ctx->regs[inst.itype.rt];
+			TraceInstruction(model->trace, pc, inst.word, address, value);
+		}
+	}
+}
+
+/**
+	@brief Fills in how often each PC in a table ran
+ */
+static void FillEvents(const struct model* model, struct pc_stats* stats)
+{
+	for(uint32_t i=0; i<=stats->mask; i++)
+	{
+		struct pc_stat* stat = &stats->slots[i];
+		if(!stat->used)
+			continue;
+		if(model->replayed != NULL)
+			stat->events = GetPcStat(model->replayed, stat->pc)->events;
+		for(struct model_region* mr = model->regions; mr != NULL; mr = mr->next)
+		{
+			if(stat->pc - mr->region->vaddr < mr->region->len)
+			{
+				stat->events = mr->executed[(stat->pc - mr->region->vaddr) / 4];
+				break;
+			}
+		}
+	}
+}
+
+/**
+	@brief Appends each model's results to the stats output
+ */
+void WriteModelStats(FILE* fp, struct model* model, uint64_t inst_count)
+{
+	if(model == NULL)
+		return;
+	if(model->pipeline != NULL)
+		WritePipelineStats(fp, model->pipeline, inst_count);
+	if(model->predictor != NULL)
+	{
+		FillEvents(model, &model->predictor->pcs);
+		WritePredictorStats(fp, model->predictor);
+	}
+
+	if(model->icache != NULL)
+		FillEvents(model, &model->icache->pcs);
+	if(model->dcache != NULL)
+		FillEvents(model, &model->dcache->pcs);
+
+	if(model->icache != NULL)
+		WriteCacheStats(fp, model->icache);
+	if(model->dcache != NULL)
+		WriteCacheStats(fp, model->dcache);
+}
+
+void FreeModel(struct model* model)
+{
+	if(model == NULL)
+		return;
+	FreeCache(model->icache);
+	FreeCache(model->dcache);
+	free(model->pipeline);
+	FreePredictor(model->predictor);
+	FreeTrace(model->trace);
+	if(model->replayed != NULL)
+		FreePcStats(model->replayed);
+	free(model->replayed);
+	while(model->regions != NULL)
+	{
+		struct model_region* next = model->regions->next;
+		free(model->regions->executed);
+		free(model->regions);
+		model->regions = next;
+	}
+	free(model);
+}
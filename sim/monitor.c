@@ -0,0 +1,239 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Live counters: a shared file (see monitor.h) kept up to date while the guest runs, and --watch to follow it
+
+	The engines update it every MONITOR_INTERVAL instructions or so, checked once per block (per chunk for the
+	interpreters, which run the chunks with their run_until), so the run itself only pays the check. Syscalls are
+	counted privately as they happen and copied in with each update. The file stays behind after the run, holding
+	how it ended.
+ */
+#include "sim.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define BILLION 1000000000L
+
+static uint64_t NanosecondsBetween(const struct timespec* t0, const struct timespec* t1)
+{
+	return BILLION * (t1->tv_sec - t0->tv_sec) + t1->tv_nsec - t0->tv_nsec;
+}
+
+/**
+	@brief Creates (or empties) the monitor file the options name and maps it. Returns 0 if that can't be done.
+ */
+int OpenMonitor(struct simulator* sim)
+{
+	int fd = open(sim->options.monitor_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+		return 0;
+	struct sim_monitor_page* page = MAP_FAILED;
+	if(ftruncate(fd, sizeof(struct sim_monitor_page)) == 0)
+		page = mmap(NULL, sizeof(struct sim_monitor_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(page == MAP_FAILED)
+		return 0;
+
+	//The magic goes in last, so a reader never takes a half-written page for a monitor
+	page->size = sizeof(struct sim_monitor_page);
+	page->pid = getpid();
+	page->state = SIM_MONITOR_LOADING;
+	memcpy(page->magic, SIM_MONITOR_MAGIC, sizeof(page->magic));
+
+	sim->monitor = calloc(1, sizeof(struct monitor));
+	sim->monitor->page = page;
+	sim->monitor->next = UINT64_MAX;
+	return 1;
+}
+
+/**
+	@brief Writes the current counters and state (one of sim_monitor_states) to the monitor file
+
+	Returns the instruction count at which the engines should call this again.
+ */
+uint64_t UpdateMonitor(struct simulator* sim, int state)
+{
+	struct monitor* m = sim->monitor;
+	struct sim_monitor_page* page = m->page;
+	uint64_t count = sim->ctx.inst_count;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	//Rates are measured from when running (re)started, then over windows of MONITOR_RATE_NS
+	if(page->state != SIM_MONITOR_RUNNING)
+	{
+		m->rate_start = now;
+		m->rate_count = count;
+	}
+	else
+	{
+		uint64_t ns = NanosecondsBetween(&m->rate_start, &now);
+		if(ns >= MONITOR_RATE_NS)
+		{
+			m->ips = (uint64_t)((double)(count - m->rate_count) * BILLION / ns);
+			m->rate_start = now;
+			m->rate_count = count;
+		}
+	}
+	uint64_t run_ns = sim->run_ns;
+	if(sim->running)
+		run_ns += NanosecondsBetween(&sim->start, &now);
+
+	//Odd seq while the fields change, see monitor.h
+	uint32_t seq = page->seq;
+	__atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	page->state = state;
+	page->pc = sim->ctx.pc;
+	page->inst_count = count;
+	page->run_ns = run_ns;
+	page->ips = (state == SIM_MONITOR_RUNNING) ? m->ips : 0;
+	page->updates++;
+	memcpy(page->syscalls, m->syscalls, sizeof(page->syscalls));
+	__atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+
+	m->next = (count < UINT64_MAX - MONITOR_INTERVAL) ? (count + MONITOR_INTERVAL) : UINT64_MAX;
+	return m->next;
+}
+
+/**
+	@brief Records how the program ended in the monitor file
+ */
+void FinishMonitor(struct simulator* sim)
+{
+	int state = SIM_MONITOR_INVALID;
+	if(sim->halt_reason == HALT_EXIT)
+		state = SIM_MONITOR_EXITED;
+	else if(sim->halt_reason == HALT_FAULT)
+		state = SIM_MONITOR_FAULTED;
+	UpdateMonitor(sim, state);
+}
+
+/**
+	@brief Runs an engine that can stop at an exact count a chunk at a time, updating the monitor in between, until
+	the guest stops or the current budget is used up
+ */
+void RunMonitored(struct virtual_memory* memory, struct context* ctx,
+	void (*run_until)(struct virtual_memory* memory, struct context* ctx, uint64_t target))
+{
+	struct simulator* sim = ctx->sim;
+	while(1)
+	{
+		uint64_t target = (sim->monitor->next < sim->stop_at) ? sim->monitor->next : sim->stop_at;
+		run_until(memory, ctx, target);
+
+		//Stopping short means an invalid instruction
+		if( (ctx->inst_count < target) || (ctx->inst_count >= sim->stop_at) )
+			return;
+		UpdateMonitor(sim, SIM_MONITOR_RUNNING);
+	}
+}
+
+void CloseMonitor(struct simulator* sim)
+{
+	if(sim->monitor == NULL)
+		return;
+	munmap(sim->monitor->page, sizeof(struct sim_monitor_page));
+	free(sim->monitor);
+	sim->monitor = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Watching
+
+static const char* MonitorStateName(uint32_t state)
+{
+	switch(state)
+	{
+		case SIM_MONITOR_LOADING:
+			return "loading";
+		case SIM_MONITOR_RUNNING:
+			return "running";
+		case SIM_MONITOR_PAUSED:
+			return "paused";
+		case SIM_MONITOR_EXITED:
+			return "exited";
+		case SIM_MONITOR_FAULTED:
+			return "faulted";
+		default:
+			return "invalid instruction";
+	}
+}
+
+//Copies a consistent snapshot of the page, see monitor.h
+static void ReadMonitor(const struct sim_monitor_page* page, struct sim_monitor_page* copy)
+{
+	while(1)
+	{
+		uint32_t seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+		if(seq & 1)
+			continue;
+		memcpy(copy, page, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq)
+			return;
+	}
+}
+
+/**
+	@brief Prints the counters in a monitor file once a second until the run it belongs to is over, then the
+	syscalls it made. Returns the process exit status: 0, or 1 if the file can't be read or the simulator went away
+	without finishing.
+ */
+int WatchMonitor(const char* path)
+{
+	int fd = open(path, O_RDONLY);
+	const struct sim_monitor_page* page = MAP_FAILED;
+	if(fd >= 0)
+	{
+		page = mmap(NULL, sizeof(struct sim_monitor_page), PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+	}
+	if( (page == MAP_FAILED) || memcmp(page->magic, SIM_MONITOR_MAGIC, sizeof(page->magic)) ||
+		(page->size != sizeof(struct sim_monitor_page)) )
+	{
+		printf("can't read counters from %s\n", path);
+		return 1;
+	}
+
+	struct sim_monitor_page copy;
+	int gone = 0;
+	while(1)
+	{
+		//Checked before reading, so the last update before it went is still printed
+		gone = (kill(page->pid, 0) != 0) && (errno == ESRCH);
+		ReadMonitor(page, &copy);
+
+		uint64_t syscalls = 0;
+		for(int i=0; i<SIM_MONITOR_SYSCALLS; i++)
+			syscalls += copy.syscalls[i];
+		printf("%s: pc %08x, %llu instructions, %.2f MIPS, %llu syscalls, %.3f s\n", MonitorStateName(copy.state),
+			copy.pc, (long long unsigned int)copy.inst_count, copy.ips / 1e6, (long long unsigned int)syscalls,
+			copy.run_ns / 1e9);
+		fflush(stdout);
+		if( (copy.state > SIM_MONITOR_PAUSED) || gone)
+			break;
+		sleep(1);
+	}
+
+	for(int i=0; i<SIM_MONITOR_SYSCALLS; i++)
+	{
+		if(copy.syscalls[i] == 0)
+			continue;
+		if(i == SIM_MONITOR_SYSCALLS - 1)
+			printf("    syscall %d and up: %llu\n", i, (long long unsigned int)copy.syscalls[i]);
+		else
+			printf("    syscall %d: %llu\n", i, (long long unsigned int)copy.syscalls[i]);
+	}
+	if( (copy.state <= SIM_MONITOR_PAUSED) && gone)
+	{
+		printf("simulator %d went away without finishing\n", (int)copy.pid);
+		return 1;
+	}
+	munmap((void*)page, sizeof(struct sim_monitor_page));
+	return 0;
+}
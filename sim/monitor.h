@@ -0,0 +1,47 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Live counters: the layout of the file --monitor keeps up to date while the guest runs
+
+	Anything that maps the file (read only is enough) can follow the run without stopping it. Updates are guarded by
+	seq, which is odd while one is being written: copy the page after reading an even seq, then read seq again, and
+	try again if it changed. Only monitor.h is needed for that, not the rest of the simulator.
+ */
+#ifndef monitor_h
+#define monitor_h
+
+#include <stdint.h>
+
+#define SIM_MONITOR_MAGIC		"SIMMON01"
+
+//Syscalls 0 to SIM_MONITOR_SYSCALLS-2 are counted each on their own, anything higher in the last slot
+#define SIM_MONITOR_SYSCALLS	128
+
+//Where the run is
+enum sim_monitor_states
+{
+	SIM_MONITOR_LOADING,			//reading the program
+	SIM_MONITOR_RUNNING,
+	SIM_MONITOR_PAUSED,				//used up a budget (embedding), and may carry on
+	SIM_MONITOR_EXITED,				//the guest made syscall 10
+	SIM_MONITOR_FAULTED,			//segfault, or the program couldn't be loaded
+	SIM_MONITOR_INVALID				//ran into an invalid instruction
+};
+
+struct sim_monitor_page
+{
+	char magic[8];
+	uint32_t size;					//sizeof(struct sim_monitor_page)
+	int32_t pid;					//of the simulator
+	uint32_t seq;					//odd while an update is being written
+	uint32_t state;					//one of sim_monitor_states
+	uint32_t pc;					//next instruction to run
+	uint32_t reserved;
+	uint64_t inst_count;			//instructions retired so far
+	uint64_t run_ns;				//execution time so far, like output.txt's but still counting
+	uint64_t ips;					//instructions per second over the last tenth of a second or so
+	uint64_t updates;				//how many times the page has been written
+	uint64_t syscalls[SIM_MONITOR_SYSCALLS];
+};
+
+#endif
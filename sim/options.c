@@ -0,0 +1,170 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Simulator options: defaults, parsing one command line argument, and combinations that can't work
+ */
+#include "sim.h"
+#include <string.h>
+
+/**
+	@brief The settings used when nothing says otherwise
+ */
+void InitOptions(struct sim_options* options)
+{
+	memset(options, 0, sizeof(*options));
+	options->engine = ENGINE_INTERP;
+	options->pipeline.forwarding = 1;
+	options->pipeline.mult_latency = 12;
+	options->pipeline.div_latency = 35;
+	options->pipeline.branch_penalty = 2;
+	options->pipeline.miss_penalty = 10;
+	options->predictor.ras_depth = 8;
+	options->harts = 1;
+}
+
+/**
+	@brief Applies one --option argument. Returns 0 if it isn't one, or its value is bad
+
+	File names are kept as pointers into arg, which has to outlive the options.
+ */
+int ParseOption(const char* arg, struct sim_options* options)
+{
+	if(!strncmp(arg, "--engine=", 9))
+	{
+		for(int i=0; i<ENGINE_COUNT; i++)
+		{
+			if(!strcmp(arg + 9, engines[i].name))
+			{
+				options->engine = i;
+				return 1;
+			}
+		}
+		return 0;
+	}
+	else if(!strcmp(arg, "--verify"))
+		options->verify = 1;
+	else if(!strcmp(arg, "--fast-forward"))
+		options->fast_forward = 1;
+	else if(!strcmp(arg, "--async-output"))
+		options->async_output = 1;
+	else if(!strcmp(arg, "--huge-pages"))
+		options->huge_pages = 1;
+	else if(!strcmp(arg, "--profile"))
+		options->profile_path = "profile.txt";
+	else if(!strncmp(arg, "--profile=", 10) && (arg[10] != '\0'))
+		options->profile_path = arg + 10;
+	else if(!strncmp(arg, "--report=", 9) && (arg[9] != '\0'))
+		options->report_path = arg + 9;
+	else if(!strncmp(arg, "--checkpoint=", 13) && (arg[13] != '\0'))
+		options->checkpoint_path = arg + 13;
+	else if(!strncmp(arg, "--checkpoint-at=", 16) && (arg[16] != '\0'))
+		options->checkpoint_at = strtoull(arg + 16, NULL, 0);
+	else if(!strncmp(arg, "--restore=", 10) && (arg[10] != '\0'))
+		options->restore_path = arg + 10;
+	else if(!strncmp(arg, "--trace=", 8) && (arg[8] != '\0'))
+		options->trace_path = arg + 8;
+	else if(!strncmp(arg, "--replay=", 9) && (arg[9] != '\0'))
+		options->replay_path = arg + 9;
+	else if(!strncmp(arg, "--input=", 8) && (arg[8] != '\0'))
+		options->input_path = arg + 8;
+	else if(!strncmp(arg, "--record-input=", 15) && (arg[15] != '\0'))
+		options->record_input_path = arg + 15;
+	else if(!strncmp(arg, "--icache=", 9))
+		return ParseCacheConfig(arg + 9, &options->icache);
+	else if(!strncmp(arg, "--dcache=", 9))
+		return ParseCacheConfig(arg + 9, &options->dcache);
+	else if(!strcmp(arg, "--pipeline"))
+		options->pipeline.enabled = 1;
+	else if(!strcmp(arg, "--pipeline=noforward"))
+	{
+		options->pipeline.enabled = 1;
+		options->pipeline.forwarding = 0;
+	}
+	else if(!strncmp(arg, "--mult-latency=", 15))
+		options->pipeline.mult_latency = atoi(arg + 15);
+	else if(!strncmp(arg, "--div-latency=", 14))
+		options->pipeline.div_latency = atoi(arg + 14);
+	else if(!strncmp(arg, "--branch-penalty=", 17))
+		options->pipeline.branch_penalty = atoi(arg + 17);
+	else if(!strncmp(arg, "--miss-penalty=", 15))
+		options->pipeline.miss_penalty = atoi(arg + 15);
+	else if(!strncmp(arg, "--predictor=", 12))
+		return ParsePredictorConfig(arg + 12, &options->predictor);
+	else if(!strncmp(arg, "--ras=", 6))
+		options->predictor.ras_depth = atoi(arg + 6);
+	else if(!strncmp(arg, "--gdb=", 6) && (arg[6] != '\0'))
+	{
+		options->gdb_port = atoi(arg + 6);
+		return (options->gdb_port > 0) && (options->gdb_port < 65536);
+	}
+	else if(!strncmp(arg, "--code-cache=", 13) && (arg[13] != '\0'))
+		options->code_cache_dir = arg + 13;
+	else if(!strncmp(arg, "--monitor=", 10) && (arg[10] != '\0'))
+		options->monitor_path = arg + 10;
+	else if(!strncmp(arg, "--watch=", 8) && (arg[8] != '\0'))
+		options->watch_path = arg + 8;
+	else if(!strncmp(arg, "--bulk-cost=", 12) && (arg[12] != '\0'))
+		options->bulk_cost = atoi(arg + 12);
+	else if(!strncmp(arg, "--harts=", 8) && (arg[8] != '\0'))
+	{
+		int n = atoi(arg + 8);
+		options->harts = n;
+		return n >= 1;
+	}
+	else
+		return 0;
+	return 1;
+}
+
+/**
+	@brief Returns 0 if the options ask for things that can't run together
+ */
+int CheckOptions(const struct sim_options* options)
+{
+	int modeled = (options->icache.size != 0) || (options->dcache.size != 0) || options->pipeline.enabled ||
+		(options->predictor.kind != PREDICTOR_NONE) || (options->trace_path != NULL);
+
+	//The profiler and the models each need their own interpreter loop
+	if( (options->profile_path != NULL) && modeled)
+		return 0;
+
+	//Only input typed on the terminal (or piped in) gets recorded
+	if( (options->record_input_path != NULL) && (options->input_path != NULL) )
+		return 0;
+
+	//Harts only ever run on the plain interpreter, and a checkpoint would only catch hart 0
+	if( (options->harts > 1) && ( (options->profile_path != NULL) || modeled || (options->checkpoint_path != NULL) ||
+		(options->checkpoint_at != 0) || (options->replay_path != NULL) ) )
+		return 0;
+
+	//A replay doesn't run anything, so nothing that does can come with it
+	if( (options->replay_path != NULL) && ( (options->restore_path != NULL) || (options->trace_path != NULL) ||
+		(options->profile_path != NULL) || (options->checkpoint_path != NULL) || (options->input_path != NULL) ||
+		(options->record_input_path != NULL) ) )
+		return 0;
+
+	//Verifying checks an engine other than the reference, run on its own (not the models or profiler) on one hart,
+	//and makes its own recording of the input for the reference
+	if(options->verify && ( (options->engine == ENGINE_REFERENCE) || (options->profile_path != NULL) || modeled ||
+		(options->harts > 1) || (options->checkpoint_at != 0) || (options->replay_path != NULL) ||
+		(options->record_input_path != NULL) ) )
+		return 0;
+
+	//A debugged program runs on the plain interpreter, on one hart, with nothing else stopping it
+	if( (options->gdb_port != 0) && ( options->verify || (options->profile_path != NULL) || modeled ||
+		(options->harts > 1) || (options->checkpoint_at != 0) || (options->replay_path != NULL) ) )
+		return 0;
+
+	//Only the block engines fast-forward, and only while nothing else has taken over the run
+	if(options->fast_forward && ( (options->engine == ENGINE_INTERP) || (options->engine == ENGINE_REFERENCE) ||
+		(options->profile_path != NULL) || modeled || (options->harts > 1) || (options->gdb_port != 0) ) )
+		return 0;
+
+	//The counters come from the engines' own loops, which the models, the profiler, harts, the verifier and the
+	//debugger replace
+	if( (options->monitor_path != NULL) && ( (options->profile_path != NULL) || modeled || (options->harts > 1) ||
+		options->verify || (options->gdb_port != 0) || (options->replay_path != NULL) ) )
+		return 0;
+
+	return 1;
+}
@@ -0,0 +1,316 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Two-level page table translating guest addresses to host pointers, and the demand-mapped stack and heap
+ */
+#include "sim.h"
+#include <string.h>
+#include <sys/mman.h>
+
+//Shared second-level table for directory slots with nothing mapped. Every entry has span 0, i.e. "take the slow path"
+static struct page_table_entry unmapped_table[VM_L2_ENTRIES];
+
+/**
+	@brief Sets up an empty address space
+ */
+void InitVirtualMemory(struct virtual_memory* memory)
+{
+	memory->regions = NULL;
+	for(int i=0; i<VM_L1_ENTRIES; i++)
+		memory->pages[i] = unmapped_table;
+	memory->code_dirty = 0;
+	memory->blocks = NULL;
+	memory->stack_top = memory->stack_bottom = memory->stack_limit = 0;
+	memory->heap_start = memory->brk = memory->heap_end = 0;
+	memory->shared = 0;
+}
+
+//Frees a region that's no longer on the list, and everything hanging off it
+static void FreeRegion(struct virtual_mem_region* region)
+{
+	if(region->map_base != NULL)
+		munmap(region->map_base, region->map_len);
+	else
+		free(region->data);
+	free(region->decoded);
+	free(region->decoded_pages);
+	free(region->dirty_pages);
+	if(region->pristine != NULL)
+		munmap(region->pristine, (region->len + VM_PAGE_MASK) & ~VM_PAGE_MASK);
+	free(region);
+}
+
+/**
+	@brief Releases every region, the page table and any cached translations, leaving an empty address space
+ */
+void FreeVirtualMemory(struct virtual_memory* memory)
+{
+	FreeBlockCache(memory);
+	
+	while(memory->regions != NULL)
+	{
+		struct virtual_mem_region* region = memory->regions;
+		memory->regions = region->next;
+		FreeRegion(region);
+	}
+	
+	//No regions left, so this just frees all the second-level tables
+	BuildPageTable(memory);
+}
+
+/**
+	@brief Returns the page table entry for a page, allocating its second-level table if needed
+ */
+static struct page_table_entry* GetWritablePage(struct virtual_memory* memory, uint32_t address)
+{
+	struct page_table_entry** table = &memory->pages[address >> VM_L1_SHIFT];
+	if(*table == unmapped_table)
+	{
+		__atomic_store_n(table, (struct page_table_entry*)calloc(VM_L2_ENTRIES, sizeof(struct page_table_entry)),
+			__ATOMIC_RELEASE);
+	}
+	return LookupPage(memory, address);
+}
+
+/**
+	@brief Gives the pages a region touches their fast translations, on top of whatever is already in the table
+
+	Other harts may be using the table meanwhile. An entry's span is what makes it usable, so it's stored last.
+ */
+static void MapRegionPages(struct virtual_memory* memory, struct virtual_mem_region* region)
+{
+	//Empty regions, or ones that wrap past the top of the address space, can never match the region walk
+	uint64_t end = (uint64_t)region->vaddr + region->len;
+	if( (region->len == 0) || (end > 0x100000000ULL) )
+		return;
+
+	uint32_t last = (uint32_t)(end - 1);
+	for(uint32_t page = region->vaddr & ~VM_PAGE_MASK; ; page += VM_PAGE_SIZE)
+	{
+		struct page_table_entry* pte = GetWritablePage(memory, page);
+
+		//Somebody else already claimed part of this page? Then neither of us gets a fast translation
+		if(pte->region != NULL)
+			__atomic_store_n(&pte->span, 0, __ATOMIC_RELEASE);
+
+		else
+		{
+			uint32_t lo = (region->vaddr > page) ? (region->vaddr - page) : 0;
+			uint32_t hi = (last - page <= VM_PAGE_MASK) ? (last - page + 1) : VM_PAGE_SIZE;
+
+			pte->region = region;
+			pte->bias = (uintptr_t)region->data - region->vaddr;
+			__atomic_store_n(&pte->lo, lo, __ATOMIC_RELAXED);
+
+			//Offsets inside a misaligned region don't line up with guest addresses, keep those on the slow path
+			__atomic_store_n(&pte->span, (region->vaddr & 3) ? 0 : (hi - lo), __ATOMIC_RELEASE);
+		}
+
+		if(last - page <= VM_PAGE_MASK)
+			break;
+	}
+}
+
+/**
+	@brief (Re)builds the page table from the region list
+
+	Must be called whenever regions are added or removed (other than by AddRegion). Pages touched by exactly one
+	word-aligned region get a fast translation covering the part of the page that region occupies. Pages touched by
+	more than one region are left on the slow path, so the first-match order of the region list still decides who
+	owns each byte.
+ */
+void BuildPageTable(struct virtual_memory* memory)
+{
+	//Forget any translations from a previous build
+	for(int i=0; i<VM_L1_ENTRIES; i++)
+	{
+		if(memory->pages[i] != unmapped_table)
+		{
+			free(memory->pages[i]);
+			memory->pages[i] = unmapped_table;
+		}
+	}
+
+	for(struct virtual_mem_region* region = memory->regions; region != NULL; region = region->next)
+		MapRegionPages(memory, region);
+}
+
+/**
+	@brief Adds a region that doesn't share a page with any other, while the program runs
+
+	Only its own pages are touched, so translations (and second-level tables) the engines may be using stay put. The
+	region is complete before it goes on the list, so harts walking the list without the lock are fine too.
+ */
+void AddRegion(struct virtual_memory* memory, struct virtual_mem_region* region)
+{
+	if(memory->sim->snapshot != NULL)
+		TrackNewRegion(region);
+	region->next = memory->regions;
+	__atomic_store_n(&memory->regions, region, __ATOMIC_RELEASE);
+	MapRegionPages(memory, region);
+	if(memory->sim->debugger != NULL)
+		ProtectWatchedPages(memory->sim);
+}
+
+/**
+	@brief Frees every region added in front of keep (which AddRegion did, e.g. to grow the stack or heap), along
+	with their translations
+
+	Those regions have pages of their own, so nothing else's translations change. If code ran from any of them, the
+	block caches are flagged for a flush.
+ */
+void DropRegionsBefore(struct virtual_memory* memory, struct virtual_mem_region* keep)
+{
+	while( (memory->regions != keep) && (memory->regions != NULL) )
+	{
+		struct virtual_mem_region* region = memory->regions;
+		memory->regions = region->next;
+
+		uint64_t end = (uint64_t)region->vaddr + region->len;
+		if( (region->len != 0) && (end <= 0x100000000ULL) )
+		{
+			for(uint64_t page = region->vaddr & ~VM_PAGE_MASK; page < end; page += VM_PAGE_SIZE)
+			{
+				struct page_table_entry* pte = LookupPage(memory, (uint32_t)page);
+				if(pte->region == region)
+					memset(pte, 0, sizeof(*pte));
+			}
+		}
+		if(region->decoded != NULL)
+			memory->code_dirty = 1;
+		FreeRegion(region);
+	}
+}
+
+/**
+	@brief Takes the page holding address off the fast path, so every access to it walks the region list (for
+	watchpoints). Lasts until the next BuildPageTable, or AddRegion mapping the page.
+ */
+void ForceSlowPage(struct virtual_memory* memory, uint32_t address)
+{
+	//Unmapped pages are slow already, and may be in the shared table
+	struct page_table_entry* pte = LookupPage(memory, address);
+	if(pte->span != 0)
+		__atomic_store_n(&pte->span, 0, __ATOMIC_RELEASE);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Stack and heap
+
+/**
+	@brief Adds a page-aligned demand-zero region. Host memory is reserved, not committed: pages the guest never
+	touches cost nothing. Returns 0 if the host is out of address space.
+ */
+int MapAnonymousRegion(struct virtual_memory* memory, uint32_t vaddr, uint32_t len)
+{
+	void* base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(base == MAP_FAILED)
+		return 0;
+#ifdef MADV_HUGEPAGE
+	if(memory->sim->options.huge_pages)
+		madvise(base, len, MADV_HUGEPAGE);
+#endif
+
+	struct virtual_mem_region* region =
+		(struct virtual_mem_region*)calloc(sizeof(struct virtual_mem_region), 1);
+	region->vaddr = vaddr;
+	region->len = len;
+	region->data = (uint32_t*)base;
+	region->map_base = base;
+	region->map_len = len;
+	AddRegion(memory, region);
+	return 1;
+}
+
+/**
+	@brief Maps the initial stack, ending at top, and sets where the heap starts (just past the executable)
+
+	The stack may later grow down to VM_STACK_MAX below top, and the heap up to wherever that is.
+ */
+int SetupStackAndHeap(struct virtual_memory* memory, uint32_t top, uint32_t heap_start)
+{
+	memory->stack_top = top;
+	memory->stack_bottom = top - VM_STACK_INITIAL;
+	memory->stack_limit = top - VM_STACK_MAX;
+	memory->heap_start = memory->brk = memory->heap_end = (heap_start + VM_PAGE_MASK) & ~VM_PAGE_MASK;
+	if(memory->heap_start > memory->stack_limit)
+		memory->heap_start = memory->brk = memory->heap_end = memory->stack_limit;
+	return MapAnonymousRegion(memory, memory->stack_bottom, VM_STACK_INITIAL);
+}
+
+static int GrowStackUnlocked(struct virtual_memory* memory, uint32_t address)
+{
+	//Another hart may have grown it past address since the caller looked
+	if( (address >= memory->stack_bottom) && (address < memory->stack_top) )
+		return 1;
+	if( (address < memory->stack_limit) || (address >= memory->stack_bottom) )
+		return 0;
+
+	uint32_t size = memory->stack_top - memory->stack_bottom;
+	uint32_t bottom = address & ~VM_PAGE_MASK;
+	if(memory->stack_bottom - bottom < size)
+		bottom = (memory->stack_bottom - memory->stack_limit > size) ? (memory->stack_bottom - size) : memory->stack_limit;
+
+	if(!MapAnonymousRegion(memory, bottom, memory->stack_bottom - bottom))
+		return 0;
+	memory->stack_bottom = bottom;
+	return 1;
+}
+
+/**
+	@brief Called for an access nothing is mapped at. If it's in the stack's reserved range, maps the stack down to
+	cover it and returns 1.
+
+	Each step at least doubles the stack, so even a deep one is only a handful of regions.
+ */
+int GrowStack(struct virtual_memory* memory, uint32_t address)
+{
+	if(memory->shared)
+		pthread_mutex_lock(&memory->lock);
+	int grown = GrowStackUnlocked(memory, address);
+	if(memory->shared)
+		pthread_mutex_unlock(&memory->lock);
+	return grown;
+}
+
+static uint32_t SbrkUnlocked(struct virtual_memory* memory, int32_t increment)
+{
+	uint32_t old = memory->brk;
+	int64_t end = (int64_t)old + (((int64_t)increment + 3) & ~(int64_t)3);
+	if( (end < memory->heap_start) || (end > memory->stack_limit) )
+		return 0xffffffff;
+
+	if(end > memory->heap_end)
+	{
+		uint64_t grow = ((uint64_t)end - memory->heap_end + VM_PAGE_MASK) & ~(uint64_t)VM_PAGE_MASK;
+		if(grow < memory->heap_end - memory->heap_start)
+			grow = memory->heap_end - memory->heap_start;
+		if(grow < VM_GROW_MIN)
+			grow = VM_GROW_MIN;
+		if(grow > memory->stack_limit - memory->heap_end)
+			grow = memory->stack_limit - memory->heap_end;
+
+		if(!MapAnonymousRegion(memory, memory->heap_end, (uint32_t)grow))
+			return 0xffffffff;
+		memory->heap_end += grow;
+	}
+
+	memory->brk = (uint32_t)end;
+	return old;
+}
+
+/**
+	@brief Moves the program break by increment bytes (rounded up to a word), like sbrk()
+
+	Returns the old break, or 0xffffffff if the heap would run into the stack or below its start. The mapped part
+	of the heap at least doubles whenever the break passes its end.
+ */
+uint32_t Sbrk(struct virtual_memory* memory, int32_t increment)
+{
+	if(memory->shared)
+		pthread_mutex_lock(&memory->lock);
+	uint32_t old = SbrkUnlocked(memory, increment);
+	if(memory->shared)
+		pthread_mutex_unlock(&memory->lock);
+	return old;
+}
@@ -0,0 +1,105 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Per-PC event and miss counters for the models, and their sorted reports
+ */
+#include "sim.h"
+#include <string.h>
+
+#define PC_STATS_INITIAL	1024
+
+void InitPcStats(struct pc_stats* stats)
+{
+	stats->slots = calloc(PC_STATS_INITIAL, sizeof(struct pc_stat));
+	stats->mask = PC_STATS_INITIAL - 1;
+	stats->used = 0;
+}
+
+static uint32_t HashPc(uint32_t pc)
+{
+	return (pc >> 2) * 2654435761u;
+}
+
+/**
+	@brief Returns the counters for a PC, adding zeroed ones the first time it's seen
+ */
+struct pc_stat* GetPcStat(struct pc_stats* stats, uint32_t pc)
+{
+	uint32_t i = HashPc(pc) & stats->mask;
+	while(stats->slots[i].used)
+	{
+		if(stats->slots[i].pc == pc)
+			return &stats->slots[i];
+		i = (i + 1) & stats->mask;
+	}
+
+	//New PC. Keep the table at most half full so probes stay short
+	if(stats->used + 1 > (stats->mask + 1) / 2)
+	{
+		struct pc_stat* old = stats->slots;
+		uint32_t old_size = stats->mask + 1;
+		stats->slots = calloc(old_size * 2, sizeof(struct pc_stat));
+		stats->mask = old_size * 2 - 1;
+		for(uint32_t j=0; j<old_size; j++)
+		{
+			if(!old[j].used)
+				continue;
+			uint32_t k = HashPc(old[j].pc) & stats->mask;
+			while(stats->slots[k].used)
+				k = (k + 1) & stats->mask;
+			stats->slots[k] = old[j];
+		}
+		free(old);
+
+		i = HashPc(pc) & stats->mask;
+		while(stats->slots[i].used)
+			i = (i + 1) & stats->mask;
+	}
+
+	struct pc_stat* stat = &stats->slots[i];
+	stat->pc = pc;
+	stat->used = 1;
+	stats->used++;
+	return stat;
+}
+
+static int CompareMisses(const void* a, const void* b)
+{
+	const struct pc_stat* x = (const struct pc_stat*)a;
+	const struct pc_stat* y = (const struct pc_stat*)b;
+	if(x->misses != y->misses)
+		return (x->misses > y->misses) ? -1 : 1;
+	return (x->pc > y->pc) - (x->pc < y->pc);
+}
+
+/**
+	@brief Lists the limit PCs with the most misses, worst first
+ */
+void WritePcStats(FILE* fp, const struct pc_stats* stats, const char* title, size_t limit)
+{
+	struct pc_stat* sorted = malloc((stats->used + 1) * sizeof(struct pc_stat));
+	size_t n = 0;
+	for(uint32_t i=0; i<=stats->mask; i++)
+	{
+		if(stats->slots[i].used && (stats->slots[i].misses != 0) )
+			sorted[n++] = stats->slots[i];
+	}
+	qsort(sorted, n, sizeof(struct pc_stat), CompareMisses);
+
+	fprintf(fp, "%s:\n", title);
+	for(size_t i=0; (i<n) && (i<limit); i++)
+	{
+		fprintf(fp, "    %08x %12llu misses of %12llu (%.2f%%)\n", sorted[i].pc,
+			(long long unsigned int)sorted[i].misses, (long long unsigned int)sorted[i].events,
+			100.0 * sorted[i].misses / sorted[i].events);
+	}
+	free(sorted);
+}
+
+void FreePcStats(struct pc_stats* stats)
+{
+	free(stats->slots);
+	stats->slots = NULL;
+	stats->mask = 0;
+	stats->used = 0;
+}
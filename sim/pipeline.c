@@ -0,0 +1,234 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Cycle-approximate 5-stage pipeline timing model
+
+	Cycles are numbered so the first instruction is in IF at 1, ID at 2 and EX at 3. One instruction enters EX per
+	cycle unless it has to wait; whatever it waited for is what the stall is charged to. A blocking cache miss of
+	miss_penalty cycles freezes the whole pipeline.
+ */
+#include "sim.h"
+#include <string.h>
+
+//Target of j/jal is known in ID, one fetched instruction is thrown away
+#define JUMP_PENALTY		1
+
+//The stage a result is first usable from, relative to its producer's EX cycle
+#define ALU_FORWARD			1		//EX -> EX
+#define LOAD_FORWARD		2		//MEM -> EX
+#define NO_FORWARD			3		//written in WB, read in ID the same cycle
+
+//Source registers and destination of one instruction
+struct pipeline_operands
+{
+	int src[3];						//-1 for unused
+	int dest;						//-1 for none (or $zero)
+	int load;
+	int reads_hilo;
+	uint32_t hilo_latency;			//nonzero for MULT/DIV
+	int jump;						//j/jal, resolved in ID
+};
+
+struct pipeline* CreatePipeline(const struct pipeline_config* config)
+{
+	struct pipeline* pipe = calloc(1, sizeof(struct pipeline));
+	pipe->config = *config;
+	pipe->last_ex = 2;
+	return pipe;
+}
+
+static void DecodeOperands(const struct pipeline* pipe, union mips_instruction inst, struct pipeline_operands* ops)
+{
+	memset(ops, 0, sizeof(*ops));
+	ops->src[0] = ops->src[1] = ops->src[2] = -1;
+	ops->dest = -1;
+
+	switch(inst.itype.opcode)
+	{
+		case OP_RTYPE:
+			switch(inst.rtype.func)
+			{
+				case FUNC_SLL:
+				case FUNC_SRL:
+				case FUNC_SRA:
+					ops->src[0] = inst.rtype.rt;
+					ops->dest = inst.rtype.rd;
+					break;
+				case FUNC_JR:
+					ops->src[0] = inst.rtype.rs;
+					break;
+				case FUNC_SYSCALL:
+					ops->src[0] = v0;
+					ops->src[1] = a0;
+					ops->src[2] = a1;
+					ops->dest = v0;
+					break;
+				case FUNC_MFHI:
+				case FUNC_MFLO:
+					ops->reads_hilo = 1;
+					ops->dest = inst.rtype.rd;
+					break;
+				case FUNC_MULT:
+				case FUNC_MULTU:
+					ops->src[0] = inst.rtype.rs;
+					ops->src[1] = inst.rtype.rt;
+					ops->hilo_latency = pipe->config.mult_latency;
+					break;
+				case FUNC_DIV:
+				case FUNC_DIVU:
+					ops->src[0] = inst.rtype.rs;
+					ops->src[1] = inst.rtype.rt;
+					ops->hilo_latency = pipe->config.div_latency;
+					break;
+				default:
+					ops->src[0] = inst.rtype.rs;
+					ops->src[1] = inst.rtype.rt;
+					ops->dest = inst.rtype.rd;
+					break;
+			}
+			break;
+
+		case OP_BGEZ:
+			ops->src[0] = inst.itype.rs;
+			if(inst.itype.rt & 0x10)
+				ops->dest = ra;
+			break;
+		case OP_J:
+			ops->jump = 1;
+			break;
+		case OP_JAL:
+			ops->jump = 1;
+			ops->dest = ra;
+			break;
+		case OP_BEQ:
+		case OP_BNE:
+			ops->src[0] = inst.itype.rs;
+			ops->src[1] = inst.itype.rt;
+			break;
+		case OP_BLEZ:
+		case OP_BGTZ:
+			ops->src[0] = inst.itype.rs;
+			break;
+		case OP_LUI:
+			ops->dest = inst.itype.rt;
+			break;
+
+		case OP_LB:
+		case OP_LBU:
+		case OP_LH:
+		case OP_LHU:
+		case OP_LW:
+		case OP_LL:
+			ops->src[0] = inst.itype.rs;
+			ops->dest = inst.itype.rt;
+			ops->load = 1;
+			break;
+		case OP_SC:
+			ops->src[0] = inst.itype.rs;
+			ops->src[1] = inst.itype.rt;
+			ops->dest = inst.itype.rt;
+			ops->load = 1;
+			break;
+		case OP_SB:
+		case OP_SH:
+		case OP_SW:
+			ops->src[0] = inst.itype.rs;
+			ops->src[1] = inst.itype.rt;
+			break;
+
+		default:
+			ops->src[0] = inst.itype.rs;
+			ops->dest = inst.itype.rt;
+			break;
+	}
+
+	if(ops->dest == zero)
+		ops->dest = -1;
+}
+
+//Moves *t up to ready if that's later, charging the wait to reason
+static void WaitUntil(struct pipeline* pipe, uint64_t* t, uint64_t ready, int reason)
+{
+	if(ready > *t)
+	{
+		pipe->stalls[reason] += ready - *t;
+		*t = ready;
+	}
+}
+
+/**
+	@brief Advances the model by one retired instruction
+
+	@param redirected	Whether fetch had to be redirected after it: a taken branch or a jump, or with a branch
+						predictor a mispredicted branch or jr (j/jal always are)
+	@param icache_miss	Whether fetching it missed in the instruction cache
+	@param dcache_miss	Whether its load or store missed in the data cache
+ */
+void PipelineStep(struct pipeline* pipe, union mips_instruction inst, int redirected, int icache_miss,
+	int dcache_miss)
+{
+	struct pipeline_operands ops;
+	DecodeOperands(pipe, inst, &ops);
+
+	uint64_t t = pipe->last_ex + 1;
+	WaitUntil(pipe, &t, pipe->redirect, STALL_BRANCH);
+	if(icache_miss)
+		WaitUntil(pipe, &t, t + pipe->config.miss_penalty, STALL_ICACHE);
+
+	for(int i=0; i<3; i++)
+	{
+		int r = ops.src[i];
+		if(r <= 0)
+			continue;
+		WaitUntil(pipe, &t, pipe->reg_ready[r], pipe->reg_from_load[r] ? STALL_LOAD_USE : STALL_RAW);
+	}
+	if(ops.reads_hilo)
+		WaitUntil(pipe, &t, pipe->hilo_ready, STALL_MULTDIV);
+	if(ops.hilo_latency)
+	{
+		WaitUntil(pipe, &t, pipe->unit_free, STALL_MULTDIV);
+		pipe->hilo_ready = t + ops.hilo_latency;
+		pipe->unit_free = t + ops.hilo_latency;
+	}
+
+	//A data miss holds everything up in MEM, this instruction's result included
+	uint64_t delay = 0;
+	if(dcache_miss)
+	{
+		delay = pipe->config.miss_penalty;
+		pipe->stalls[STALL_DCACHE] += delay;
+	}
+
+	if(ops.dest > 0)
+	{
+		uint64_t latency = ops.load ? LOAD_FORWARD : ALU_FORWARD;
+		if(!pipe->config.forwarding)
+			latency = NO_FORWARD;
+		pipe->reg_ready[ops.dest] = t + latency + delay;
+		pipe->reg_from_load[ops.dest] = ops.load;
+	}
+
+	if(redirected)
+		pipe->redirect = t + 1 + (ops.jump ? JUMP_PENALTY : pipe->config.branch_penalty);
+	pipe->last_ex = t + delay;
+}
+
+void WritePipelineStats(FILE* fp, const struct pipeline* pipe, uint64_t inst_count)
+{
+	//MEM and WB of the last instruction
+	uint64_t cycles = pipe->last_ex + 2;
+	uint64_t total = 0;
+	for(int i=0; i<STALL_COUNT; i++)
+		total += pipe->stalls[i];
+
+	fprintf(fp, "Pipeline: 5-stage, %s, mult %u / div %u cycles, branch penalty %u, miss penalty %u\n",
+		pipe->config.forwarding ? "forwarding" : "no forwarding", pipe->config.mult_latency,
+		pipe->config.div_latency, pipe->config.branch_penalty, pipe->config.miss_penalty);
+	fprintf(fp, "Cycles: %llu\n", (long long unsigned int)cycles);
+	fprintf(fp, "CPI: %.3f\n", inst_count ? ((double)cycles / inst_count) : 0.0);
+	fprintf(fp, "Stall Cycles: %llu (RAW %llu, load-use %llu, branch %llu, mult/div %llu, icache %llu, dcache %llu)\n",
+		(long long unsigned int)total, (long long unsigned int)pipe->stalls[STALL_RAW],
+		(long long unsigned int)pipe->stalls[STALL_LOAD_USE], (long long unsigned int)pipe->stalls[STALL_BRANCH],
+		(long long unsigned int)pipe->stalls[STALL_MULTDIV], (long long unsigned int)pipe->stalls[STALL_ICACHE],
+		(long long unsigned int)pipe->stalls[STALL_DCACHE]);
+}
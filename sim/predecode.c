@@ -0,0 +1,1058 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Predecode cache: each text word is decoded once, then executed from its decoded record
+ */
+#include "sim.h"
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Handlers
+//
+// These mirror the sim* handlers in sim.c exactly, but read their operands from the predecoded record instead of
+// pulling bitfields out of the instruction word every time.
+
+static int pdBGEZ(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	if ((int32_t)ctx->regs[pi->rs] >= 0)
+		ctx->pc = pi->target;
+	else
+		ctx->pc += 4;
+	return 1;
+}
+
+static int pdBGEZAL(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	if ((int32_t)ctx->regs[pi->rs] >= 0) {
+		ctx->regs[ra] = ctx->pc + 8;
+		ctx->pc = pi->target;
+	}
+	else
+		ctx->pc += 4;
+	return 1;
+}
+
+static int pdBLTZ(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	if ((int32_t)ctx->regs[pi->rs] < 0)
+		ctx->pc = pi->target;
+	else
+		ctx->pc += 4;
+	return 1;
+}
+
+static int pdBLTZAL(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	if ((int32_t)ctx->regs[pi->rs] < 0) {
+		ctx->regs[ra] = ctx->pc + 8;
+		ctx->pc = pi->target;
+	}
+	else
+		ctx->pc += 4;
+	return 1;
+}
+
+static int pdJ(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->pc = pi->target;
+	return 1;
+}
+
+static int pdJAL(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[ra] = ctx->pc + 8;
+	ctx->pc = pi->target;
+	return 1;
+}
+
+static int pdBEQ(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	if(ctx->regs[pi->rs] == ctx->regs[pi->rt])
+		ctx->pc = pi->target;
+	else
+		ctx->pc += 4;
+	return 1;
+}
+
+static int pdBNE(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	if(ctx->regs[pi->rs] != ctx->regs[pi->rt])
+		ctx->pc = pi->target;
+	else
+		ctx->pc += 4;
+	return 1;
+}
+
+static int pdBLEZ(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	if ((int32_t)ctx->regs[pi->rs] <= 0)
+		ctx->pc = pi->target;
+	else
+		ctx->pc += 4;
+	return 1;
+}
+
+static int pdBGTZ(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	if ((int32_t)ctx->regs[pi->rs] > 0)
+		ctx->pc = pi->target;
+	else
+		ctx->pc += 4;
+	return 1;
+}
+
+//Also used for ADDIU, the reference interpreter does not trap on overflow
+static int pdADDI(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rt] = ctx->regs[pi->rs] + pi->imm;
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdSLTI(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rt] = ((int32_t)ctx->regs[pi->rs] < (int32_t)pi->imm) ? 1 : 0;
+	ctx->pc += 4;
+	return 1;
+}
+
+//Compares against the sign-extended immediate as unsigned
+static int pdSLTIU(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rt] = (ctx->regs[pi->rs] < pi->imm) ? 1 : 0;
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdANDI(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rt] = ctx->regs[pi->rs] & pi->imm;
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdORI(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rt] = ctx->regs[pi->rs] | pi->imm;
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdXORI(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rt] = ctx->regs[pi->rs] ^ pi->imm;
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdLUI(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rt] = pi->imm;
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdLB(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rt] = SIGN_EXTEND_8(FetchByteFromVirtualMemory(ctx->regs[pi->rs] + pi->imm, memory));
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdLBU(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rt] = FetchByteFromVirtualMemory(ctx->regs[pi->rs] + pi->imm, memory);
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdLH(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rt] = SIGN_EXTEND_16(FetchHalfwordFromVirtualMemory(ctx->regs[pi->rs] + pi->imm, memory));
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdLHU(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rt] = FetchHalfwordFromVirtualMemory(ctx->regs[pi->rs] + pi->imm, memory);
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdLW(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rt] = FetchWordFromVirtualMemory(ctx->regs[pi->rs] + pi->imm, memory);
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdSB(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	StoreByteToVirtualMemory(ctx->regs[pi->rs] + pi->imm, ctx->regs[pi->rt] & 0xff, memory);
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdSH(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	StoreHalfwordToVirtualMemory(ctx->regs[pi->rs] + pi->imm, ctx->regs[pi->rt] & 0xffff, memory);
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdSW(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	StoreWordToVirtualMemory(ctx->regs[pi->rs] + pi->imm, ctx->regs[pi->rt], memory);
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdSLL(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rd] = ctx->regs[pi->rt] << pi->shamt;
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdSRL(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rd] = ctx->regs[pi->rt] >> pi->shamt;
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdSRA(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rd] = (uint32_t)((int32_t)ctx->regs[pi->rt] >> pi->shamt);
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdSLLV(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rd] = ctx->regs[pi->rt] << (ctx->regs[pi->rs] & 31);
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdSRLV(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rd] = ctx->regs[pi->rt] >> (ctx->regs[pi->rs] & 31);
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdJR(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->pc = ctx->regs[pi->rs];
+	return 1;
+}
+
+static int pdSYSCALL(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	return SimulateSyscall(ctx->regs[v0], memory, ctx);
+}
+
+static int pdMFHI(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rd] = ctx->HI;
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdMFLO(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rd] = ctx->LO;
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdMULT(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	int64_t product = (int64_t)(int32_t)ctx->regs[pi->rs] * (int32_t)ctx->regs[pi->rt];
+	ctx->LO = (uint32_t)product;
+	ctx->HI = (uint32_t)((uint64_t)product >> 32);
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdMULTU(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	uint64_t product = (uint64_t)ctx->regs[pi->rs] * ctx->regs[pi->rt];
+	ctx->LO = (uint32_t)product;
+	ctx->HI = (uint32_t)(product >> 32);
+	ctx->pc += 4;
+	return 1;
+}
+
+//Dividing by zero leaves HI and LO as they were, like the hardware. Dividing by -1 negates, as in simDIV.
+static int pdDIV(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	if(ctx->regs[pi->rt] == 0)
+	{
+		ctx->pc += 4;
+		return 1;
+	}
+	if(ctx->regs[pi->rt] == 0xffffffff)
+	{
+		ctx->LO = -ctx->regs[pi->rs];
+		ctx->HI = 0;
+		ctx->pc += 4;
+		return 1;
+	}
+	ctx->LO = (uint32_t)((int32_t)ctx->regs[pi->rs] / (int32_t)ctx->regs[pi->rt]);
+	ctx->HI = (uint32_t)((int32_t)ctx->regs[pi->rs] % (int32_t)ctx->regs[pi->rt]);
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdDIVU(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	if(ctx->regs[pi->rt] == 0)
+	{
+		ctx->pc += 4;
+		return 1;
+	}
+	ctx->LO = ctx->regs[pi->rs] / ctx->regs[pi->rt];
+	ctx->HI = ctx->regs[pi->rs] % ctx->regs[pi->rt];
+	ctx->pc += 4;
+	return 1;
+}
+
+//Also used for ADDU
+static int pdADD(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rd] = ctx->regs[pi->rs] + ctx->regs[pi->rt];
+	ctx->pc += 4;
+	return 1;
+}
+
+//Also used for SUBU
+static int pdSUB(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rd] = ctx->regs[pi->rs] - ctx->regs[pi->rt];
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdAND(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rd] = ctx->regs[pi->rs] & ctx->regs[pi->rt];
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdOR(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rd] = ctx->regs[pi->rs] | ctx->regs[pi->rt];
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdXOR(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rd] = ctx->regs[pi->rs] ^ ctx->regs[pi->rt];
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdSLT(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rd] = ((int32_t)ctx->regs[pi->rs] < (int32_t)ctx->regs[pi->rt]) ? 1 : 0;
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdSLTU(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rd] = (ctx->regs[pi->rs] < ctx->regs[pi->rt]) ? 1 : 0;
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdLL(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	uint32_t address = ctx->regs[pi->rs] + pi->imm;
+	ctx->link_value = LoadLinkedWord(address, memory);
+	ctx->link_address = address;
+	ctx->link_valid = 1;
+	ctx->regs[pi->rt] = ctx->link_value;
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdSC(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	uint32_t address = ctx->regs[pi->rs] + pi->imm;
+	int stored = ctx->link_valid && (ctx->link_address == address) &&
+		StoreConditionalWord(address, ctx->link_value, ctx->regs[pi->rt], memory);
+	ctx->link_valid = 0;
+	ctx->regs[pi->rt] = stored;
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdSYNC(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	ctx->pc += 4;
+	return 1;
+}
+
+static int pdInvalidOpcode(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ConsolePrintf(&ctx->sim->console, "Invalid or unsupported instruction opcode\n");
+	return 0;
+}
+
+static int pdInvalidFunc(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ConsolePrintf(&ctx->sim->console, "Invalid or unsupported instruction func code\n");
+	return 0;
+}
+
+static int pdInvalidBranch(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	return 0;
+}
+
+//Handler for each op, indexed by predecoded_ops
+const predecoded_handler predecoded_handlers[PD_COUNT] =
+{
+	[PD_INVALID_OPCODE]	= pdInvalidOpcode,
+	[PD_INVALID_FUNC]	= pdInvalidFunc,
+	[PD_INVALID_BRANCH]	= pdInvalidBranch,
+	[PD_BGEZ]			= pdBGEZ,
+	[PD_BGEZAL]			= pdBGEZAL,
+	[PD_BLTZ]			= pdBLTZ,
+	[PD_BLTZAL]			= pdBLTZAL,
+	[PD_J]				= pdJ,
+	[PD_JAL]			= pdJAL,
+	[PD_BEQ]			= pdBEQ,
+	[PD_BNE]			= pdBNE,
+	[PD_BLEZ]			= pdBLEZ,
+	[PD_BGTZ]			= pdBGTZ,
+	[PD_ADDI]			= pdADDI,
+	[PD_SLTI]			= pdSLTI,
+	[PD_SLTIU]			= pdSLTIU,
+	[PD_ANDI]			= pdANDI,
+	[PD_ORI]			= pdORI,
+	[PD_XORI]			= pdXORI,
+	[PD_LUI]			= pdLUI,
+	[PD_LB]				= pdLB,
+	[PD_LBU]			= pdLBU,
+	[PD_LH]				= pdLH,
+	[PD_LHU]			= pdLHU,
+	[PD_LW]				= pdLW,
+	[PD_SB]				= pdSB,
+	[PD_SH]				= pdSH,
+	[PD_SW]				= pdSW,
+	[PD_SLL]			= pdSLL,
+	[PD_SRL]			= pdSRL,
+	[PD_SRA]			= pdSRA,
+	[PD_SLLV]			= pdSLLV,
+	[PD_SRLV]			= pdSRLV,
+	[PD_JR]				= pdJR,
+	[PD_SYSCALL]		= pdSYSCALL,
+	[PD_MFHI]			= pdMFHI,
+	[PD_MFLO]			= pdMFLO,
+	[PD_MULT]			= pdMULT,
+	[PD_MULTU]			= pdMULTU,
+	[PD_DIV]			= pdDIV,
+	[PD_DIVU]			= pdDIVU,
+	[PD_ADD]			= pdADD,
+	[PD_SUB]			= pdSUB,
+	[PD_AND]			= pdAND,
+	[PD_OR]				= pdOR,
+	[PD_XOR]			= pdXOR,
+	[PD_SLT]			= pdSLT,
+	[PD_SLTU]			= pdSLTU,
+	[PD_LL]				= pdLL,
+	[PD_SC]				= pdSC,
+	[PD_SYNC]			= pdSYNC
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Fused pairs
+//
+// Common two-instruction idioms run as one handler call from the record of the first word. The second word's own
+// record (always pi[1], decoded at the same time) supplies its operands, and stays valid for anything that jumps
+// straight to it. Each handler counts the first instruction itself; the interpreter loop counts the second as usual.
+// Pairs are only fused when the first doesn't write $zero, so nothing has to clear it in between.
+
+//lui + ori, what la/li expand to
+static int pdLUI_ORI(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rt] = pi->imm;
+	ctx->regs[pi[1].rt] = ctx->regs[pi[1].rs] | pi[1].imm;
+	ctx->pc += 8;
+	ctx->inst_count++;
+	return 1;
+}
+
+//lui + addiu, for addresses with the low half sign-adjusted
+static int pdLUI_ADDI(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rt] = pi->imm;
+	ctx->regs[pi[1].rt] = ctx->regs[pi[1].rs] + pi[1].imm;
+	ctx->pc += 8;
+	ctx->inst_count++;
+	return 1;
+}
+
+//slt + bne, compare and branch
+static int pdSLT_BNE(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rd] = ((int32_t)ctx->regs[pi->rs] < (int32_t)ctx->regs[pi->rt]) ? 1 : 0;
+	if(ctx->regs[pi[1].rs] != ctx->regs[pi[1].rt])
+		ctx->pc = pi[1].target;
+	else
+		ctx->pc += 8;
+	ctx->inst_count++;
+	return 1;
+}
+
+static int pdSLT_BEQ(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rd] = ((int32_t)ctx->regs[pi->rs] < (int32_t)ctx->regs[pi->rt]) ? 1 : 0;
+	if(ctx->regs[pi[1].rs] == ctx->regs[pi[1].rt])
+		ctx->pc = pi[1].target;
+	else
+		ctx->pc += 8;
+	ctx->inst_count++;
+	return 1;
+}
+
+//sltu + bne
+static int pdSLTU_BNE(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rd] = (ctx->regs[pi->rs] < ctx->regs[pi->rt]) ? 1 : 0;
+	if(ctx->regs[pi[1].rs] != ctx->regs[pi[1].rt])
+		ctx->pc = pi[1].target;
+	else
+		ctx->pc += 8;
+	ctx->inst_count++;
+	return 1;
+}
+
+static int pdSLTU_BEQ(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rd] = (ctx->regs[pi->rs] < ctx->regs[pi->rt]) ? 1 : 0;
+	if(ctx->regs[pi[1].rs] == ctx->regs[pi[1].rt])
+		ctx->pc = pi[1].target;
+	else
+		ctx->pc += 8;
+	ctx->inst_count++;
+	return 1;
+}
+
+//slti + bne
+static int pdSLTI_BNE(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rt] = ((int32_t)ctx->regs[pi->rs] < (int32_t)pi->imm) ? 1 : 0;
+	if(ctx->regs[pi[1].rs] != ctx->regs[pi[1].rt])
+		ctx->pc = pi[1].target;
+	else
+		ctx->pc += 8;
+	ctx->inst_count++;
+	return 1;
+}
+
+static int pdSLTI_BEQ(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rt] = ((int32_t)ctx->regs[pi->rs] < (int32_t)pi->imm) ? 1 : 0;
+	if(ctx->regs[pi[1].rs] == ctx->regs[pi[1].rt])
+		ctx->pc = pi[1].target;
+	else
+		ctx->pc += 8;
+	ctx->inst_count++;
+	return 1;
+}
+
+//sltiu + bne
+static int pdSLTIU_BNE(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rt] = (ctx->regs[pi->rs] < pi->imm) ? 1 : 0;
+	if(ctx->regs[pi[1].rs] != ctx->regs[pi[1].rt])
+		ctx->pc = pi[1].target;
+	else
+		ctx->pc += 8;
+	ctx->inst_count++;
+	return 1;
+}
+
+static int pdSLTIU_BEQ(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rt] = (ctx->regs[pi->rs] < pi->imm) ? 1 : 0;
+	if(ctx->regs[pi[1].rs] == ctx->regs[pi[1].rt])
+		ctx->pc = pi[1].target;
+	else
+		ctx->pc += 8;
+	ctx->inst_count++;
+	return 1;
+}
+
+//addiu + bne, the loop counter idiom
+static int pdADDI_BNE(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rt] = ctx->regs[pi->rs] + pi->imm;
+	if(ctx->regs[pi[1].rs] != ctx->regs[pi[1].rt])
+		ctx->pc = pi[1].target;
+	else
+		ctx->pc += 8;
+	ctx->inst_count++;
+	return 1;
+}
+
+//sll + addu, scaled index address arithmetic
+static int pdSLL_ADD(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[pi->rd] = ctx->regs[pi->rt] << pi->shamt;
+	ctx->regs[pi[1].rd] = ctx->regs[pi[1].rs] + ctx->regs[pi[1].rt];
+	ctx->pc += 8;
+	ctx->inst_count++;
+	return 1;
+}
+
+/**
+	@brief Picks the fused handler for a pair of adjacent decoded words, or NULL if they aren't an idiom we fuse
+ */
+predecoded_handler FusedHandler(const struct predecoded_inst* first, const struct predecoded_inst* second)
+{
+	switch(first->op)
+	{
+		case PD_LUI:
+			if( (first->rt == zero) || (second->rs != first->rt) )
+				return NULL;
+			if(second->op == PD_ORI)
+				return pdLUI_ORI;
+			if(second->op == PD_ADDI)
+				return pdLUI_ADDI;
+			return NULL;
+		case PD_SLT:
+		case PD_SLTU:
+			if(first->rd == zero)
+				return NULL;
+			if(second->op == PD_BNE)
+				return (first->op == PD_SLT) ? pdSLT_BNE : pdSLTU_BNE;
+			if(second->op == PD_BEQ)
+				return (first->op == PD_SLT) ? pdSLT_BEQ : pdSLTU_BEQ;
+			return NULL;
+		case PD_SLTI:
+		case PD_SLTIU:
+			if(first->rt == zero)
+				return NULL;
+			if(second->op == PD_BNE)
+				return (first->op == PD_SLTI) ? pdSLTI_BNE : pdSLTIU_BNE;
+			if(second->op == PD_BEQ)
+				return (first->op == PD_SLTI) ? pdSLTI_BEQ : pdSLTIU_BEQ;
+			return NULL;
+		case PD_ADDI:
+			if( (first->rt == zero) || (second->op != PD_BNE) )
+				return NULL;
+			return pdADDI_BNE;
+		case PD_SLL:
+			if( (first->rd == zero) || (second->op != PD_ADD) )
+				return NULL;
+			return pdSLL_ADD;
+		default:
+			return NULL;
+	}
+}
+
+/**
+	@brief Checks whether a record runs a fused pair rather than just its own instruction
+ */
+int IsFusedInstruction(const struct predecoded_inst* pi)
+{
+	predecoded_handler handler = __atomic_load_n(&pi->handler, __ATOMIC_ACQUIRE);
+	return (handler != NULL) && (handler != predecoded_handlers[pi->op]);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Decoding
+
+/**
+	@brief Decodes one instruction word into a predecoded record
+
+	@param pi		Record to fill in
+	@param address	Virtual address the word was fetched from (needed for branch targets)
+	@param inst		The instruction word
+ */
+void PredecodeInstruction(struct predecoded_inst* pi, uint32_t address, union mips_instruction inst)
+{
+	pi->rs = inst.rtype.rs;
+	pi->rt = inst.rtype.rt;
+	pi->rd = inst.rtype.rd;
+	pi->shamt = inst.rtype.shamt;
+	pi->imm = SIGN_EXTEND_16(inst.itype.imm);
+	pi->target = address + 4 + (pi->imm << 2);
+
+	switch(inst.itype.opcode)
+	{
+		case OP_RTYPE:
+			switch(inst.rtype.func)
+			{
+				case FUNC_SLL:
+					pi->op = PD_SLL;
+					break;
+				case FUNC_SRL:
+					pi->op = PD_SRL;
+					break;
+				case FUNC_SRA:
+					pi->op = PD_SRA;
+					break;
+				case FUNC_SLLV:
+					pi->op = PD_SLLV;
+					break;
+				case FUNC_SRLV:
+					pi->op = PD_SRLV;
+					break;
+				case FUNC_JR:
+					pi->op = PD_JR;
+					break;
+				case FUNC_SYSCALL:
+					pi->op = PD_SYSCALL;
+					break;
+				case FUNC_MFHI:
+					pi->op = PD_MFHI;
+					break;
+				case FUNC_MFLO:
+					pi->op = PD_MFLO;
+					break;
+				case FUNC_MULT:
+					pi->op = PD_MULT;
+					break;
+				case FUNC_MULTU:
+					pi->op = PD_MULTU;
+					break;
+				case FUNC_DIV:
+					pi->op = PD_DIV;
+					break;
+				case FUNC_DIVU:
+					pi->op = PD_DIVU;
+					break;
+				case FUNC_ADD:
+				case FUNC_ADDU:
+					pi->op = PD_ADD;
+					break;
+				case FUNC_SUB:
+				case FUNC_SUBU:
+					pi->op = PD_SUB;
+					break;
+				case FUNC_AND:
+					pi->op = PD_AND;
+					break;
+				case FUNC_OR:
+					pi->op = PD_OR;
+					break;
+				case FUNC_XOR:
+					pi->op = PD_XOR;
+					break;
+				case FUNC_SLT:
+					pi->op = PD_SLT;
+					break;
+				case FUNC_SLTU:
+					pi->op = PD_SLTU;
+					break;
+				case FUNC_SYNC:
+					pi->op = PD_SYNC;
+					break;
+				default:
+					pi->op = PD_INVALID_FUNC;
+					break;
+			}
+			break;
+		case OP_BGEZ: //BGEZ, BGEZAL, BLTZ, BLTZAL are selected by rt
+			switch(inst.itype.rt)
+			{
+				case 0x01:
+					pi->op = PD_BGEZ;
+					break;
+				case 0x11:
+					pi->op = PD_BGEZAL;
+					break;
+				case 0x00:
+					pi->op = PD_BLTZ;
+					break;
+				case 0x10:
+					pi->op = PD_BLTZAL;
+					break;
+				default:
+					pi->op = PD_INVALID_BRANCH;
+					break;
+			}
+			break;
+		case OP_J:
+			pi->target = (address & 0xf0000000) | (inst.jtype.addr << 2);
+			pi->op = PD_J;
+			break;
+		case OP_JAL:
+			pi->target = (address & 0xf0000000) | (inst.jtype.addr << 2);
+			pi->op = PD_JAL;
+			break;
+		case OP_BEQ:
+			pi->op = PD_BEQ;
+			break;
+		case OP_BNE:
+			pi->op = PD_BNE;
+			break;
+		case OP_BLEZ:
+			pi->op = PD_BLEZ;
+			break;
+		case OP_BGTZ:
+			pi->op = PD_BGTZ;
+			break;
+		case OP_ADDI:
+		case OP_ADDIU:
+			pi->op = PD_ADDI;
+			break;
+		case OP_SLTI:
+			pi->op = PD_SLTI;
+			break;
+		case OP_SLTIU:
+			pi->op = PD_SLTIU;
+			break;
+		case OP_ANDI:
+			pi->imm = inst.itype.imm;
+			pi->op = PD_ANDI;
+			break;
+		case OP_ORI:
+			pi->imm = inst.itype.imm;
+			pi->op = PD_ORI;
+			break;
+		case OP_XORI:
+			pi->imm = inst.itype.imm;
+			pi->op = PD_XORI;
+			break;
+		case OP_LUI:
+			pi->imm = inst.itype.imm << 16;
+			pi->op = PD_LUI;
+			break;
+		case OP_LB:
+			pi->op = PD_LB;
+			break;
+		case OP_LBU:
+			pi->op = PD_LBU;
+			break;
+		case OP_LH:
+			pi->op = PD_LH;
+			break;
+		case OP_LHU:
+			pi->op = PD_LHU;
+			break;
+		case OP_LW:
+			pi->op = PD_LW;
+			break;
+		case OP_SB:
+			pi->op = PD_SB;
+			break;
+		case OP_SH:
+			pi->op = PD_SH;
+			break;
+		case OP_SW:
+			pi->op = PD_SW;
+			break;
+		case OP_LL:
+			pi->op = PD_LL;
+			break;
+		case OP_SC:
+			pi->op = PD_SC;
+			break;
+		default:
+			pi->op = PD_INVALID_OPCODE;
+			break;
+	}
+	
+	__atomic_store_n(&pi->handler, predecoded_handlers[pi->op], __ATOMIC_RELEASE);
+}
+
+/**
+	@brief Checks for ALU ops whose destination is $zero.
+
+	The interpreters clear $zero before every instruction so such writes are never visible; the block engine and JIT
+	drop them instead. Loads are left alone since they can still fault.
+ */
+int WritesOnlyZero(struct predecoded_inst* pi)
+{
+	switch(pi->op)
+	{
+		case PD_SLL:
+		case PD_SRL:
+		case PD_SRA:
+		case PD_SLLV:
+		case PD_SRLV:
+		case PD_MFHI:
+		case PD_MFLO:
+		case PD_ADD:
+		case PD_SUB:
+		case PD_AND:
+		case PD_OR:
+		case PD_XOR:
+		case PD_SLT:
+		case PD_SLTU:
+			return pi->rd == zero;
+		case PD_ADDI:
+		case PD_SLTI:
+		case PD_SLTIU:
+		case PD_ANDI:
+		case PD_ORI:
+		case PD_XORI:
+		case PD_LUI:
+			return pi->rt == zero;
+		default:
+			return 0;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Cache lookup and invalidation
+
+//Decodes the word at a region offset into its record
+static void DecodeWord(struct virtual_mem_region* region, uint32_t offset)
+{
+	union mips_instruction inst;
+	inst.word = region->data[offset / 4];
+	PredecodeInstruction(&region->decoded[offset / 4], region->vaddr + offset, inst);
+	__atomic_store_n(&region->decoded_pages[offset >> VM_PAGE_SHIFT], 1, __ATOMIC_RELAXED);
+}
+
+/**
+	@brief Decodes the word at a region offset into its cache entry (allocating the cache first if this is the
+	first time we execute from the region), fused with the following word if they make a pair we fuse
+
+	With several harts this takes the memory lock. Anyone can be reading the cache meanwhile, so the cache pointer
+	and each handler are only published once what they point at is complete.
+ */
+static void DecodeCached(struct virtual_memory* memory, struct virtual_mem_region* region, uint32_t offset)
+{
+	if(memory->shared)
+		pthread_mutex_lock(&memory->lock);
+	
+	if(region->decoded == NULL)
+	{
+		region->decoded_pages = calloc((region->len + VM_PAGE_SIZE - 1) >> VM_PAGE_SHIFT, 1);
+		__atomic_store_n(&region->decoded, calloc((region->len + 3) / 4, sizeof(struct predecoded_inst)),
+			__ATOMIC_RELEASE);
+	}
+	
+	//Another hart may have got here first
+	struct predecoded_inst* pi = &region->decoded[offset / 4];
+	if(__atomic_load_n(&pi->handler, __ATOMIC_ACQUIRE) == NULL)
+	{
+		DecodeWord(region, offset);
+		memory->decoded_new = 1;
+
+		//Try to fuse with the following word, which gets decoded now too (and marks its page, so a store to it
+		//finds this record)
+		if(offset + 4 < region->len)
+		{
+			if(__atomic_load_n(&pi[1].handler, __ATOMIC_ACQUIRE) == NULL)
+				DecodeWord(region, offset + 4);
+			predecoded_handler fused = FusedHandler(pi, pi + 1);
+			if(fused != NULL)
+				__atomic_store_n(&pi->handler, fused, __ATOMIC_RELEASE);
+		}
+		
+		//Breakpoints set on either word point it at the debugger again
+		if(memory->sim->debugger != NULL)
+			PatchBreakpoints(memory->sim->debugger, region, offset);
+	}
+	
+	if(memory->shared)
+		pthread_mutex_unlock(&memory->lock);
+}
+
+/**
+	@brief Returns the predecoded record for the instruction at an address, decoding it on first use
+
+	The record's handler may run a fused pair starting at this word. Loops that need to see every instruction on
+	its own call predecoded_handlers[pi->op] instead.
+
+	@param hint		Region the previous fetch came from. Checked first so straight-line code and loops never walk
+					the region list; updated whenever the fetch lands somewhere else.
+
+	Segfault and alignment reporting is identical to FetchWordFromVirtualMemory().
+ */
+struct predecoded_inst* FetchPredecodedInstruction(uint32_t address, struct virtual_memory* memory, struct virtual_mem_region** hint)
+{
+	struct virtual_mem_region* region = *hint;
+
+	//Same region as last time? This also catches address < vaddr since the subtraction wraps
+	if( (region == NULL) || (address - region->vaddr >= region->len) )
+	{
+		//Traverse the linked list until we find the range of interest
+		region = __atomic_load_n(&memory->regions, __ATOMIC_ACQUIRE);
+		for(; region != NULL; region = region->next)
+		{
+			if( (address >= region->vaddr) && (address < (region->vaddr + region->len)) )
+				break;
+		}
+
+		if(region == NULL)
+		{
+			ConsolePrintf(&memory->sim->console, "SEGFAULT: attempted to read word from nonexistent virtual address %08x\n", address);
+			HaltSimulator(memory->sim, HALT_FAULT);
+		}
+		*hint = region;
+	}
+
+	//Align check
+	uint32_t offset = address - region->vaddr;
+	if(offset & 3)
+	{
+		ConsolePrintf(&memory->sim->console, "SEGFAULT: address %08x is not aligned\n", address);
+		HaltSimulator(memory->sim, HALT_FAULT);
+	}
+
+	struct predecoded_inst* decoded = __atomic_load_n(&region->decoded, __ATOMIC_ACQUIRE);
+	if( (decoded == NULL) || (__atomic_load_n(&decoded[offset / 4].handler, __ATOMIC_ACQUIRE) == NULL) )
+	{
+		DecodeCached(memory, region, offset);
+		decoded = region->decoded;
+	}
+	return &decoded[offset / 4];
+}
+
+/**
+	@brief Called after a word at the given region offset has been overwritten
+
+	Pages without any decoded entries return after a single byte check. On a cached text page only the entry for the
+	modified word (and a fused pair ending at it) is dropped, so data sharing a page with code doesn't keep forcing the rest of the page to re-decode.
+	Overwriting a word that really was decoded also flags the address space so block caches get flushed.
+ */
+void InvalidatePredecodedWord(struct virtual_memory* memory, struct virtual_mem_region* region, uint32_t offset)
+{
+	if(!__atomic_load_n(&region->decoded_pages[offset >> VM_PAGE_SHIFT], __ATOMIC_RELAXED))
+		return;
+	
+	struct predecoded_inst* pi = &region->decoded[offset / 4];
+	if(__atomic_load_n(&pi->handler, __ATOMIC_RELAXED) != NULL)
+	{
+		__atomic_store_n(&pi->handler, NULL, __ATOMIC_RELAXED);
+		__atomic_store_n(&memory->code_dirty, 1, __ATOMIC_RELAXED);
+	}
+
+	//A pair fused into the previous word executes this one as well
+	if( (offset != 0) && IsFusedInstruction(pi - 1) )
+		__atomic_store_n(&pi[-1].handler, NULL, __ATOMIC_RELAXED);
+}
+
+/**
+	@brief Drops every decoded entry on a page whose contents were just replaced wholesale (and a fused pair running
+	into it from the page before), flagging block caches for a flush if there were any
+ */
+void ForgetPredecodedPage(struct virtual_memory* memory, struct virtual_mem_region* region, uint32_t page)
+{
+	if( (region->decoded_pages == NULL) || !region->decoded_pages[page])
+		return;
+
+	uint32_t first = (page << VM_PAGE_SHIFT) / 4;
+	uint32_t last = ((region->len + 3) / 4 < first + VM_PAGE_SIZE / 4) ? (region->len + 3) / 4 : first + VM_PAGE_SIZE / 4;
+	memset(&region->decoded[first], 0, (last - first) * sizeof(struct predecoded_inst));
+	if( (first != 0) && IsFusedInstruction(&region->decoded[first - 1]) )
+		region->decoded[first - 1].handler = NULL;
+	region->decoded_pages[page] = 0;
+	memory->code_dirty = 1;
+}
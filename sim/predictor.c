@@ -0,0 +1,221 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Branch predictor models: static, BTFN, bimodal and gshare direction predictors, and a return address stack
+ */
+#include "sim.h"
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Direction predictors
+
+static int PredictNotTaken(struct predictor* pred, uint32_t pc, uint32_t target)
+{
+	return 0;
+}
+
+static int PredictBackwardTaken(struct predictor* pred, uint32_t pc, uint32_t target)
+{
+	return target <= pc;
+}
+
+static void UpdateNothing(struct predictor* pred, uint32_t pc, int taken)
+{
+}
+
+static uint32_t BimodalIndex(struct predictor* pred, uint32_t pc)
+{
+	return (pc >> 2) & pred->mask;
+}
+
+static uint32_t GshareIndex(struct predictor* pred, uint32_t pc)
+{
+	return ((pc >> 2) ^ pred->history) & pred->mask;
+}
+
+//Counters 2 and 3 predict taken
+static void UpdateCounter(uint8_t* counter, int taken)
+{
+	if(taken && (*counter < 3))
+		(*counter)++;
+	else if(!taken && (*counter > 0))
+		(*counter)--;
+}
+
+static int PredictBimodal(struct predictor* pred, uint32_t pc, uint32_t target)
+{
+	return pred->counters[BimodalIndex(pred, pc)] >= 2;
+}
+
+static void UpdateBimodal(struct predictor* pred, uint32_t pc, int taken)
+{
+	UpdateCounter(&pred->counters[BimodalIndex(pred, pc)], taken);
+}
+
+static int PredictGshare(struct predictor* pred, uint32_t pc, uint32_t target)
+{
+	return pred->counters[GshareIndex(pred, pc)] >= 2;
+}
+
+static void UpdateGshare(struct predictor* pred, uint32_t pc, int taken)
+{
+	UpdateCounter(&pred->counters[GshareIndex(pred, pc)], taken);
+	pred->history = ((pred->history << 1) | (taken ? 1 : 0)) & pred->mask;
+}
+
+//Indexed by predictors
+static const struct predictor_ops predictor_ops[] =
+{
+	[PREDICTOR_STATIC] = {"static not-taken", PredictNotTaken, UpdateNothing},
+	[PREDICTOR_BTFN] = {"backward taken, forward not taken", PredictBackwardTaken, UpdateNothing},
+	[PREDICTOR_BIMODAL] = {"bimodal", PredictBimodal, UpdateBimodal},
+	[PREDICTOR_GSHARE] = {"gshare", PredictGshare, UpdateGshare}
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Setup
+
+/**
+	@brief Parses a predictor name, optionally followed by :bits for the table size, e.g. gshare:14
+
+	Returns 0 if it's not one we know.
+ */
+int ParsePredictorConfig(const char* text, struct predictor_config* config)
+{
+	config->bits = 12;
+	size_t len = strcspn(text, ":");
+	if( (len == 6) && !strncmp(text, "static", 6) )
+		config->kind = PREDICTOR_STATIC;
+	else if( (len == 4) && !strncmp(text, "btfn", 4) )
+		config->kind = PREDICTOR_BTFN;
+	else if( (len == 7) && !strncmp(text, "bimodal", 7) )
+		config->kind = PREDICTOR_BIMODAL;
+	else if( (len == 6) && !strncmp(text, "gshare", 6) )
+		config->kind = PREDICTOR_GSHARE;
+	else
+		return 0;
+
+	if(text[len] == ':')
+	{
+		char* end;
+		config->bits = strtoul(text + len + 1, &end, 10);
+		if( (*end != '\0') || (config->bits < 1) || (config->bits > 24) )
+			return 0;
+	}
+	else if(text[len] != '\0')
+		return 0;
+	return 1;
+}
+
+struct predictor* CreatePredictor(const struct predictor_config* config)
+{
+	struct predictor* pred = calloc(1, sizeof(struct predictor));
+	pred->ops = &predictor_ops[config->kind];
+	pred->config = *config;
+
+	//Counters start weakly not taken
+	pred->mask = (1u << config->bits) - 1;
+	pred->counters = malloc(pred->mask + 1);
+	memset(pred->counters, 1, pred->mask + 1);
+
+	if(config->ras_depth != 0)
+		pred->ras = calloc(config->ras_depth, sizeof(uint32_t));
+	InitPcStats(&pred->pcs);
+	return pred;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Events
+
+/**
+	@brief Predicts and resolves a conditional branch. Returns 1 if it was mispredicted.
+ */
+int PredictBranch(struct predictor* pred, uint32_t pc, uint32_t target, int taken)
+{
+	int wrong = (pred->ops->predict(pred, pc, target) != taken);
+	pred->ops->update(pred, pc, taken);
+
+	pred->branches++;
+	if(wrong)
+	{
+		pred->mispredicts++;
+		GetPcStat(&pred->pcs, pc)->misses++;
+	}
+	return wrong;
+}
+
+/**
+	@brief Remembers the return address of a call (jal, or a taken bgezal/bltzal)
+ */
+void PushReturn(struct predictor* pred, uint32_t address)
+{
+	if(pred->ras == NULL)
+		return;
+	pred->ras[pred->ras_top] = address;
+	pred->ras_top = (pred->ras_top + 1) % pred->config.ras_depth;
+	if(pred->ras_count < pred->config.ras_depth)
+		pred->ras_count++;
+}
+
+/**
+	@brief Predicts a jr ra from the return address stack. Returns 1 if it was mispredicted (always, without one).
+ */
+int PredictReturn(struct predictor* pred, uint32_t pc, uint32_t target)
+{
+	int wrong = 1;
+	if(pred->ras_count != 0)
+	{
+		pred->ras_top = (pred->ras_top + pred->config.ras_depth - 1) % pred->config.ras_depth;
+		pred->ras_count--;
+		wrong = (pred->ras[pred->ras_top] != target);
+	}
+
+	pred->returns++;
+	if(wrong)
+	{
+		pred->return_mispredicts++;
+		GetPcStat(&pred->pcs, pc)->misses++;
+	}
+	return wrong;
+}
+
+/**
+	@brief Any other jr. There's no target buffer, so these always count as mispredicted.
+ */
+int PredictIndirect(struct predictor* pred, uint32_t pc)
+{
+	pred->indirect++;
+	GetPcStat(&pred->pcs, pc)->misses++;
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Report
+
+void WritePredictorStats(FILE* fp, const struct predictor* pred)
+{
+	fprintf(fp, "Branch Predictor: %s", pred->ops->name);
+	if( (pred->config.kind == PREDICTOR_BIMODAL) || (pred->config.kind == PREDICTOR_GSHARE) )
+		fprintf(fp, ", %u counters", pred->mask + 1);
+	if(pred->config.kind == PREDICTOR_GSHARE)
+		fprintf(fp, ", %u bits of history", pred->config.bits);
+	fprintf(fp, ", %u entry return stack\n", pred->config.ras_depth);
+
+	fprintf(fp, "Branches: %llu, mispredicted %llu (%.2f%%)\n", (long long unsigned int)pred->branches,
+		(long long unsigned int)pred->mispredicts, pred->branches ? (100.0 * pred->mispredicts / pred->branches) : 0.0);
+	fprintf(fp, "Returns: %llu, mispredicted %llu (%.2f%%)\n", (long long unsigned int)pred->returns,
+		(long long unsigned int)pred->return_mispredicts,
+		pred->returns ? (100.0 * pred->return_mispredicts / pred->returns) : 0.0);
+	fprintf(fp, "Other Indirect Jumps: %llu\n", (long long unsigned int)pred->indirect);
+	WritePcStats(fp, &pred->pcs, "Mispredictions by PC", MODEL_TOP_PCS);
+}
+
+void FreePredictor(struct predictor* pred)
+{
+	if(pred == NULL)
+		return;
+	free(pred->counters);
+	free(pred->ras);
+	FreePcStats(&pred->pcs);
+	free(pred);
+}
@@ -0,0 +1,347 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Execution profiler: per-opcode, per-PC and per-function instruction counts
+
+	Profiling runs on its own copy of the interpreter loop, so the normal engines pay nothing for it.
+ */
+#include "sim.h"
+#include <string.h>
+
+//Mnemonics for the report, by encoding. Anything missing is printed as a raw field value.
+static const char* opcode_names[64] =
+{
+	[OP_J] = "j", [OP_JAL] = "jal", [OP_BEQ] = "beq", [OP_BNE] = "bne", [OP_BLEZ] = "blez", [OP_BGTZ] = "bgtz",
+	[OP_ADDI] = "addi", [OP_ADDIU] = "addiu", [OP_SLTI] = "slti", [OP_SLTIU] = "sltiu", [OP_ANDI] = "andi",
+	[OP_ORI] = "ori", [OP_XORI] = "xori", [OP_LUI] = "lui", [OP_LB] = "lb", [OP_LH] = "lh", [OP_LW] = "lw",
+	[OP_LBU] = "lbu", [OP_LHU] = "lhu", [OP_SB] = "sb", [OP_SH] = "sh", [OP_SW] = "sw", [OP_LL] = "ll", [OP_SC] = "sc"
+};
+
+static const char* function_names[64] =
+{
+	[FUNC_SLL] = "sll", [FUNC_SRL] = "srl", [FUNC_SRA] = "sra", [FUNC_SLLV] = "sllv", [FUNC_SRLV] = "srlv",
+	[FUNC_JR] = "jr", [FUNC_SYSCALL] = "syscall", [FUNC_MFHI] = "mfhi", [FUNC_MFLO] = "mflo", [FUNC_MULT] = "mult",
+	[FUNC_MULTU] = "multu", [FUNC_DIV] = "div", [FUNC_DIVU] = "divu", [FUNC_ADD] = "add", [FUNC_ADDU] = "addu",
+	[FUNC_SUB] = "sub", [FUNC_SUBU] = "subu", [FUNC_AND] = "and", [FUNC_OR] = "or", [FUNC_XOR] = "xor",
+	[FUNC_SLT] = "slt", [FUNC_SLTU] = "sltu", [FUNC_SYNC] = "sync"
+};
+
+static const char* regimm_names[32] =
+{
+	[0x00] = "bltz", [0x01] = "bgez", [0x10] = "bltzal", [0x11] = "bgezal"
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Collection
+
+/**
+	@brief Finds (or makes) the per-PC counters for a region
+ */
+static struct profile_region* ProfileRegion(struct profile* prof, struct virtual_mem_region* region)
+{
+	struct profile_region* pr;
+	for(pr = prof->regions; pr != NULL; pr = pr->next)
+	{
+		if(pr->region == region)
+			return pr;
+	}
+
+	pr = calloc(1, sizeof(struct profile_region));
+	pr->region = region;
+	pr->counts = calloc((region->len + 3) / 4, sizeof(uint64_t));
+	pr->next = prof->regions;
+	prof->regions = pr;
+	return pr;
+}
+
+/**
+	@brief Runs the predecoded interpreter, counting every instruction it retires
+
+	Same semantics and instruction count as RunInterpreter, but also stops once a budgeted run (see ContinueProgram)
+	is used up.
+ */
+void RunProfiler(struct virtual_memory* memory, struct context* ctx)
+{
+	struct profile* prof = ctx->sim->profile;
+
+	// Region the last instruction was fetched from, and its counters
+	struct virtual_mem_region* text = NULL;
+	struct profile_region* counts = NULL;
+
+	while(ctx->inst_count < ctx->sim->stop_at)
+	{
+		uint32_t pc = ctx->pc;
+		struct predecoded_inst* pi = FetchPredecodedInstruction(pc, memory, &text);
+		if( (counts == NULL) || (counts->region != text) )
+			counts = ProfileRegion(prof, text);
+
+		//Look at the encoding before running it, the instruction may overwrite itself
+		uint32_t offset = (pc - text->vaddr) / 4;
+		union mips_instruction inst;
+		inst.word = text->data[offset];
+
+		ctx->regs[zero] = 0;
+		if(!predecoded_handlers[pi->op](pi, memory, ctx))
+			break;
+		ctx->inst_count++;
+
+		counts->counts[offset]++;
+		switch(inst.itype.opcode)
+		{
+			case OP_RTYPE:
+				prof->functions[inst.rtype.func]++;
+				break;
+			case OP_BGEZ:
+				prof->regimm[inst.itype.rt]++;
+				break;
+			default:
+				prof->opcodes[inst.itype.opcode]++;
+				break;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Symbols
+
+/**
+	@brief Remembers a function from the ELF symbol table, in any order (WriteProfile sorts them)
+ */
+void AddProfileSymbol(struct profile* prof, uint32_t addr, uint32_t size, const char* name)
+{
+	//Grow by doubling from 64, so the array is full whenever the count is a power of two from there on
+	size_t n = prof->symbol_count;
+	if( (n == 0) || ( (n >= 64) && ((n & (n - 1)) == 0) ) )
+		prof->symbols = realloc(prof->symbols, (n ? n * 2 : 64) * sizeof(struct elf_symbol));
+
+	prof->symbols[n].addr = addr;
+	prof->symbols[n].size = size;
+	prof->symbols[n].name = strdup(name);
+	prof->symbol_count = n + 1;
+}
+
+static int CompareSymbols(const void* a, const void* b)
+{
+	const struct elf_symbol* x = (const struct elf_symbol*)a;
+	const struct elf_symbol* y = (const struct elf_symbol*)b;
+	if(x->addr != y->addr)
+		return (x->addr < y->addr) ? -1 : 1;
+
+	//Of several names for one address, list the one that knows its size first
+	return (x->size > y->size) ? -1 : (x->size < y->size);
+}
+
+/**
+	@brief Finds the index of the function an address belongs to, or -1 if none does
+ */
+static long FindSymbol(const struct profile* prof, uint32_t addr)
+{
+	//Last symbol starting at or before addr
+	size_t lo = 0;
+	size_t hi = prof->symbol_count;
+	while(lo < hi)
+	{
+		size_t mid = (lo + hi) / 2;
+		if(prof->symbols[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if(lo == 0)
+		return -1;
+
+	//Back up over aliases to the first (best) name for that address
+	long i = lo - 1;
+	while( (i > 0) && (prof->symbols[i-1].addr == prof->symbols[i].addr) )
+		i--;
+
+	const struct elf_symbol* sym = &prof->symbols[i];
+	if( (sym->size != 0) && (addr - sym->addr >= sym->size) )
+		return -1;
+	return i;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Report
+
+//One line of a report table
+struct profile_entry
+{
+	char name[64];
+	uint32_t pc;
+	uint64_t count;
+};
+
+static int CompareEntries(const void* a, const void* b)
+{
+	const struct profile_entry* x = (const struct profile_entry*)a;
+	const struct profile_entry* y = (const struct profile_entry*)b;
+	if(x->count != y->count)
+		return (x->count > y->count) ? -1 : 1;
+	return (x->pc > y->pc) - (x->pc < y->pc);
+}
+
+static void AddEntry(struct profile_entry* entries, size_t* n, uint64_t count, const char* name,
+	const char* kind, unsigned int field)
+{
+	if(count == 0)
+		return;
+
+	struct profile_entry* e = &entries[(*n)++];
+	e->pc = 0;
+	e->count = count;
+	if(name != NULL)
+		snprintf(e->name, sizeof(e->name), "%s", name);
+	else
+		snprintf(e->name, sizeof(e->name), "%s %02x", kind, field);
+}
+
+static double Percent(uint64_t count, uint64_t total)
+{
+	return total ? (100.0 * count / total) : 0.0;
+}
+
+/**
+	@brief Writes the instruction mix, the hottest PCs and the per-function totals, each sorted hottest first
+ */
+void WriteProfile(struct simulator* sim)
+{
+	struct profile* prof = sim->profile;
+	if( (prof == NULL) || (sim->options.profile_path == NULL) )
+		return;
+
+	FILE* fp = fopen(sim->options.profile_path, "w");
+	if(fp == NULL)
+	{
+		ConsolePrintf(&sim->console, "failed to write profile to %s\n", sim->options.profile_path);
+		return;
+	}
+
+	qsort(prof->symbols, prof->symbol_count, sizeof(struct elf_symbol), CompareSymbols);
+
+	//Instruction mix
+	struct profile_entry mix[64 + 64 + 32];
+	size_t mix_count = 0;
+	uint64_t total = 0;
+	for(unsigned int i=0; i<64; i++)
+	{
+		if( (i != OP_RTYPE) && (i != OP_BGEZ) )
+			AddEntry(mix, &mix_count, prof->opcodes[i], opcode_names[i], "opcode", i);
+		AddEntry(mix, &mix_count, prof->functions[i], function_names[i], "function", i);
+		total += prof->opcodes[i] + prof->functions[i];
+	}
+	for(unsigned int i=0; i<32; i++)
+	{
+		AddEntry(mix, &mix_count, prof->regimm[i], regimm_names[i], "regimm", i);
+		total += prof->regimm[i];
+	}
+	qsort(mix, mix_count, sizeof(struct profile_entry), CompareEntries);
+
+	fprintf(fp, "%llu instructions\n\nInstruction mix:\n", (long long unsigned int)total);
+	for(size_t i=0; i<mix_count; i++)
+		fprintf(fp, "    %-12s %14llu  %6.2f%%\n", mix[i].name, (long long unsigned int)mix[i].count,
+			Percent(mix[i].count, total));
+
+	//Every PC that ran, and the functions they belong to
+	size_t pc_count = 0;
+	for(struct profile_region* pr = prof->regions; pr != NULL; pr = pr->next)
+	{
+		for(uint32_t i=0; i<(pr->region->len + 3) / 4; i++)
+			pc_count += (pr->counts[i] != 0);
+	}
+	struct profile_entry* pcs = calloc(pc_count + 1, sizeof(struct profile_entry));
+	uint64_t* function_counts = calloc(prof->symbol_count + 1, sizeof(uint64_t));
+	uint64_t unknown = 0;
+	size_t n = 0;
+	for(struct profile_region* pr = prof->regions; pr != NULL; pr = pr->next)
+	{
+		for(uint32_t i=0; i<(pr->region->len + 3) / 4; i++)
+		{
+			if(pr->counts[i] == 0)
+				continue;
+
+			struct profile_entry* e = &pcs[n++];
+			e->pc = pr->region->vaddr + i*4;
+			e->count = pr->counts[i];
+
+			long sym = FindSymbol(prof, e->pc);
+			if(sym < 0)
+			{
+				snprintf(e->name, sizeof(e->name), "?");
+				unknown += e->count;
+			}
+			else
+			{
+				snprintf(e->name, sizeof(e->name), "%s+0x%x", prof->symbols[sym].name, e->pc - prof->symbols[sym].addr);
+				function_counts[sym] += e->count;
+			}
+		}
+	}
+	qsort(pcs, pc_count, sizeof(struct profile_entry), CompareEntries);
+
+	fprintf(fp, "\nHottest PCs:\n");
+	for(size_t i=0; (i<pc_count) && (i<PROFILE_HOT_PCS); i++)
+		fprintf(fp, "    %08x %14llu  %6.2f%%  %s\n", pcs[i].pc, (long long unsigned int)pcs[i].count,
+			Percent(pcs[i].count, total), pcs[i].name);
+
+	//Functions, reusing the PC table
+	n = 0;
+	for(size_t i=0; i<prof->symbol_count; i++)
+	{
+		if(function_counts[i] == 0)
+			continue;
+		pcs[n].pc = prof->symbols[i].addr;
+		pcs[n].count = function_counts[i];
+		snprintf(pcs[n].name, sizeof(pcs[n].name), "%s", prof->symbols[i].name);
+		n++;
+	}
+	if(unknown != 0)
+	{
+		pcs[n].pc = 0;
+		pcs[n].count = unknown;
+		snprintf(pcs[n].name, sizeof(pcs[n].name), "(no symbol)");
+		n++;
+	}
+	qsort(pcs, n, sizeof(struct profile_entry), CompareEntries);
+
+	fprintf(fp, "\nFunctions:\n");
+	for(size_t i=0; i<n; i++)
+		fprintf(fp, "    %-24s %14llu  %6.2f%%\n", pcs[i].name, (long long unsigned int)pcs[i].count,
+			Percent(pcs[i].count, total));
+
+	free(function_counts);
+	free(pcs);
+	fclose(fp);
+}
+
+/**
+	@brief Zeroes every count (and forgets the regions they were for), keeping the symbol table
+ */
+void ClearProfile(struct profile* prof)
+{
+	if(prof == NULL)
+		return;
+
+	while(prof->regions != NULL)
+	{
+		struct profile_region* next = prof->regions->next;
+		free(prof->regions->counts);
+		free(prof->regions);
+		prof->regions = next;
+	}
+	memset(prof->opcodes, 0, sizeof(prof->opcodes));
+	memset(prof->functions, 0, sizeof(prof->functions));
+	memset(prof->regimm, 0, sizeof(prof->regimm));
+}
+
+void FreeProfile(struct profile* prof)
+{
+	if(prof == NULL)
+		return;
+
+	ClearProfile(prof);
+	for(size_t i=0; i<prof->symbol_count; i++)
+		free(prof->symbols[i].name);
+	free(prof->symbols);
+	free(prof);
+}
@@ -0,0 +1,499 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Server mode: runs jobs sent over a Unix socket, keeping loaded programs by content for the next job that
+	sends the same ELF
+ */
+#include "sim.h"
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//Longest request line accepted
+#define SERVE_LINE_MAX		4096
+
+//Largest ELF or input a job can send
+#define SERVE_DATA_MAX		(256u << 20)
+
+//Loaded programs kept for later jobs (more if that many jobs are running at once)
+#define SERVE_CACHE_MAX		32
+
+/**
+	@brief A simulator with an ELF loaded and snapshotted, ready to run it from the start, and the bytes it came from
+ */
+struct serve_image
+{
+	uint64_t hash;					//of elf, see HashBytes
+	uint8_t* elf;
+	size_t len;
+	char* name;						//what the simulator's messages call the program
+	struct simulator* sim;
+	int busy;						//a job is running it
+	uint64_t last_used;				//cache tick when it was last handed back, for eviction
+	struct serve_image* next;
+};
+
+/**
+	@brief Every image the server holds, busy or not. Several idle ones can have the same bytes, when jobs for the
+	same program ran at the same time.
+ */
+struct serve_cache
+{
+	pthread_mutex_t lock;
+	struct serve_image* images;
+	int count;
+	uint64_t tick;
+	const struct sim_options* options;
+};
+
+/**
+	@brief One request: the ELF (read from a path, or sent inline), console input and instruction budget
+ */
+struct serve_job
+{
+	char* name;
+	uint8_t* elf;
+	size_t elf_len;
+	uint8_t* input;
+	size_t input_len;
+	uint64_t budget;				//0 for none
+};
+
+struct serve_connection
+{
+	struct serve_cache* cache;
+	int fd;
+};
+
+//FNV-1a
+static uint64_t HashBytes(const uint8_t* data, size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for(size_t i=0; i<len; i++)
+		hash = (hash ^ data[i]) * 0x100000001b3ull;
+	return hash;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Image cache
+
+/**
+	@brief Claims an idle image of exactly these bytes, or returns NULL if there isn't one
+ */
+static struct serve_image* TakeImage(struct serve_cache* cache, uint64_t hash, const uint8_t* elf, size_t len)
+{
+	pthread_mutex_lock(&cache->lock);
+	struct serve_image* image = cache->images;
+	for(; image != NULL; image = image->next)
+	{
+		if( !image->busy && (image->hash == hash) && (image->len == len) && !memcmp(image->elf, elf, len) )
+		{
+			image->busy = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return image;
+}
+
+/**
+	@brief Loads a job's ELF into a new simulator writing messages to out, adding it to the cache as busy if it loaded
+
+	Takes over the job's copy of the ELF. If the load failed, the simulator has finished with HALT_FAULT.
+ */
+static struct serve_image* NewImage(struct serve_cache* cache, struct serve_job* job, uint64_t hash, FILE* out)
+{
+	struct serve_image* image = calloc(1, sizeof(struct serve_image));
+	image->hash = hash;
+	image->elf = job->elf;
+	image->len = job->elf_len;
+	image->name = strdup(job->name);
+	image->busy = 1;
+	job->elf = NULL;
+
+	image->sim = malloc(sizeof(struct simulator));
+	InitSimulator(image->sim, cache->options, out, NULL, NULL);
+	if(LoadProgramImage(image->sim, image->name, image->elf, image->len))
+		TakeSnapshot(image->sim);
+
+	//A program that couldn't load (or be snapshotted) is only good for this one job
+	if(image->sim->snapshot != NULL)
+	{
+		pthread_mutex_lock(&cache->lock);
+		image->next = cache->images;
+		cache->images = image;
+		cache->count++;
+		pthread_mutex_unlock(&cache->lock);
+	}
+	return image;
+}
+
+static void FreeImage(struct serve_image* image)
+{
+	FreeSimulator(image->sim);
+	free(image->sim);
+	free(image->elf);
+	free(image->name);
+	free(image);
+}
+
+/**
+	@brief Resets an image for the next job and makes it available, first evicting the least recently used idle
+	images if there are too many
+ */
+static void ReturnImage(struct serve_cache* cache, struct serve_image* image)
+{
+	static const uint8_t no_input[1];
+	SetInputBuffer(&image->sim->in, no_input, 0);
+	ConsoleRedirect(&image->sim->console, stdout);
+	if( (image->sim->snapshot == NULL) || !RestartProgram(image->sim) )
+	{
+		FreeImage(image);
+		return;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	image->busy = 0;
+	image->last_used = ++cache->tick;
+
+	struct serve_image* evicted = NULL;
+	while(cache->count > SERVE_CACHE_MAX)
+	{
+		struct serve_image** oldest = NULL;
+		for(struct serve_image** p = &cache->images; *p != NULL; p = &(*p)->next)
+		{
+			if( !(*p)->busy && ( (oldest == NULL) || ((*p)->last_used < (*oldest)->last_used) ) )
+				oldest = p;
+		}
+		if(oldest == NULL)
+			break;
+
+		struct serve_image* victim = *oldest;
+		*oldest = victim->next;
+		victim->next = evicted;
+		evicted = victim;
+		cache->count--;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	while(evicted != NULL)
+	{
+		struct serve_image* next = evicted->next;
+		FreeImage(evicted);
+		evicted = next;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Protocol
+
+//Reads exactly len bytes into a new buffer, NULL if the connection ends first
+static uint8_t* ReadData(FILE* in, size_t len)
+{
+	uint8_t* data = malloc(len ? len : 1);
+	if(fread(data, 1, len, in) != len)
+	{
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
+//Reads a whole file into a new buffer, NULL if it can't be
+static uint8_t* ReadFile(const char* path, size_t* len)
+{
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+	struct stat st;
+	if( (fstat(fd, &st) != 0) || (st.st_size > SERVE_DATA_MAX) )
+	{
+		close(fd);
+		return NULL;
+	}
+
+	uint8_t* data = malloc(st.st_size ? st.st_size : 1);
+	size_t got = 0;
+	while(got < (size_t)st.st_size)
+	{
+		ssize_t n = read(fd, data + got, st.st_size - got);
+		if(n <= 0)
+			break;
+		got += n;
+	}
+	close(fd);
+	if(got != (size_t)st.st_size)
+	{
+		free(data);
+		return NULL;
+	}
+	*len = got;
+	return data;
+}
+
+static int ParseCount(const char* s, uint64_t* value)
+{
+	char* end;
+	errno = 0;
+	*value = strtoull(s, &end, 10);
+	return (s[0] >= '0') && (s[0] <= '9') && (*end == '\0') && (errno == 0);
+}
+
+static void FreeJob(struct serve_job* job)
+{
+	free(job->name);
+	free(job->elf);
+	free(job->input);
+	memset(job, 0, sizeof(*job));
+}
+
+/**
+	@brief Reads one request, see the README for the format
+
+	Returns 1 for a job, 0 if the connection ended (or stopped making sense) and -1, setting error, for a request
+	that was read but can't be run.
+ */
+static int ReadJob(FILE* in, struct serve_job* job, char* error, size_t error_size)
+{
+	memset(job, 0, sizeof(*job));
+	const char* problem = NULL;
+
+	char line[SERVE_LINE_MAX];
+	while(fgets(line, sizeof(line), in) != NULL)
+	{
+		size_t n = strlen(line);
+		if( (n == 0) || (line[n-1] != '\n') )
+			break;
+		line[--n] = '\0';
+		if( (n != 0) && (line[n-1] == '\r') )
+			line[--n] = '\0';
+
+		//A blank line ends the request
+		if(n == 0)
+		{
+			if( (problem == NULL) && (job->elf == NULL) )
+				problem = "no program given";
+			if(problem == NULL)
+				return 1;
+			snprintf(error, error_size, "%s", problem);
+			FreeJob(job);
+			return -1;
+		}
+
+		char* arg = strchr(line, ' ');
+		if(arg == NULL)
+			break;
+		*arg++ = '\0';
+
+		uint64_t value;
+		if(!strcmp(line, "path"))
+		{
+			free(job->name);
+			free(job->elf);
+			job->name = strdup(arg);
+			job->elf = ReadFile(arg, &job->elf_len);
+			if(job->elf == NULL)
+				problem = "can't read the ELF";
+		}
+		else if(!strcmp(line, "elf") || !strcmp(line, "input"))
+		{
+			if(!ParseCount(arg, &value) || (value > SERVE_DATA_MAX))
+				break;
+			uint8_t* data = ReadData(in, value);
+			if(data == NULL)
+				break;
+
+			if(line[0] == 'e')
+			{
+				free(job->name);
+				free(job->elf);
+				job->elf = data;
+				job->elf_len = value;
+				job->name = malloc(32);
+				snprintf(job->name, 32, "<%llu bytes>", (long long unsigned int)value);
+			}
+			else
+			{
+				free(job->input);
+				job->input = data;
+				job->input_len = value;
+			}
+		}
+		else if(!strcmp(line, "budget") && ParseCount(arg, &value))
+			job->budget = value;
+		else
+			break;
+	}
+
+	FreeJob(job);
+	return 0;
+}
+
+/**
+	@brief Writes a buffer as a "name length" line followed by the bytes
+ */
+static void WriteSection(FILE* out, const char* name, const char* data, size_t len)
+{
+	fprintf(out, "%s %llu\n", name, (long long unsigned int)len);
+	fwrite(data, 1, len, out);
+}
+
+/**
+	@brief Runs a job on a cached image of its ELF (loading one if there isn't an idle one) and sends the response
+ */
+static void RunJob(struct serve_cache* cache, struct serve_job* job, FILE* out)
+{
+	char* output = NULL;
+	size_t output_len = 0;
+	FILE* console = open_memstream(&output, &output_len);
+
+	uint64_t hash = HashBytes(job->elf, job->elf_len);
+	struct serve_image* image = TakeImage(cache, hash, job->elf, job->elf_len);
+	int cached = (image != NULL);
+	if(cached)
+		ConsoleRedirect(&image->sim->console, console);
+	else
+		image = NewImage(cache, job, hash, console);
+
+	struct simulator* sim = image->sim;
+	int reason = sim->halt_reason;
+	if(!sim->finished)
+	{
+		SetInputBuffer(&sim->in, job->input, job->input_len);
+		reason = ContinueProgram(sim, job->budget);
+	}
+	ConsoleFlush(&sim->console);
+
+	char* stats = NULL;
+	size_t stats_len = 0;
+	FILE* fp = open_memstream(&stats, &stats_len);
+	WriteStats(fp, sim);
+	fclose(fp);
+	fclose(console);
+
+	fprintf(out, "halt %s\n", HaltReasonName(reason));
+	fprintf(out, "instructions %llu\n", (long long unsigned int)sim->ctx.inst_count);
+	fprintf(out, "cached %d\n", cached);
+	WriteSection(out, "output", output, output_len);
+	WriteSection(out, "stats", stats, stats_len);
+	fprintf(out, "\n");
+	fflush(out);
+	free(output);
+	free(stats);
+
+	//Resetting for the next job happens after the client has its answer
+	ReturnImage(cache, image);
+}
+
+static void* ServeConnection(void* arg)
+{
+	struct serve_connection* conn = (struct serve_connection*)arg;
+	FILE* in = fdopen(conn->fd, "r");
+	int out_fd = dup(conn->fd);
+	FILE* out = (out_fd >= 0) ? fdopen(out_fd, "w") : NULL;
+	if( (in == NULL) || (out == NULL) )
+	{
+		if(in != NULL)
+			fclose(in);
+		else
+			close(conn->fd);
+		if(out != NULL)
+			fclose(out);
+		else if(out_fd >= 0)
+			close(out_fd);
+		free(conn);
+		return NULL;
+	}
+
+	struct serve_job job;
+	char error[128];
+	int got;
+	while( (got = ReadJob(in, &job, error, sizeof(error))) != 0 )
+	{
+		if(got < 0)
+		{
+			fprintf(out, "error %s\n\n", error);
+			fflush(out);
+			continue;
+		}
+		RunJob(conn->cache, &job, out);
+		FreeJob(&job);
+	}
+
+	fclose(in);
+	fclose(out);
+	free(conn);
+	return NULL;
+}
+
+/**
+	@brief Serves jobs on a Unix socket at path until killed, one thread per connection
+
+	Returns the process exit status if the socket can't be set up.
+ */
+int RunServer(const char* path, const struct sim_options* options)
+{
+	//A client hanging up mid-response shouldn't take the server with it
+	signal(SIGPIPE, SIG_IGN);
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr.sun_path))
+	{
+		printf("socket path %s is too long\n", path);
+		return 1;
+	}
+	strcpy(addr.sun_path, path);
+
+	//A socket left behind by an earlier server is replaced, anything else in the way isn't touched
+	struct stat st;
+	if( (lstat(path, &st) == 0) && S_ISSOCK(st.st_mode) )
+		unlink(path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if( (fd < 0) || (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) || (listen(fd, 64) != 0) )
+	{
+		printf("failed to listen on %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	printf("Serving on %s\n", path);
+	fflush(stdout);
+
+	struct serve_cache cache;
+	memset(&cache, 0, sizeof(cache));
+	pthread_mutex_init(&cache.lock, NULL);
+	cache.options = options;
+
+	while(1)
+	{
+		int client = accept(fd, NULL, NULL);
+		if(client < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			printf("accept failed: %s\n", strerror(errno));
+			break;
+		}
+
+		struct serve_connection* conn = malloc(sizeof(struct serve_connection));
+		conn->cache = &cache;
+		conn->fd = client;
+		pthread_t thread;
+		if(0 != pthread_create(&thread, NULL, ServeConnection, conn))
+		{
+			close(client);
+			free(conn);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	close(fd);
+	return 1;
+}
@@ -8,100 +8,841 @@
 #include "stdint.h"
 #include "time.h"
 
+#include <string.h>
+#include <sys/resource.h>
+
 #define BILLION 1000000000L
 
-int inst_count = 0;
-uint64_t skip = 0;
-uint64_t finalTime;
-struct timespec start, end;
+//Longest line syscall 8 will store, however big a buffer the guest claims to have
+#define READ_STRING_MAX (64 * 1024)
 
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Simulator instances
 
 /**
-	@brief Read logic for instruction fetch and load instructions
+	@brief Sets up an empty simulator instance
 	
-	Address must be aligned
+	@param options		Settings to run with (copied)
+	@param out			Guest console output, also gets the loader and fault messages
+	@param in			Guest console input, unless options say to use an input file
+	@param stats_path	Where to write the output.txt stats when the guest exits
+ */
+void InitSimulator(struct simulator* sim, const struct sim_options* options, FILE* out, FILE* in,
+	const char* stats_path)
+{
+	memset(sim, 0, sizeof(*sim));
+	sim->options = *options;
+	InitConsole(&sim->console, out);
+	if(options->async_output)
+		StartConsoleWriter(&sim->console);
+	InitInput(&sim->in, in);
+	sim->stats_path = stats_path;
+	if(options->profile_path != NULL)
+		sim->profile = calloc(1, sizeof(struct profile));
+	sim->model = CreateModel(options);
+	
+	InitVirtualMemory(&sim->memory);
+	sim->memory.sim = sim;
+	sim->ctx.sim = sim;
+	sim->stop_at = UINT64_MAX;
+	if(options->harts > 1)
+		InitHarts(sim);
+}
+
+/**
+	@brief Nanoseconds on the monotonic clock since t0
+ */
+static uint64_t NanosecondsSince(const struct timespec* t0)
+{
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return BILLION * (t1.tv_sec - t0->tv_sec) + t1.tv_nsec - t0->tv_nsec;
+}
+
+/**
+	@brief Ends (or pauses) the timed part of the run, if it was still going
+ */
+static void StopClock(struct simulator* sim)
+{
+	if(!sim->running)
+		return;
+	sim->running = 0;
+	sim->run_ns += NanosecondsSince(&sim->start);
+	sim->elapsed = sim->run_ns - sim->skip;
+}
+
+/**
+	@brief Everything that happens once the guest stops, however it stopped
+ */
+static void FinishProgram(struct simulator* sim)
+{
+	StopHarts(sim);
+	StopClock(sim);
+	FinishVerifier(sim);
+	ReportFastForward(sim);
+	if(sim->model != NULL)
+		CloseTrace(sim->model->trace, sim->ctx.pc);
+	WriteProfile(sim);
+	WriteReport(sim);
+	SaveCodeCache(sim);
+	if(sim->monitor != NULL)
+		FinishMonitor(sim);
+	ConsoleFlush(&sim->console);
+}
+
+//LoadProgram, from image (of image_len bytes) instead of the file if it isn't NULL
+static int LoadFrom(struct simulator* sim, const char* fname, const uint8_t* image, size_t image_len)
+{
+	sim->program = sim->options.restore_path ? sim->options.restore_path : fname;
+	if(setjmp(sim->halt) != 0)
+	{
+		sim->load_ns = NanosecondsSince(&sim->load_start);
+		sim->finished = 1;
+		FinishProgram(sim);
+		return 0;
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &sim->load_start);
+	if( (sim->options.monitor_path != NULL) && !OpenMonitor(sim) )
+	{
+		ConsolePrintf(&sim->console, "failed to write counters to %s\n", sim->options.monitor_path);
+		HaltSimulator(sim, HALT_FAULT);
+	}
+	if(sim->options.restore_path != NULL)
+		ReadCheckpoint(sim->options.restore_path, sim);
+	else if(image != NULL)
+		ReadELFImage(fname, image, image_len, sim);
+	else
+		ReadELF(fname, sim);
+	sim->load_ns = NanosecondsSince(&sim->load_start);
+	
+	if( (sim->options.input_path != NULL) && !MapInputFile(&sim->in, sim->options.input_path) )
+	{
+		ConsolePrintf(&sim->console, "failed to read input from %s\n", sim->options.input_path);
+		HaltSimulator(sim, HALT_FAULT);
+	}
+	if( (sim->options.record_input_path != NULL) && !RecordInput(&sim->in, sim->options.record_input_path) )
+	{
+		ConsolePrintf(&sim->console, "failed to write input to %s\n", sim->options.record_input_path);
+		HaltSimulator(sim, HALT_FAULT);
+	}
+	if(sim->options.verify)
+		StartVerifier(sim, fname, image, image_len);
+	
+	//Report what loading cost us
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	ConsolePrintf(&sim->console, "Startup took %ld us, peak RSS %ld KB\n", (long)(sim->load_ns / 1000),
+		usage.ru_maxrss);
+	ConsolePrintf(&sim->console, "Starting simulation...\n");
+	return 1;
+}
+
+/**
+	@brief Loads an ELF (or the checkpoint the options name instead) and opens the console input files, ready for
+	ContinueProgram
+
+	Returns 0 if that failed, in which case the program has already finished with HALT_FAULT.
+ */
+int LoadProgram(struct simulator* sim, const char* fname)
+{
+	return LoadFrom(sim, fname, NULL, 0);
+}
+
+/**
+	@brief Same as LoadProgram, but for an ELF already in memory, called name in messages. The segments are copied.
+ */
+int LoadProgramImage(struct simulator* sim, const char* name, const uint8_t* image, size_t image_len)
+{
+	return LoadFrom(sim, name, image, image_len);
+}
+
+/**
+	@brief Runs the loaded program until it stops, or until it has retired max_insts more instructions (0 for no
+	limit)
+	
+	Returns one of halt_reasons. After HALT_BUDGET (or HALT_BREAK, under a debugger) the program is paused (its clock
+	too) and can be continued by calling this again; anything else means it's finished, and every later call just
+	returns the same reason.
+	Budgeted runs go through an interpreter (the engine asked for if it can stop at an exact count, or the profiler or
+	models), so they stop at exactly the right instruction. Never exits the process, whatever the guest does.
+ */
+int ContinueProgram(struct simulator* sim, uint64_t max_insts)
+{
+	if(sim->finished)
+		return sim->halt_reason;
+	if(setjmp(sim->halt) != 0)
+	{
+		sim->finished = 1;
+		FinishProgram(sim);
+		return sim->halt_reason;
+	}
+	
+	sim->stop_at = UINT64_MAX;
+	if( (max_insts != 0) && (max_insts < UINT64_MAX - sim->ctx.inst_count) )
+		sim->stop_at = sim->ctx.inst_count + max_insts;
+	RunSimulator(&sim->memory, &sim->ctx, sim->options.engine);
+	if( (sim->debugger != NULL) && sim->debugger->stopped )
+	{
+		StopClock(sim);
+		sim->halt_reason = HALT_BREAK;
+		return HALT_BREAK;
+	}
+	if(sim->ctx.inst_count >= sim->stop_at)
+	{
+		StopClock(sim);
+		if(sim->monitor != NULL)
+			UpdateMonitor(sim, SIM_MONITOR_PAUSED);
+		sim->halt_reason = HALT_BUDGET;
+		return HALT_BUDGET;
+	}
+	
+	sim->halt_reason = HALT_NONE;
+	sim->finished = 1;
+	FinishProgram(sim);
+	return sim->halt_reason;
+}
+
+/**
+	@brief Loads and runs one ELF (or resumes a checkpoint, if the options say so) to completion
+	
+	Returns one of halt_reasons. Never exits the process, whatever the guest does. All console output has been
+	flushed, and any profile or report written, by the time this returns.
+ */
+int RunProgram(struct simulator* sim, const char* fname)
+{
+	if(!LoadProgram(sim, fname))
+		return sim->halt_reason;
+	return ContinueProgram(sim, 0);
+}
+
+/**
+	@brief Starts a loaded program over from the snapshot taken after loading it, without going back to the ELF
+
+	The instruction count, timing, models and profile start from zero again and an --input file is read from the
+	start. Console output and the input stream carry on where they are. Returns 0 if there's no snapshot.
+ */
+int RestartProgram(struct simulator* sim)
+{
+	if(sim->snapshot == NULL)
+		return 0;
+
+	StopClock(sim);
+	ResetToSnapshot(sim);
+	sim->finished = 0;
+	sim->halt_reason = HALT_NONE;
+	sim->stop_at = UINT64_MAX;
+	sim->run_ns = sim->syscall_ns = sim->skip = sim->elapsed = 0;
+	sim->forwarded_loops = sim->forwarded_insts = sim->forwarded_ns = 0;
+	if(sim->model != NULL)
+	{
+		FreeModel(sim->model);
+		sim->model = CreateModel(&sim->options);
+	}
+	ClearProfile(sim->profile);
+	if(sim->monitor != NULL)
+		memset(sim->monitor->syscalls, 0, sizeof(sim->monitor->syscalls));
+	sim->in.pos = 0;
+	return 1;
+}
+
+/**
+	@brief Releases all guest memory, translations, profile and model data, and stops the console writer
+	
+	The output and input files themselves belong to the caller.
+ */
+void FreeSimulator(struct simulator* sim)
+{
+	FreeVerifier(sim);
+	FreeDebugger(sim);
+	FreeSnapshot(sim);
+	FreeVirtualMemory(&sim->memory);
+	FreeProfile(sim->profile);
+	FreeModel(sim->model);
+	FreeHarts(sim);
+	CloseMonitor(sim);
+	CloseInput(&sim->in);
+	CloseConsole(&sim->console);
+}
+
+/**
+	@brief Stops the guest program, unwinding back to RunProgram
+	
+	On a spawned hart's thread only that hart stops, unwinding back to the start of its thread.
+ */
+void HaltSimulator(struct simulator* sim, int reason)
+{
+	struct hart* hart = CurrentHart();
+	if(hart != NULL)
+	{
+		hart->halt_reason = reason;
+		longjmp(hart->halt, 1);
+	}
+	sim->halt_reason = reason;
+	longjmp(sim->halt, 1);
+}
+
+const char* HaltReasonName(int reason)
+{
+	switch(reason)
+	{
+		case HALT_EXIT:
+			return "exited";
+		case HALT_FAULT:
+			return "faulted";
+		case HALT_BUDGET:
+			return "out of budget";
+		case HALT_BREAK:
+			return "stopped by the debugger";
+		default:
+			return "invalid instruction";
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Memory access
+
+/**
+	@brief Whether an access of size bytes can use the page table entry's direct translation
+	
+	Like the region walk, only the first byte has to be inside the region. Aligned accesses never cross a page.
+ */
+static inline int IsFastAccess(struct page_table_entry* pte, uint32_t address, uint32_t size)
+{
+	//span is published last when a page gets mapped while harts run, so it has to be read first
+	uint32_t span = __atomic_load_n(&pte->span, __ATOMIC_ACQUIRE);
+	return ((address & VM_PAGE_MASK) - __atomic_load_n(&pte->lo, __ATOMIC_RELAXED) < span) && !(address & (size - 1));
+}
+
+/**
+	@brief Slow path behind the page table: walks the region list for an access of size bytes (1, 2 or 4)
+	
+	Returns the host address of the access and the region it falls in. Segfaults (unmapped, or not aligned to the
+	access size) are reported here and never return.
  */
-uint32_t FetchWordFromVirtualMemory(uint32_t address, struct virtual_mem_region* memory)
+static uint8_t* FindAccess(struct virtual_memory* memory, uint32_t address, uint32_t size, int write,
+	struct virtual_mem_region** hit)
 {
 	//Traverse the linked list until we find the range of interest
-	while(memory != NULL)
+	struct virtual_mem_region* region = __atomic_load_n(&memory->regions, __ATOMIC_ACQUIRE);
+	for(; region != NULL; region = region->next)
 	{
 		//Not in range? Try next one
-		if( (address < memory->vaddr) || (address >= (memory->vaddr + memory->len)) )
-		{
-			memory = memory->next;
+		if( (address < region->vaddr) || (address >= (region->vaddr + region->len)) )
 			continue;
-		}
 		
 		//Align check
-		uint32_t offset = address - memory->vaddr;
-		if(offset & 3)
+		if(address & (size - 1))
 		{
-			printf("SEGFAULT: address %08x is not aligned\n", address);
-			exit(1);	
+			ConsolePrintf(&memory->sim->console, "SEGFAULT: address %08x is not aligned\n", address);
+			HaltSimulator(memory->sim, HALT_FAULT);
 		}
 		
-		return memory->data[offset/4];
+		//Watched pages always come this way
+		if(memory->sim->debugger != NULL)
+			WatchAccess(memory->sim, address, size, write);
+		
+		*hit = region;
+		return (uint8_t*)region->data + (address - region->vaddr);
 	}
 	
+	//Just below the stack? Grow it and look again
+	if(GrowStack(memory, address))
+		return FindAccess(memory, address, size, write, hit);
+	
 	//Didn't find anything! Give up
-	printf("SEGFAULT: attempted to read word from nonexistent virtual address %08x\n", address);
-	exit(1);
+	const char* what = (size == 4) ? "word" : (size == 2) ? "halfword" : "byte";
+	if(write)
+		ConsolePrintf(&memory->sim->console, "SEGFAULT: attempted to write %s to nonexistent virtual address %08x\n", what, address);
+	else
+		ConsolePrintf(&memory->sim->console, "SEGFAULT: attempted to read %s from nonexistent virtual address %08x\n", what, address);
+	HaltSimulator(memory->sim, HALT_FAULT);
+}
+
+//Drop any stale decoded copy of the word a store landed in, and note the page needs restoring on reset
+static inline void InvalidateStore(struct virtual_memory* memory, struct virtual_mem_region* region, uint32_t address)
+{
+	uint32_t offset = address - region->vaddr;
+	if(__atomic_load_n(&region->decoded, __ATOMIC_ACQUIRE) != NULL)
+		InvalidatePredecodedWord(memory, region, offset & ~3);
+	if( (region->dirty_pages != NULL) && !region->dirty_pages[offset >> VM_PAGE_SHIFT])
+		MarkPageDirty(memory, region, offset);
+}
+
+/**
+	@brief Read logic for instruction fetch and load instructions
+	
+	Address must be aligned
+ */
+uint32_t FetchWordFromVirtualMemory(uint32_t address, struct virtual_memory* memory)
+{
+	//Fast path: one page table lookup
+	struct page_table_entry* pte = LookupPage(memory, address);
+	if(IsFastAccess(pte, address, 4))
+		return *(uint32_t*)(pte->bias + address);
+	
+	struct virtual_mem_region* region;
+	return *(uint32_t*)FindAccess(memory, address, 4, 0, &region);
 }
 
 /**
 	@brief Write logic for store instructions.
 	
-	Stores an entire 32-bit word. sh/sb instructions will need to do a read-modify-write structure
+	Stores an entire 32-bit word.
  */
-void StoreWordToVirtualMemory(uint32_t address, uint32_t value, struct virtual_mem_region* memory)
+void StoreWordToVirtualMemory(uint32_t address, uint32_t value, struct virtual_memory* memory)
 {
-	//Traverse the linked list until we find the range of interest
-	while(memory != NULL)
+	//Fast path: one page table lookup
+	struct page_table_entry* pte = LookupPage(memory, address);
+	if(IsFastAccess(pte, address, 4))
 	{
-		//Not in range? Try next one
-		if( (address < memory->vaddr) || (address >= (memory->vaddr + memory->len)) )
+		*(uint32_t*)(pte->bias + address) = value;
+		InvalidateStore(memory, pte->region, address);
+		return;
+	}
+	
+	struct virtual_mem_region* region;
+	*(uint32_t*)FindAccess(memory, address, 4, 1, &region) = value;
+	InvalidateStore(memory, region, address);
+}
+
+/**
+	@brief Reads a halfword (lh/lhu). Address must be 2-byte aligned
+ */
+uint16_t FetchHalfwordFromVirtualMemory(uint32_t address, struct virtual_memory* memory)
+{
+	struct page_table_entry* pte = LookupPage(memory, address);
+	if(IsFastAccess(pte, address, 2))
+		return *(uint16_t*)(pte->bias + address);
+	
+	struct virtual_mem_region* region;
+	return *(uint16_t*)FindAccess(memory, address, 2, 0, &region);
+}
+
+/**
+	@brief Writes a halfword (sh) in place, no read-modify-write of the containing word
+ */
+void StoreHalfwordToVirtualMemory(uint32_t address, uint16_t value, struct virtual_memory* memory)
+{
+	struct page_table_entry* pte = LookupPage(memory, address);
+	if(IsFastAccess(pte, address, 2))
+	{
+		*(uint16_t*)(pte->bias + address) = value;
+		InvalidateStore(memory, pte->region, address);
+		return;
+	}
+	
+	struct virtual_mem_region* region;
+	*(uint16_t*)FindAccess(memory, address, 2, 1, &region) = value;
+	InvalidateStore(memory, region, address);
+}
+
+/**
+	@brief Reads a byte (lb/lbu)
+ */
+uint8_t FetchByteFromVirtualMemory(uint32_t address, struct virtual_memory* memory)
+{
+	struct page_table_entry* pte = LookupPage(memory, address);
+	if(IsFastAccess(pte, address, 1))
+		return *(uint8_t*)(pte->bias + address);
+	
+	struct virtual_mem_region* region;
+	return *FindAccess(memory, address, 1, 0, &region);
+}
+
+/**
+	@brief Writes a byte (sb) in place
+ */
+void StoreByteToVirtualMemory(uint32_t address, uint8_t value, struct virtual_memory* memory)
+{
+	struct page_table_entry* pte = LookupPage(memory, address);
+	if(IsFastAccess(pte, address, 1))
+	{
+		*(uint8_t*)(pte->bias + address) = value;
+		InvalidateStore(memory, pte->region, address);
+		return;
+	}
+	
+	struct virtual_mem_region* region;
+	*FindAccess(memory, address, 1, 1, &region) = value;
+	InvalidateStore(memory, region, address);
+}
+
+//Host address of an aligned guest word, and the region it's in
+static uint32_t* WordAddress(struct virtual_memory* memory, uint32_t address, int write,
+	struct virtual_mem_region** region)
+{
+	struct page_table_entry* pte = LookupPage(memory, address);
+	if(IsFastAccess(pte, address, 4))
+	{
+		*region = pte->region;
+		return (uint32_t*)(pte->bias + address);
+	}
+	return (uint32_t*)FindAccess(memory, address, 4, write, region);
+}
+
+/**
+	@brief Reads a word for ll. Sequentially consistent with every other hart's atomic accesses.
+ */
+uint32_t LoadLinkedWord(uint32_t address, struct virtual_memory* memory)
+{
+	struct virtual_mem_region* region;
+	return __atomic_load_n(WordAddress(memory, address, 0, &region), __ATOMIC_SEQ_CST);
+}
+
+/**
+	@brief Does the store half of sc: atomically replaces the word at address with value if it still holds expected
+	(what ll read). Returns 1 if it stored.
+	
+	This is a compare-and-swap, so it also succeeds if other harts changed the word and then changed it back since the
+	ll. Locks, counters and lists built on ll/sc don't care.
+ */
+int StoreConditionalWord(uint32_t address, uint32_t expected, uint32_t value, struct virtual_memory* memory)
+{
+	struct virtual_mem_region* region;
+	uint32_t* word = WordAddress(memory, address, 1, &region);
+	if(!__atomic_compare_exchange_n(word, &expected, value, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		return 0;
+	InvalidateStore(memory, region, address);
+	return 1;
+}
+
+/**
+	@brief Host address of the guest bytes from address on (up to len of them) that are contiguous in one region, for
+	syscalls that work on whole buffers
+	
+	*span gets how many there are: they stop at the end of the region, or where a region earlier in the list (which
+	wins, as it does for every other access) starts. An unmapped address faults like a byte access would, after
+	trying to grow the stack. len must not be 0.
+ */
+static uint8_t* FindSpan(struct virtual_memory* memory, uint32_t address, uint32_t len, int write,
+	struct virtual_mem_region** hit, uint32_t* span)
+{
+	uint8_t* p = FindAccess(memory, address, 1, write, hit);
+	uint32_t left = (*hit)->len - (address - (*hit)->vaddr);
+	struct virtual_mem_region* region = __atomic_load_n(&memory->regions, __ATOMIC_ACQUIRE);
+	for(; region != *hit; region = region->next)
+	{
+		if( (region->vaddr > address) && (region->vaddr - address < left) )
+			left = region->vaddr - address;
+	}
+	*span = (len < left) ? len : left;
+	if(memory->sim->debugger != NULL)
+		WatchAccess(memory->sim, address, *span, write);
+	return p;
+}
+
+/**
+	@brief What InvalidateStore does for every word of len bytes stored at address, all in region
+	
+	Pages with nothing decoded on them (nearly all of them) cost one check each, not one per word.
+ */
+void InvalidateSpan(struct virtual_memory* memory, struct virtual_mem_region* region, uint32_t address,
+	uint32_t len)
+{
+	uint32_t first = address - region->vaddr;
+	uint32_t last = first + len - 1;
+	int decoded = (__atomic_load_n(&region->decoded, __ATOMIC_ACQUIRE) != NULL);
+	for(uint32_t page = first >> VM_PAGE_SHIFT; page <= (last >> VM_PAGE_SHIFT); page++)
+	{
+		uint32_t lo = (page == (first >> VM_PAGE_SHIFT)) ? first : (page << VM_PAGE_SHIFT);
+		uint32_t hi = (page == (last >> VM_PAGE_SHIFT)) ? last : (lo | VM_PAGE_MASK);
+		if(decoded && __atomic_load_n(&region->decoded_pages[page], __ATOMIC_RELAXED))
 		{
-			memory = memory->next;
-			continue;
+			for(uint32_t offset = lo & ~3; offset <= hi; offset += 4)
+				InvalidatePredecodedWord(memory, region, offset);
 		}
-		
-		//Align check
-		uint32_t offset = address - memory->vaddr;
-		if(offset & 3)
+		if( (region->dirty_pages != NULL) && !region->dirty_pages[page])
+			MarkPageDirty(memory, region, lo);
+	}
+}
+
+//Copies n guest bytes at src out to buf
+static void CopyFromGuest(struct virtual_memory* memory, uint8_t* buf, uint32_t src, uint32_t n)
+{
+	struct virtual_mem_region* region;
+	uint32_t span;
+	for(; n != 0; src += span, buf += span, n -= span)
+	{
+		const uint8_t* p = FindSpan(memory, src, n, 0, &region, &span);
+		memcpy(buf, p, span);
+	}
+}
+
+//Copies n bytes from buf into guest memory at dst
+static void CopyToGuest(struct virtual_memory* memory, uint32_t dst, const uint8_t* buf, uint32_t n)
+{
+	struct virtual_mem_region* region;
+	uint32_t span;
+	for(; n != 0; dst += span, buf += span, n -= span)
+	{
+		uint8_t* p = FindSpan(memory, dst, n, 1, &region, &span);
+		memcpy(p, buf, span);
+		InvalidateSpan(memory, region, dst, span);
+	}
+}
+
+/**
+	@brief memmove() on guest memory: one host memmove per stretch that's contiguous on both sides
+	
+	If the destination overlaps the end of the source, copying front to back would overwrite source bytes before
+	they're read. That's fine when both sides are in one piece (memmove copes), otherwise the copy goes back to
+	front through a small buffer.
+ */
+static void BulkCopy(struct virtual_memory* memory, uint32_t dst, uint32_t src, uint32_t n)
+{
+	struct virtual_mem_region* region;
+	uint32_t span;
+	if( (dst > src) && (dst - src < n) )
+	{
+		uint8_t* from = FindSpan(memory, src, n, 0, &region, &span);
+		if(span == n)
 		{
-			printf("SEGFAULT: address %08x is not aligned\n", address);
-			exit(1);	
+			uint8_t* to = FindSpan(memory, dst, n, 1, &region, &span);
+			if(span == n)
+			{
+				memmove(to, from, n);
+				InvalidateSpan(memory, region, dst, n);
+				return;
+			}
 		}
 		
-		memory->data[offset/4] = value;
+		uint8_t buf[4096];
+		while(n != 0)
+		{
+			uint32_t chunk = (n < sizeof(buf)) ? n : sizeof(buf);
+			n -= chunk;
+			CopyFromGuest(memory, buf, src + n, chunk);
+			CopyToGuest(memory, dst + n, buf, chunk);
+		}
 		return;
 	}
 	
-	//Didn't find anything! Give up
-	printf("SEGFAULT: attempted to write word to nonexistent virtual address %08x\n", address);
-	exit(1);
+	while(n != 0)
+	{
+		uint32_t from_span;
+		uint8_t* from = FindSpan(memory, src, n, 0, &region, &from_span);
+		uint8_t* to = FindSpan(memory, dst, from_span, 1, &region, &span);
+		memmove(to, from, span);
+		InvalidateSpan(memory, region, dst, span);
+		src += span;
+		dst += span;
+		n -= span;
+	}
+}
+
+//memset() on guest memory
+static void BulkSet(struct virtual_memory* memory, uint32_t dst, uint8_t value, uint32_t n)
+{
+	struct virtual_mem_region* region;
+	uint32_t span;
+	for(; n != 0; dst += span, n -= span)
+	{
+		uint8_t* p = FindSpan(memory, dst, n, 1, &region, &span);
+		memset(p, value, span);
+		InvalidateSpan(memory, region, dst, span);
+	}
+}
+
+/**
+	@brief memcmp() on guest memory: the difference between the first bytes (as unsigned) that differ, or 0
+	
+	*compared gets how many bytes that took, counting the one that differed.
+ */
+static int32_t BulkCompare(struct virtual_memory* memory, uint32_t a, uint32_t b, uint32_t n, uint32_t* compared)
+{
+	struct virtual_mem_region* region;
+	uint32_t done = 0;
+	while(done < n)
+	{
+		uint32_t a_span, span;
+		const uint8_t* pa = FindSpan(memory, a + done, n - done, 0, &region, &a_span);
+		const uint8_t* pb = FindSpan(memory, b + done, a_span, 0, &region, &span);
+		if(memcmp(pa, pb, span) != 0)
+		{
+			uint32_t i = 0;
+			while(pa[i] == pb[i])
+				i++;
+			*compared = done + i + 1;
+			return (int32_t)pa[i] - (int32_t)pb[i];
+		}
+		done += span;
+	}
+	*compared = n;
+	return 0;
+}
+
+//strlen() on guest memory
+static uint32_t BulkLength(struct virtual_memory* memory, uint32_t address)
+{
+	struct virtual_mem_region* region;
+	uint32_t len = 0;
+	while(1)
+	{
+		uint32_t span;
+		const uint8_t* p = FindSpan(memory, address + len, UINT32_MAX, 0, &region, &span);
+		const uint8_t* nul = memchr(p, 0, span);
+		if(nul != NULL)
+			return len + (uint32_t)(nul - p);
+		len += span;
+	}
 }
 
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Execution
+
 
 /**
  @brief Runs the actual simulation
  */
-void RunSimulator(struct virtual_mem_region* memory, struct context* ctx)
+void RunSimulator(struct virtual_memory* memory, struct context* ctx, int engine)
+{
+	clock_gettime(CLOCK_MONOTONIC, &ctx->sim->start);
+	ctx->sim->running = 1;
+	if(ctx->sim->monitor != NULL)
+		UpdateMonitor(ctx->sim, SIM_MONITOR_RUNNING);
+	
+	//Anything up to the checkpoint runs on the interpreter, which can stop at an exact count
+	if( (ctx->sim->options.checkpoint_path != NULL) && (ctx->sim->options.checkpoint_at > ctx->inst_count) )
+	{
+		if(!RunToCheckpoint(memory, ctx, ctx->sim->options.checkpoint_at))
+			return;
+	}
+	
+	//So do harts, which have to stop when the program does
+	if(ctx->sim->harts != NULL)
+	{
+		RunHart(memory, ctx);
+		return;
+	}
+	
+	//Modeling and profiling have their own interpreter loops, whatever engine was asked for
+	if(ctx->sim->model != NULL)
+	{
+		RunModel(memory, ctx);
+		return;
+	}
+	if(ctx->sim->profile != NULL)
+	{
+		RunProfiler(memory, ctx);
+		return;
+	}
+	
+	if(ctx->sim->verifier != NULL)
+	{
+		RunVerified(memory, ctx, engine);
+		return;
+	}
+	
+	//Breakpoints live in the predecoded entries, so a debugged program runs on the interpreter
+	if(ctx->sim->debugger != NULL)
+	{
+		RunDebugged(memory, ctx);
+		return;
+	}
+	
+	//Blocks are chained, so engines built on them hand budgeted runs to the interpreter. Monitored runs that end up
+	//on one that can stop at an exact count go a chunk between updates at a time (the others update at block
+	//boundaries).
+	const struct engine* e = &engines[engine];
+	if( (ctx->sim->monitor != NULL) && ( (e->run_until != NULL) || (ctx->sim->stop_at != UINT64_MAX) ) )
+	{
+		RunMonitored(memory, ctx, (e->run_until != NULL) ? e->run_until : RunInterpreterUntil);
+		return;
+	}
+	if(ctx->sim->stop_at != UINT64_MAX)
+	{
+		if(e->run_until != NULL)
+			e->run_until(memory, ctx, ctx->sim->stop_at);
+		else
+			RunInterpreterUntil(memory, ctx, ctx->sim->stop_at);
+		return;
+	}
+	e->run(memory, ctx);
+}
+
+static void RunThreadedCode(struct virtual_memory* memory, struct context* ctx)
+{
+	RunThreaded(memory, ctx, 0);
+}
+
+static void RunJit(struct virtual_memory* memory, struct context* ctx)
+{
+	RunThreaded(memory, ctx, 1);
+}
+
+/**
+	@brief Every engine, indexed by engines
+ */
+const struct engine engines[ENGINE_COUNT] =
 {
-	printf("Starting simulation...\n");
-	// Time tracking variables
-	union mips_instruction inst;
+	[ENGINE_INTERP]		= { "interp",		RunInterpreter,		RunInterpreterUntil,	0 },
+	[ENGINE_THREADED]	= { "threaded",		RunThreadedCode,	NULL,					1 },
+	[ENGINE_JIT]		= { "jit",			RunJit,				NULL,					1 },
+	[ENGINE_REFERENCE]	= { "reference",	RunReference,		RunReferenceUntil,		0 }
+};
 
-	clock_gettime(CLOCK_REALTIME, &start);
+/**
+ @brief Runs the predecoded interpreter: one handler call per instruction (or fused pair)
+ */
+void RunInterpreter(struct virtual_memory* memory, struct context* ctx)
+{
+	// Region the last instruction was fetched from
+	struct virtual_mem_region* text = NULL;
 
 	while(1)
 	{
+		struct predecoded_inst* pi = FetchPredecodedInstruction(ctx->pc, memory, &text);
+		ctx->regs[zero] = 0;
+		if(!pi->handler(pi, memory, ctx))
+			break;
+		else 
+			ctx->inst_count++;
+	}
+}
+
+/**
+	@brief Runs the predecoded interpreter until inst_count reaches target, or it runs into an invalid instruction
+	
+	A fused pair only runs as one while there are at least two instructions to go, so it never overshoots.
+ */
+void RunInterpreterUntil(struct virtual_memory* memory, struct context* ctx, uint64_t target)
+{
+	struct virtual_mem_region* text = NULL;
+
+	while(ctx->inst_count < target)
+	{
+		struct predecoded_inst* pi = FetchPredecodedInstruction(ctx->pc, memory, &text);
+		predecoded_handler handler = (target - ctx->inst_count >= 2) ? pi->handler : predecoded_handlers[pi->op];
+		ctx->regs[zero] = 0;
+		if(!handler(pi, memory, ctx))
+			break;
+		ctx->inst_count++;
+	}
+}
+
+/**
+	@brief Runs the reference interpreter: every instruction fetched and decoded from memory as it's reached
+	
+	Nothing is cached, so this is slow, but it's what SimulateInstruction says and nothing else.
+ */
+void RunReference(struct virtual_memory* memory, struct context* ctx)
+{
+	RunReferenceUntil(memory, ctx, UINT64_MAX);
+}
+
+/**
+	@brief Runs the reference interpreter until inst_count reaches target, or it runs into an invalid instruction
+ */
+void RunReferenceUntil(struct virtual_memory* memory, struct context* ctx, uint64_t target)
+{
+	while(ctx->inst_count < target)
+	{
+		union mips_instruction inst;
 		inst.word = FetchWordFromVirtualMemory(ctx->pc, memory);
 		if(!SimulateInstruction(&inst, memory, ctx))
 			break;
-		else 
-			inst_count++;
+		ctx->inst_count++;
 	}
 }
 
@@ -110,7 +851,7 @@ void RunSimulator(struct virtual_mem_region* memory, struct context* ctx)
 	
 	Return 0 to exit the program (for syscall/invalid instruction) and 1 to keep going
  */
-int SimulateInstruction(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+int SimulateInstruction(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
 	//TODO: Switch on opcode, if R-type instruction call SimulateRTypeInstruction()
 	//otherwise it's I/J type
@@ -120,11 +861,9 @@ int SimulateInstruction(union mips_instruction* inst, struct virtual_mem_region*
 	switch(inst->itype.opcode)
 	{
 		case OP_RTYPE:
-			SimulateRtypeInstruction(inst, memory, ctx);
-			break;
+			return SimulateRtypeInstruction(inst, memory, ctx);
 		case OP_BGEZ: //this will deal with BGEZ, BGEZAL, BLTZ, BLTZAL
-            SimulateBswitch(inst, memory, ctx);
-			break;
+			return SimulateBswitch(inst, memory, ctx);
 		case OP_J:
             simJ(inst, memory, ctx);
 			break;
@@ -170,24 +909,42 @@ int SimulateInstruction(union mips_instruction* inst, struct virtual_mem_region*
 		case OP_LB:
             simLB(inst, memory, ctx);
 			break;
+		case OP_LBU:
+            simLBU(inst, memory, ctx);
+			break;
+		case OP_LH:
+            simLH(inst, memory, ctx);
+			break;
+		case OP_LHU:
+            simLHU(inst, memory, ctx);
+			break;
 		case OP_LW:
             simLW(inst, memory, ctx);
 			break;
 		case OP_SB:
             simSB(inst, memory, ctx);
 			break;
+		case OP_SH:
+            simSH(inst, memory, ctx);
+			break;
 		case OP_SW:
             simSW(inst, memory, ctx);
 			break;
+		case OP_LL:
+			simLL(inst, memory, ctx);
+			break;
+		case OP_SC:
+			simSC(inst, memory, ctx);
+			break;
 		default:
-			printf("Invalid or unsupported instruction opcode\n");
+			ConsolePrintf(&ctx->sim->console, "Invalid or unsupported instruction opcode\n");
 			return 0;
 	}
 	
 	return 1;
 }
 
-int SimulateRtypeInstruction(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+int SimulateRtypeInstruction(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
 	//TODO: switch on func, if syscall call SimulateSyscall()
 	//else process instruction normally
@@ -258,142 +1015,280 @@ int SimulateRtypeInstruction(union mips_instruction* inst, struct virtual_mem_re
 		case FUNC_SLTU:
             simSLTU(inst, memory, ctx);
 			break;
+		case FUNC_SYNC:
+			simSYNC(inst, memory, ctx);
+			break;
 		default:
-			printf("Invalid or unsupported instruction func code\n");
+			ConsolePrintf(&ctx->sim->console, "Invalid or unsupported instruction func code\n");
 			return 0;
 	}
 	return 1;
 }
 
-void timefunc()
+/**
+	@brief Writes what output.txt holds: the instruction count, run time and any model stats
+ */
+void WriteStats(FILE* out, struct simulator* sim)
 {
-	FILE* out = fopen("output.txt", "w");
-	clock_gettime(CLOCK_REALTIME, &end);
-	finalTime = BILLION * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec;
-	finalTime -= skip;
-
 	fprintf(out, "Output File\n");
-	fprintf(out, "Total Instruction Count: %d\n", inst_count);
-	fprintf(out, "Time Elapsed: %llu nanoseconds\n", (long long unsigned int) finalTime);
+	fprintf(out, "Total Instruction Count: %llu\n", (long long unsigned int) sim->ctx.inst_count);
+	fprintf(out, "Time Elapsed: %llu nanoseconds\n", (long long unsigned int) sim->elapsed);
+	WriteModelStats(out, sim->model, sim->ctx.inst_count);
+}
+
+void timefunc(struct simulator* sim)
+{
+	StopClock(sim);
+	if(sim->stats_path == NULL)
+		return;
+
+	FILE* out = fopen(sim->stats_path, "w");
+	if(out == NULL)
+		return;
+	WriteStats(out, sim);
+	fclose(out);
 }
 
-int SimulateSyscall(uint32_t callnum, struct virtual_mem_region* memory, struct context* ctx)
+//Writes s as a JSON string literal
+static void WriteJSONString(FILE* fp, const char* s)
 {
-	struct timespec startSkip, endSkip;
+	fputc('"', fp);
+	for(; *s; s++)
+	{
+		unsigned char c = *s;
+		if( (c == '"') || (c == '\\') )
+			fprintf(fp, "\\%c", c);
+		else if(c < 0x20)
+			fprintf(fp, "\\u%04x", c);
+		else
+			fputc(c, fp);
+	}
+	fputc('"', fp);
+}
+
+/**
+	@brief Writes the JSON performance report, if one was asked for
+	
+	Times are monotonic nanoseconds. "execute" is time spent running guest code and "syscall" time spent in syscalls
+	(console input waits included, and also broken out as "input_wait"); "run" is the Time Elapsed figure from
+	output.txt, i.e. both minus the input waits, and is what MIPS and ns_per_inst are based on.
+ */
+void WriteReport(struct simulator* sim)
+{
+	if(sim->options.report_path == NULL)
+		return;
+	FILE* fp = fopen(sim->options.report_path, "w");
+	if(fp == NULL)
+	{
+		ConsolePrintf(&sim->console, "failed to write report to %s\n", sim->options.report_path);
+		return;
+	}
+	
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	
+	uint64_t count = sim->ctx.inst_count;
+	double run = (double)sim->elapsed;
+	
+	fprintf(fp, "{\n");
+	fprintf(fp, "\t\"program\": ");
+	WriteJSONString(fp, sim->program ? sim->program : "");
+	fprintf(fp, ",\n");
+	fprintf(fp, "\t\"engine\": \"%s\",\n",
+		sim->model ? "model" : (sim->profile ? "profile" : engines[sim->options.engine].name));
+	fprintf(fp, "\t\"halt\": \"%s\",\n", HaltReasonName(sim->halt_reason));
+	fprintf(fp, "\t\"instructions\": %llu,\n", (long long unsigned int)count);
+	fprintf(fp, "\t\"time_ns\": {\n");
+	fprintf(fp, "\t\t\"load\": %llu,\n", (long long unsigned int)sim->load_ns);
+	fprintf(fp, "\t\t\"execute\": %llu,\n", (long long unsigned int)(sim->run_ns - sim->syscall_ns));
+	fprintf(fp, "\t\t\"syscall\": %llu,\n", (long long unsigned int)sim->syscall_ns);
+	fprintf(fp, "\t\t\"input_wait\": %llu,\n", (long long unsigned int)sim->skip);
+	fprintf(fp, "\t\t\"run\": %llu\n", (long long unsigned int)sim->elapsed);
+	fprintf(fp, "\t},\n");
+	fprintf(fp, "\t\"mips\": %.3f,\n", (run > 0) ? (count * 1000.0 / run) : 0.0);
+	fprintf(fp, "\t\"ns_per_inst\": %.3f,\n", (count > 0) ? (run / count) : 0.0);
+	if(sim->options.fast_forward)
+	{
+		fprintf(fp, "\t\"fast_forward\": {\n");
+		fprintf(fp, "\t\t\"loops\": %llu,\n", (long long unsigned int)sim->forwarded_loops);
+		fprintf(fp, "\t\t\"instructions\": %llu,\n", (long long unsigned int)sim->forwarded_insts);
+		fprintf(fp, "\t\t\"saved_ns\": %llu\n", (long long unsigned int)sim->forwarded_ns);
+		fprintf(fp, "\t},\n");
+	}
+	fprintf(fp, "\t\"peak_rss_kb\": %ld\n", usage.ru_maxrss);
+	fprintf(fp, "}\n");
+	fclose(fp);
+}
+
+/**
+	@brief Ends the program the way syscall 10 does: any other harts are stopped, then the stats are written
+	
+	Only hart 0 can do that, so any other hart asks it to and just stops.
+ */
+void ExitProgram(struct context* ctx)
+{
+	struct simulator* sim = ctx->sim;
+	if(ctx->hart != 0)
+	{
+		StopProgram(sim, HALT_EXIT);
+		HaltSimulator(sim, HALT_EXIT);
+	}
+	
+	StopHarts(sim);
+	ConsoleFlush(&sim->console);
+	timefunc(sim);
+	HaltSimulator(sim, HALT_EXIT);
+}
+
+int SimulateSyscall(uint32_t callnum, struct virtual_memory* memory, struct context* ctx)
+{
+	struct timespec startSyscall, startSkip;
+	clock_gettime(CLOCK_MONOTONIC, &startSyscall);
+	ctx->link_valid = 0;
+	uint32_t bulk = 0;			//bytes a bulk memory syscall went through, for --bulk-cost
+	if(ctx->sim->monitor != NULL)
+		ctx->sim->monitor->syscalls[(callnum < SIM_MONITOR_SYSCALLS) ? callnum : (SIM_MONITOR_SYSCALLS - 1)]++;
 	switch (callnum) {
 		case 1: //print integer
-			printf("%d", ctx->regs[a0]);
+			ConsolePrintf(&ctx->sim->console, "%d", ctx->regs[a0]);
 			break;
 		case 4: //print string
 			simPrintString(memory, ctx);
 			break;
 		case 5: //read integer
-			clock_gettime(CLOCK_REALTIME, &startSkip);
-			scanf("%d", &(ctx->regs[v0]));
-			clock_gettime(CLOCK_REALTIME, &endSkip);
-			skip += (BILLION * (endSkip.tv_sec - startSkip.tv_sec) + endSkip.tv_nsec - startSkip.tv_nsec);
+			//Waiting for someone to type doesn't count as run time, reading a mapped input file does
+			if(!InputMayBlock(&ctx->sim->in))
+			{
+				InputReadInt(&ctx->sim->in, &ctx->regs[v0]);
+				break;
+			}
+			ConsoleFlush(&ctx->sim->console);
+			clock_gettime(CLOCK_MONOTONIC, &startSkip);
+			InputReadInt(&ctx->sim->in, &ctx->regs[v0]);
+			__atomic_add_fetch(&ctx->sim->skip, NanosecondsSince(&startSkip), __ATOMIC_RELAXED);
 			break;
 		case 8: //read string
+			if(InputMayBlock(&ctx->sim->in))
+				ConsoleFlush(&ctx->sim->console);
 			simReadString(memory, ctx);
 			break;
+		case 9: //sbrk, returns the old break
+			ctx->regs[v0] = Sbrk(memory, (int32_t)ctx->regs[a0]);
+			break;
+		case 90: //checkpoint marker, resuming after this syscall
+			if(ctx->sim->options.checkpoint_path != NULL)
+				WriteCheckpoint(ctx->sim, ctx->pc + 4, ctx->inst_count + 1);
+			break;
 		case 10: //exit (end of program)
-			timefunc();
-			exit(1);
+			ExitProgram(ctx);
+			break;
+		case 100: //hart ID
+			ctx->regs[v0] = ctx->hart;
+			break;
+		case 101: //spawn a hart at $a0 with $sp = $a1 and $a0 = $a2, returns its ID or -1
+			ctx->regs[v0] = SpawnHart(ctx, ctx->regs[a0], ctx->regs[a1], ctx->regs[a2]);
+			break;
+		case 102: //join hart $a0, returns its exit value or -1
+			ctx->regs[v0] = JoinHart(ctx, ctx->regs[a0]);
+			break;
+		case 103: //end this hart with exit value $a0 (ends the program on hart 0)
+			ExitHart(ctx, ctx->regs[a0]);
+			break;
+		case 110: //memmove $a2 bytes from $a1 to $a0, returns $a0
+			BulkCopy(memory, ctx->regs[a0], ctx->regs[a1], ctx->regs[a2]);
+			ctx->regs[v0] = ctx->regs[a0];
+			bulk = ctx->regs[a2];
+			break;
+		case 111: //memset $a2 bytes at $a0 to $a1, returns $a0
+			BulkSet(memory, ctx->regs[a0], (uint8_t)ctx->regs[a1], ctx->regs[a2]);
+			ctx->regs[v0] = ctx->regs[a0];
+			bulk = ctx->regs[a2];
+			break;
+		case 112: //memcmp $a2 bytes at $a0 and $a1
+			ctx->regs[v0] = BulkCompare(memory, ctx->regs[a0], ctx->regs[a1], ctx->regs[a2], &bulk);
+			break;
+		case 113: //strlen of the string at $a0
+			ctx->regs[v0] = BulkLength(memory, ctx->regs[a0]);
+			bulk = ctx->regs[v0] + 1;
 			break;
 		default:
 			break;
 	}
+	ctx->inst_count += (uint64_t)bulk * ctx->sim->options.bulk_cost;
+	__atomic_add_fetch(&ctx->sim->syscall_ns, NanosecondsSince(&startSyscall), __ATOMIC_RELAXED);
     
     ctx->pc += 4;
 	return 1;
 }
 
-void simPrintString(struct virtual_mem_region* memory, struct context* ctx)
+void simPrintString(struct virtual_memory* memory, struct context* ctx)
 {
+	//Hand the console each stretch of the string that's contiguous on the host in one go
+	struct virtual_mem_region* region;
 	uint32_t addr = ctx->regs[a0];
-	uint32_t dataAtMemAdr =	FetchWordFromVirtualMemory(addr, memory);
-
-	while(dataAtMemAdr != 0)
+	while(1)
 	{
-		for(int i=0; i<4; i++)
-		{
-			printf("%c", (char)dataAtMemAdr);
-			dataAtMemAdr = dataAtMemAdr>>8;
-			if(dataAtMemAdr == 0 && i != 3)
-				return;
-		}
-		addr += 4;
-		dataAtMemAdr = FetchWordFromVirtualMemory(addr, memory);
+		uint32_t span;
+		const char* p = (const char*)FindSpan(memory, addr, UINT32_MAX, 0, &region, &span);
+		const char* nul = memchr(p, 0, span);
+		ConsoleWrite(&ctx->sim->console, p, nul ? (size_t)(nul - p) : span);
+		if(nul != NULL)
+			return;
+		addr += span;
 	}
 }
 
-void simReadString(struct virtual_mem_region* memory, struct context* ctx)
+/**
+	@brief Syscall 8, with the semantics in the note below
+	
+	When the whole buffer is in one piece on the host the line is read straight into it, however long it is;
+	otherwise it goes through a copy of at most READ_STRING_MAX bytes. A failed read (empty line or no input left)
+	leaves an empty string.
+ */
+void simReadString(struct virtual_memory* memory, struct context* ctx)
 {
 	uint32_t addr = ctx->regs[a0];
-	uint32_t n = ctx->regs[a1];
-	char string[n];
-	struct timespec startSkip, endSkip;
-
-	clock_gettime(CLOCK_REALTIME, &startSkip);
-	scanf ("%[^\n]%*c", string);
-	clock_gettime(CLOCK_REALTIME, &endSkip);
-
-	skip += (BILLION * (endSkip.tv_sec - startSkip.tv_sec) + endSkip.tv_nsec - startSkip.tv_nsec);
-
-	if (n < 1) {
+	int32_t n = (int32_t)ctx->regs[a1];
+	if(n < 1)
+	{
+		//Nothing is stored, but the line is still consumed
+		char c;
+		InputReadLine(&ctx->sim->in, &c, 1);
 		return;
 	}
-	else if (n == 1) {
-		StoreWordToVirtualMemory(addr, 0, memory);
-		return;
+	
+	struct virtual_mem_region* region;
+	uint32_t span;
+	char* direct = (char*)FindSpan(memory, addr, n, 1, &region, &span);
+	int whole = (span == (uint32_t)n);
+	size_t size = whole ? (size_t)n : (n > READ_STRING_MAX) ? READ_STRING_MAX : (size_t)n;
+	char copy[whole ? 1 : size];
+	char* buf = whole ? direct : copy;
+	
+	int kept;
+	if(InputMayBlock(&ctx->sim->in))
+	{
+		struct timespec startSkip;
+		clock_gettime(CLOCK_MONOTONIC, &startSkip);
+		kept = InputReadLine(&ctx->sim->in, buf, size);
+		__atomic_add_fetch(&ctx->sim->skip, NanosecondsSince(&startSkip), __ATOMIC_RELAXED);
 	}
-	else {
-		int i=0;
-		while((int)string[i] != 0 && i < n-1)
-		{
-			uint32_t newData;
-			newData = 0;
-			for(int j=0; j<4; j++)
-			{
-				if(i == n-1)
-				{
-					//printf("i has reached n-1 and is writing nullChar to newData and storing newData at memAddress: %08x\n", addr);
-					StoreWordToVirtualMemory(addr, newData, memory);
-					return;
-				}
-
-				if((int)string[i] == 0)
-				{
-					if(i%4 == 0)
-						newData += 10;
-					else if(i%4 == 1)
-						newData += 10<<8;
-					else if(1%4 == 2)
-						newData += 10<<16;
-					else
-						newData += 10<<24;
-					//printf("char is a nullChar and is adding newLine to newData and ");
-					//printf("storing newData at memAddress: %08x\n", addr);
-					StoreWordToVirtualMemory(addr, newData, memory);
-					return;
-				}
-
-				//printf("writing %c to newData at memAddress: %08x\n", string[i], addr);
-				if(i%4 == 0)
-					newData += (int)string[i];
-				else if(i%4 == 1)
-					newData += ((int)string[i])<<8;
-				else if(i%4 == 2)
-					newData += ((int)string[i])<<16;
-				else
-					newData += ((int)string[i])<<24;
-				i++;
-			}
-			//printf("storing newData at memAddress: %08x and incrementing to next data block\n", addr);
-			StoreWordToVirtualMemory(addr, newData, memory);
-			addr += 4;
-		}
+	else
+		kept = InputReadLine(&ctx->sim->in, buf, size);
+	
+	//A line shorter than the buffer allows gets its newline back (there's always room for it and the NUL)
+	uint32_t len = (kept < 0) ? 1 : (uint32_t)kept + 1;
+	if( (kept >= 0) && ((size_t)kept + 1 < size) )
+	{
+		buf[kept] = '\n';
+		buf[kept + 1] = '\0';
+		len++;
 	}
+	
+	if(whole)
+		InvalidateSpan(memory, region, addr, len);
+	else
+		CopyToGuest(memory, addr, (const uint8_t*)buf, len);
 }
 
 // read string	8	$a0 = address of input buffer
@@ -405,7 +1300,7 @@ void simReadString(struct virtual_mem_region* memory, struct context* ctx)
 // null byte placed at buffer address. If n < 1, input is ignored and nothing
 // is written to the buffer. 
 
-int SimulateBswitch(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+int SimulateBswitch(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
 	switch (inst->itype.rt) {
 		case 0x01:
@@ -426,102 +1321,102 @@ int SimulateBswitch(union mips_instruction* inst, struct virtual_mem_region* mem
 	return 1;
 }
 
-void simBGEZ(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simBGEZ(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
-	if (ctx->regs[inst->itype.rs] >= 0)
-		ctx->pc += 4 + (inst->itype.imm << 2);
+	if ((int32_t)ctx->regs[inst->itype.rs] >= 0)
+		ctx->pc += 4 + (SIGN_EXTEND_16(inst->itype.imm) << 2);
     else
         ctx->pc += 4;
 }
 
-void simBGEZAL(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simBGEZAL(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
-	if (ctx->regs[inst->itype.rs] >= 0) {
+	if ((int32_t)ctx->regs[inst->itype.rs] >= 0) {
 		ctx->regs[ra] = ctx->pc + 8;
-		ctx->pc += 4 + (inst->itype.imm << 2);
+		ctx->pc += 4 + (SIGN_EXTEND_16(inst->itype.imm) << 2);
 	}
     else
         ctx->pc += 4;
 }
 
-void simBLTZ(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simBLTZ(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
-	if (ctx->regs[inst->itype.rs] < 0)
-		ctx->pc += 4 + (inst->itype.imm << 2);
+	if ((int32_t)ctx->regs[inst->itype.rs] < 0)
+		ctx->pc += 4 + (SIGN_EXTEND_16(inst->itype.imm) << 2);
     else
         ctx->pc += 4;
 }
 
-void simBLTZAL(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simBLTZAL(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
-	if (ctx->regs[inst->itype.rs] < 0) {
+	if ((int32_t)ctx->regs[inst->itype.rs] < 0) {
 		ctx->regs[ra] = ctx->pc + 8;
-		ctx->pc += 4 + (inst->itype.imm << 2);
+		ctx->pc += 4 + (SIGN_EXTEND_16(inst->itype.imm) << 2);
 	}
     else
         ctx->pc += 4;
 }
 
-void simJ(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simJ(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
 	ctx->pc = (ctx->pc & 0xf0000000) | (inst->jtype.addr << 2);
 }
 
-void simJAL(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simJAL(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
 	ctx->regs[ra] = ctx->pc + 8;
 	ctx->pc = (ctx->pc & 0xf0000000) | (inst->jtype.addr << 2);
 }
 
-void simBEQ(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simBEQ(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
 	if(ctx->regs[inst->itype.rs] == ctx->regs[inst->itype.rt])
- 		ctx->pc += 4 + (inst->itype.imm << 2);
+ 		ctx->pc += 4 + (SIGN_EXTEND_16(inst->itype.imm) << 2);
     else
         ctx->pc += 4;
 }
 
-void simBNE(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simBNE(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
 	if(ctx->regs[inst->itype.rs] != ctx->regs[inst->itype.rt])
- 		ctx->pc += 4 + (inst->itype.imm << 2);
+ 		ctx->pc += 4 + (SIGN_EXTEND_16(inst->itype.imm) << 2);
     else
         ctx->pc += 4;
 }
 
-void simBLEZ(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simBLEZ(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
-	if (ctx->regs[inst->itype.rs] <= 0)
-		ctx->pc += 4 + (inst->itype.imm << 2);
+	if ((int32_t)ctx->regs[inst->itype.rs] <= 0)
+		ctx->pc += 4 + (SIGN_EXTEND_16(inst->itype.imm) << 2);
     else
         ctx->pc += 4;
 }
 
-void simBGTZ(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simBGTZ(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
-	if (ctx->regs[inst->itype.rs] > 0)
-		ctx->pc += 4 + (inst->itype.imm << 2);
+	if ((int32_t)ctx->regs[inst->itype.rs] > 0)
+		ctx->pc += 4 + (SIGN_EXTEND_16(inst->itype.imm) << 2);
     else
         ctx->pc += 4;
 }
 
-void simADDI(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simADDI(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
-    ctx->regs[inst->itype.rt] = ctx->regs[inst->itype.rs] + inst->itype.imm;
+    ctx->regs[inst->itype.rt] = ctx->regs[inst->itype.rs] + SIGN_EXTEND_16(inst->itype.imm);
     
     ctx->pc += 4;
 }
 
-void simADDIU(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simADDIU(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
-    ctx->regs[inst->itype.rt] = ctx->regs[inst->itype.rs] + inst->itype.imm;
+    ctx->regs[inst->itype.rt] = ctx->regs[inst->itype.rs] + SIGN_EXTEND_16(inst->itype.imm);
     
     ctx->pc += 4;
 }
 
-void simSLTI(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simSLTI(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
-    if(ctx->regs[inst->itype.rs] < inst->itype.imm)
+    if((int32_t)ctx->regs[inst->itype.rs] < (int32_t)SIGN_EXTEND_16(inst->itype.imm))
         ctx->regs[inst->itype.rt] = 1;
     else
         ctx->regs[inst->itype.rt] = 0;
@@ -529,9 +1424,9 @@ void simSLTI(union mips_instruction* inst, struct virtual_mem_region* memory, st
     ctx->pc += 4;
 }
 
-void simSLTIU(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simSLTIU(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
-    if(ctx->regs[inst->itype.rs] < inst->itype.imm)
+    if(ctx->regs[inst->itype.rs] < SIGN_EXTEND_16(inst->itype.imm))
         ctx->regs[inst->itype.rt] = 1;
     else
         ctx->regs[inst->itype.rt] = 0;
@@ -539,210 +1434,222 @@ void simSLTIU(union mips_instruction* inst, struct virtual_mem_region* memory, s
     ctx->pc += 4;
 }
 
-void simANDI(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simANDI(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
     ctx->regs[inst->itype.rt] = ctx->regs[inst->itype.rs] & inst->itype.imm;
     ctx->pc += 4;
 }
 
-void simORI(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simORI(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
     ctx->regs[inst->itype.rt] = ctx->regs[inst->itype.rs] | inst->itype.imm;
     ctx->pc += 4;
 }
 
-void simXORI(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simXORI(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
     ctx->regs[inst->itype.rt] = ctx->regs[inst->itype.rs] ^ inst->itype.imm;
     ctx->pc += 4;
 }
 
-void simLUI(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simLUI(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
     ctx->regs[inst->itype.rt] = inst->itype.imm<<16;
     ctx->pc += 4;
 }
 
-void simLB(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simLB(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
-    if(inst->itype.imm % 4 == 0)
-		ctx->regs[inst->itype.rt] = FetchWordFromVirtualMemory(ctx->regs[inst->itype.rs] + inst->itype.imm, memory) & 0x000000ff;
-	else if(inst->itype.imm % 4 == 1)
-		ctx->regs[inst->itype.rt] = (FetchWordFromVirtualMemory(ctx->regs[inst->itype.rs] + inst->itype.imm - 1, memory) & 0x0000ff00)>>8;
-	else if(inst->itype.imm % 4 == 2)
-		ctx->regs[inst->itype.rt] = (FetchWordFromVirtualMemory(ctx->regs[inst->itype.rs] + inst->itype.imm - 2, memory) & 0x00ff0000)>>16;
-	else
-		ctx->regs[inst->itype.rt] = (FetchWordFromVirtualMemory(ctx->regs[inst->itype.rs] + inst->itype.imm - 3, memory) & 0xff000000)>>24;
+	ctx->regs[inst->itype.rt] = SIGN_EXTEND_8(FetchByteFromVirtualMemory(ctx->regs[inst->itype.rs] + SIGN_EXTEND_16(inst->itype.imm), memory));
+    ctx->pc += 4;
+}
 
+void simLBU(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
+{
+	ctx->regs[inst->itype.rt] = FetchByteFromVirtualMemory(ctx->regs[inst->itype.rs] + SIGN_EXTEND_16(inst->itype.imm), memory);
     ctx->pc += 4;
 }
 
-void simLW(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simLH(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
-    ctx->regs[inst->itype.rt] = FetchWordFromVirtualMemory(ctx->regs[inst->itype.rs] + inst->itype.imm, memory);
+	ctx->regs[inst->itype.rt] = SIGN_EXTEND_16(FetchHalfwordFromVirtualMemory(ctx->regs[inst->itype.rs] + SIGN_EXTEND_16(inst->itype.imm), memory));
     ctx->pc += 4;
 }
 
-void simSB(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simLHU(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
-	uint32_t tempAddressData;
-    if(inst->itype.imm % 4 == 0)
-    {
-        tempAddressData = FetchWordFromVirtualMemory(ctx->regs[inst->itype.rs] + inst->itype.imm, memory);
-        tempAddressData = tempAddressData & 0xffffff00;
-        tempAddressData = tempAddressData | (ctx->regs[inst->itype.rt] & 0x000000ff);
-        StoreWordToVirtualMemory(ctx->regs[inst->itype.rs] + inst->itype.imm, tempAddressData, memory);
-    }
-	else if(inst->itype.imm % 4 == 1)
-    {
-        tempAddressData = FetchWordFromVirtualMemory(ctx->regs[inst->itype.rs] + inst->itype.imm - 1, memory);
-        tempAddressData = tempAddressData & 0xffff00ff;
-        tempAddressData = tempAddressData | ((ctx->regs[inst->itype.rt]<<8) & 0x0000ff00);
-        StoreWordToVirtualMemory(ctx->regs[inst->itype.rs] + inst->itype.imm - 1, tempAddressData, memory);
-    }
-	else if(inst->itype.imm % 4 == 2)
-    {
-        tempAddressData = FetchWordFromVirtualMemory(ctx->regs[inst->itype.rs] + inst->itype.imm - 2, memory);
-        tempAddressData = tempAddressData & 0xff00ffff;
-        tempAddressData = tempAddressData | ((ctx->regs[inst->itype.rt]<<16) & 0x00ff0000);
-        StoreWordToVirtualMemory(ctx->regs[inst->itype.rs] + inst->itype.imm - 2, tempAddressData, memory);
-    }
-	else
-    {
-        tempAddressData = FetchWordFromVirtualMemory(ctx->regs[inst->itype.rs] + inst->itype.imm - 3, memory);
-        tempAddressData = tempAddressData & 0x00ffffff;
-        tempAddressData = tempAddressData | ((ctx->regs[inst->itype.rt]<<24) & 0xff000000);
-        StoreWordToVirtualMemory(ctx->regs[inst->itype.rs] + inst->itype.imm - 3, tempAddressData, memory);
-    }
+	ctx->regs[inst->itype.rt] = FetchHalfwordFromVirtualMemory(ctx->regs[inst->itype.rs] + SIGN_EXTEND_16(inst->itype.imm), memory);
     ctx->pc += 4;
 }
 
-void simSW(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simLW(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
-    StoreWordToVirtualMemory(ctx->regs[inst->itype.rs] + inst->itype.imm, ctx->regs[inst->itype.rt], memory);
+    ctx->regs[inst->itype.rt] = FetchWordFromVirtualMemory(ctx->regs[inst->itype.rs] + SIGN_EXTEND_16(inst->itype.imm), memory);
     ctx->pc += 4;
 }
 
-void simSLL(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simSB(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
+{
+	StoreByteToVirtualMemory(ctx->regs[inst->itype.rs] + SIGN_EXTEND_16(inst->itype.imm), ctx->regs[inst->itype.rt] & 0xff, memory);
+    ctx->pc += 4;
+}
+
+void simSH(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
+{
+	StoreHalfwordToVirtualMemory(ctx->regs[inst->itype.rs] + SIGN_EXTEND_16(inst->itype.imm), ctx->regs[inst->itype.rt] & 0xffff, memory);
+    ctx->pc += 4;
+}
+
+void simSW(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
+{
+    StoreWordToVirtualMemory(ctx->regs[inst->itype.rs] + SIGN_EXTEND_16(inst->itype.imm), ctx->regs[inst->itype.rt], memory);
+    ctx->pc += 4;
+}
+
+void simSLL(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
     ctx->regs[inst->rtype.rd] = ctx->regs[inst->rtype.rt]<<inst->rtype.shamt;
     ctx->pc += 4;
 }
 
-void simSRL(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simSRL(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
     ctx->regs[inst->rtype.rd] = ctx->regs[inst->rtype.rt]>>inst->rtype.shamt;
     ctx->pc += 4;
 }
 
-void simSRA(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simSRA(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
-    ctx->regs[inst->rtype.rd] = ctx->regs[inst->rtype.rt]>>inst->rtype.shamt;
+    ctx->regs[inst->rtype.rd] = (uint32_t)((int32_t)ctx->regs[inst->rtype.rt]>>inst->rtype.shamt);
     ctx->pc += 4;
 }
 
-void simSLLV(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simSLLV(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
-    ctx->regs[inst->rtype.rd] = ctx->regs[inst->rtype.rt]<<ctx->regs[inst->rtype.rs];
+    ctx->regs[inst->rtype.rd] = ctx->regs[inst->rtype.rt]<<(ctx->regs[inst->rtype.rs] & 31);
     ctx->pc += 4;
 }
 
-void simSRLV(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simSRLV(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
-    ctx->regs[inst->rtype.rd] = ctx->regs[inst->rtype.rt]>>ctx->regs[inst->rtype.rs];
+    ctx->regs[inst->rtype.rd] = ctx->regs[inst->rtype.rt]>>(ctx->regs[inst->rtype.rs] & 31);
     ctx->pc += 4;
 }
 
-void simJR(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simJR(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
 	ctx->pc = ctx->regs[inst->rtype.rs];
 }
 
-void simMFHI(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simMFHI(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
     ctx->regs[inst->rtype.rd] = ctx->HI;
     ctx->pc += 4;
 }
 
-void simMFLO(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simMFLO(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
     ctx->regs[inst->rtype.rd] = ctx->LO;
     ctx->pc += 4;
 }
 
-void simMULT(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simMULT(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
-    ctx->LO = ctx->regs[inst->rtype.rs] * ctx->regs[inst->rtype.rt];
+    int64_t product = (int64_t)(int32_t)ctx->regs[inst->rtype.rs] * (int32_t)ctx->regs[inst->rtype.rt];
+    ctx->LO = (uint32_t)product;
+    ctx->HI = (uint32_t)((uint64_t)product >> 32);
     ctx->pc += 4;
 }
 
-void simMULTU(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simMULTU(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
-    ctx->LO = ctx->regs[inst->rtype.rs] * ctx->regs[inst->rtype.rt];
+    uint64_t product = (uint64_t)ctx->regs[inst->rtype.rs] * ctx->regs[inst->rtype.rt];
+    ctx->LO = (uint32_t)product;
+    ctx->HI = (uint32_t)(product >> 32);
     ctx->pc += 4;
 }
 
-void simDIV(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simDIV(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
-    ctx->LO = ctx->regs[inst->rtype.rs] / ctx->regs[inst->rtype.rt];
-    ctx->HI = ctx->regs[inst->rtype.rs] % ctx->regs[inst->rtype.rt];
+    //Dividing by zero leaves HI and LO as they were
+    if(ctx->regs[inst->rtype.rt] == 0)
+    {
+        ctx->pc += 4;
+        return;
+    }
+    //Dividing by -1 negates, so INT_MIN / -1 wraps to INT_MIN rather than overflowing the host
+    if(ctx->regs[inst->rtype.rt] == 0xffffffff)
+    {
+        ctx->LO = -ctx->regs[inst->rtype.rs];
+        ctx->HI = 0;
+        ctx->pc += 4;
+        return;
+    }
+    ctx->LO = (uint32_t)((int32_t)ctx->regs[inst->rtype.rs] / (int32_t)ctx->regs[inst->rtype.rt]);
+    ctx->HI = (uint32_t)((int32_t)ctx->regs[inst->rtype.rs] % (int32_t)ctx->regs[inst->rtype.rt]);
     
     ctx->pc += 4;
 }
 
-void simDIVU(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simDIVU(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
+    //Dividing by zero leaves HI and LO as they were
+    if(ctx->regs[inst->rtype.rt] == 0)
+    {
+        ctx->pc += 4;
+        return;
+    }
     ctx->LO = ctx->regs[inst->rtype.rs] / ctx->regs[inst->rtype.rt];
     ctx->HI = ctx->regs[inst->rtype.rs] % ctx->regs[inst->rtype.rt];
     
     ctx->pc += 4;
 }
 
-void simADD(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simADD(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
     ctx->regs[inst->rtype.rd] = ctx->regs[inst->rtype.rs] + ctx->regs[inst->rtype.rt];
     ctx->pc += 4;
 }
 
-void simADDU(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simADDU(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
     ctx->regs[inst->rtype.rd] = ctx->regs[inst->rtype.rs] + ctx->regs[inst->rtype.rt];
     ctx->pc += 4;
 }
 
-void simSUB(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simSUB(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
     ctx->regs[inst->rtype.rd] = ctx->regs[inst->rtype.rs] - ctx->regs[inst->rtype.rt];
     ctx->pc += 4;
 }
 
-void simSUBU(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simSUBU(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
     ctx->regs[inst->rtype.rd] = ctx->regs[inst->rtype.rs] - ctx->regs[inst->rtype.rt];
     ctx->pc += 4;
 }
 
-void simAND(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simAND(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
     ctx->regs[inst->rtype.rd] = ctx->regs[inst->rtype.rs] & ctx->regs[inst->rtype.rt];
     ctx->pc += 4;
 }
 
-void simOR(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simOR(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
     ctx->regs[inst->rtype.rd] = ctx->regs[inst->rtype.rs] | ctx->regs[inst->rtype.rt];
     ctx->pc += 4;
 }
 
-void simXOR(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simXOR(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
     ctx->regs[inst->rtype.rd] = ctx->regs[inst->rtype.rs] ^ ctx->regs[inst->rtype.rt];
     ctx->pc += 4;
 }
 
-void simSLT(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simSLT(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
-    if(ctx->regs[inst->rtype.rs] < ctx->regs[inst->rtype.rt])
+    if((int32_t)ctx->regs[inst->rtype.rs] < (int32_t)ctx->regs[inst->rtype.rt])
         ctx->regs[inst->rtype.rd] = 1;
     else
         ctx->regs[inst->rtype.rd] = 0;
@@ -750,7 +1657,7 @@ void simSLT(union mips_instruction* inst, struct virtual_mem_region* memory, str
     ctx->pc += 4;
 }
 
-void simSLTU(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx)
+void simSLTU(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
 {
     if(ctx->regs[inst->rtype.rs] < ctx->regs[inst->rtype.rt])
         ctx->regs[inst->rtype.rd] = 1;
@@ -759,3 +1666,29 @@ void simSLTU(union mips_instruction* inst, struct virtual_mem_region* memory, st
     
     ctx->pc += 4;
 }
+
+void simLL(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
+{
+	uint32_t address = ctx->regs[inst->itype.rs] + SIGN_EXTEND_16(inst->itype.imm);
+	ctx->link_value = LoadLinkedWord(address, memory);
+	ctx->link_address = address;
+	ctx->link_valid = 1;
+	ctx->regs[inst->itype.rt] = ctx->link_value;
+	ctx->pc += 4;
+}
+
+void simSC(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
+{
+	uint32_t address = ctx->regs[inst->itype.rs] + SIGN_EXTEND_16(inst->itype.imm);
+	int stored = ctx->link_valid && (ctx->link_address == address) &&
+		StoreConditionalWord(address, ctx->link_value, ctx->regs[inst->itype.rt], memory);
+	ctx->link_valid = 0;
+	ctx->regs[inst->itype.rt] = stored;
+	ctx->pc += 4;
+}
+
+void simSYNC(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	ctx->pc += 4;
+}
@@ -8,6 +8,7 @@
 #define sim_h
 
 #define _POSIX_C_SOURCE 199309
+#define _DEFAULT_SOURCE		//for MAP_ANONYMOUS
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // System headers
@@ -15,7 +16,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <setjmp.h>
+#include <pthread.h>
 #include <linux/elf.h>
+#include "monitor.h"
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Opcode table
@@ -42,9 +46,15 @@ enum opcodes
     OP_XORI     = 0x0e, //done | testing complete
     OP_LUI      = 0x0f, //done | testing complete
     OP_LB       = 0x20, //done | testing complete
+    OP_LH       = 0x21,
     OP_LW       = 0x23, //done | testing complete
+    OP_LBU      = 0x24,
+    OP_LHU      = 0x25,
     OP_SB       = 0x28, //done | testing complete
-	OP_SW		= 0x2b  //done | testing complete
+    OP_SH       = 0x29,
+	OP_SW		= 0x2b, //done | testing complete
+	OP_LL		= 0x30,
+	OP_SC		= 0x38
 };
 
 enum functions
@@ -56,6 +66,7 @@ enum functions
     FUNC_SRLV       = 0x06, //done | testing complete 
 	FUNC_JR			= 0x08, //done | testing complete
 	FUNC_SYSCALL	= 0x0c, //done | testing complete
+	FUNC_SYNC		= 0x0f,
     FUNC_MFHI       = 0x10, //done | testing complete
     FUNC_MFLO       = 0x12, //done | testing complete
     FUNC_MULT       = 0x18, //done | testing complete
@@ -80,6 +91,7 @@ enum regids
 {
 	REGID_ZERO = 0,
 	REGID_A0 = 4,
+	REGID_GP = 28,
 	REGID_SP = 29,
 	REGID_RA = 31
 };
@@ -121,9 +133,127 @@ union mips_instruction
 	uint32_t word;
 };
 
+//Sign-extends a 16-bit immediate field (or loaded halfword) to a full word
+#define SIGN_EXTEND_16(x) ((uint32_t)(int32_t)(int16_t)(x))
+
+//Sign-extends a loaded byte to a full word
+#define SIGN_EXTEND_8(x) ((uint32_t)(int32_t)(int8_t)(x))
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Predecoded instructions
+
+struct predecoded_inst;
+struct virtual_mem_region;
+struct virtual_memory;
+struct block_cache;
+struct context;
+struct simulator;
+
+typedef int (*predecoded_handler)(struct predecoded_inst* pi, struct virtual_memory* memory, struct context* ctx);
+
+/**
+	@brief Operations a word can decode to.
+	
+	Instructions that differ only in whether they trap on overflow (ADDI/ADDIU, ADD/ADDU, SUB/SUBU) share one op, since
+	no engine traps.
+ */
+enum predecoded_ops
+{
+	PD_INVALID_OPCODE,
+	PD_INVALID_FUNC,
+	PD_INVALID_BRANCH,
+	PD_BGEZ,
+	PD_BGEZAL,
+	PD_BLTZ,
+	PD_BLTZAL,
+	PD_J,
+	PD_JAL,
+	PD_BEQ,
+	PD_BNE,
+	PD_BLEZ,
+	PD_BGTZ,
+	PD_ADDI,
+	PD_SLTI,
+	PD_SLTIU,
+	PD_ANDI,
+	PD_ORI,
+	PD_XORI,
+	PD_LUI,
+	PD_LB,
+	PD_LBU,
+	PD_LH,
+	PD_LHU,
+	PD_LW,
+	PD_SB,
+	PD_SH,
+	PD_SW,
+	PD_SLL,
+	PD_SRL,
+	PD_SRA,
+	PD_SLLV,
+	PD_SRLV,
+	PD_JR,
+	PD_SYSCALL,
+	PD_MFHI,
+	PD_MFLO,
+	PD_MULT,
+	PD_MULTU,
+	PD_DIV,
+	PD_DIVU,
+	PD_ADD,
+	PD_SUB,
+	PD_AND,
+	PD_OR,
+	PD_XOR,
+	PD_SLT,
+	PD_SLTU,
+	PD_LL,
+	PD_SC,
+	PD_SYNC,
+	
+	PD_COUNT
+};
+
+/**
+	@brief One instruction word, decoded once into the fields its handler needs.
+	
+	A NULL handler means the word has not been decoded yet (or its page was invalidated by a store). The handler may
+	also run the next word as part of a fused pair; op always describes this word alone.
+	
+	Harts share records. The handler is written last, with release semantics, and read with acquire, so anyone who
+	sees a handler also sees the fields it uses.
+ */
+struct predecoded_inst
+{
+	predecoded_handler handler;
+	uint32_t imm;		//sign-extended (zero-extended for andi/ori/xori, pre-shifted for lui)
+	uint32_t target;	//precomputed branch/jump target
+	uint8_t op;			//one of predecoded_ops
+	uint8_t rs;
+	uint8_t rt;
+	uint8_t rd;
+	uint8_t shamt;
+};
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Virtual memory
 
+//Guest pages are 4 KB. A 32-bit address splits into a 10-bit directory index, 10-bit table index and 12-bit offset
+#define VM_PAGE_SHIFT		12
+#define VM_PAGE_SIZE		(1 << VM_PAGE_SHIFT)
+#define VM_PAGE_MASK		(VM_PAGE_SIZE - 1)
+#define VM_L1_SHIFT			22
+#define VM_L1_ENTRIES		(1 << (32 - VM_L1_SHIFT))
+#define VM_L2_ENTRIES		(1 << (VM_L1_SHIFT - VM_PAGE_SHIFT))
+
+//The stack starts as VM_STACK_INITIAL bytes just below VM_STACK_TOP and may grow down to VM_STACK_MAX below it
+#define VM_STACK_TOP		0xc0008000u
+#define VM_STACK_INITIAL	0x8000
+#define VM_STACK_MAX		(256u << 20)
+
+//Smallest step the heap mapping grows by
+#define VM_GROW_MIN			(64u << 10)
+
 /**
 	@brief One contiguous region of virtual memory (corresponds to an ELF program header).
  */
@@ -133,8 +263,80 @@ struct virtual_mem_region
 	uint32_t len;
 	uint32_t* data;
 	struct virtual_mem_region* next;
+	
+	//Host mapping that data lives in (page aligned, data may start partway into it), or NULL if data was malloc'd
+	void* map_base;
+	size_t map_len;
+	
+	//Predecode cache, allocated the first time we execute from this region
+	struct predecoded_inst* decoded;
+	uint8_t* decoded_pages;		//nonzero for each page holding at least one decoded entry
+	
+	//Reset tracking: dirty_pages is NULL unless there's a snapshot, pristine unless the region was there when it was
+	//taken
+	uint8_t* dirty_pages;		//nonzero for each page stored to since the snapshot
+	uint8_t* pristine;			//contents at the snapshot (page-aligned mapping), NULL if they were all zeros
+};
+
+/**
+	@brief Translation for one guest page.
+	
+	Offsets [lo, lo+span) within the page belong to a single region and are at host address bias + guest address.
+	Everything else (unmapped, shared by several regions, or in a region that isn't word aligned) has span 0 and
+	goes through the region list walk, which also does all the segfault reporting.
+ */
+struct page_table_entry
+{
+	uintptr_t bias;
+	struct virtual_mem_region* region;
+	uint16_t lo;
+	uint16_t span;
 };
 
+/**
+	@brief A guest address space: the region list plus a two-level page table over it.
+	
+	Directory slots with nothing mapped point at a shared all-slow table, so lookups never need a NULL check.
+ */
+struct virtual_memory
+{
+	struct virtual_mem_region* regions;
+	struct page_table_entry* pages[VM_L1_ENTRIES];
+	
+	//Set when a store overwrote a word that had been decoded; engines caching more than single words flush on it
+	int code_dirty;
+	
+	//Set whenever a word gets decoded, so the code cache knows whether it has anything new to save
+	int decoded_new;
+	
+	//Basic blocks built by the threaded engine, NULL until it first runs
+	struct block_cache* blocks;
+	
+	//Demand-mapped areas. [stack_bottom, stack_top) is mapped and may grow down to stack_limit; the heap runs from
+	//heap_start to the break and is mapped up to heap_end (never past stack_limit). All zero if there's no stack
+	uint32_t stack_top;
+	uint32_t stack_bottom;
+	uint32_t stack_limit;
+	uint32_t heap_start;
+	uint32_t brk;
+	uint32_t heap_end;
+	
+	//Instance this address space belongs to (for reporting faults)
+	struct simulator* sim;
+	
+	//Set when several harts run here. Changes to the region list, page table and decode caches then take lock
+	int shared;
+	pthread_mutex_t lock;
+};
+
+/**
+	@brief Looks up the page table entry for an address
+ */
+static inline struct page_table_entry* LookupPage(struct virtual_memory* memory, uint32_t address)
+{
+	return &memory->pages[address >> VM_L1_SHIFT][(address >> VM_PAGE_SHIFT) & (VM_L2_ENTRIES - 1)];
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // CPU context
 
@@ -147,6 +349,14 @@ struct context
 	uint32_t regs[32];
 	uint32_t HI;
     uint32_t LO;
+	
+	uint64_t inst_count;		//instructions retired so far
+	struct simulator* sim;		//instance this CPU belongs to
+	
+	uint32_t hart;				//which hart this is, 0 for the one that starts at the ELF entry point
+	uint32_t link_address;		//address of the last ll, while link_valid
+	uint32_t link_value;		//what it loaded
+	int link_valid;				//cleared by sc and syscalls
 };
 
 enum mips_regids
@@ -163,68 +373,1043 @@ enum mips_regids
 	ra
 };
 
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Console output
+
+//Guest output is staged in blocks of this size (power of two)
+#define CONSOLE_BUFFER_SIZE		(64 * 1024)
+
+/**
+	@brief Buffered guest console output (simulator messages go through it too, so everything stays in order).
+	
+	Normally bytes collect in the buffer and are written out when it fills or on ConsoleFlush. With a writer thread
+	the buffer is instead a single-producer single-consumer ring: the simulation thread only ever copies into it and
+	bumps head, the writer drains it and bumps tail, and neither takes a lock.
+ */
+struct console
+{
+	FILE* out;
+	char* buffer;
+	size_t used;					//bytes waiting in the buffer (no writer thread)
+	
+	int async;						//nonzero once the writer thread is running
+	pthread_t writer;
+	uint64_t head;					//total bytes produced, only written by the simulation thread
+	uint64_t tail;					//total bytes written out, only written by the writer thread
+	uint64_t flush_request;			//bumped by ConsoleFlush...
+	uint64_t flush_done;			//...and echoed by the writer once everything before it is out
+	int stop;
+	
+	int shared;						//several harts write, so every call takes lock
+	pthread_mutex_t lock;
+};
+
+void InitConsole(struct console* con, FILE* out);
+void StartConsoleWriter(struct console* con);
+void ConsoleWrite(struct console* con, const char* data, size_t len);
+void ConsolePrintf(struct console* con, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void ConsoleFlush(struct console* con);
+void ConsoleRedirect(struct console* con, FILE* out);
+void ShareConsole(struct console* con);
+void CloseConsole(struct console* con);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Console input
+
+/**
+	@brief Where syscalls 5 and 8 read from: a stdio stream, or an input file mapped into memory
+	
+	A mapped file is served straight from memory and never waits. Reading from the stream can copy every byte the
+	guest consumes to a record file, which can be given back as --input to replay the same run unattended.
+ */
+struct console_input
+{
+	FILE* fp;						//used when data is NULL
+	const uint8_t* data;			//mapped input file (or a buffer someone else owns), NULL for none
+	size_t len;
+	int mapped;						//data was mapped by MapInputFile, and gets unmapped on close
+	size_t pos;						//next byte of data to hand out
+	FILE* record;					//gets a copy of everything read from fp, NULL for none
+	
+	int shared;						//several harts read, so every read takes lock
+	pthread_mutex_t lock;
+};
+
+void InitInput(struct console_input* input, FILE* fp);
+int MapInputFile(struct console_input* input, const char* path);
+void SetInputBuffer(struct console_input* input, const uint8_t* data, size_t len);
+void ExtendInputBuffer(struct console_input* input, const uint8_t* data, size_t len);
+int RecordInput(struct console_input* input, const char* path);
+int InputReadInt(struct console_input* input, uint32_t* value);
+int InputReadLine(struct console_input* input, char* buf, size_t size);
+int InputMayBlock(const struct console_input* input);
+void ShareInput(struct console_input* input);
+void CloseInput(struct console_input* input);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Simulator instances
+
+//Why a run stopped
+enum halt_reasons
+{
+	HALT_NONE,			//ran into an invalid instruction
+	HALT_EXIT,			//syscall 10
+	HALT_FAULT,			//segfault, or the ELF couldn't be loaded
+	HALT_BUDGET,		//ran as many instructions as it was given, and can carry on
+	HALT_BREAK			//stopped for the debugger (breakpoint, watchpoint), and can carry on
+};
+
+//Replacement policies for the cache model
+enum cache_replacement
+{
+	CACHE_LRU,
+	CACHE_FIFO,
+	CACHE_RANDOM
+};
+
+//Write policies for the cache model
+enum cache_write_policy
+{
+	CACHE_WRITE_BACK,				//write-allocate, dirty lines written back on eviction
+	CACHE_WRITE_THROUGH				//no-write-allocate, every store goes to memory
+};
+
+//Geometry and policies of one modeled cache, size 0 for no cache
+struct cache_config
+{
+	uint32_t size;					//bytes
+	uint32_t assoc;					//ways per set
+	uint32_t line;					//bytes per line
+	int replacement;				//one of cache_replacement
+	int write_policy;				//one of cache_write_policy
+};
+
+//Settings for the pipeline timing model
+struct pipeline_config
+{
+	int enabled;
+	int forwarding;					//results forwarded to EX, otherwise consumers wait for WB
+	uint32_t mult_latency;			//cycles until MULT/MULTU results can be read from HI/LO
+	uint32_t div_latency;			//same for DIV/DIVU
+	uint32_t branch_penalty;		//cycles lost to a taken branch or jr (resolved in EX)
+	uint32_t miss_penalty;			//cycles the pipeline stalls on a cache miss
+};
+
+//Branch direction predictors
+enum predictors
+{
+	PREDICTOR_NONE,
+	PREDICTOR_STATIC,				//always not taken
+	PREDICTOR_BTFN,					//backward taken, forward not taken
+	PREDICTOR_BIMODAL,				//2-bit counters indexed by PC
+	PREDICTOR_GSHARE				//2-bit counters indexed by PC xor global history
+};
+
+//Settings for the branch predictor model
+struct predictor_config
+{
+	int kind;						//one of predictors
+	uint32_t bits;					//log2 of the counter table size (and history length for gshare)
+	uint32_t ras_depth;				//return address stack entries, 0 for none
+};
+
+//Command line settings that apply to every instance
+struct sim_options
+{
+	int engine;						//one of engines
+	int verify;						//check the engine against the reference interpreter as it runs
+	int fast_forward;				//let the block engines skip loops they can work out the end of
+	int async_output;				//drain console output from a writer thread
+	int huge_pages;					//ask for transparent huge pages on the stack and heap
+	const char* profile_path;		//run under the profiler and write its report here, NULL for none
+	const char* report_path;		//write a JSON performance report here when the program stops, NULL for none
+	const char* checkpoint_path;	//where checkpoints go, NULL to never take one
+	uint64_t checkpoint_at;			//take a checkpoint once this many instructions have run, 0 for only on syscall 90
+	const char* restore_path;		//start from this checkpoint instead of an ELF, NULL for none
+	const char* trace_path;			//write a binary execution trace here, NULL for none
+	const char* replay_path;		//replay this trace into the models instead of running anything, NULL for none
+	const char* input_path;			//serve console input from this file instead of the input stream, NULL for none
+	const char* record_input_path;	//copy console input read from the stream here, NULL for none
+	uint32_t harts;					//most harts that may run at once, 1 for no spawning
+	uint32_t bulk_cost;				//instructions counted per byte syscalls 110-113 go through, on top of the syscall
+	int gdb_port;					//wait for GDB on this TCP port and run under it, 0 for no debugger
+	const char* code_cache_dir;		//keep decoded code for each program in here between runs, NULL for none
+	const char* monitor_path;		//keep live counters in this file while running, NULL for none
+	const char* watch_path;			//instead of running anything, follow the counters in this file, NULL for none
+	struct cache_config icache;		//L1 instruction cache model
+	struct cache_config dcache;		//L1 data cache model
+	struct pipeline_config pipeline;
+	struct predictor_config predictor;
+};
+
+void InitOptions(struct sim_options* options);
+int ParseOption(const char* arg, struct sim_options* options);
+int CheckOptions(const struct sim_options* options);
+
+/**
+	@brief Everything one guest program run needs.
+	
+	Nothing is shared between instances, so several can run at once on different threads.
+ */
+struct simulator
+{
+	struct virtual_memory memory;
+	struct context ctx;
+	struct sim_options options;
+	
+	struct console console;			//guest console output and simulator messages
+	struct console_input in;		//guest console input
+	const char* stats_path;			//where the output.txt stats go
+	struct profile* profile;		//execution profile, NULL unless profiling
+	struct model* model;			//cache and timing models, NULL unless any were asked for
+	struct hart_set* harts;			//spawned harts, NULL unless more than one may run
+	struct snapshot* snapshot;		//state right after loading, to reset to, NULL unless one was taken
+	struct verifier* verifier;		//reference run shadowing this one, NULL unless verifying
+	struct debugger* debugger;		//GDB connection, NULL unless running under one
+	struct monitor* monitor;		//live counters, NULL unless --monitor was given
+	
+	const char* program;			//ELF being run
+	uint64_t code_hash;				//of its PT_LOAD segments, names its code cache file (0 if it came from a checkpoint)
+	uint64_t stop_at;				//inst_count where the current run has used up its budget, UINT64_MAX for none
+	int finished;					//the program has stopped for good (or never loaded)
+	
+	//Timing, all CLOCK_MONOTONIC nanoseconds
+	struct timespec load_start;		//when loading started
+	struct timespec start;			//when execution started
+	int running;					//start is valid, and the clock hasn't been stopped yet
+	uint64_t load_ns;				//reading and mapping the ELF
+	uint64_t run_ns;				//wall time spent executing, from start to halt (less any pauses)
+	uint64_t syscall_ns;			//part of run_ns spent in syscalls, including skip
+	uint64_t skip;					//time spent waiting for console input, not counted as run time
+	uint64_t elapsed;				//run time once halted: run_ns - skip
+	uint64_t forwarded_loops;		//loops the block engines fast-forwarded through
+	uint64_t forwarded_insts;		//instructions those would have run, included in ctx.inst_count
+	uint64_t forwarded_ns;			//how long they would have taken, going by the trips timed before each skip
+	
+	int halt_reason;				//one of halt_reasons
+	jmp_buf halt;					//where HaltSimulator returns to
+};
+
+void InitSimulator(struct simulator* sim, const struct sim_options* options, FILE* out, FILE* in,
+	const char* stats_path);
+int RunProgram(struct simulator* sim, const char* fname);
+int LoadProgram(struct simulator* sim, const char* fname);
+int LoadProgramImage(struct simulator* sim, const char* name, const uint8_t* image, size_t image_len);
+int ContinueProgram(struct simulator* sim, uint64_t max_insts);
+int RestartProgram(struct simulator* sim);
+void FreeSimulator(struct simulator* sim);
+void HaltSimulator(struct simulator* sim, int reason) __attribute__((noreturn));
+const char* HaltReasonName(int reason);
+void WriteReport(struct simulator* sim);
+void WriteStats(FILE* out, struct simulator* sim);
+
+void ExitProgram(struct context* ctx) __attribute__((noreturn));
+
+int RunBatch(const char* list, int threads, const struct sim_options* options);
+int RunServer(const char* path, const struct sim_options* options);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Harts
+
+//Instructions a hart runs between checks for the program having stopped
+#define HART_POLL_INTERVAL	4096
+
+//Where a spawned hart is in its life
+enum hart_states
+{
+	HART_FREE,						//never started, or joined (the slot can be reused)
+	HART_RUNNING,
+	HART_EXITED						//finished, waiting to be joined
+};
+
+/**
+	@brief A hart started by the spawn syscall, running on its own host thread
+ */
+struct hart
+{
+	struct context ctx;
+	int state;						//one of hart_states
+	int joining;					//somebody is waiting for it
+	uint32_t exit_value;			//$a0 of its exit syscall
+	int halt_reason;				//why it stopped, one of halt_reasons
+	int thread_started;				//thread exists and hasn't been joined on the host yet
+	pthread_t thread;
+	jmp_buf halt;					//where HaltSimulator returns to on this hart's thread
+};
+
+/**
+	@brief Every hart besides hart 0 (which is the simulator's own context, run by the thread calling RunProgram)
+	
+	Harts run the predecoded interpreter independently and never take a lock on the way: they share the decode cache
+	and page table through acquire/release publication, and only decoding a word, growing memory, console I/O and
+	hart management lock anything. Ordinary guest loads and stores are plain host accesses, so between harts they're
+	only as ordered as the host makes them (TSO on x86-64). ll/sc, sync, and spawn/join (which act as release and
+	acquire) are the ways to order them.
+ */
+struct hart_set
+{
+	uint32_t count;					//harts[1..count-1] can be spawned, harts[0] is unused
+	struct hart* harts;
+	
+	pthread_mutex_t lock;			//protects everything below, and the state of each hart
+	pthread_cond_t changed;			//broadcast when a hart exits or the program stops
+	int stop;						//set once the program is ending, polled by every hart
+	int stop_reason;				//why, one of halt_reasons
+	uint64_t retired;				//instructions run by harts that have already been joined
+};
+
+void InitHarts(struct simulator* sim);
+void RunHart(struct virtual_memory* memory, struct context* ctx);
+struct hart* CurrentHart(void);
+void StopProgram(struct simulator* sim, int reason);
+void StopHarts(struct simulator* sim);
+uint32_t SpawnHart(struct context* ctx, uint32_t entry, uint32_t stack, uint32_t arg);
+uint32_t JoinHart(struct context* ctx, uint32_t id);
+void ExitHart(struct context* ctx, uint32_t value) __attribute__((noreturn));
+void FreeHarts(struct simulator* sim);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Profiler
+
+//How many of the hottest PCs the profile report lists
+#define PROFILE_HOT_PCS		32
+
+//A function (or code label) from the ELF symbol table
+struct elf_symbol
+{
+	uint32_t addr;
+	uint32_t size;					//0 if unknown, it then runs up to the next symbol
+	char* name;
+};
+
+//Execution counts for every word of one region, indexed like its predecode cache
+struct profile_region
+{
+	struct virtual_mem_region* region;
+	uint64_t* counts;
+	struct profile_region* next;
+};
+
+/**
+	@brief Everything the profiling interpreter collects.
+	
+	Only exists when profiling, the normal engines never look at it.
+ */
+struct profile
+{
+	uint64_t opcodes[64];			//by opcode field
+	uint64_t functions[64];			//R-type, by function field
+	uint64_t regimm[32];			//OP_BGEZ and friends, by rt field
+	struct profile_region* regions;
+	
+	struct elf_symbol* symbols;		//sorted by address
+	size_t symbol_count;
+};
+
+void RunProfiler(struct virtual_memory* memory, struct context* ctx);
+void AddProfileSymbol(struct profile* prof, uint32_t addr, uint32_t size, const char* name);
+void WriteProfile(struct simulator* sim);
+void ClearProfile(struct profile* prof);
+void FreeProfile(struct profile* prof);
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Startup
 
-void ReadELF(const char* fname, struct virtual_mem_region** memory, struct context* ctx);
+void ReadELF(const char* fname, struct simulator* sim);
+void ReadELFImage(const char* name, const uint8_t* image, size_t image_len, struct simulator* sim);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Per-PC statistics
+
+//Event and miss counts for one PC. Only misses are counted as they happen, events are filled in for the report.
+struct pc_stat
+{
+	uint32_t pc;
+	uint32_t used;
+	uint64_t events;
+	uint64_t misses;
+};
+
+//Open-addressed hash table of pc_stats, grown to stay at most half full
+struct pc_stats
+{
+	struct pc_stat* slots;
+	uint32_t mask;
+	uint32_t used;
+};
+
+void InitPcStats(struct pc_stats* stats);
+struct pc_stat* GetPcStat(struct pc_stats* stats, uint32_t pc);
+void WritePcStats(FILE* fp, const struct pc_stats* stats, const char* title, size_t limit);
+void FreePcStats(struct pc_stats* stats);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Cache and timing models
+
+//How many PCs each per-PC model table lists
+#define MODEL_TOP_PCS		16
+
+/**
+	@brief One set-associative cache
+ */
+struct cache
+{
+	const char* name;
+	struct cache_config config;
+	uint32_t line_shift;
+	uint32_t set_mask;
+	
+	//Per line, indexed set * assoc + way
+	uint32_t* tags;					//line address (address >> line_shift)
+	uint8_t* valid;
+	uint8_t* dirty;
+	uint64_t* stamps;				//last use (LRU) or fill time (FIFO)
+	uint64_t clock;
+	uint32_t random;				//xorshift state for CACHE_RANDOM
+	
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t read_misses;
+	uint64_t write_misses;
+	uint64_t writebacks;			//dirty lines evicted
+	uint64_t write_throughs;		//stores sent straight to memory
+	struct pc_stats pcs;			//misses by instruction PC
+};
+
+//Why the pipeline model stalled
+enum pipeline_stalls
+{
+	STALL_RAW,						//waiting on an ALU result (only without forwarding)
+	STALL_LOAD_USE,					//waiting on a load
+	STALL_BRANCH,					//refetching after a taken branch or jump
+	STALL_MULTDIV,					//waiting on HI/LO, or for the multiply/divide unit to be free
+	STALL_ICACHE,					//instruction cache misses
+	STALL_DCACHE,					//data cache misses
+	STALL_COUNT
+};
+
+/**
+	@brief Classic in-order 5-stage (IF ID EX MEM WB) timing model
+	
+	Tracks, for every register, the first cycle a consumer's EX stage could use its value, and moves each
+	instruction's EX cycle back past whatever it has to wait for.
+ */
+struct pipeline
+{
+	struct pipeline_config config;
+	
+	uint64_t last_ex;				//EX cycle of the previous instruction
+	uint64_t redirect;				//earliest EX cycle after a taken branch
+	uint64_t reg_ready[32];
+	uint8_t reg_from_load[32];		//reg_ready was set by a load
+	uint64_t hilo_ready;
+	uint64_t unit_free;				//multiply/divide unit isn't pipelined
+	
+	uint64_t stalls[STALL_COUNT];
+};
+
+struct predictor;
+
+//One direction predictor implementation
+struct predictor_ops
+{
+	const char* name;
+	int (*predict)(struct predictor* pred, uint32_t pc, uint32_t target);
+	void (*update)(struct predictor* pred, uint32_t pc, int taken);
+};
+
+/**
+	@brief Branch predictor model: a direction predictor plus an optional return address stack
+ */
+struct predictor
+{
+	const struct predictor_ops* ops;
+	struct predictor_config config;
+	
+	uint8_t* counters;				//2-bit saturating counters, for the table based predictors
+	uint32_t mask;
+	uint32_t history;				//global taken/not taken history, newest in bit 0
+	
+	uint32_t* ras;					//circular, oldest entries are overwritten
+	uint32_t ras_top;
+	uint32_t ras_count;
+	
+	uint64_t branches;
+	uint64_t mispredicts;
+	uint64_t returns;				//jr ra
+	uint64_t return_mispredicts;
+	uint64_t indirect;				//other jr, which are never predicted
+	struct pc_stats pcs;			//mispredictions by branch PC
+};
+
+//How many times each word of one region has run, indexed like its predecode cache
+struct model_region
+{
+	struct virtual_mem_region* region;
+	uint64_t* executed;
+	struct model_region* next;
+};
+
+/**
+	@brief Everything the modeling interpreter keeps track of
+	
+	Only exists when a model was asked for, the normal engines never look at it.
+ */
+struct model
+{
+	struct cache* icache;			//NULL if not modeled
+	struct cache* dcache;
+	struct pipeline* pipeline;
+	struct predictor* predictor;
+	struct trace* trace;			//trace being written, opened when the model loop starts
+	
+	//Execution counts, which are also the per-PC access counts: every instruction is one fetch and at most one
+	//data access
+	struct model_region* regions;
+	struct pc_stats* replayed;		//the same by PC, when replaying a trace (which has no regions)
+};
+
+int ParseCacheConfig(const char* text, struct cache_config* config);
+struct cache* CreateCache(const char* name, const struct cache_config* config);
+int CacheAccess(struct cache* cache, uint32_t pc, uint32_t address, int write);
+void WriteCacheStats(FILE* fp, const struct cache* cache);
+void FreeCache(struct cache* cache);
+
+struct pipeline* CreatePipeline(const struct pipeline_config* config);
+void PipelineStep(struct pipeline* pipe, union mips_instruction inst, int redirected, int icache_miss,
+	int dcache_miss);
+void WritePipelineStats(FILE* fp, const struct pipeline* pipe, uint64_t inst_count);
+
+int ParsePredictorConfig(const char* text, struct predictor_config* config);
+struct predictor* CreatePredictor(const struct predictor_config* config);
+int PredictBranch(struct predictor* pred, uint32_t pc, uint32_t target, int taken);
+void PushReturn(struct predictor* pred, uint32_t address);
+int PredictReturn(struct predictor* pred, uint32_t pc, uint32_t target);
+int PredictIndirect(struct predictor* pred, uint32_t pc);
+void WritePredictorStats(FILE* fp, const struct predictor* pred);
+void FreePredictor(struct predictor* pred);
+
+struct model* CreateModel(const struct sim_options* options);
+void ModelInstruction(struct model* model, union mips_instruction inst, uint32_t pc, uint32_t next_pc, int access,
+	uint32_t address, int write);
+void RunModel(struct virtual_memory* memory, struct context* ctx);
+void WriteModelStats(FILE* fp, struct model* model, uint64_t inst_count);
+void FreeModel(struct model* model);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Execution traces
+
+//Raw events between the simulation and the trace writer thread (power of two)
+#define TRACE_RING_SIZE		65536
+
+//Entries in the coder's table of instruction words last seen at each PC (power of two)
+#define TRACE_WORD_CACHE	65536
+
+//One retired instruction, as handed to the trace writer
+struct trace_event
+{
+	uint32_t pc;
+	uint32_t word;
+	uint32_t address;				//loads and stores only
+	uint32_t value;					//value stored, or loaded
+};
+
+//What encoding and decoding both have to track to turn records back into events
+struct trace_coder
+{
+	uint32_t next_pc;				//where the previous instruction went
+	uint32_t address;				//previous data access
+	uint32_t* cache_pc;
+	uint32_t* cache_word;
+};
+
+/**
+	@brief A trace file being written. The simulation thread fills a ring of raw events that a writer thread encodes
+	and writes out.
+ */
+struct trace
+{
+	FILE* fp;
+	struct trace_event* ring;
+	uint64_t head;					//next event to fill
+	uint64_t published;				//head as last shown to the writer
+	uint64_t tail_seen;				//tail as the simulation last saw it
+	uint64_t tail;					//next event to encode
+	int stop;
+	int threaded;					//0 if the writer couldn't be started, the ring is then drained inline
+	pthread_t writer;
+
+	//Owned by whoever drains the ring
+	struct trace_coder coder;
+	uint8_t* out;
+	size_t out_used;
+};
+
+struct trace* CreateTrace(const char* path);
+void TraceInstruction(struct trace* trace, uint32_t pc, uint32_t word, uint32_t address, uint32_t value);
+void CloseTrace(struct trace* trace, uint32_t next_pc);
+void FreeTrace(struct trace* trace);
+int ReplayTrace(const struct sim_options* options, const char* path, const char* stats_path);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Checkpoints
+
+void WriteCheckpoint(struct simulator* sim, uint32_t pc, uint64_t inst_count);
+int RunToCheckpoint(struct virtual_memory* memory, struct context* ctx, uint64_t target);
+void ReadCheckpoint(const char* fname, struct simulator* sim);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Code cache
+
+//Starting value for HashCode
+#define CODE_HASH_SEED		0xcbf29ce484222325ull
+
+uint64_t HashCode(uint64_t hash, const void* data, size_t len);
+void LoadCodeCache(struct simulator* sim);
+void SaveCodeCache(struct simulator* sim);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Live counters
+
+//Instructions between updates of the monitor file, checked at block boundaries
+#define MONITOR_INTERVAL	(1u << 16)
+
+//Instructions per second are measured over at least this many nanoseconds
+#define MONITOR_RATE_NS		100000000ull
+
+/**
+	@brief The --monitor file, and what goes into it next
+ */
+struct monitor
+{
+	struct sim_monitor_page* page;	//shared mapping of the file
+	uint64_t next;					//inst_count at which the engines update it next
+	uint64_t syscalls[SIM_MONITOR_SYSCALLS];	//counted here as they happen, copied in with each update
+	struct timespec rate_start;		//when the current instructions per second measurement started
+	uint64_t rate_count;			//inst_count then
+	uint64_t ips;					//result of the last measurement
+};
+
+int OpenMonitor(struct simulator* sim);
+uint64_t UpdateMonitor(struct simulator* sim, int state);
+void FinishMonitor(struct simulator* sim);
+void RunMonitored(struct virtual_memory* memory, struct context* ctx,
+	void (*run_until)(struct virtual_memory* memory, struct context* ctx, uint64_t target));
+void CloseMonitor(struct simulator* sim);
+int WatchMonitor(const char* path);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Snapshots
+
+//A page stored to since the snapshot
+struct dirty_page
+{
+	struct virtual_mem_region* region;
+	uint32_t page;					//index within the region
+};
+
+/**
+	@brief A loaded program as it was before running, so it can be reset without loading it again
+
+	Every region that existed then has a pristine copy of its nonzero pages and a dirty flag per page; the first store
+	to a page puts it on the dirty list. Resetting copies back just those pages and drops regions added since, so it
+	costs as much as the run touched, not as much as the image. Stores to regions added since are tracked as well
+	(--verify compares every page on the lists), they just have nothing to be restored to.
+ */
+struct snapshot
+{
+	struct context ctx;				//registers before the first instruction
+	struct virtual_mem_region* regions;	//the region list then: anything in front of it was added by the run
+	uint32_t stack_bottom;
+	uint32_t brk;
+	uint32_t heap_end;
+	
+	struct dirty_page* dirty;
+	size_t dirty_count;
+	size_t dirty_size;				//entries allocated
+};
+
+void TakeSnapshot(struct simulator* sim);
+void TrackNewRegion(struct virtual_mem_region* region);
+void MarkPageDirty(struct virtual_memory* memory, struct virtual_mem_region* region, uint32_t offset);
+void ResetToSnapshot(struct simulator* sim);
+void FreeSnapshot(struct simulator* sim);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Differential checking
+
+//Instructions an engine without blocks of its own runs between checks
+#define VERIFY_STEP				32
+
+//Instructions between comparisons of memory (registers are compared at every check)
+#define VERIFY_MEMORY_INTERVAL	(1u << 16)
+
+/**
+	@brief The same program run on the reference interpreter, a check behind the engine being verified
+
+	Both runs start from identical images and snapshot them, so every page either one has stored to is on a dirty
+	list; comparing just those pages covers all of memory. Console output from the shadow goes nowhere, and input
+	it reads is whatever the engine's run read (the same file, or a recording of the stream).
+ */
+struct verifier
+{
+	struct simulator shadow;
+	FILE* discard;					//the shadow's console
+	FILE* record;					//memory stream recording the engine's input, NULL if that comes from a file
+	char* recorded;					//what it holds so far
+	size_t recorded_len;
+	
+	uint32_t last_pc;				//start of the last block both runs agreed at
+	uint64_t last_count;			//inst_count then
+	uint64_t memory_due;			//inst_count at which memory gets compared next
+	uint64_t checks;				//blocks compared
+	int failed;						//a difference was reported
+};
+
+void StartVerifier(struct simulator* sim, const char* fname, const uint8_t* image, size_t image_len);
+void RunVerified(struct virtual_memory* memory, struct context* ctx, int engine);
+void VerifyBlock(struct context* ctx);
+void FinishVerifier(struct simulator* sim);
+void FreeVerifier(struct simulator* sim);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// GDB remote stub
+
+//Longest packet taken from GDB or sent to it
+#define DEBUG_PACKET_MAX		4096
+
+//Instructions run between looks at the connection for an interrupt (^C) while continuing
+#define DEBUG_POLL_INTERVAL		(1u << 20)
+
+#define DEBUG_MAX_BREAKPOINTS	64
+#define DEBUG_MAX_WATCHPOINTS	16
+
+//What a watchpoint stops on, numbered like GDB's Z packets
+enum watch_kinds
+{
+	WATCH_WRITE = 2,
+	WATCH_READ = 3,
+	WATCH_ACCESS = 4
+};
+
+struct watchpoint
+{
+	uint32_t address;
+	uint32_t len;
+	int kind;						//one of watch_kinds
+};
+
+/**
+	@brief A GDB connection and the breakpoints and watchpoints it has set
+
+	Breakpoints cost nothing until they're hit: the predecoded entry of the word is pointed at a handler that stops
+	the run, and everything else runs as it always does. Watchpoints take their pages off the fast path in the page
+	table, so only accesses to those pages get checked.
+ */
+struct debugger
+{
+	int fd;							//connection to GDB
+	int no_ack;						//GDB asked for QStartNoAckMode
+	char in[DEBUG_PACKET_MAX];		//bytes received but not parsed yet
+	size_t in_pos;
+	size_t in_len;
+	
+	int stopped;					//signal the current stop is reported with, 0 while running
+	const struct watchpoint* hit;	//watchpoint that stopped the run, NULL if none did
+	uint32_t hit_address;			//what the access was to
+	
+	uint32_t breakpoints[DEBUG_MAX_BREAKPOINTS];
+	int breakpoint_count;
+	struct watchpoint watchpoints[DEBUG_MAX_WATCHPOINTS];
+	int watchpoint_count;
+};
+
+int DebugProgram(struct simulator* sim, const char* fname, int port);
+void RunDebugged(struct virtual_memory* memory, struct context* ctx);
+void PatchBreakpoints(struct debugger* d, struct virtual_mem_region* region, uint32_t offset);
+void ProtectWatchedPages(struct simulator* sim);
+void WatchAccess(struct simulator* sim, uint32_t address, uint32_t size, int write);
+void FreeDebugger(struct simulator* sim);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Page table
+
+void InitVirtualMemory(struct virtual_memory* memory);
+void BuildPageTable(struct virtual_memory* memory);
+void FreeVirtualMemory(struct virtual_memory* memory);
+void AddRegion(struct virtual_memory* memory, struct virtual_mem_region* region);
+void DropRegionsBefore(struct virtual_memory* memory, struct virtual_mem_region* keep);
+int MapAnonymousRegion(struct virtual_memory* memory, uint32_t vaddr, uint32_t len);
+int SetupStackAndHeap(struct virtual_memory* memory, uint32_t top, uint32_t heap_start);
+int GrowStack(struct virtual_memory* memory, uint32_t address);
+uint32_t Sbrk(struct virtual_memory* memory, int32_t increment);
+void ForceSlowPage(struct virtual_memory* memory, uint32_t address);
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Simulator core
 
-void RunSimulator(struct virtual_mem_region* memory, struct context* ctx);
+//Execution engines selectable from the command line
+enum engines
+{
+	ENGINE_INTERP,		//predecoded interpreter
+	ENGINE_THREADED,	//threaded basic-block engine
+	ENGINE_JIT,			//threaded engine, with hot blocks translated to x86-64
+	ENGINE_REFERENCE,	//SimulateInstruction on every fetched word, what the others are checked against
+
+	ENGINE_COUNT
+};
+
+/**
+	@brief How to run guest code on one of the engines
+ */
+struct engine
+{
+	const char* name;				//as given to --engine=
+	
+	//Runs until the guest stops
+	void (*run)(struct virtual_memory* memory, struct context* ctx);
+	
+	//Runs until inst_count reaches target (or the guest stops), NULL if the engine can't stop at an exact count
+	void (*run_until)(struct virtual_memory* memory, struct context* ctx, uint64_t target);
+	
+	int checks_blocks;				//run calls VerifyBlock on entering each block while verifying
+};
+
+extern const struct engine engines[ENGINE_COUNT];
+
+void RunSimulator(struct virtual_memory* memory, struct context* ctx, int engine);
+void RunInterpreter(struct virtual_memory* memory, struct context* ctx);
+void RunInterpreterUntil(struct virtual_memory* memory, struct context* ctx, uint64_t target);
+
+uint32_t FetchWordFromVirtualMemory(uint32_t address, struct virtual_memory* memory);
+void StoreWordToVirtualMemory(uint32_t address, uint32_t value, struct virtual_memory* memory);
+uint16_t FetchHalfwordFromVirtualMemory(uint32_t address, struct virtual_memory* memory);
+void StoreHalfwordToVirtualMemory(uint32_t address, uint16_t value, struct virtual_memory* memory);
+uint8_t FetchByteFromVirtualMemory(uint32_t address, struct virtual_memory* memory);
+void StoreByteToVirtualMemory(uint32_t address, uint8_t value, struct virtual_memory* memory);
+uint32_t LoadLinkedWord(uint32_t address, struct virtual_memory* memory);
+int StoreConditionalWord(uint32_t address, uint32_t expected, uint32_t value, struct virtual_memory* memory);
+void InvalidateSpan(struct virtual_memory* memory, struct virtual_mem_region* region, uint32_t address,
+	uint32_t len);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Predecoder
+
+struct predecoded_inst* FetchPredecodedInstruction(uint32_t address, struct virtual_memory* memory, struct virtual_mem_region** hint);
+void PredecodeInstruction(struct predecoded_inst* pi, uint32_t address, union mips_instruction inst);
+void InvalidatePredecodedWord(struct virtual_memory* memory, struct virtual_mem_region* region, uint32_t offset);
+void ForgetPredecodedPage(struct virtual_memory* memory, struct virtual_mem_region* region, uint32_t page);
+
+int WritesOnlyZero(struct predecoded_inst* pi);
+int IsFusedInstruction(const struct predecoded_inst* pi);
+predecoded_handler FusedHandler(const struct predecoded_inst* first, const struct predecoded_inst* second);
 
-uint32_t FetchWordFromVirtualMemory(uint32_t address, struct virtual_mem_region* memory);
-void StoreWordToVirtualMemory(uint32_t address, uint32_t value, struct virtual_mem_region* memory);
+extern const predecoded_handler predecoded_handlers[PD_COUNT];
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Threaded basic-block engine
+
+//Engine-only ops, numbered after the predecoded ones
+enum threaded_ops
+{
+	TH_NOP = PD_COUNT,		//ALU op whose only effect is writing $zero
+	TH_FALLTHROUGH,			//block ended without a branch (size limit or end of region)
+
+	TH_COUNT
+};
+
+/**
+	@brief One instruction inside a block: predecoded fields plus the address of the code implementing it
+ */
+struct threaded_inst
+{
+	const void* label;
+	uint32_t pc;
+	uint32_t imm;
+	uint32_t target;
+	uint8_t rs;
+	uint8_t rt;
+	uint8_t rd;
+	uint8_t shamt;
+};
+
+/**
+	@brief What native code hands back to the engine
+
+	Translations jump straight into each other once chained, so the block that exits isn't necessarily the one that
+	was entered.
+ */
+struct native_exit
+{
+	uint64_t code;					//one of jit_exits
+	struct basic_block* block;		//block whose exit was taken
+};
+
+//Native code for a block. Leaves ctx->pc at the next guest instruction
+typedef struct native_exit (*native_block)(struct context* ctx, struct virtual_memory* memory);
+
+//One step of a block_loop: reg += imm, plus (or minus, if negate) regs[src] when src isn't zero
+struct loop_term
+{
+	uint32_t imm;
+	uint8_t reg;
+	uint8_t src;
+	uint8_t negate;
+};
+
+/**
+	@brief Closed form of a block that branches back to its own start while regs[rs] != regs[rt], and otherwise only
+	steps registers by amounts the loop never changes
+
+	Each trip adds the same to every register the terms step, so any number of trips can be applied at once.
+ */
+struct block_loop
+{
+	uint8_t rs;
+	uint8_t rt;
+	uint32_t timing;				//trips still to run on the clock before the rest are skipped, 0 if not timing
+	uint32_t timed;					//how many trips that started with
+	struct timespec timed_from;		//when the first of them started
+	uint64_t clock_ns;				//what reading the clock cost just then, not counted as trip time
+	uint32_t term_count;
+	struct loop_term terms[];
+};
+
+/**
+	@brief A straight-line run of guest instructions ending at a branch, jump, syscall or invalid instruction
+ */
+struct basic_block
+{
+	uint32_t start;					//address of the first instruction
+	uint32_t end;					//address just past the last instruction
+	uint32_t count;					//number of guest instructions (not counting a trailing TH_FALLTHROUGH)
+	uint32_t credit;				//instructions added to ctx->inst_count on entry (syscall/invalid count themselves)
+
+	struct basic_block* hash_next;
+
+	//Chained successors, filled in the first time each exit is taken
+	struct basic_block* taken;		//branch/jump target
+	struct basic_block* fallthrough;//next sequential block
+
+	//One-entry cache for jr, which has no fixed target
+	uint32_t indirect_pc;
+	struct basic_block* indirect;
+
+	//JIT tier: times entered so far, and the translation once the block got hot
+	uint32_t exec_count;
+	native_block native;
+	uint8_t* native_body;			//translation entry point for chained jumps (past the prologue)
+	uint8_t* taken_patch;			//rel32 of the taken exit's jump, pointed at the successor once both are native
+	uint8_t* fallthrough_patch;		//same, for the fall-through exit
+
+	struct block_loop* loop;		//set if the block is a loop --fast-forward can skip, NULL otherwise
+
+	struct threaded_inst insts[];
+};
+
+//Number of hash buckets for looking up blocks by start address (power of two)
+#define BLOCK_HASH_SIZE		4096
+
+/**
+	@brief All blocks built for one address space, plus the executable buffer their native translations live in
+ */
+struct block_cache
+{
+	struct basic_block* buckets[BLOCK_HASH_SIZE];
+	
+	uint8_t* code;
+	size_t code_used;
+	size_t code_size;
+	const uint64_t* publish_at;		//inst_count at which translations leave for a monitor update, NULL if none
+};
+
+void RunThreaded(struct virtual_memory* memory, struct context* ctx, int use_jit);
+void FlushBlockCache(struct virtual_memory* memory);
+void FreeBlockCache(struct virtual_memory* memory);
+void ReportFastForward(struct simulator* sim);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// x86-64 JIT
+
+//Blocks entered this many times get translated to native code
+#define JIT_THRESHOLD		50
+
+//How a native block left
+enum jit_exits
+{
+	JIT_EXIT_FALLTHROUGH,	//continue at block->end
+	JIT_EXIT_TAKEN,			//branch or jump to its fixed target
+	JIT_EXIT_INDIRECT,		//jr, ctx->pc holds the target
+	JIT_EXIT_SYSCALL,		//ctx->pc holds the syscall, the engine runs it
+	JIT_EXIT_SIDE			//left early (e.g. a store hit decoded code), ctx->pc holds where to resume
+};
+
+native_block JitCompileBlock(struct block_cache* cache, struct virtual_memory* memory, struct basic_block* block);
+void JitChain(uint8_t** patch, struct basic_block* successor);
+void JitReset(struct block_cache* cache);
+void JitFree(struct block_cache* cache);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Reference interpreter
 
-int SimulateInstruction(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-int SimulateRtypeInstruction(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-int SimulateBswitch(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-int SimulateSyscall(uint32_t callnum, struct virtual_mem_region* memory, struct context* ctx);
-void simPrintString(struct virtual_mem_region* memory, struct context* ctx);
-void simReadString(struct virtual_mem_region* memory, struct context* ctx);
+void RunReference(struct virtual_memory* memory, struct context* ctx);
+void RunReferenceUntil(struct virtual_memory* memory, struct context* ctx, uint64_t target);
+int SimulateInstruction(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+int SimulateRtypeInstruction(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+int SimulateBswitch(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+int SimulateSyscall(uint32_t callnum, struct virtual_memory* memory, struct context* ctx);
+void simPrintString(struct virtual_memory* memory, struct context* ctx);
+void simReadString(struct virtual_memory* memory, struct context* ctx);
 
 // Simulate specific instructions
-void simBGEZ(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simBGEZAL(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simBLTZ(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simBLTZAL(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simJ(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simJAL(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simBEQ(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simBNE(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simBLEZ(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simBGTZ(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simADDI(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simADDIU(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simSLTI(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simSLTIU(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simANDI(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simORI(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simXORI(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simLUI(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simLB(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simLW(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simSB(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simSW(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simSLL(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simSRL(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simSRA(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simSLLV(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simSRLV(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simJR(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simMFHI(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simMFLO(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simMULT(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simMULTU(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simDIV(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simDIVU(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simADD(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simADDU(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simSUB(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simSUBU(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simAND(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simOR(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simXOR(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simSLT(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
-void simSLTU(union mips_instruction* inst, struct virtual_mem_region* memory, struct context* ctx);
+void simBGEZ(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simBGEZAL(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simBLTZ(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simBLTZAL(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simJ(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simJAL(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simBEQ(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simBNE(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simBLEZ(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simBGTZ(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simADDI(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simADDIU(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simSLTI(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simSLTIU(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simANDI(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simORI(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simXORI(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simLUI(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simLB(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simLBU(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simLH(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simLHU(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simLW(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simSB(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simSH(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simSW(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simSLL(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simSRL(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simSRA(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simSLLV(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simSRLV(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simJR(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simMFHI(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simMFLO(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simMULT(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simMULTU(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simDIV(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simDIVU(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simADD(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simADDU(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simSUB(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simSUBU(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simAND(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simOR(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simXOR(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simSLT(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simSLTU(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simLL(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simSC(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
+void simSYNC(union mips_instruction* inst, struct virtual_memory* memory, struct context* ctx);
 #endif
@@ -0,0 +1,156 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief In-memory snapshots of a loaded program, and resetting to one by restoring only the pages a run dirtied
+ */
+#include "sim.h"
+#include <string.h>
+#include <sys/mman.h>
+
+//Bytes of page i that belong to the region
+static uint32_t PageBytes(const struct virtual_mem_region* region, uint32_t page)
+{
+	uint32_t left = region->len - (page << VM_PAGE_SHIFT);
+	return (left < VM_PAGE_SIZE) ? left : VM_PAGE_SIZE;
+}
+
+static int IsZeroPage(const uint8_t* p, uint32_t len)
+{
+	for(uint32_t i=0; i<len; i++)
+	{
+		if(p[i] != 0)
+			return 0;
+	}
+	return 1;
+}
+
+/**
+	@brief Remembers the program as it is now (just loaded, nothing run yet) and starts tracking stores
+
+	Pristine copies go in demand-zero mappings, so all-zero pages like the BSS and the stack cost nothing. Replaces
+	any earlier snapshot.
+ */
+void TakeSnapshot(struct simulator* sim)
+{
+	FreeSnapshot(sim);
+
+	struct virtual_memory* memory = &sim->memory;
+	struct snapshot* snap = calloc(1, sizeof(struct snapshot));
+	snap->ctx = sim->ctx;
+	snap->regions = memory->regions;
+	snap->stack_bottom = memory->stack_bottom;
+	snap->brk = memory->brk;
+	snap->heap_end = memory->heap_end;
+
+	for(struct virtual_mem_region* region = memory->regions; region != NULL; region = region->next)
+	{
+		uint32_t pages = (uint32_t)(((uint64_t)region->len + VM_PAGE_MASK) >> VM_PAGE_SHIFT);
+		region->dirty_pages = calloc(pages ? pages : 1, 1);
+		for(uint32_t page = 0; page < pages; page++)
+		{
+			const uint8_t* p = (const uint8_t*)region->data + (page << VM_PAGE_SHIFT);
+			uint32_t len = PageBytes(region, page);
+			if(IsZeroPage(p, len))
+				continue;
+
+			if(region->pristine == NULL)
+			{
+				region->pristine = mmap(NULL, (size_t)pages << VM_PAGE_SHIFT, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+				if(region->pristine == MAP_FAILED)
+				{
+					//Without a copy the page can't be restored, so the snapshot is no good
+					region->pristine = NULL;
+					sim->snapshot = snap;
+					FreeSnapshot(sim);
+					return;
+				}
+			}
+			memcpy(region->pristine + (page << VM_PAGE_SHIFT), p, len);
+		}
+	}
+
+	sim->snapshot = snap;
+}
+
+/**
+	@brief Starts tracking stores to a region added after the snapshot (it has no pristine copy: it didn't exist)
+ */
+void TrackNewRegion(struct virtual_mem_region* region)
+{
+	uint32_t pages = (uint32_t)(((uint64_t)region->len + VM_PAGE_MASK) >> VM_PAGE_SHIFT);
+	region->dirty_pages = calloc(pages ? pages : 1, 1);
+}
+
+/**
+	@brief Called on the first store to a tracked page since the snapshot (or the last reset)
+ */
+void MarkPageDirty(struct virtual_memory* memory, struct virtual_mem_region* region, uint32_t offset)
+{
+	struct snapshot* snap = memory->sim->snapshot;
+	uint32_t page = offset >> VM_PAGE_SHIFT;
+	region->dirty_pages[page] = 1;
+
+	if(snap->dirty_count == snap->dirty_size)
+	{
+		snap->dirty_size = snap->dirty_size ? (snap->dirty_size * 2) : 64;
+		snap->dirty = realloc(snap->dirty, snap->dirty_size * sizeof(struct dirty_page));
+	}
+	snap->dirty[snap->dirty_count].region = region;
+	snap->dirty[snap->dirty_count].page = page;
+	snap->dirty_count++;
+}
+
+/**
+	@brief Puts memory and registers back the way they were at the snapshot
+
+	Dirtied pages are copied back from the pristine copy (or cleared), decoded code on those pages is dropped, and
+	then regions added since (stack and heap growth) go away. Decoded code everywhere else, and the block caches if
+	no code page was touched, stay warm for the next run.
+ */
+void ResetToSnapshot(struct simulator* sim)
+{
+	struct snapshot* snap = sim->snapshot;
+	struct virtual_memory* memory = &sim->memory;
+
+	for(size_t i=0; i<snap->dirty_count; i++)
+	{
+		struct virtual_mem_region* region = snap->dirty[i].region;
+		uint32_t page = snap->dirty[i].page;
+		uint8_t* p = (uint8_t*)region->data + (page << VM_PAGE_SHIFT);
+		if(region->pristine != NULL)
+			memcpy(p, region->pristine + (page << VM_PAGE_SHIFT), PageBytes(region, page));
+		else
+			memset(p, 0, PageBytes(region, page));
+		region->dirty_pages[page] = 0;
+		ForgetPredecodedPage(memory, region, page);
+	}
+	snap->dirty_count = 0;
+
+	//Regions added since are tracked too, so they can only go once nothing on the dirty list points at them
+	DropRegionsBefore(memory, snap->regions);
+	memory->stack_bottom = snap->stack_bottom;
+	memory->brk = snap->brk;
+	memory->heap_end = snap->heap_end;
+
+	sim->ctx = snap->ctx;
+}
+
+void FreeSnapshot(struct simulator* sim)
+{
+	struct snapshot* snap = sim->snapshot;
+	if(snap == NULL)
+		return;
+
+	for(struct virtual_mem_region* region = sim->memory.regions; region != NULL; region = region->next)
+	{
+		free(region->dirty_pages);
+		region->dirty_pages = NULL;
+		if(region->pristine != NULL)
+			munmap(region->pristine, (region->len + VM_PAGE_MASK) & ~VM_PAGE_MASK);
+		region->pristine = NULL;
+	}
+	free(snap->dirty);
+	free(snap);
+	sim->snapshot = NULL;
+}
@@ -0,0 +1,785 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Threaded-code engine: predecoded basic blocks run with computed-goto dispatch and chain to each other
+ */
+#include "sim.h"
+#include <string.h>
+
+//Most instructions a single block may hold
+#define MAX_BLOCK_LEN		256
+
+//Fewest trips worth fast-forwarding a loop for, shorter runs of it just execute
+#define FAST_FORWARD_MIN	16
+
+//Most trips of a loop that run on the clock before the rest are skipped, to tell how long those would have taken
+#define FAST_FORWARD_TIMED	256
+
+static inline uint32_t BlockHash(uint32_t pc)
+{
+	return (pc >> 2) & (BLOCK_HASH_SIZE - 1);
+}
+
+/**
+	@brief Throws away every block, e.g. because the guest overwrote code we had translated
+ */
+void FlushBlockCache(struct virtual_memory* memory)
+{
+	struct block_cache* cache = memory->blocks;
+	memory->code_dirty = 0;
+	if(cache == NULL)
+		return;
+
+	JitReset(cache);
+	for(int i=0; i<BLOCK_HASH_SIZE; i++)
+	{
+		struct basic_block* block = cache->buckets[i];
+		while(block != NULL)
+		{
+			struct basic_block* next = block->hash_next;
+			free(block->loop);
+			free(block);
+			block = next;
+		}
+		cache->buckets[i] = NULL;
+	}
+}
+
+/**
+	@brief Throws away the block cache and everything in it
+ */
+void FreeBlockCache(struct virtual_memory* memory)
+{
+	if(memory->blocks == NULL)
+		return;
+	
+	FlushBlockCache(memory);
+	JitFree(memory->blocks);
+	free(memory->blocks);
+	memory->blocks = NULL;
+}
+
+static struct basic_block* LookupBlock(struct block_cache* cache, uint32_t pc)
+{
+	for(struct basic_block* block = cache->buckets[BlockHash(pc)]; block != NULL; block = block->hash_next)
+	{
+		if(block->start == pc)
+			return block;
+	}
+	return NULL;
+}
+
+static int IsBlockTerminator(int op)
+{
+	switch(op)
+	{
+		case PD_BGEZ:
+		case PD_BGEZAL:
+		case PD_BLTZ:
+		case PD_BLTZAL:
+		case PD_J:
+		case PD_JAL:
+		case PD_BEQ:
+		case PD_BNE:
+		case PD_BLEZ:
+		case PD_BGTZ:
+		case PD_JR:
+		case PD_SYSCALL:
+		case PD_INVALID_OPCODE:
+		case PD_INVALID_FUNC:
+		case PD_INVALID_BRANCH:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/**
+	@brief Works out whether a block is a loop --fast-forward can skip, see struct block_loop
+
+	That is a block ending in bne back to its own start, whose other instructions are all addiu r, r, imm or
+	addu/subu r, r, s with s a register the loop doesn't write. Returns NULL for anything else.
+ */
+static struct block_loop* SummarizeLoop(struct virtual_memory* memory, struct basic_block* block)
+{
+	struct loop_term terms[MAX_BLOCK_LEN];
+	struct virtual_mem_region* text = NULL;
+	uint32_t written = 0;				//registers the terms step
+	uint32_t read = 0;					//and those they step them by
+	uint32_t count = 0;
+	for(uint32_t i=0; i+1 < block->count; i++)
+	{
+		struct predecoded_inst* pi = FetchPredecodedInstruction(block->insts[i].pc, memory, &text);
+		if(WritesOnlyZero(pi))
+			continue;
+		struct loop_term* t = &terms[count++];
+		t->imm = 0;
+		t->src = zero;
+		t->negate = 0;
+		if( (pi->op == PD_ADDI) && (pi->rt == pi->rs) )
+		{
+			t->reg = pi->rt;
+			t->imm = pi->imm;
+		}
+		else if( (pi->op == PD_ADD) && ( (pi->rd == pi->rs) || (pi->rd == pi->rt) ) )
+		{
+			t->reg = pi->rd;
+			t->src = (pi->rd == pi->rs) ? pi->rt : pi->rs;
+		}
+		else if( (pi->op == PD_SUB) && (pi->rd == pi->rs) )
+		{
+			t->reg = pi->rd;
+			t->src = pi->rt;
+			t->negate = 1;
+		}
+		else
+			return NULL;
+		written |= 1u << t->reg;
+		read |= 1u << t->src;
+	}
+	if( (count == 0) || (written & read) )
+		return NULL;
+
+	struct predecoded_inst* branch = FetchPredecodedInstruction(block->insts[block->count - 1].pc, memory, &text);
+	struct block_loop* loop = malloc(sizeof(struct block_loop) + count * sizeof(struct loop_term));
+	loop->rs = branch->rs;
+	loop->rt = branch->rt;
+	loop->timing = loop->timed = 0;
+	loop->term_count = count;
+	memcpy(loop->terms, terms, count * sizeof(struct loop_term));
+	return loop;
+}
+
+//What a term adds to its register every trip
+static inline uint32_t TermStep(const struct loop_term* t, const uint32_t* regs)
+{
+	return t->imm + (t->negate ? -regs[t->src] : regs[t->src]);
+}
+
+//Smallest number of trips n >= 1 after which d + n*step is 0 (mod 2^32), or 0 if it never is
+static uint64_t LoopTrips(uint32_t d, uint32_t step)
+{
+	uint32_t want = -d;
+	if(step == 0)
+		return (want == 0) ? 1 : 0;
+
+	//n*step = want has solutions iff want has at least step's trailing zeros, then they repeat every period
+	int shift = __builtin_ctz(step);
+	if(want & ((1u << shift) - 1))
+		return 0;
+	uint32_t odd = step >> shift;
+	uint32_t inverse = odd;
+	for(int i=0; i<4; i++)
+		inverse *= 2 - odd * inverse;
+	uint64_t period = 1ull << (32 - shift);
+	uint64_t n = (uint32_t)((want >> shift) * inverse) & (period - 1);
+	return (n == 0) ? period : n;
+}
+
+//Nanoseconds on the monotonic clock since t0
+static uint64_t NanosecondsSince(const struct timespec* t0)
+{
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return 1000000000ull * (t1.tv_sec - t0->tv_sec) + t1.tv_nsec - t0->tv_nsec;
+}
+
+/**
+	@brief Runs every remaining trip of a block_loop in one go, as the block is entered
+
+	The stepped registers get their final values, the count the exact instructions the trips would have retired and
+	the pc the instruction after the loop. Returns 0, doing nothing, if the loop would end within FAST_FORWARD_MIN
+	trips or never.
+
+	A loop worth skipping first runs a sixteenth of its trips (up to FAST_FORWARD_TIMED) as usual, on the clock, and
+	returns 0 for each. The rest are skipped on the entry after the last, and counted as saving what the timed ones
+	took per trip, less the cost of reading the clock.
+ */
+static int FastForward(struct basic_block* block, struct context* ctx)
+{
+	struct block_loop* loop = block->loop;
+	uint32_t* regs = ctx->regs;
+
+	int timed = 0;
+	if(loop->timing != 0)
+	{
+		if(--loop->timing != 0)
+			return 0;
+		timed = 1;
+	}
+
+	//The branch looks at rs - rt, which moves the same amount every trip
+	uint32_t step = 0;
+	for(uint32_t i=0; i<loop->term_count; i++)
+	{
+		const struct loop_term* t = &loop->terms[i];
+		if(t->reg == loop->rs)
+			step += TermStep(t, regs);
+		if(t->reg == loop->rt)
+			step -= TermStep(t, regs);
+	}
+	uint64_t trips = LoopTrips(regs[loop->rs] - regs[loop->rt], step);
+	if( (trips == 0) || (!timed && (trips < FAST_FORWARD_MIN)) )
+		return 0;
+	if(!timed)
+	{
+		loop->timing = loop->timed = (trips / 16 < FAST_FORWARD_TIMED) ? trips / 16 : FAST_FORWARD_TIMED;
+		struct timespec before;
+		clock_gettime(CLOCK_MONOTONIC, &before);
+		clock_gettime(CLOCK_MONOTONIC, &loop->timed_from);
+		loop->clock_ns = NanosecondsSince(&before);
+		return 0;
+	}
+
+	for(uint32_t i=0; i<loop->term_count; i++)
+	{
+		const struct loop_term* t = &loop->terms[i];
+		regs[t->reg] += (uint32_t)trips * TermStep(t, regs);
+	}
+	uint64_t insts = trips * block->credit;
+	ctx->inst_count += insts;
+	ctx->pc = block->end;
+	ctx->sim->forwarded_loops++;
+	ctx->sim->forwarded_insts += insts;
+	uint64_t ns = NanosecondsSince(&loop->timed_from);
+	ns = (ns > loop->clock_ns) ? ns - loop->clock_ns : 0;
+	ctx->sim->forwarded_ns += ns * trips / loop->timed;
+	return 1;
+}
+
+/**
+	@brief Whether native code leaving block may jump straight into successor
+
+	Not into a loop FastForward might skip, which has to be entered through the engine to get the chance. Going round
+	such a loop is fine: it only runs natively once FastForward has passed it up, and what it decided on entry can't
+	change while the loop runs, as nothing the loop depends on is written by it.
+ */
+static inline int ChainsTo(const struct basic_block* block, const struct basic_block* successor)
+{
+	return (successor->loop == NULL) || (successor == block);
+}
+
+/**
+	@brief Says what --fast-forward skipped, once the program stops
+ */
+void ReportFastForward(struct simulator* sim)
+{
+	if(!sim->options.fast_forward)
+		return;
+	ConsolePrintf(&sim->console, "\nfast-forward: skipped %llu instructions in %llu loops\n",
+		(long long unsigned int)sim->forwarded_insts, (long long unsigned int)sim->forwarded_loops);
+}
+
+/**
+	@brief Decodes the block starting at pc and adds it to the cache
+
+	Decoding stops at the end of the region holding pc. Anything past that is left for the next dispatch to fetch, so
+	a program running off the end of its text segfaults at the same point it would under the interpreter. With
+	fast_forward set, loops it could skip get their block_loop.
+ */
+static struct basic_block* BuildBlock(struct virtual_memory* memory, uint32_t pc, const void* const* labels,
+	int fast_forward)
+{
+	struct threaded_inst insts[MAX_BLOCK_LEN + 1];
+	struct virtual_mem_region* text = NULL;
+	uint32_t count = 0;
+	uint32_t addr = pc;
+	int last_op;
+
+	while(1)
+	{
+		struct predecoded_inst* pi = FetchPredecodedInstruction(addr, memory, &text);
+		struct threaded_inst* ti = &insts[count++];
+		ti->label = labels[WritesOnlyZero(pi) ? TH_NOP : pi->op];
+		ti->pc = addr;
+		ti->imm = pi->imm;
+		ti->target = pi->target;
+		ti->rs = pi->rs;
+		ti->rt = pi->rt;
+		ti->rd = pi->rd;
+		ti->shamt = pi->shamt;
+		addr += 4;
+
+		last_op = pi->op;
+		if(IsBlockTerminator(last_op))
+			break;
+		if( (count == MAX_BLOCK_LEN) || (addr - text->vaddr >= text->len) )
+		{
+			insts[count].label = labels[TH_FALLTHROUGH];
+			insts[count].pc = addr;
+			break;
+		}
+	}
+	
+	//No trailing TH_FALLTHROUGH after a real terminator
+	if(IsBlockTerminator(last_op))
+		memset(&insts[count], 0, sizeof(insts[count]));
+
+	struct basic_block* block = calloc(1, sizeof(struct basic_block) + (count + 1) * sizeof(struct threaded_inst));
+	block->start = pc;
+	block->end = addr;
+	block->count = count;
+	block->credit = count;
+	if( (last_op == PD_SYSCALL) || (last_op == PD_INVALID_OPCODE) || (last_op == PD_INVALID_FUNC) ||
+		(last_op == PD_INVALID_BRANCH) )
+	{
+		block->credit --;
+	}
+	memcpy(block->insts, insts, (count + 1) * sizeof(struct threaded_inst));
+	if( fast_forward && (last_op == PD_BNE) && (insts[count - 1].target == pc) )
+		block->loop = SummarizeLoop(memory, block);
+
+	struct block_cache* cache = memory->blocks;
+	uint32_t hash = BlockHash(pc);
+	block->hash_next = cache->buckets[hash];
+	cache->buckets[hash] = block;
+	return block;
+}
+
+/**
+	@brief Runs the threaded engine until the guest exits or hits an invalid instruction
+
+	Each block is entered at its first instruction and runs by jumping straight from one handler label to the next.
+	At the end of a block the successor pointer is followed if it has been resolved; otherwise we drop back to the
+	dispatcher, which looks up or builds the successor and patches the pointer so the next trip goes direct.
+	
+	With use_jit set, blocks entered JIT_THRESHOLD times are translated to x86-64 and run natively from then on.
+	Native blocks credit their own instructions and, once a direct successor is native too, jump straight to it.
+	Anything else (unlinked successors, jr, syscalls, invalidation) comes back here.
+	
+	With --fast-forward, a block SummarizeLoop found a closed form for runs all its remaining trips at once when it's
+	entered (see FastForward), before it would otherwise run or go native. The few trips it times first always run
+	here, as native code could go round the loop without coming back.
+	
+	While verifying, every block is checked against the reference before it runs, so native blocks are never chained
+	and always come back here too.
+ */
+void RunThreaded(struct virtual_memory* memory, struct context* ctx, int use_jit)
+{
+	static const void* const labels[TH_COUNT] =
+	{
+		[PD_INVALID_OPCODE]	= &&op_INVALID_OPCODE,
+		[PD_INVALID_FUNC]	= &&op_INVALID_FUNC,
+		[PD_INVALID_BRANCH]	= &&op_INVALID_BRANCH,
+		[PD_BGEZ]			= &&op_BGEZ,
+		[PD_BGEZAL]			= &&op_BGEZAL,
+		[PD_BLTZ]			= &&op_BLTZ,
+		[PD_BLTZAL]			= &&op_BLTZAL,
+		[PD_J]				= &&op_J,
+		[PD_JAL]			= &&op_JAL,
+		[PD_BEQ]			= &&op_BEQ,
+		[PD_BNE]			= &&op_BNE,
+		[PD_BLEZ]			= &&op_BLEZ,
+		[PD_BGTZ]			= &&op_BGTZ,
+		[PD_ADDI]			= &&op_ADDI,
+		[PD_SLTI]			= &&op_SLTI,
+		[PD_SLTIU]			= &&op_SLTIU,
+		[PD_ANDI]			= &&op_ANDI,
+		[PD_ORI]			= &&op_ORI,
+		[PD_XORI]			= &&op_XORI,
+		[PD_LUI]			= &&op_LUI,
+		[PD_LB]				= &&op_LB,
+		[PD_LBU]			= &&op_LBU,
+		[PD_LH]				= &&op_LH,
+		[PD_LHU]			= &&op_LHU,
+		[PD_LW]				= &&op_LW,
+		[PD_SB]				= &&op_SB,
+		[PD_SH]				= &&op_SH,
+		[PD_SW]				= &&op_SW,
+		[PD_SLL]			= &&op_SLL,
+		[PD_SRL]			= &&op_SRL,
+		[PD_SRA]			= &&op_SRA,
+		[PD_SLLV]			= &&op_SLLV,
+		[PD_SRLV]			= &&op_SRLV,
+		[PD_JR]				= &&op_JR,
+		[PD_SYSCALL]		= &&op_SYSCALL,
+		[PD_MFHI]			= &&op_MFHI,
+		[PD_MFLO]			= &&op_MFLO,
+		[PD_MULT]			= &&op_MULT,
+		[PD_MULTU]			= &&op_MULTU,
+		[PD_DIV]			= &&op_DIV,
+		[PD_DIVU]			= &&op_DIVU,
+		[PD_ADD]			= &&op_ADD,
+		[PD_SUB]			= &&op_SUB,
+		[PD_AND]			= &&op_AND,
+		[PD_OR]				= &&op_OR,
+		[PD_XOR]			= &&op_XOR,
+		[PD_SLT]			= &&op_SLT,
+		[PD_SLTU]			= &&op_SLTU,
+		[PD_LL]				= &&op_LL,
+		[PD_SC]				= &&op_SC,
+		[PD_SYNC]			= &&op_SYNC,
+		[TH_NOP]			= &&op_NOP,
+		[TH_FALLTHROUGH]	= &&op_FALLTHROUGH
+	};
+
+	if(memory->blocks == NULL)
+	{
+		memory->blocks = calloc(1, sizeof(struct block_cache));
+		if(ctx->sim->monitor != NULL)
+			memory->blocks->publish_at = &ctx->sim->monitor->next;
+	}
+
+	uint32_t* regs = ctx->regs;
+	struct basic_block* block;
+	struct basic_block** link = NULL;	//successor slot waiting for the block the dispatcher finds next
+	const struct threaded_inst* ti;
+	struct native_exit result;
+	int verifying = (ctx->sim->verifier != NULL);
+	uint64_t publish_at = (ctx->sim->monitor != NULL) ? ctx->sim->monitor->next : UINT64_MAX;
+
+	regs[zero] = 0;
+
+	#define NEXT()	do { ti++; goto *ti->label; } while(0)
+
+	//Runs a load or store, which can fault, with the pc pointing at it and the credit for it and the rest of the block
+	//taken back until it's done: a fault stops with the interpreter's pc and count
+	#define FAULTABLE(access) do { \
+			uint32_t rest = block->credit - (ti->pc - block->start) / 4; \
+			ctx->pc = ti->pc; \
+			ctx->inst_count -= rest; \
+			access; \
+			ctx->inst_count += rest; \
+		} while(0)
+
+dispatch:
+	if(memory->code_dirty)
+	{
+		FlushBlockCache(memory);
+		link = NULL;
+	}
+	block = LookupBlock(memory->blocks, ctx->pc);
+	if(block == NULL)
+		block = BuildBlock(memory, ctx->pc, labels, ctx->sim->options.fast_forward);
+	if(link != NULL)
+		*link = block;
+
+enter:
+	if(verifying)
+		VerifyBlock(ctx);
+	if(ctx->inst_count >= publish_at)
+		publish_at = UpdateMonitor(ctx->sim, SIM_MONITOR_RUNNING);
+	if(block->loop != NULL)
+	{
+		if(FastForward(block, ctx))
+			goto follow_fallthrough;
+		if(block->loop->timing != 0)
+			goto run;
+	}
+	if(block->native != NULL)
+		goto native;
+	if(use_jit && (++block->exec_count == JIT_THRESHOLD) )
+	{
+		block->native = JitCompileBlock(memory->blocks, memory, block);
+		if(block->native != NULL)
+			goto native;
+	}
+run:
+	ctx->inst_count += block->credit;
+	ti = block->insts;
+	goto *ti->label;
+
+	//Native blocks have already set the pc for whichever exit they took
+native:
+	result = block->native(ctx, memory);
+	block = result.block;
+	switch(result.code)
+	{
+		case JIT_EXIT_TAKEN:
+			if( (block->taken != NULL) && !verifying && ChainsTo(block, block->taken) )
+				JitChain(&block->taken_patch, block->taken);
+			goto follow_taken;
+		case JIT_EXIT_INDIRECT:
+			goto follow_indirect;
+		case JIT_EXIT_SYSCALL:
+			ti = &block->insts[(ctx->pc - block->start) / 4];
+			goto op_SYSCALL;
+		case JIT_EXIT_SIDE:
+			ctx->inst_count -= block->credit - (ctx->pc - block->start) / 4;
+			link = NULL;
+			goto dispatch;
+		default:
+			if( (block->fallthrough != NULL) && !verifying && ChainsTo(block, block->fallthrough) )
+				JitChain(&block->fallthrough_patch, block->fallthrough);
+			goto follow_fallthrough;
+	}
+
+	//Block exits
+taken:
+	ctx->pc = ti->target;
+follow_taken:
+	if(block->taken != NULL)
+	{
+		block = block->taken;
+		goto enter;
+	}
+	link = &block->taken;
+	goto dispatch;
+
+not_taken:
+	ctx->pc = block->end;
+follow_fallthrough:
+	if(block->fallthrough != NULL)
+	{
+		block = block->fallthrough;
+		goto enter;
+	}
+	link = &block->fallthrough;
+	goto dispatch;
+
+	//A store hit translated code: give back the credit for the rest of the block and rebuild from the next pc
+code_modified:
+	ctx->inst_count -= block->credit - ((ti->pc - block->start) / 4 + 1);
+	ctx->pc = ti->pc + 4;
+	link = NULL;
+	goto dispatch;
+
+	//Branches and jumps
+op_BGEZ:
+	if((int32_t)regs[ti->rs] >= 0)
+		goto taken;
+	goto not_taken;
+op_BGEZAL:
+	if((int32_t)regs[ti->rs] >= 0)
+	{
+		regs[ra] = ti->pc + 8;
+		goto taken;
+	}
+	goto not_taken;
+op_BLTZ:
+	if((int32_t)regs[ti->rs] < 0)
+		goto taken;
+	goto not_taken;
+op_BLTZAL:
+	if((int32_t)regs[ti->rs] < 0)
+	{
+		regs[ra] = ti->pc + 8;
+		goto taken;
+	}
+	goto not_taken;
+op_J:
+	goto taken;
+op_JAL:
+	regs[ra] = ti->pc + 8;
+	goto taken;
+op_BEQ:
+	if(regs[ti->rs] == regs[ti->rt])
+		goto taken;
+	goto not_taken;
+op_BNE:
+	if(regs[ti->rs] != regs[ti->rt])
+		goto taken;
+	goto not_taken;
+op_BLEZ:
+	if((int32_t)regs[ti->rs] <= 0)
+		goto taken;
+	goto not_taken;
+op_BGTZ:
+	if((int32_t)regs[ti->rs] > 0)
+		goto taken;
+	goto not_taken;
+op_JR:
+	ctx->pc = regs[ti->rs];
+follow_indirect:
+	if( (block->indirect != NULL) && (block->indirect_pc == ctx->pc) )
+	{
+		block = block->indirect;
+		goto enter;
+	}
+	block->indirect_pc = ctx->pc;
+	link = &block->indirect;
+	goto dispatch;
+op_FALLTHROUGH:
+	goto not_taken;
+
+	//Syscalls leave the block with pc pointing at the syscall, like the interpreter
+op_SYSCALL:
+	ctx->pc = ti->pc;
+	if(!SimulateSyscall(regs[v0], memory, ctx))
+		return;
+	ctx->inst_count++;
+	regs[zero] = 0;
+	if(memory->code_dirty)
+	{
+		link = NULL;
+		goto dispatch;
+	}
+	goto not_taken;
+
+op_INVALID_OPCODE:
+	ctx->pc = ti->pc;
+	predecoded_handlers[PD_INVALID_OPCODE](NULL, memory, ctx);
+	return;
+op_INVALID_FUNC:
+	ctx->pc = ti->pc;
+	predecoded_handlers[PD_INVALID_FUNC](NULL, memory, ctx);
+	return;
+op_INVALID_BRANCH:
+	ctx->pc = ti->pc;
+	return;
+
+	//Immediate ALU ops
+op_ADDI:
+	regs[ti->rt] = regs[ti->rs] + ti->imm;
+	NEXT();
+op_SLTI:
+	regs[ti->rt] = ((int32_t)regs[ti->rs] < (int32_t)ti->imm) ? 1 : 0;
+	NEXT();
+op_SLTIU:
+	regs[ti->rt] = (regs[ti->rs] < ti->imm) ? 1 : 0;
+	NEXT();
+op_ANDI:
+	regs[ti->rt] = regs[ti->rs] & ti->imm;
+	NEXT();
+op_ORI:
+	regs[ti->rt] = regs[ti->rs] | ti->imm;
+	NEXT();
+op_XORI:
+	regs[ti->rt] = regs[ti->rs] ^ ti->imm;
+	NEXT();
+op_LUI:
+	regs[ti->rt] = ti->imm;
+	NEXT();
+
+	//Loads and stores (a load into $zero must not stick)
+op_LB:
+	FAULTABLE(regs[ti->rt] = SIGN_EXTEND_8(FetchByteFromVirtualMemory(regs[ti->rs] + ti->imm, memory)));
+	regs[zero] = 0;
+	NEXT();
+op_LBU:
+	FAULTABLE(regs[ti->rt] = FetchByteFromVirtualMemory(regs[ti->rs] + ti->imm, memory));
+	regs[zero] = 0;
+	NEXT();
+op_LH:
+	FAULTABLE(regs[ti->rt] = SIGN_EXTEND_16(FetchHalfwordFromVirtualMemory(regs[ti->rs] + ti->imm, memory)));
+	regs[zero] = 0;
+	NEXT();
+op_LHU:
+	FAULTABLE(regs[ti->rt] = FetchHalfwordFromVirtualMemory(regs[ti->rs] + ti->imm, memory));
+	regs[zero] = 0;
+	NEXT();
+op_LW:
+	FAULTABLE(regs[ti->rt] = FetchWordFromVirtualMemory(regs[ti->rs] + ti->imm, memory));
+	regs[zero] = 0;
+	NEXT();
+op_SB:
+	FAULTABLE(StoreByteToVirtualMemory(regs[ti->rs] + ti->imm, regs[ti->rt] & 0xff, memory));
+	if(memory->code_dirty)
+		goto code_modified;
+	NEXT();
+op_SH:
+	FAULTABLE(StoreHalfwordToVirtualMemory(regs[ti->rs] + ti->imm, regs[ti->rt] & 0xffff, memory));
+	if(memory->code_dirty)
+		goto code_modified;
+	NEXT();
+op_SW:
+	FAULTABLE(StoreWordToVirtualMemory(regs[ti->rs] + ti->imm, regs[ti->rt], memory));
+	if(memory->code_dirty)
+		goto code_modified;
+	NEXT();
+
+	//Atomics (like loads, ll and sc may target $zero, which must not stick)
+op_LL:
+	ctx->link_address = regs[ti->rs] + ti->imm;
+	FAULTABLE(ctx->link_value = LoadLinkedWord(ctx->link_address, memory));
+	ctx->link_valid = 1;
+	regs[ti->rt] = ctx->link_value;
+	regs[zero] = 0;
+	NEXT();
+op_SC:
+	{
+		uint32_t address = regs[ti->rs] + ti->imm;
+		int stored = 0;
+		if(ctx->link_valid && (ctx->link_address == address))
+			FAULTABLE(stored = StoreConditionalWord(address, ctx->link_value, regs[ti->rt], memory));
+		ctx->link_valid = 0;
+		regs[ti->rt] = stored;
+		regs[zero] = 0;
+	}
+	if(memory->code_dirty)
+		goto code_modified;
+	NEXT();
+op_SYNC:
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	NEXT();
+
+	//Register ALU ops
+op_NOP:
+	NEXT();
+op_SLL:
+	regs[ti->rd] = regs[ti->rt] << ti->shamt;
+	NEXT();
+op_SRL:
+	regs[ti->rd] = regs[ti->rt] >> ti->shamt;
+	NEXT();
+op_SRA:
+	regs[ti->rd] = (uint32_t)((int32_t)regs[ti->rt] >> ti->shamt);
+	NEXT();
+op_SLLV:
+	regs[ti->rd] = regs[ti->rt] << (regs[ti->rs] & 31);
+	NEXT();
+op_SRLV:
+	regs[ti->rd] = regs[ti->rt] >> (regs[ti->rs] & 31);
+	NEXT();
+op_MFHI:
+	regs[ti->rd] = ctx->HI;
+	NEXT();
+op_MFLO:
+	regs[ti->rd] = ctx->LO;
+	NEXT();
+op_MULT:
+	{
+		int64_t product = (int64_t)(int32_t)regs[ti->rs] * (int32_t)regs[ti->rt];
+		ctx->LO = (uint32_t)product;
+		ctx->HI = (uint32_t)((uint64_t)product >> 32);
+	}
+	NEXT();
+op_MULTU:
+	{
+		uint64_t product = (uint64_t)regs[ti->rs] * regs[ti->rt];
+		ctx->LO = (uint32_t)product;
+		ctx->HI = (uint32_t)(product >> 32);
+	}
+	NEXT();
+op_DIV:
+	if(regs[ti->rt] == 0)
+		NEXT();
+	if(regs[ti->rt] == 0xffffffff)
+	{
+		ctx->LO = -regs[ti->rs];
+		ctx->HI = 0;
+		NEXT();
+	}
+	ctx->LO = (uint32_t)((int32_t)regs[ti->rs] / (int32_t)regs[ti->rt]);
+	ctx->HI = (uint32_t)((int32_t)regs[ti->rs] % (int32_t)regs[ti->rt]);
+	NEXT();
+op_DIVU:
+	if(regs[ti->rt] == 0)
+		NEXT();
+	ctx->LO = regs[ti->rs] / regs[ti->rt];
+	ctx->HI = regs[ti->rs] % regs[ti->rt];
+	NEXT();
+op_ADD:
+	regs[ti->rd] = regs[ti->rs] + regs[ti->rt];
+	NEXT();
+op_SUB:
+	regs[ti->rd] = regs[ti->rs] - regs[ti->rt];
+	NEXT();
+op_AND:
+	regs[ti->rd] = regs[ti->rs] & regs[ti->rt];
+	NEXT();
+op_OR:
+	regs[ti->rd] = regs[ti->rs] | regs[ti->rt];
+	NEXT();
+op_XOR:
+	regs[ti->rd] = regs[ti->rs] ^ regs[ti->rt];
+	NEXT();
+op_SLT:
+	regs[ti->rd] = ((int32_t)regs[ti->rs] < (int32_t)regs[ti->rt]) ? 1 : 0;
+	NEXT();
+op_SLTU:
+	regs[ti->rd] = (regs[ti->rs] < regs[ti->rt]) ? 1 : 0;
+	NEXT();
+
+	#undef NEXT
+}
@@ -0,0 +1,464 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Binary execution traces: written from the model loop through a ring buffer drained by a writer thread,
+	and replayed into the models (or dumped as text) later
+
+	A trace file is TRACE_MAGIC followed by one record per retired instruction. Each record starts with a flags
+	byte, then:
+		TRACE_JUMP		The PC isn't the previous instruction's successor: zigzag varint of the difference in words
+		TRACE_WORD		The instruction word isn't the one last seen at this PC (by a TRACE_WORD_CACHE entry table):
+						the 4 bytes of the word
+		Loads and stores (known from the word) then have a zigzag varint of the address minus the previous access's,
+		and a zigzag varint of the value read or written (just the bytes accessed).
+	The last record is TRACE_END alone, followed by the PC delta of where execution stopped. Code that runs straight
+	through, and has been seen before, costs one byte per instruction.
+ */
+#include "sim.h"
+#include <string.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TRACE_MAGIC			"MIPSTRC1"
+
+#define TRACE_JUMP			0x01
+#define TRACE_WORD			0x02
+#define TRACE_END			0x80
+
+//Encoded output is written in chunks of this size, never splitting a record (at most TRACE_MAX_RECORD bytes)
+#define TRACE_OUT_SIZE		(256 * 1024)
+#define TRACE_MAX_RECORD	20
+
+//The simulation only shows the writer its progress this often
+#define TRACE_PUBLISH		256
+
+//How long the writer thread naps when it has caught up
+#define TRACE_IDLE_NS		50000
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Record encoding
+
+static void InitCoder(struct trace_coder* coder)
+{
+	coder->next_pc = 0;
+	coder->address = 0;
+	coder->cache_pc = malloc(TRACE_WORD_CACHE * sizeof(uint32_t));
+	coder->cache_word = calloc(TRACE_WORD_CACHE, sizeof(uint32_t));
+
+	//No instruction is at an unaligned PC, so this never matches
+	memset(coder->cache_pc, 0xff, TRACE_WORD_CACHE * sizeof(uint32_t));
+}
+
+static void FreeCoder(struct trace_coder* coder)
+{
+	free(coder->cache_pc);
+	free(coder->cache_word);
+}
+
+/**
+	@brief Bytes a load or store accesses (with *write set for stores), 0 for anything else
+ */
+static uint32_t AccessSize(uint32_t word, int* write)
+{
+	union mips_instruction inst;
+	inst.word = word;
+	*write = 0;
+	switch(inst.itype.opcode)
+	{
+		case OP_SB:
+			*write = 1;
+			//fall through
+		case OP_LB:
+		case OP_LBU:
+			return 1;
+		case OP_SH:
+			*write = 1;
+			//fall through
+		case OP_LH:
+		case OP_LHU:
+			return 2;
+		case OP_SW:
+		case OP_SC:
+			*write = 1;
+			//fall through
+		case OP_LW:
+		case OP_LL:
+			return 4;
+		default:
+			return 0;
+	}
+}
+
+static uint32_t ValueMask(uint32_t size)
+{
+	return (size == 4) ? 0xffffffff : ((1u << (size * 8)) - 1);
+}
+
+static uint8_t* PutVarint(uint8_t* p, int32_t value)
+{
+	uint32_t v = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+	while(v >= 0x80)
+	{
+		*p++ = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (uint8_t)v;
+	return p;
+}
+
+//Reads a varint from [*p, end). Returns 0 if it's cut off
+static int GetVarint(const uint8_t** p, const uint8_t* end, int32_t* value)
+{
+	uint32_t v = 0;
+	for(int shift=0; shift<35; shift+=7)
+	{
+		if(*p == end)
+			return 0;
+		uint8_t b = *(*p)++;
+		v |= (uint32_t)(b & 0x7f) << shift;
+		if(!(b & 0x80))
+		{
+			*value = (int32_t)((v >> 1) ^ -(v & 1));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//Appends one event's record to the output buffer
+static uint8_t* EncodeEvent(struct trace_coder* coder, uint8_t* p, const struct trace_event* ev)
+{
+	uint8_t* flags = p++;
+	*flags = 0;
+
+	if(ev->pc != coder->next_pc)
+	{
+		*flags |= TRACE_JUMP;
+		p = PutVarint(p, (int32_t)(ev->pc - coder->next_pc) / 4);
+	}
+	coder->next_pc = ev->pc + 4;
+
+	uint32_t slot = (ev->pc >> 2) & (TRACE_WORD_CACHE - 1);
+	if( (coder->cache_pc[slot] != ev->pc) || (coder->cache_word[slot] != ev->word) )
+	{
+		*flags |= TRACE_WORD;
+		memcpy(p, &ev->word, 4);
+		p += 4;
+		coder->cache_pc[slot] = ev->pc;
+		coder->cache_word[slot] = ev->word;
+	}
+
+	int write;
+	uint32_t size = AccessSize(ev->word, &write);
+	if(size != 0)
+	{
+		p = PutVarint(p, (int32_t)(ev->address - coder->address));
+		coder->address = ev->address;
+		p = PutVarint(p, (int32_t)(ev->value & ValueMask(size)));
+	}
+	return p;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Writing
+
+//Writes out whatever has been encoded so far
+static void FlushEncoded(struct trace* trace)
+{
+	if(trace->out_used != 0)
+		fwrite(trace->out, 1, trace->out_used, trace->fp);
+	trace->out_used = 0;
+}
+
+/**
+	@brief Encodes events [tail, head) and hands the ring space back
+ */
+static void DrainRing(struct trace* trace, uint64_t head)
+{
+	uint64_t tail = trace->tail;
+	while(tail != head)
+	{
+		if(trace->out_used > TRACE_OUT_SIZE - TRACE_MAX_RECORD)
+			FlushEncoded(trace);
+		uint8_t* p = trace->out + trace->out_used;
+		trace->out_used = EncodeEvent(&trace->coder, p, &trace->ring[tail & (TRACE_RING_SIZE - 1)]) - trace->out;
+		tail++;
+
+		//Free up space in batches too, so the simulation isn't kept waiting on a whole ring
+		if( (tail & (TRACE_PUBLISH - 1)) == 0)
+			__atomic_store_n(&trace->tail, tail, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&trace->tail, tail, __ATOMIC_RELEASE);
+}
+
+static void* TraceWriter(void* arg)
+{
+	struct trace* trace = (struct trace*)arg;
+
+	while(1)
+	{
+		//Read stop before head, so every event published before it is drained below
+		int stop = __atomic_load_n(&trace->stop, __ATOMIC_ACQUIRE);
+		uint64_t head = __atomic_load_n(&trace->published, __ATOMIC_ACQUIRE);
+
+		int work = (head != trace->tail);
+		if(work)
+			DrainRing(trace, head);
+
+		if(stop)
+			break;
+		if(!work)
+		{
+			struct timespec nap = {0, TRACE_IDLE_NS};
+			nanosleep(&nap, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+	@brief Creates a trace file and starts its writer thread (if that fails, the ring is encoded inline as it fills)
+
+	Returns NULL if the file can't be created.
+ */
+struct trace* CreateTrace(const char* path)
+{
+	FILE* fp = fopen(path, "wb");
+	if(fp == NULL)
+		return NULL;
+	fwrite(TRACE_MAGIC, 1, 8, fp);
+
+	struct trace* trace = calloc(1, sizeof(struct trace));
+	trace->fp = fp;
+	trace->ring = malloc(TRACE_RING_SIZE * sizeof(struct trace_event));
+	trace->out = malloc(TRACE_OUT_SIZE);
+	InitCoder(&trace->coder);
+
+	if(0 == pthread_create(&trace->writer, NULL, TraceWriter, trace))
+		trace->threaded = 1;
+	return trace;
+}
+
+/**
+	@brief Adds one retired instruction to the trace. Only waits if the writer has fallen a whole ring behind.
+ */
+void TraceInstruction(struct trace* trace, uint32_t pc, uint32_t word, uint32_t address, uint32_t value)
+{
+	uint64_t head = trace->head;
+	if(head - trace->tail_seen == TRACE_RING_SIZE)
+	{
+		if(!trace->threaded)
+		{
+			DrainRing(trace, head);
+			trace->tail_seen = head;
+		}
+		else
+		{
+			__atomic_store_n(&trace->published, head, __ATOMIC_RELEASE);
+			while( (trace->tail_seen = __atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE)) == head - TRACE_RING_SIZE)
+				sched_yield();
+		}
+	}
+
+	struct trace_event* ev = &trace->ring[head & (TRACE_RING_SIZE - 1)];
+	ev->pc = pc;
+	ev->word = word;
+	ev->address = address;
+	ev->value = value;
+	trace->head = ++head;
+
+	if( (head & (TRACE_PUBLISH - 1)) == 0)
+		__atomic_store_n(&trace->published, head, __ATOMIC_RELEASE);
+}
+
+/**
+	@brief Writes out everything traced, ends the file with where execution stopped and stops the writer thread
+
+	Safe to call on a trace that's already closed, or NULL.
+ */
+void CloseTrace(struct trace* trace, uint32_t next_pc)
+{
+	if( (trace == NULL) || (trace->fp == NULL) )
+		return;
+
+	if(trace->threaded)
+	{
+		__atomic_store_n(&trace->published, trace->head, __ATOMIC_RELEASE);
+		__atomic_store_n(&trace->stop, 1, __ATOMIC_RELEASE);
+		pthread_join(trace->writer, NULL);
+		trace->threaded = 0;
+	}
+	else
+		DrainRing(trace, trace->head);
+
+	uint8_t* p = trace->out + trace->out_used;
+	*p++ = TRACE_END;
+	p = PutVarint(p, (int32_t)(next_pc - trace->coder.next_pc) / 4);
+	trace->out_used = p - trace->out;
+	FlushEncoded(trace);
+
+	fclose(trace->fp);
+	trace->fp = NULL;
+}
+
+void FreeTrace(struct trace* trace)
+{
+	if(trace == NULL)
+		return;
+	CloseTrace(trace, trace->coder.next_pc);
+	free(trace->ring);
+	free(trace->out);
+	FreeCoder(&trace->coder);
+	free(trace);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Reading
+
+/**
+	@brief Decodes the record at *p. Returns 1 for an instruction, 0 at the end record (ev->pc is then where the
+	program stopped) and -1 if the trace is damaged or cut off.
+ */
+static int DecodeEvent(struct trace_coder* coder, const uint8_t** p, const uint8_t* end, struct trace_event* ev)
+{
+	if(*p == end)
+		return -1;
+	uint8_t flags = *(*p)++;
+	int32_t delta = 0;
+
+	if(flags & TRACE_END)
+	{
+		if(!GetVarint(p, end, &delta))
+			return -1;
+		ev->pc = coder->next_pc + (uint32_t)delta * 4;
+		return 0;
+	}
+
+	if( (flags & TRACE_JUMP) && !GetVarint(p, end, &delta) )
+		return -1;
+	ev->pc = coder->next_pc + (uint32_t)delta * 4;
+	coder->next_pc = ev->pc + 4;
+
+	uint32_t slot = (ev->pc >> 2) & (TRACE_WORD_CACHE - 1);
+	if(flags & TRACE_WORD)
+	{
+		if(end - *p < 4)
+			return -1;
+		memcpy(&ev->word, *p, 4);
+		*p += 4;
+		coder->cache_pc[slot] = ev->pc;
+		coder->cache_word[slot] = ev->word;
+	}
+	else if(coder->cache_pc[slot] == ev->pc)
+		ev->word = coder->cache_word[slot];
+	else
+		return -1;
+
+	ev->address = 0;
+	ev->value = 0;
+	int write;
+	if(AccessSize(ev->word, &write) != 0)
+	{
+		int32_t value;
+		if(!GetVarint(p, end, &delta) || !GetVarint(p, end, &value))
+			return -1;
+		ev->address = coder->address + (uint32_t)delta;
+		coder->address = ev->address;
+		ev->value = (uint32_t)value;
+	}
+	return 1;
+}
+
+//Prints one event as text: PC, instruction word, then R/W address value for loads and stores
+static void DumpEvent(const struct trace_event* ev)
+{
+	int write;
+	uint32_t size = AccessSize(ev->word, &write);
+	if(size != 0)
+		printf("%08x %08x %c %08x %0*x\n", ev->pc, ev->word, write ? 'W' : 'R', ev->address, size * 2, ev->value);
+	else
+		printf("%08x %08x\n", ev->pc, ev->word);
+}
+
+/**
+	@brief Plays a trace back through whichever models the options ask for and writes their stats to stats_path,
+	just as a live run would. With no models, prints the trace as text instead.
+
+	Returns the process exit status: 0 if the whole trace was read, 1 if it couldn't be.
+ */
+int ReplayTrace(const struct sim_options* options, const char* path, const char* stats_path)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	const uint8_t* image = MAP_FAILED;
+	if( (fd >= 0) && (fstat(fd, &st) == 0) && (st.st_size >= 8) )
+		image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(fd >= 0)
+		close(fd);
+	if( (image == MAP_FAILED) || memcmp(image, TRACE_MAGIC, 8) )
+	{
+		printf("%s is not a trace file\n", path);
+		if(image != MAP_FAILED)
+			munmap((void*)image, st.st_size);
+		return 1;
+	}
+
+	const uint8_t* p = image + 8;
+	const uint8_t* end = image + st.st_size;
+	struct model* model = CreateModel(options);
+	if(model != NULL)
+	{
+		model->replayed = malloc(sizeof(struct pc_stats));
+		InitPcStats(model->replayed);
+	}
+
+	//Each instruction goes to the models once the next record says where it went
+	struct trace_coder coder;
+	InitCoder(&coder);
+	struct trace_event ev, next;
+	uint64_t count = 0;
+	int status = DecodeEvent(&coder, &p, end, &ev);
+	while(status > 0)
+	{
+		status = DecodeEvent(&coder, &p, end, &next);
+		if(status < 0)
+			break;
+		count++;
+
+		if(model == NULL)
+			DumpEvent(&ev);
+		else
+		{
+			union mips_instruction inst;
+			inst.word = ev.word;
+			int write;
+			int access = (AccessSize(ev.word, &write) != 0);
+			GetPcStat(model->replayed, ev.pc)->events++;
+			ModelInstruction(model, inst, ev.pc, next.pc, access, ev.address, write);
+		}
+		ev = next;
+	}
+	FreeCoder(&coder);
+	munmap((void*)image, st.st_size);
+
+	if(status < 0)
+		printf("trace %s is damaged or cut off after %llu instructions\n", path, (long long unsigned int)count);
+
+	if(model != NULL)
+	{
+		FILE* out = fopen(stats_path, "w");
+		if(out != NULL)
+		{
+			fprintf(out, "Output File\n");
+			fprintf(out, "Total Instruction Count: %llu\n", (long long unsigned int)count);
+			WriteModelStats(out, model, count);
+			fclose(out);
+		}
+		FreeModel(model);
+	}
+	return (status < 0) ? 1 : 0;
+}
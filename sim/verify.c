@@ -0,0 +1,344 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief --verify: runs the reference interpreter in lockstep with a faster engine and stops at the first difference
+ */
+#include "sim.h"
+#include <string.h>
+#include <stdarg.h>
+
+/**
+	@brief Says where the engine went wrong, and stops it with HALT_FAULT (unwinding, unless halt is 0 because it's
+	stopping already)
+
+	Registers are compared before every block, so anything they show went wrong in the block since the last check;
+	memory is only compared every so often, so a difference there may come from any block since.
+ */
+static void ReportDifference(struct simulator* sim, int halt, uint32_t pc, uint64_t count, const char* format, ...)
+{
+	struct verifier* v = sim->verifier;
+	char what[256];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(what, sizeof(what), format, args);
+	va_end(args);
+
+	v->failed = 1;
+	ConsolePrintf(&sim->console, "\nverify: %s engine differs from the reference (they last agreed at 0x%08x, %llu "
+		"instructions in): %s\n", engines[sim->options.engine].name, pc, (long long unsigned int)count, what);
+	if(halt)
+		HaltSimulator(sim, HALT_FAULT);
+	sim->halt_reason = HALT_FAULT;
+}
+
+/**
+	@brief Sets up the reference run next to a program that has just been loaded
+
+	Takes snapshots of both, so their stores are tracked from here on.
+ */
+void StartVerifier(struct simulator* sim, const char* fname, const uint8_t* image, size_t image_len)
+{
+	struct verifier* v = calloc(1, sizeof(struct verifier));
+	sim->verifier = v;
+	v->last_pc = sim->ctx.pc;
+	v->last_count = sim->ctx.inst_count;
+	v->memory_due = sim->ctx.inst_count + VERIFY_MEMORY_INTERVAL;
+
+	v->discard = fopen("/dev/null", "r+");
+	if(v->discard == NULL)
+	{
+		v->failed = 1;
+		ConsolePrintf(&sim->console, "verify: failed to open /dev/null\n");
+		HaltSimulator(sim, HALT_FAULT);
+	}
+
+	//Only the engine's run writes anything, or models anything
+	struct sim_options options;
+	InitOptions(&options);
+	options.engine = ENGINE_REFERENCE;
+	options.huge_pages = sim->options.huge_pages;
+	options.restore_path = sim->options.restore_path;
+	options.input_path = sim->options.input_path;
+	options.bulk_cost = sim->options.bulk_cost;
+	InitSimulator(&v->shadow, &options, v->discard, v->discard, NULL);
+
+	int loaded = (image != NULL) ? LoadProgramImage(&v->shadow, fname, image, image_len) :
+		LoadProgram(&v->shadow, fname);
+	if(!loaded)
+	{
+		v->failed = 1;
+		ConsolePrintf(&sim->console, "verify: the reference run failed to load %s\n", v->shadow.program);
+		HaltSimulator(sim, HALT_FAULT);
+	}
+
+	//Input from the stream gets handed to the reference once the engine has read it
+	if(sim->in.data == NULL)
+	{
+		v->record = open_memstream(&v->recorded, &v->recorded_len);
+		sim->in.record = v->record;
+		SetInputBuffer(&v->shadow.in, (const uint8_t*)"", 0);
+	}
+
+	TakeSnapshot(sim);
+	TakeSnapshot(&v->shadow);
+	if( (v->record == NULL && sim->in.data == NULL) || (sim->snapshot == NULL) || (v->shadow.snapshot == NULL) )
+	{
+		v->failed = 1;
+		ConsolePrintf(&sim->console, "verify: not enough memory to track stores\n");
+		HaltSimulator(sim, HALT_FAULT);
+	}
+}
+
+/**
+	@brief Runs the reference up to the engine's instruction count (only ever forwards). Returns 0 if it stopped first
+ */
+static int CatchUp(struct verifier* v, uint64_t count)
+{
+	struct simulator* shadow = &v->shadow;
+	if(v->record != NULL)
+	{
+		fflush(v->record);
+		ExtendInputBuffer(&shadow->in, v->recorded ? (const uint8_t*)v->recorded : (const uint8_t*)"",
+			v->recorded_len);
+	}
+	if(shadow->finished || (shadow->ctx.inst_count >= count))
+		return !shadow->finished;
+
+	//Not through ContinueProgram: this happens before every block, and the reference has no clock, files or models
+	//to look after when it stops
+	if(setjmp(shadow->halt) != 0)
+	{
+		shadow->finished = 1;
+		return 0;
+	}
+	RunReferenceUntil(&shadow->memory, &shadow->ctx, count);
+	if(shadow->ctx.inst_count < count)
+	{
+		shadow->halt_reason = HALT_NONE;
+		shadow->finished = 1;
+	}
+	return !shadow->finished;
+}
+
+/**
+	@brief Compares the registers. Returns 0 (having described the first difference in what) if they don't match
+ */
+static int CompareContexts(const struct context* ctx, const struct context* ref, char* what, size_t size)
+{
+	if(ctx->inst_count != ref->inst_count)
+	{
+		snprintf(what, size, "ran %llu instructions, the reference %llu", (long long unsigned int)ctx->inst_count,
+			(long long unsigned int)ref->inst_count);
+		return 0;
+	}
+	if(ctx->pc != ref->pc)
+	{
+		snprintf(what, size, "pc is 0x%08x, should be 0x%08x", ctx->pc, ref->pc);
+		return 0;
+	}
+
+	//$zero only has to read as zero, the interpreters let writes to it sit until the next instruction
+	for(int i=1; i<32; i++)
+	{
+		if(ctx->regs[i] != ref->regs[i])
+		{
+			snprintf(what, size, "$%d is 0x%08x, should be 0x%08x", i, ctx->regs[i], ref->regs[i]);
+			return 0;
+		}
+	}
+	if(ctx->HI != ref->HI)
+	{
+		snprintf(what, size, "HI is 0x%08x, should be 0x%08x", ctx->HI, ref->HI);
+		return 0;
+	}
+	if(ctx->LO != ref->LO)
+	{
+		snprintf(what, size, "LO is 0x%08x, should be 0x%08x", ctx->LO, ref->LO);
+		return 0;
+	}
+	if( (ctx->link_valid != ref->link_valid) || (ctx->link_valid && (ctx->link_address != ref->link_address)) )
+	{
+		snprintf(what, size, "ll link is %s 0x%08x, should be %s 0x%08x", ctx->link_valid ? "set at" : "clear, was",
+			ctx->link_address, ref->link_valid ? "set at" : "clear, was", ref->link_address);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+	@brief Compares every page either run has stored to. Returns 0 (having described the first difference in what)
+	if any differ
+
+	Both address spaces are laid out the same way as long as the runs agree (regions only get added by stack and heap
+	growth), so the region lists are walked side by side.
+ */
+static int CompareMemory(const struct virtual_memory* memory, const struct virtual_memory* ref, char* what,
+	size_t size)
+{
+	if( (memory->brk != ref->brk) || (memory->stack_bottom != ref->stack_bottom) )
+	{
+		snprintf(what, size, "break and stack are at 0x%08x and 0x%08x, should be 0x%08x and 0x%08x", memory->brk,
+			memory->stack_bottom, ref->brk, ref->stack_bottom);
+		return 0;
+	}
+
+	const struct virtual_mem_region* a = memory->regions;
+	const struct virtual_mem_region* b = ref->regions;
+	for(; (a != NULL) && (b != NULL); a = a->next, b = b->next)
+	{
+		if( (a->vaddr != b->vaddr) || (a->len != b->len) )
+		{
+			snprintf(what, size, "memory is mapped at 0x%08x (0x%x bytes), should be 0x%08x (0x%x bytes)", a->vaddr,
+				a->len, b->vaddr, b->len);
+			return 0;
+		}
+
+		uint32_t pages = (uint32_t)(((uint64_t)a->len + VM_PAGE_MASK) >> VM_PAGE_SHIFT);
+		for(uint32_t page = 0; page < pages; page++)
+		{
+			if(!a->dirty_pages[page] && !b->dirty_pages[page])
+				continue;
+
+			uint32_t first = page << (VM_PAGE_SHIFT - 2);
+			uint32_t left = a->len - (page << VM_PAGE_SHIFT);
+			uint32_t words = ((left < VM_PAGE_SIZE) ? left : VM_PAGE_SIZE) / 4;
+			if(!memcmp(a->data + first, b->data + first, words * 4))
+				continue;
+			for(uint32_t i = first; ; i++)
+			{
+				if(a->data[i] != b->data[i])
+				{
+					snprintf(what, size, "the word at 0x%08x is 0x%08x, should be 0x%08x", a->vaddr + i * 4,
+						a->data[i], b->data[i]);
+					return 0;
+				}
+			}
+		}
+	}
+	if( (a != NULL) || (b != NULL) )
+	{
+		snprintf(what, size, "memory is mapped differently");
+		return 0;
+	}
+	return 1;
+}
+
+/**
+	@brief Runs the engine with a check before every block (or every VERIFY_STEP instructions, for engines without
+	blocks of their own)
+ */
+void RunVerified(struct virtual_memory* memory, struct context* ctx, int engine)
+{
+	const struct engine* e = &engines[engine];
+	struct simulator* sim = ctx->sim;
+	if(e->checks_blocks && (sim->stop_at == UINT64_MAX))
+	{
+		e->run(memory, ctx);
+		return;
+	}
+
+	void (*run_until)(struct virtual_memory* memory, struct context* ctx, uint64_t target) =
+		(e->run_until != NULL) ? e->run_until : RunInterpreterUntil;
+	while(ctx->inst_count < sim->stop_at)
+	{
+		VerifyBlock(ctx);
+		uint64_t target = (sim->stop_at - ctx->inst_count > VERIFY_STEP) ? (ctx->inst_count + VERIFY_STEP) :
+			sim->stop_at;
+		run_until(memory, ctx, target);
+		if(ctx->inst_count < target)
+			return;
+	}
+}
+
+/**
+	@brief Checks the engine against the reference as it's about to run the block at ctx->pc
+
+	Brings the reference up to the same instruction count, then compares registers, and every
+	VERIFY_MEMORY_INTERVAL instructions memory as well. Stops the program with HALT_FAULT if they differ.
+ */
+void VerifyBlock(struct context* ctx)
+{
+	struct simulator* sim = ctx->sim;
+	struct verifier* v = sim->verifier;
+	struct simulator* shadow = &v->shadow;
+	char what[160];
+
+	if(!CatchUp(v, ctx->inst_count))
+	{
+		ReportDifference(sim, 1, v->last_pc, v->last_count, "the reference stopped (%s) at 0x%08x, the engine carried on",
+			HaltReasonName(shadow->halt_reason), shadow->ctx.pc);
+	}
+	if(!CompareContexts(ctx, &shadow->ctx, what, sizeof(what)))
+		ReportDifference(sim, 1, v->last_pc, v->last_count, "%s", what);
+	if(ctx->inst_count >= v->memory_due)
+	{
+		if(!CompareMemory(&sim->memory, &shadow->memory, what, sizeof(what)))
+			ReportDifference(sim, 1, v->last_pc, v->last_count, "%s (stored since %llu instructions in)", what,
+				(long long unsigned int)(v->memory_due - VERIFY_MEMORY_INTERVAL));
+		v->memory_due = ctx->inst_count + VERIFY_MEMORY_INTERVAL;
+	}
+
+	v->last_pc = ctx->pc;
+	v->last_count = ctx->inst_count;
+	v->checks++;
+}
+
+/**
+	@brief Once the engine has stopped, makes sure the reference stops the same way, and says how the run went
+
+	The instruction the engine stopped at is the one run after the last check.
+ */
+void FinishVerifier(struct simulator* sim)
+{
+	struct verifier* v = sim->verifier;
+	if( (v == NULL) || v->failed )
+		return;
+	struct simulator* shadow = &v->shadow;
+	char what[160];
+
+	//Whatever the engine stopped on must stop the reference too, at the latest one instruction later
+	if(CatchUp(v, sim->ctx.inst_count))
+		CatchUp(v, sim->ctx.inst_count + 1);
+	if(!shadow->finished)
+	{
+		ReportDifference(sim, 0, v->last_pc, v->last_count, "the engine stopped (%s) at 0x%08x, the reference carried on",
+			HaltReasonName(sim->halt_reason), sim->ctx.pc);
+		return;
+	}
+	if(shadow->halt_reason != sim->halt_reason)
+	{
+		ReportDifference(sim, 0, v->last_pc, v->last_count, "the engine stopped (%s) at 0x%08x, the reference (%s) at 0x%08x",
+			HaltReasonName(sim->halt_reason), sim->ctx.pc, HaltReasonName(shadow->halt_reason), shadow->ctx.pc);
+		return;
+	}
+	if( !CompareContexts(&sim->ctx, &shadow->ctx, what, sizeof(what)) ||
+		!CompareMemory(&sim->memory, &shadow->memory, what, sizeof(what)) )
+	{
+		ReportDifference(sim, 0, v->last_pc, v->last_count, "%s", what);
+		return;
+	}
+
+	ConsolePrintf(&sim->console, "\nverify: %s engine matched the reference at %llu checks\n",
+		engines[sim->options.engine].name, (long long unsigned int)v->checks);
+}
+
+void FreeVerifier(struct simulator* sim)
+{
+	struct verifier* v = sim->verifier;
+	if(v == NULL)
+		return;
+
+	//The shadow reads what the recording holds, and the recording belongs to the engine's input
+	if(v->shadow.ctx.sim != NULL)
+		FreeSimulator(&v->shadow);
+	if(v->record != NULL)
+	{
+		sim->in.record = NULL;
+		fclose(v->record);
+		free(v->recorded);
+	}
+	if(v->discard != NULL)
+		fclose(v->discard);
+	free(v);
+	sim->verifier = NULL;
+}
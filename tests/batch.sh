@@ -0,0 +1,46 @@
+#!/bin/bash
+#
+# Runs the jobs in batch.jobs (ELFs from here, among them one that faults and one that doesn't exist) as one
+# two-thread batch, checking that each job's foo.elf.stdout still holds what foo.expected does and that the summary
+# (timings left out) matches batch.expected.
+#
+# Usage: batch.sh (run by "make check")
+# Exits 1 if the batch went wrong, 0 otherwise.
+
+SIM=${SIM:-$(dirname "$0")/../sim/sim}
+SIM=$(realpath "$SIM")
+cd "$(dirname "$0")"
+
+# Results land next to each ELF, so work on copies in a scratch directory
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+for elf in $(cat batch.jobs); do
+	[ -f "$elf" ] && cp "$elf" "$TMP/"
+done
+sed "s|^|$TMP/|" batch.jobs > "$TMP/list.txt"
+
+failed=0
+(cd "$TMP" && "$SIM" --batch list.txt -j 2 < /dev/null > out)
+status=$?
+sed -e "s|$TMP/||" -e 's/, [0-9]* nanoseconds$//' -e 's/ in [0-9]* ms,/,/' "$TMP/out" > "$TMP/summary"
+if [ $status -ne 1 ]; then
+	echo "FAIL batch: exited with $status, not 1"
+	failed=1
+fi
+if ! cmp -s "$TMP/summary" batch.expected; then
+	echo "FAIL batch: summary differs:"
+	diff batch.expected "$TMP/summary" | head -10
+	failed=1
+fi
+for elf in $(cat batch.jobs); do
+	name=$(basename "$elf" .elf)
+	[ -f "$name.expected" ] || continue
+	sed '1,/^Starting simulation\.\.\.$/d' "$TMP/$elf.stdout" 2>/dev/null | cmp -s - "$name.expected" || {
+		echo "FAIL batch: $elf printed something else"
+		failed=1
+	}
+done
+[ $failed -eq 0 ] && echo "ok   batch"
+
+exit $failed
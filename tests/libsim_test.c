@@ -0,0 +1,90 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Runs a program through libsim on every engine, whole, in budgeted slices and a step at a time, checking
+	that each way gets the same ending, instruction count and HI/LO
+
+	Usage: libsim_test foo.elf. Prints one line per engine and exits 1 if any of them disagreed or didn't exit. A
+	guest that takes the process down with it fails it as well.
+ */
+#include "../sim/libsim.h"
+#include <stdlib.h>
+
+//SimGetRegister numbers past the GPRs
+#define REG_HI	32
+#define REG_LO	33
+
+struct outcome
+{
+	int status;
+	uint64_t count;
+	uint32_t hi;
+	uint32_t lo;
+};
+
+static void Record(struct sim_instance* inst, int status, struct outcome* out)
+{
+	out->status = status;
+	out->count = SimInstructionCount(inst);
+	out->hi = SimGetRegister(inst, REG_HI);
+	out->lo = SimGetRegister(inst, REG_LO);
+}
+
+static int Same(const struct outcome* a, const struct outcome* b)
+{
+	return (a->status == b->status) && (a->count == b->count) && (a->hi == b->hi) && (a->lo == b->lo);
+}
+
+static int TestEngine(const char* engine, const char* elf)
+{
+	FILE* null = fopen("/dev/null", "r+");
+	const char* argv[] = { engine };
+	struct sim_instance* inst = SimCreate(1, argv, null, null);
+	if( (inst == NULL) || !SimLoad(inst, elf) )
+	{
+		printf("FAIL libsim: %s can't load %s\n", engine, elf);
+		return 0;
+	}
+
+	struct outcome whole, sliced, stepped;
+	Record(inst, SimRun(inst, 0), &whole);
+
+	SimReset(inst);
+	int status;
+	while( (status = SimRun(inst, 100)) == SIM_BUDGET )
+		;
+	Record(inst, status, &sliced);
+
+	SimReset(inst);
+	while( (status = SimStep(inst)) == SIM_BUDGET )
+		;
+	Record(inst, status, &stepped);
+
+	SimDestroy(inst);
+	fclose(null);
+
+	if( (whole.status != SIM_EXITED) || !Same(&whole, &sliced) || !Same(&whole, &stepped) )
+	{
+		printf("FAIL libsim: %s ended %d/%d/%d after %llu/%llu/%llu instructions (whole/sliced/stepped)\n", engine,
+			whole.status, sliced.status, stepped.status, (long long unsigned int)whole.count,
+			(long long unsigned int)sliced.count, (long long unsigned int)stepped.count);
+		return 0;
+	}
+	printf("ok   libsim (%s): %llu instructions, hi %u, lo %u\n", engine + sizeof("--engine=") - 1,
+		(long long unsigned int)whole.count, whole.hi, whole.lo);
+	return 1;
+}
+
+int main(int argc, char** argv)
+{
+	if(argc != 2)
+	{
+		printf("usage: %s foo.elf\n", argv[0]);
+		return 2;
+	}
+	const char* engines[] = { "--engine=interp", "--engine=threaded", "--engine=jit", "--engine=reference" };
+	int ok = 1;
+	for(size_t i=0; i<sizeof(engines) / sizeof(engines[0]); i++)
+		ok &= TestEngine(engines[i], argv[1]);
+	return ok ? 0 : 1;
+}
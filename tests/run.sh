@@ -0,0 +1,71 @@
+#!/bin/bash
+#
+# Runs each test program through the simulator on every engine and checks what it printed against foo.expected,
+# and that all the engines retired the same number of instructions and stopped the same way. The block engines
+# also run it under --verify.
+#
+# Usage: run.sh [foo.elf...] (default: every .elf here)
+#
+# foo.args, if there is one, holds more simulator options for the test and foo.engines the engines to run it on
+# (default: interp threaded jit reference). Output is compared from the line after "Starting simulation...".
+# Exits 1 if any test failed, 0 otherwise.
+
+SIM=${SIM:-$(dirname "$0")/../sim/sim}
+SIM=$(realpath "$SIM")
+cd "$(dirname "$0")"
+[ $# -eq 0 ] && set -- *.elf
+
+# The simulator drops its output.txt in the current directory, so run from a scratch one
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+failed=0
+fail()
+{
+	echo "FAIL $1: $2"
+	bad=1
+	failed=1
+}
+
+# Prints what one run's --report says as "halt instructions" (top-level fields only)
+summary()
+{
+	sed -n -e 's/^\t"halt": "\(.*\)",/\1/p' -e 's/^\t"instructions": \([0-9]*\),/\1/p' "$1" | tr '\n' ' '
+}
+
+for elf in "$@"; do
+	name=$(basename "$elf" .elf)
+	elf=$(realpath "$elf")
+	args=$(cat "$name.args" 2>/dev/null)
+	engines=$(cat "$name.engines" 2>/dev/null || echo interp threaded jit reference)
+
+	bad=0
+	first=
+	for engine in $engines; do
+		(cd "$TMP" && "$SIM" --engine=$engine $args --report="$TMP/report.json" "$elf" < /dev/null > "$TMP/out")
+		sed '1,/^Starting simulation\.\.\.$/d' "$TMP/out" > "$TMP/printed"
+		if ! cmp -s "$TMP/printed" "$name.expected"; then
+			fail $name "$engine printed something else:"
+			diff "$name.expected" "$TMP/printed" | head -10
+			continue
+		fi
+		got=$(summary "$TMP/report.json")
+		if [ -z "$first" ]; then
+			first="$got"
+			firstengine=$engine
+		elif [ "$got" != "$first" ]; then
+			fail $name "$engine stopped with $got, $firstengine with $first"
+		fi
+
+		case $engine in
+			threaded|jit)
+				(cd "$TMP" && "$SIM" --engine=$engine $args --verify "$elf" < /dev/null > "$TMP/out")
+				grep -q "^verify: $engine engine matched the reference" "$TMP/out" ||
+					fail $name "$engine differs from the reference: $(grep '^verify:' "$TMP/out")"
+				;;
+		esac
+	done
+	[ $bad -eq 0 ] && echo "ok   $name"
+done
+
+exit $failed
@@ -0,0 +1,44 @@
+#!/bin/bash
+#
+# Starts a simulator server on each engine and sends it the jobs in serve.jobs (one ELF per line, in order on one
+# connection) with serve_client, checking what came back against serve.expected (loader messages left out) and
+# that the server is still up at the end.
+#
+# Usage: serve.sh (run by "make check", which builds serve_client first)
+# Exits 1 if any engine's server answered differently or went away, 0 otherwise.
+
+SIM=${SIM:-$(dirname "$0")/../sim/sim}
+SIM=$(realpath "$SIM")
+cd "$(dirname "$0")"
+
+TMP=$(mktemp -d)
+server=
+trap '[ -n "$server" ] && kill $server 2>/dev/null; rm -rf "$TMP"' EXIT
+
+failed=0
+for engine in interp threaded jit reference; do
+	(cd "$TMP" && exec "$SIM" --engine=$engine --serve "$TMP/sock" > "$TMP/log" 2>&1) &
+	server=$!
+	for i in $(seq 50); do
+		[ -S "$TMP/sock" ] && break
+		sleep 0.1
+	done
+
+	./serve_client "$TMP/sock" $(cat serve.jobs) | sed '/^Reading ELF image/,/^Starting simulation\.\.\.$/d' > "$TMP/got"
+	if ! cmp -s "$TMP/got" serve.expected; then
+		echo "FAIL serve: $engine server answered something else:"
+		diff serve.expected "$TMP/got" | head -10
+		failed=1
+	elif ! kill -0 $server 2>/dev/null; then
+		echo "FAIL serve: $engine server went away: $(tail -1 "$TMP/log")"
+		failed=1
+	else
+		echo "ok   serve ($engine)"
+	fi
+	kill $server 2>/dev/null
+	wait $server 2>/dev/null
+	server=
+	rm -f "$TMP/sock"
+done
+
+exit $failed
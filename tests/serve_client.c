@@ -0,0 +1,118 @@
+/**
+	@file
+	@author Brian Corbin
+	@brief Sends each ELF named on the command line to a simulator server as a job of its own, one after another on
+	one connection, and prints what came back: the halt, instructions and cached lines and the console output
+
+	Usage: serve_client socket foo.elf... Exits 1 if the server can't be reached or hangs up before answering. A job
+	only starts once the one before it has been answered and its image is back in the cache, so which ones come
+	from the cache doesn't depend on timing.
+ */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//Returns the connected socket, or -1
+static int Connect(const char* path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if( (fd < 0) || (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) )
+	{
+		if(fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+//Copies a "name N" section's N bytes to stdout, or just skips them. Returns 0 if the response ended early.
+static int Section(FILE* in, const char* line, int print)
+{
+	unsigned long long len;
+	if(sscanf(line, "%*s %llu", &len) != 1)
+		return 0;
+	for(unsigned long long i=0; i<len; i++)
+	{
+		int c = fgetc(in);
+		if(c == EOF)
+			return 0;
+		if(print)
+			putchar(c);
+	}
+	return 1;
+}
+
+static int RunJob(FILE* in, FILE* out, const char* elf)
+{
+	char path[PATH_MAX];
+	if(realpath(elf, path) == NULL)
+	{
+		printf("%s: no such file\n", elf);
+		return 0;
+	}
+	fprintf(out, "path %s\n\n", path);
+	fflush(out);
+
+	char line[256];
+	int ok = 0;
+	while(fgets(line, sizeof(line), in) != NULL)
+	{
+		if(strcmp(line, "\n") == 0)
+		{
+			ok = 1;
+			break;
+		}
+		if(strncmp(line, "output ", 7) == 0)
+		{
+			printf("output:\n");
+			if(!Section(in, line, 1))
+				break;
+		}
+		else if(strncmp(line, "stats ", 6) == 0)
+		{
+			if(!Section(in, line, 0))
+				break;
+		}
+		else
+			fputs(line, stdout);
+	}
+	if(!ok)
+		printf("%s: the server hung up\n", elf);
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		printf("usage: %s socket foo.elf...\n", argv[0]);
+		return 2;
+	}
+	int fd = Connect(argv[1]);
+	if(fd < 0)
+	{
+		printf("can't reach the server on %s\n", argv[1]);
+		return 1;
+	}
+	FILE* in = fdopen(fd, "r");
+	FILE* out = fdopen(dup(fd), "w");
+	int ok = 1;
+	for(int i=2; ok && (i<argc); i++)
+	{
+		printf("%s\n", argv[i]);
+		ok = RunJob(in, out, argv[i]);
+	}
+	fclose(in);
+	fclose(out);
+	return ok ? 0 : 1;
+}